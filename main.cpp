@@ -1,33 +1,69 @@
 #include <algorithm>
+#include <array>
+#include <bit>
+#include <cctype>
+#include <cmath>
+#include <cstddef>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
 #include <fstream>
 #include <functional>
 #include <initializer_list>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <span>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <tuple>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
 #include "SDL3/SDL.h" // IWYU pragma: keep
+#include "SDL3/SDL_atomic.h"
+#include "SDL3/SDL_cpuinfo.h"
 #include "SDL3/SDL_keyboard.h"
+#include "SDL3/SDL_mutex.h"
 #include "SDL3/SDL_scancode.h"
+#include "SDL3/SDL_thread.h"
 #include "SDL3/SDL_timer.h"
 #include "SDL3/SDL_video.h"
 #include "glad/glad.h"
 #include "glm/ext/matrix_clip_space.hpp"
 #include "glm/ext/matrix_transform.hpp"
 #include "glm/ext/scalar_constants.hpp"
+#include "glm/gtc/quaternion.hpp"
 #include "glm/gtc/type_ptr.hpp"
 #include "glm/mat4x4.hpp" // IWYU pragma: keep
 #include "glm/trigonometric.hpp"
+#include "glm/vec2.hpp" // IWYU pragma: keep
 #include "glm/vec3.hpp" // IWYU pragma: keep
+#include "glm/vec4.hpp" // IWYU pragma: keep
 
 #define GLM_ENABLE_EXPERIMENTAL
 #include "glm/gtx/rotate_vector.hpp" // This API is supposedly "experimental" for the past 10 years.
 
+// SSE2 is part of every x86-64 CPU. The AVX kernels of Geometry are compiled
+// for that target alone, so the build needs no -mavx.
+#if defined(__SSE2__) || defined(_M_X64)
+#define GEOMETRY_SIMD
+#include <immintrin.h>
+#if defined(__GNUC__)
+#define GEOMETRY_AVX_TARGET __attribute__((target("avx")))
+#else
+#define GEOMETRY_AVX_TARGET
+#endif
+#endif
+
 template <typename> constexpr bool always_false_v{false};
 
 // Catch unsupported types at compile time
@@ -56,6 +92,8 @@ struct VertexAttribute {
   GLenum type;
   GLboolean normalized;
   GLsizei offset;
+
+  bool operator==(const VertexAttribute &) const = default;
 };
 
 class VertexLayout {
@@ -85,1208 +123,7722 @@ public:
   }
 
   GLsizei stride() const { return m_stride; }
+
+  bool operator==(const VertexLayout &) const = default;
 };
 
-class Mesh {
-private:
-  // TODO: Create VAO class
-  // https://gamedev.stackexchange.com/questions/204015/how-to-abstract-vao-as-a-class-in-c
-  //
-  // TODO: Create VBO class
-  // https://gamedev.stackexchange.com/questions/204015/how-to-abstract-vao-as-a-class-in-c
+// Intersection queries shared by light culling, frustum culling and picking.
+//
+// Single queries are scalar. Batches keep their primitives as a structure of
+// arrays, and a batch kernel tests one query against 4 (SSE) or 8 (AVX) of
+// them per iteration. The AVX kernels only run when the CPU reports AVX.
+namespace Geometry {
+
+struct AABB {
+  glm::vec3 min;
+  glm::vec3 max;
+};
 
-  GLuint m_vertexArrayObjectId{0};
-  GLuint m_vertexBufferObjectId{0};
-  GLuint m_elementBufferObjectId{0};
+struct Sphere {
+  glm::vec3 center;
+  float radius;
+};
 
-  GLenum m_indexType{0};
-  GLsizei m_indicesCount{0};
+// Distances along the ray are in multiples of direction, which doesn't need
+// to be normalized
+struct Ray {
+  glm::vec3 origin;
+  glm::vec3 direction;
+};
 
-  void cleanup() {
-    if (m_vertexArrayObjectId != 0) {
-      glDeleteVertexArrays(1, &m_vertexArrayObjectId);
-    }
-    if (m_vertexBufferObjectId != 0) {
-      glDeleteBuffers(1, &m_vertexBufferObjectId);
-    }
-    if (m_elementBufferObjectId != 0) {
-      glDeleteBuffers(1, &m_elementBufferObjectId);
-    }
-  }
+struct Frustum {
+  // (normal, distance) pointing inside: left, right, bottom, top, near, far
+  std::array<glm::vec4, 6> planes;
+};
 
-public:
-  // TODO: Default constructor, no parameters
-  // TODO: Add getter/setter for vertices & indices.
-  template <typename VertexType, typename IndexType>
-  Mesh(const std::vector<VertexType> &vertices,
-       const std::vector<IndexType> &indices, const VertexLayout &layout) {
-    if constexpr (!std::is_fundamental_v<VertexType>) {
-      assert(layout.stride() == sizeof(VertexType) &&
-             "VertexType has padded data. Layout stride does not match C++ "
-             "struct size.");
-    }
+// Gribb & Hartmann, combine the rows of the clip matrix. Works for the
+// perspective camera and the orthographic light alike.
+Frustum extractFrustum(const glm::mat4 &viewProjection) {
+  // glm is column major, transposing gives access to the rows
+  const glm::mat4 rows{glm::transpose(viewProjection)};
+
+  Frustum frustum{{
+      rows[3] + rows[0],
+      rows[3] - rows[0],
+      rows[3] + rows[1],
+      rows[3] - rows[1],
+      rows[3] + rows[2],
+      rows[3] - rows[2],
+  }};
+  for (glm::vec4 &plane : frustum.planes) {
+    plane /= glm::length(glm::vec3{plane});
+  }
 
-    // GLTypeTraits limits IndexType to fundamental type and sizeof() won't
-    // return padded data
-    m_indexType = GLIndexTraits<IndexType>::type;
-    m_indicesCount = static_cast<GLsizei>(indices.size());
+  return frustum;
+}
 
-    glGenVertexArrays(1, &m_vertexArrayObjectId);
-    glGenBuffers(1, &m_vertexBufferObjectId);
-    glGenBuffers(1, &m_elementBufferObjectId);
+// Clamp the sphere center to the box, the clamped point is the nearest point
+// on the box (see prototype/aabb-collision.py).
+bool intersects(const Sphere &sphere, const AABB &box) {
+  const glm::vec3 closest{glm::clamp(sphere.center, box.min, box.max)};
+  const glm::vec3 delta{sphere.center - closest};
+  // Avoid taking square root for compute performance
+  return glm::dot(delta, delta) <= sphere.radius * sphere.radius;
+}
 
-    glBindVertexArray(m_vertexArrayObjectId);
+bool intersects(const Sphere &a, const Sphere &b) {
+  const glm::vec3 delta{a.center - b.center};
+  const float radius{a.radius + b.radius};
+  return glm::dot(delta, delta) <= radius * radius;
+}
 
-    // TODO: What if sizeof() gives compiler-padded size?
-    glBindBuffer(GL_ARRAY_BUFFER, m_vertexBufferObjectId);
-    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(VertexType),
-                 vertices.data(), GL_STATIC_DRAW);
+bool intersects(const AABB &a, const AABB &b) {
+  return glm::all(glm::lessThanEqual(a.min, b.max)) &&
+         glm::all(glm::lessThanEqual(b.min, a.max));
+}
 
-    // TODO: What if sizeof() gives compiler-padded size?
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_elementBufferObjectId);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(IndexType),
-                 indices.data(), GL_STATIC_DRAW);
+// Culled when entirely behind any plane. Spheres near a frustum corner can
+// pass while outside, which only costs a draw.
+bool intersects(const Frustum &frustum, const Sphere &sphere) {
+  for (const glm::vec4 &plane : frustum.planes) {
+    if (glm::dot(glm::vec3{plane}, sphere.center) + plane.w < -sphere.radius) {
+      return false;
+    }
+  }
+  return true;
+}
 
-    for (const auto &attribute : layout.attributes()) {
-      glEnableVertexAttribArray(attribute.index);
-      glVertexAttribPointer(                               //
-          attribute.index,                                 //
-          attribute.size,                                  //
-          attribute.type,                                  //
-          attribute.normalized,                            //
-          layout.stride(),                                 //
-          reinterpret_cast<const void *>(attribute.offset) //
-      );
+// The corner furthest along the plane normal is the last one to leave
+bool intersects(const Frustum &frustum, const AABB &box) {
+  for (const glm::vec4 &plane : frustum.planes) {
+    const glm::vec3 corner{glm::mix(box.min, box.max,
+                                    glm::greaterThanEqual(glm::vec3{plane},
+                                                          glm::vec3{0.0f}))};
+    if (glm::dot(glm::vec3{plane}, corner) + plane.w < 0.0f) {
+      return false;
     }
+  }
+  return true;
+}
 
-    // Unbind VAO first to protect its state
-    glBindVertexArray(0);
+// Slab test. Distance to where the ray enters the box, zero when it starts
+// inside, infinity when it misses.
+float intersect(const Ray &ray, const AABB &box) {
+  const glm::vec3 inverseDirection{1.0f / ray.direction};
+  const glm::vec3 t1{(box.min - ray.origin) * inverseDirection};
+  const glm::vec3 t2{(box.max - ray.origin) * inverseDirection};
 
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  const glm::vec3 tMin{glm::min(t1, t2)};
+  const glm::vec3 tMax{glm::max(t1, t2)};
+  const float enter{glm::max(glm::max(tMin.x, tMin.y), glm::max(tMin.z, 0.0f))};
+  const float exit{glm::min(glm::min(tMax.x, tMax.y), tMax.z)};
+
+  return enter <= exit ? enter : std::numeric_limits<float>::infinity();
+}
+
+// Distance to the nearest hit in front of the origin, zero when it starts
+// inside, infinity when it misses
+float intersect(const Ray &ray, const Sphere &sphere) {
+  const glm::vec3 offset{ray.origin - sphere.center};
+  const float a{glm::dot(ray.direction, ray.direction)};
+  const float b{glm::dot(offset, ray.direction)};
+  const float c{glm::dot(offset, offset) - sphere.radius * sphere.radius};
+
+  const float discriminant{b * b - a * c};
+  if (discriminant < 0.0f) {
+    return std::numeric_limits<float>::infinity();
   }
 
-  Mesh(const Mesh &) = delete;
+  const float root{glm::sqrt(discriminant)};
+  if ((-b + root) / a < 0.0f) {
+    return std::numeric_limits<float>::infinity();
+  }
+  return glm::max((-b - root) / a, 0.0f);
+}
 
-  Mesh &operator=(const Mesh &) = delete;
+/////////////////////////////////////////////////////////////////////////////
 
-  Mesh(Mesh &&other) noexcept
-      : m_vertexArrayObjectId{std::exchange(other.m_vertexArrayObjectId, 0)},
-        m_vertexBufferObjectId{std::exchange(other.m_vertexBufferObjectId, 0)},
-        m_elementBufferObjectId{
-            std::exchange(other.m_elementBufferObjectId, 0)},
-        m_indexType{std::exchange(other.m_indexType, 0)},
-        m_indicesCount{std::exchange(other.m_indicesCount, 0)} {}
+enum class SimdWidth { SCALAR = 1, SSE = 4, AVX = 8 };
 
-  Mesh &operator=(Mesh &&other) noexcept {
-    if (this != &other) {
-      cleanup();
+constexpr size_t MAX_LANES{8};
 
-      m_vertexArrayObjectId = std::exchange(other.m_vertexArrayObjectId, 0);
-      m_vertexBufferObjectId = std::exchange(other.m_vertexBufferObjectId, 0);
-      m_elementBufferObjectId = std::exchange(other.m_elementBufferObjectId, 0);
-      m_indexType = std::exchange(other.m_indexType, 0);
-      m_indicesCount = std::exchange(other.m_indicesCount, 0);
+// The widest kernels the CPU runs
+SimdWidth bestSimdWidth() {
+#ifdef GEOMETRY_SIMD
+  static const SimdWidth width{SDL_HasAVX() ? SimdWidth::AVX : SimdWidth::SSE};
+  return width;
+#else
+  return SimdWidth::SCALAR;
+#endif
+}
+
+// A kernel reads whole SIMD widths, the arrays are padded so a range ending
+// at count never reads past them. Padding is never reported as a hit.
+size_t paddedSize(const size_t count) { return count + MAX_LANES - 1; }
+
+struct AABBBatch {
+  std::vector<float> minX;
+  std::vector<float> minY;
+  std::vector<float> minZ;
+  std::vector<float> maxX;
+  std::vector<float> maxY;
+  std::vector<float> maxZ;
+  size_t count{0};
+
+  void resize(const size_t boxCount) {
+    count = boxCount;
+    for (std::vector<float> *array :
+         {&minX, &minY, &minZ, &maxX, &maxY, &maxZ}) {
+      array->resize(paddedSize(count), 0.0f);
     }
-    return *this;
   }
 
-  ~Mesh() { cleanup(); }
+  void set(const size_t i, const AABB &box) {
+    minX[i] = box.min.x;
+    minY[i] = box.min.y;
+    minZ[i] = box.min.z;
+    maxX[i] = box.max.x;
+    maxY[i] = box.max.y;
+    maxZ[i] = box.max.z;
+  }
 
-  GLenum indexType() const { return m_indexType; }
+  AABB get(const size_t i) const {
+    return AABB{.min = {minX[i], minY[i], minZ[i]},
+                .max = {maxX[i], maxY[i], maxZ[i]}};
+  }
+};
 
-  GLsizei indicesCount() const { return m_indicesCount; }
+// Hits among the first valid lanes of a comparison mask, the rest are past
+// the end of the range
+size_t countHits(const int mask, const size_t valid) {
+  return std::popcount(static_cast<unsigned int>(mask) & ((1u << valid) - 1));
+}
 
-  void bind() const { glBindVertexArray(m_vertexArrayObjectId); }
+// Writes the lanes of a comparison mask which are still inside the range,
+// returns how many of them hit
+size_t storeHits(const int mask, const size_t lanes, const size_t remaining,
+                 uint8_t *hits) {
+  const size_t valid{glm::min(lanes, remaining)};
+  for (size_t lane{0}; lane < valid; ++lane) {
+    hits[lane] = (mask >> lane) & 1;
+  }
+  return countHits(mask, valid);
+}
 
-  void unbind() const { glBindVertexArray(0); }
-};
+/* FRUSTUM AGAINST BOXES */
 
-struct Vertex {
-  glm::vec3 pos;
-  glm::vec3 color;
-  glm::vec3 normal;
-};
+size_t intersectScalar(const Frustum &frustum, const AABBBatch &boxes,
+                       const size_t first, const size_t count,
+                       uint8_t *hits) {
+  size_t hitCount{0};
+  for (size_t i{0}; i < count; ++i) {
+    hits[i] = intersects(frustum, boxes.get(first + i));
+    hitCount += hits[i];
+  }
+  return hitCount;
+}
 
-Mesh generateCube(float side) {
-  float h = side / 2.0f;
+#ifdef GEOMETRY_SIMD
+// The corner furthest along each plane normal, picked per plane since every
+// lane shares the plane. Pointers to the first box of the range.
+std::array<std::array<const float *, 3>, 6>
+furthestCorners(const Frustum &frustum, const AABBBatch &boxes,
+                const size_t first) {
+  const std::array<const std::vector<float> *, 3> mins{
+      &boxes.minX, &boxes.minY, &boxes.minZ};
+  const std::array<const std::vector<float> *, 3> maxs{
+      &boxes.maxX, &boxes.maxY, &boxes.maxZ};
+
+  std::array<std::array<const float *, 3>, 6> corners;
+  for (size_t plane{0}; plane < corners.size(); ++plane) {
+    for (int axis{0}; axis < 3; ++axis) {
+      corners[plane][axis] =
+          &(*(frustum.planes[plane][axis] >= 0.0f ? maxs : mins)[axis])[first];
+    }
+  }
+  return corners;
+}
 
-  struct Face {
-    glm::vec3 normal, right, up, color;
-  };
+size_t intersectSSE(const Frustum &frustum, const AABBBatch &boxes,
+                    const size_t first, const size_t count, uint8_t *hits) {
+  const std::array<std::array<const float *, 3>, 6> corners{
+      furthestCorners(frustum, boxes, first)};
+
+  size_t hitCount{0};
+  for (size_t i{0}; i < count; i += 4) {
+    __m128 inside{_mm_castsi128_ps(_mm_set1_epi32(-1))};
+    for (size_t p{0}; p < corners.size(); ++p) {
+      const glm::vec4 &plane{frustum.planes[p]};
+      const __m128 distance{_mm_add_ps(
+          _mm_add_ps(
+              _mm_add_ps(
+                  _mm_mul_ps(_mm_set1_ps(plane.x),
+                             _mm_loadu_ps(corners[p][0] + i)),
+                  _mm_mul_ps(_mm_set1_ps(plane.y),
+                             _mm_loadu_ps(corners[p][1] + i))),
+              _mm_mul_ps(_mm_set1_ps(plane.z),
+                         _mm_loadu_ps(corners[p][2] + i))),
+          _mm_set1_ps(plane.w))};
+      inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, _mm_setzero_ps()));
+    }
 
-  glm::vec3 white{1.0f, 1.0f, 1.0f};
+    hitCount += storeHits(_mm_movemask_ps(inside), 4, count - i, hits + i);
+  }
+  return hitCount;
+}
 
-  std::vector<Face> faces = {
-      {{0, 0, 1}, {1, 0, 0}, {0, 1, 0}, white},   // Front
-      {{0, 0, -1}, {-1, 0, 0}, {0, 1, 0}, white}, // Back
-      {{0, 1, 0}, {1, 0, 0}, {0, 0, -1}, white},  // Top
-      {{0, -1, 0}, {1, 0, 0}, {0, 0, 1}, white},  // Bottom
-      {{1, 0, 0}, {0, 0, -1}, {0, 1, 0}, white},  // Right
-      {{-1, 0, 0}, {0, 0, 1}, {0, 1, 0}, white}   // Left
-  };
+GEOMETRY_AVX_TARGET
+size_t intersectAVX(const Frustum &frustum, const AABBBatch &boxes,
+                    const size_t first, const size_t count, uint8_t *hits) {
+  const std::array<std::array<const float *, 3>, 6> corners{
+      furthestCorners(frustum, boxes, first)};
+
+  size_t hitCount{0};
+  for (size_t i{0}; i < count; i += 8) {
+    __m256 inside{_mm256_castsi256_ps(_mm256_set1_epi32(-1))};
+    for (size_t p{0}; p < corners.size(); ++p) {
+      const glm::vec4 &plane{frustum.planes[p]};
+      const __m256 distance{_mm256_add_ps(
+          _mm256_add_ps(
+              _mm256_add_ps(
+                  _mm256_mul_ps(_mm256_set1_ps(plane.x),
+                                _mm256_loadu_ps(corners[p][0] + i)),
+                  _mm256_mul_ps(_mm256_set1_ps(plane.y),
+                                _mm256_loadu_ps(corners[p][1] + i))),
+              _mm256_mul_ps(_mm256_set1_ps(plane.z),
+                            _mm256_loadu_ps(corners[p][2] + i))),
+          _mm256_set1_ps(plane.w))};
+      inside = _mm256_and_ps(
+          inside, _mm256_cmp_ps(distance, _mm256_setzero_ps(), _CMP_GE_OQ));
+    }
 
-  std::vector<Vertex> vertices;
-  std::vector<unsigned int> indices;
+    hitCount += storeHits(_mm256_movemask_ps(inside), 8, count - i, hits + i);
+  }
+  return hitCount;
+}
+#endif // GEOMETRY_SIMD
 
-  for (int i = 0; i < faces.size(); i++) {
-    const auto &f = faces[i];
-    glm::vec3 center = f.normal * h;
+/* SPHERE AGAINST BOXES */
 
-    // Add 4 edge vertices
-    vertices.push_back({.pos = center - (f.right * h) - (f.up * h),
-                        .color = f.color,
-                        .normal = f.normal}); // BottomLeft
-    vertices.push_back({.pos = center + (f.right * h) - (f.up * h),
-                        .color = f.color,
-                        .normal = f.normal}); // TopLeft
-    vertices.push_back({.pos = center + (f.right * h) + (f.up * h),
-                        .color = f.color,
-                        .normal = f.normal}); // TopRight
-    vertices.push_back({.pos = center - (f.right * h) + (f.up * h),
-                        .color = f.color,
-                        .normal = f.normal}); // BottomRight
+size_t intersectScalar(const Sphere &sphere, const AABBBatch &boxes,
+                       const size_t first, const size_t count,
+                       uint8_t *hits) {
+  size_t hitCount{0};
+  for (size_t i{0}; i < count; ++i) {
+    hits[i] = intersects(sphere, boxes.get(first + i));
+    hitCount += hits[i];
+  }
+  return hitCount;
+}
 
-    // Add face indices
-    unsigned int offset = i * 4;
+#ifdef GEOMETRY_SIMD
+// Squared distance from the center to its clamp into the box on one axis
+__m128 clampDistanceSquaredSSE(const __m128 center, const float *min,
+                               const float *max) {
+  const __m128 closest{
+      _mm_min_ps(_mm_max_ps(center, _mm_loadu_ps(min)), _mm_loadu_ps(max))};
+  const __m128 delta{_mm_sub_ps(center, closest)};
+  return _mm_mul_ps(delta, delta);
+}
 
-    indices.push_back(offset + 0);
-    indices.push_back(offset + 1);
-    indices.push_back(offset + 2);
-    indices.push_back(offset + 2);
-    indices.push_back(offset + 3);
-    indices.push_back(offset + 0);
+GEOMETRY_AVX_TARGET
+__m256 clampDistanceSquaredAVX(const __m256 center, const float *min,
+                               const float *max) {
+  const __m256 closest{_mm256_min_ps(
+      _mm256_max_ps(center, _mm256_loadu_ps(min)), _mm256_loadu_ps(max))};
+  const __m256 delta{_mm256_sub_ps(center, closest)};
+  return _mm256_mul_ps(delta, delta);
+}
+
+size_t intersectSSE(const Sphere &sphere, const AABBBatch &boxes,
+                    const size_t first, const size_t count, uint8_t *hits) {
+  const __m128 centerX{_mm_set1_ps(sphere.center.x)};
+  const __m128 centerY{_mm_set1_ps(sphere.center.y)};
+  const __m128 centerZ{_mm_set1_ps(sphere.center.z)};
+  const __m128 radiusSquared{_mm_set1_ps(sphere.radius * sphere.radius)};
+
+  size_t hitCount{0};
+  for (size_t i{0}; i < count; i += 4) {
+    const size_t j{first + i};
+    const __m128 distanceSquared{_mm_add_ps(
+        _mm_add_ps(
+            clampDistanceSquaredSSE(centerX, &boxes.minX[j], &boxes.maxX[j]),
+            clampDistanceSquaredSSE(centerY, &boxes.minY[j], &boxes.maxY[j])),
+        clampDistanceSquaredSSE(centerZ, &boxes.minZ[j], &boxes.maxZ[j]))};
+
+    hitCount +=
+        storeHits(_mm_movemask_ps(_mm_cmple_ps(distanceSquared, radiusSquared)),
+                  4, count - i, hits + i);
   }
+  return hitCount;
+}
 
-  VertexLayout layout;
-  layout.push<float>(3);
-  layout.push<float>(3);
-  layout.push<float>(3);
+GEOMETRY_AVX_TARGET
+size_t intersectAVX(const Sphere &sphere, const AABBBatch &boxes,
+                    const size_t first, const size_t count, uint8_t *hits) {
+  const __m256 centerX{_mm256_set1_ps(sphere.center.x)};
+  const __m256 centerY{_mm256_set1_ps(sphere.center.y)};
+  const __m256 centerZ{_mm256_set1_ps(sphere.center.z)};
+  const __m256 radiusSquared{_mm256_set1_ps(sphere.radius * sphere.radius)};
+
+  size_t hitCount{0};
+  for (size_t i{0}; i < count; i += 8) {
+    const size_t j{first + i};
+    const __m256 distanceSquared{_mm256_add_ps(
+        _mm256_add_ps(
+            clampDistanceSquaredAVX(centerX, &boxes.minX[j], &boxes.maxX[j]),
+            clampDistanceSquaredAVX(centerY, &boxes.minY[j], &boxes.maxY[j])),
+        clampDistanceSquaredAVX(centerZ, &boxes.minZ[j], &boxes.maxZ[j]))};
+
+    hitCount += storeHits(_mm256_movemask_ps(_mm256_cmp_ps(
+                              distanceSquared, radiusSquared, _CMP_LE_OQ)),
+                          8, count - i, hits + i);
+  }
+  return hitCount;
+}
+#endif // GEOMETRY_SIMD
+
+/* RAY AGAINST BOXES */
+
+// Writes the entry distance of every box, infinity when missed
+size_t intersectScalar(const Ray &ray, const AABBBatch &boxes,
+                       const size_t first, const size_t count,
+                       float *distances) {
+  size_t hitCount{0};
+  for (size_t i{0}; i < count; ++i) {
+    distances[i] = intersect(ray, boxes.get(first + i));
+    hitCount += distances[i] != std::numeric_limits<float>::infinity();
+  }
+  return hitCount;
+}
 
-  Mesh mesh{vertices, indices, layout};
+#ifdef GEOMETRY_SIMD
+size_t intersectSSE(const Ray &ray, const AABBBatch &boxes, const size_t first,
+                    const size_t count, float *distances) {
+  const glm::vec3 inverseDirection{1.0f / ray.direction};
+  const __m128 origin[3]{_mm_set1_ps(ray.origin.x),
+                         _mm_set1_ps(ray.origin.y),
+                         _mm_set1_ps(ray.origin.z)};
+  const __m128 inverse[3]{_mm_set1_ps(inverseDirection.x),
+                          _mm_set1_ps(inverseDirection.y),
+                          _mm_set1_ps(inverseDirection.z)};
+  const std::array<const std::vector<float> *, 3> mins{
+      &boxes.minX, &boxes.minY, &boxes.minZ};
+  const std::array<const std::vector<float> *, 3> maxs{
+      &boxes.maxX, &boxes.maxY, &boxes.maxZ};
+  const __m128 infinity{_mm_set1_ps(std::numeric_limits<float>::infinity())};
+
+  size_t hitCount{0};
+  for (size_t i{0}; i < count; i += 4) {
+    __m128 enter{_mm_setzero_ps()};
+    __m128 exit{infinity};
+    for (size_t axis{0}; axis < 3; ++axis) {
+      const __m128 t1{_mm_mul_ps(
+          _mm_sub_ps(_mm_loadu_ps(&(*mins[axis])[first + i]), origin[axis]),
+          inverse[axis])};
+      const __m128 t2{_mm_mul_ps(
+          _mm_sub_ps(_mm_loadu_ps(&(*maxs[axis])[first + i]), origin[axis]),
+          inverse[axis])};
+      enter = _mm_max_ps(enter, _mm_min_ps(t1, t2));
+      exit = _mm_min_ps(exit, _mm_max_ps(t1, t2));
+    }
 
-  return mesh;
+    const __m128 hit{_mm_cmple_ps(enter, exit)};
+    alignas(16) std::array<float, 4> result;
+    // SSE2 has no blend, select with masks
+    _mm_store_ps(result.data(), _mm_or_ps(_mm_and_ps(hit, enter),
+                                          _mm_andnot_ps(hit, infinity)));
+    const size_t valid{glm::min<size_t>(4, count - i)};
+    std::copy_n(result.begin(), valid, distances + i);
+    hitCount += countHits(_mm_movemask_ps(hit), valid);
+  }
+  return hitCount;
 }
 
-glm::vec3 sphericalCoord(const float yaw, const float pitch,
-                         const float r = 1) {
-  glm::vec3 coord{
-      glm::sin(yaw) * glm::cos(pitch), //
-      glm::sin(pitch),                 //
-      -glm::cos(yaw) * glm::cos(pitch) //
-  };
-  return r * coord;
+GEOMETRY_AVX_TARGET
+size_t intersectAVX(const Ray &ray, const AABBBatch &boxes, const size_t first,
+                    const size_t count, float *distances) {
+  const glm::vec3 inverseDirection{1.0f / ray.direction};
+  const __m256 origin[3]{_mm256_set1_ps(ray.origin.x),
+                         _mm256_set1_ps(ray.origin.y),
+                         _mm256_set1_ps(ray.origin.z)};
+  const __m256 inverse[3]{_mm256_set1_ps(inverseDirection.x),
+                          _mm256_set1_ps(inverseDirection.y),
+                          _mm256_set1_ps(inverseDirection.z)};
+  const std::array<const std::vector<float> *, 3> mins{
+      &boxes.minX, &boxes.minY, &boxes.minZ};
+  const std::array<const std::vector<float> *, 3> maxs{
+      &boxes.maxX, &boxes.maxY, &boxes.maxZ};
+  const __m256 infinity{
+      _mm256_set1_ps(std::numeric_limits<float>::infinity())};
+
+  size_t hitCount{0};
+  for (size_t i{0}; i < count; i += 8) {
+    __m256 enter{_mm256_setzero_ps()};
+    __m256 exit{infinity};
+    for (size_t axis{0}; axis < 3; ++axis) {
+      const __m256 t1{_mm256_mul_ps(
+          _mm256_sub_ps(_mm256_loadu_ps(&(*mins[axis])[first + i]),
+                        origin[axis]),
+          inverse[axis])};
+      const __m256 t2{_mm256_mul_ps(
+          _mm256_sub_ps(_mm256_loadu_ps(&(*maxs[axis])[first + i]),
+                        origin[axis]),
+          inverse[axis])};
+      enter = _mm256_max_ps(enter, _mm256_min_ps(t1, t2));
+      exit = _mm256_min_ps(exit, _mm256_max_ps(t1, t2));
+    }
+
+    const __m256 hit{_mm256_cmp_ps(enter, exit, _CMP_LE_OQ)};
+    alignas(32) std::array<float, 8> result;
+    _mm256_store_ps(result.data(), _mm256_blendv_ps(infinity, enter, hit));
+    const size_t valid{glm::min<size_t>(8, count - i)};
+    std::copy_n(result.begin(), valid, distances + i);
+    hitCount += countHits(_mm256_movemask_ps(hit), valid);
+  }
+  return hitCount;
+}
+#endif // GEOMETRY_SIMD
+
+/* DISPATCH */
+
+// Tests boxes or spheres [first, first + count) of a batch, writes one result
+// per element to the output. Returns the hit count.
+template <typename Query, typename Batch, typename Output>
+size_t intersectBatch(const Query &query, const Batch &batch,
+                      const size_t first, const size_t count, Output *output,
+                      const SimdWidth width = bestSimdWidth()) {
+  assert(first + count <= batch.count && "Range is outside the batch.");
+
+  switch (width) {
+#ifdef GEOMETRY_SIMD
+  case SimdWidth::AVX:
+    return intersectAVX(query, batch, first, count, output);
+  case SimdWidth::SSE:
+    return intersectSSE(query, batch, first, count, output);
+#endif // GEOMETRY_SIMD
+  default:
+    return intersectScalar(query, batch, first, count, output);
+  }
 }
 
-// TODO: Figure out if it's beneficial to refactor this function to use
-// generateMesh
-Mesh generateSphere(const int latitudeBands, const int longitudeBands,
-                    const float r = 1,
-                    const glm::vec3 &color = {1.0f, 1.0f, 1.0f}) {
-  std::vector<Vertex> vertices;
+/////////////////////////////////////////////////////////////////////////////
 
-  const float pi{glm::pi<float>()};
+AABB merge(const AABB &a, const AABB &b) {
+  return AABB{.min = glm::min(a.min, b.min), .max = glm::max(a.max, b.max)};
+}
 
-  for (int i{0}; i <= latitudeBands; ++i) {
-    const float floatI{static_cast<float>(i)};
-    const float floatLatitudeBands{static_cast<float>(latitudeBands)};
+float surfaceArea(const AABB &box) {
+  const glm::vec3 size{box.max - box.min};
+  return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
 
-    const float pitch{pi / 2 - (floatI / floatLatitudeBands) * pi};
+// Box around a transformed box, the extents are rotated by the absolute
+// matrix (Arvo)
+AABB transform(const AABB &box, const glm::mat4 &matrix) {
+  const glm::vec3 center{matrix * glm::vec4{(box.min + box.max) * 0.5f, 1.0f}};
+  const glm::vec3 extent{(box.max - box.min) * 0.5f};
 
-    for (int j{0}; j <= longitudeBands; ++j) {
-      const float floatJ{static_cast<float>(j)};
-      const float floatLongitudeBands{static_cast<float>(longitudeBands)};
+  glm::mat3 absolute{matrix};
+  for (int column{0}; column < 3; ++column) {
+    absolute[column] = glm::abs(absolute[column]);
+  }
+  const glm::vec3 rotatedExtent{absolute * extent};
 
-      const float yaw{(floatJ / floatLongitudeBands) * 2 * pi};
+  return AABB{.min = center - rotatedExtent, .max = center + rotatedExtent};
+}
 
-      const glm::vec3 normal{sphericalCoord(yaw, pitch, 1)};
+enum class Containment { OUTSIDE, INTERSECTS, INSIDE };
 
-      const glm::vec3 white{1.0f, 1.0f, 1.0f};
+// Like intersects, and also tells when the whole box is inside, so a query can
+// take a subtree without testing it
+Containment classify(const Frustum &frustum, const AABB &box) {
+  Containment containment{Containment::INSIDE};
+  for (const glm::vec4 &plane : frustum.planes) {
+    const glm::bvec3 positive{
+        glm::greaterThanEqual(glm::vec3{plane}, glm::vec3{0.0f})};
+    const glm::vec3 furthest{glm::mix(box.min, box.max, positive)};
+    const glm::vec3 nearest{glm::mix(box.max, box.min, positive)};
 
-      vertices.push_back({
-          .pos = r * normal,
-          .color = color,
-          .normal = normal,
-      });
+    if (glm::dot(glm::vec3{plane}, furthest) + plane.w < 0.0f) {
+      return Containment::OUTSIDE;
+    }
+    if (glm::dot(glm::vec3{plane}, nearest) + plane.w < 0.0f) {
+      containment = Containment::INTERSECTS;
     }
   }
+  return containment;
+}
 
-  std::vector<unsigned int> indices;
+// Bounding volume hierarchy over boxes, built with the binned surface area
+// heuristic. The nodes are one flat array and the two children of a node are
+// adjacent, so a node is 32 bytes and a child is always after its parent.
+// The boxes of a leaf are tested with the batch kernels, 4 or 8 at a time.
+// Queries return primitive indices, the positions of the boxes in build.
+class Bvh {
+public:
+  struct Node {
+    AABB bounds;
+    // Interior: the left child, the right one follows. Leaf: the first entry
+    // of m_primitives.
+    uint32_t first;
+    // Zero for interior nodes
+    uint32_t count;
+  };
 
-  for (int i{0}; i < latitudeBands; ++i) {
-    for (int j{0}; j < longitudeBands; ++j) {
-      const int rowStride{longitudeBands + 1};
+  struct RayHit {
+    uint32_t primitive;
+    float distance;
+  };
 
-      const int topLeft{i * rowStride + j};
-      const int topRight{topLeft + 1};
-      const int bottomLeft{(i + 1) * rowStride + j};
-      const int bottomRight{bottomLeft + 1};
+  static constexpr uint32_t NO_HIT{std::numeric_limits<uint32_t>::max()};
 
-      indices.push_back(topLeft);
-      indices.push_back(topRight);
-      indices.push_back(bottomLeft);
+private:
+  static constexpr uint32_t MAX_LEAF_SIZE{4};
+  // Leaf entries tested per batch kernel call. Leaves are larger than
+  // MAX_LEAF_SIZE when they can't be split.
+  static constexpr size_t LEAF_CHUNK{32};
+  static constexpr int BIN_COUNT{12};
+  // Bounds the traversal stack, deeper nodes become leaves
+  static constexpr int MAX_DEPTH{60};
+  static constexpr size_t STACK_SIZE{MAX_DEPTH + 4};
+
+  std::vector<Node> m_nodes;
+  // Primitive index of every leaf entry
+  std::vector<uint32_t> m_primitives;
+  // Bounds of every leaf entry, so a leaf is a range tested with the batch
+  // kernels
+  AABBBatch m_bounds;
+
+  void subdivide(const uint32_t nodeIndex, const int depth,
+                 const std::vector<AABB> &bounds,
+                 const std::vector<glm::vec3> &centroids) {
+    const uint32_t first{m_nodes[nodeIndex].first};
+    const uint32_t count{m_nodes[nodeIndex].count};
+    if (count <= MAX_LEAF_SIZE || depth >= MAX_DEPTH) {
+      return;
+    }
 
-      indices.push_back(topRight);
-      indices.push_back(bottomRight);
-      indices.push_back(bottomLeft);
+    AABB centroidBounds{.min = centroids[m_primitives[first]],
+                        .max = centroids[m_primitives[first]]};
+    for (uint32_t i{first}; i < first + count; ++i) {
+      centroidBounds.min = glm::min(centroidBounds.min,
+                                    centroids[m_primitives[i]]);
+      centroidBounds.max = glm::max(centroidBounds.max,
+                                    centroids[m_primitives[i]]);
     }
-  }
 
-  VertexLayout layout;
+    struct Bin {
+      AABB bounds{.min = glm::vec3{std::numeric_limits<float>::max()},
+                  .max = glm::vec3{std::numeric_limits<float>::lowest()}};
+      uint32_t count{0};
+    };
+
+    const auto binIndex{[&](const int axis, const glm::vec3 &centroid) {
+      const float extent{centroidBounds.max[axis] - centroidBounds.min[axis]};
+      const int bin{static_cast<int>((centroid[axis] -
+                                      centroidBounds.min[axis]) /
+                                     extent * BIN_COUNT)};
+      return glm::min(bin, BIN_COUNT - 1);
+    }};
+
+    // Cost of a split is the area of each side times its primitive count
+    float bestCost{std::numeric_limits<float>::max()};
+    int bestAxis{-1};
+    int bestSplit{0};
+
+    for (int axis{0}; axis < 3; ++axis) {
+      if (centroidBounds.max[axis] <= centroidBounds.min[axis]) {
+        continue;
+      }
 
-  layout.push<float>(3);
-  layout.push<float>(3);
-  layout.push<float>(3);
+      std::array<Bin, BIN_COUNT> bins{};
+      for (uint32_t i{first}; i < first + count; ++i) {
+        const uint32_t primitive{m_primitives[i]};
+        Bin &bin{bins[binIndex(axis, centroids[primitive])]};
+        bin.bounds = merge(bin.bounds, bounds[primitive]);
+        ++bin.count;
+      }
 
-  Mesh mesh{vertices, indices, layout};
+      // Sweep from the right, then from the left
+      std::array<float, BIN_COUNT> rightCosts{};
+      AABB right{bins[BIN_COUNT - 1].bounds};
+      uint32_t rightCount{0};
+      for (int split{BIN_COUNT - 1}; split > 0; --split) {
+        right = merge(right, bins[split].bounds);
+        rightCount += bins[split].count;
+        rightCosts[split] = rightCount > 0 ? rightCount * surfaceArea(right)
+                                           : 0.0f;
+      }
 
-  return mesh;
-}
+      AABB left{bins[0].bounds};
+      uint32_t leftCount{0};
+      for (int split{1}; split < BIN_COUNT; ++split) {
+        left = merge(left, bins[split - 1].bounds);
+        leftCount += bins[split - 1].count;
+        if (leftCount == 0 || leftCount == count) {
+          continue;
+        }
 
-Mesh generateQuad(const float edge = 0.5f) {
-  auto createVertex{[](const glm::vec3 &pos) -> Vertex {
-    const glm::vec3 color{1.0f, 1.0f, 1.0f};
-    const glm::vec3 normal{0.0f, 1.0f, 0.0f};
+        const float cost{leftCount * surfaceArea(left) + rightCosts[split]};
+        if (cost < bestCost) {
+          bestCost = cost;
+          bestAxis = axis;
+          bestSplit = split;
+        }
+      }
+    }
 
-    return {.pos = pos, .color = color, .normal = normal};
+    // Not splitting is cheaper, or every centroid is in the same spot
+    if (bestAxis < 0 ||
+        bestCost >= count * surfaceArea(m_nodes[nodeIndex].bounds)) {
+      return;
+    }
+
+    const auto middle{std::partition(
+        m_primitives.begin() + first, m_primitives.begin() + first + count,
+        [&](const uint32_t primitive) {
+          return binIndex(bestAxis, centroids[primitive]) < bestSplit;
+        })};
+    const uint32_t leftCount{
+        static_cast<uint32_t>(middle - m_primitives.begin()) - first};
+
+    const uint32_t leftIndex{static_cast<uint32_t>(m_nodes.size())};
+    for (const auto &[childFirst, childCount] :
+         {std::pair{first, leftCount},
+          std::pair{first + leftCount, count - leftCount}}) {
+      AABB childBounds{bounds[m_primitives[childFirst]]};
+      for (uint32_t i{childFirst}; i < childFirst + childCount; ++i) {
+        childBounds = merge(childBounds, bounds[m_primitives[i]]);
+      }
+      m_nodes.push_back(Node{
+          .bounds = childBounds, .first = childFirst, .count = childCount});
+    }
+
+    m_nodes[nodeIndex].first = leftIndex;
+    m_nodes[nodeIndex].count = 0;
+
+    subdivide(leftIndex, depth + 1, bounds, centroids);
+    subdivide(leftIndex + 1, depth + 1, bounds, centroids);
+  }
+
+  // Calls visit(entry, result) for every entry of a leaf, with the batch
+  // kernel's result for query. Chunks without a hit are skipped.
+  template <typename Result, typename Query, typename Visit>
+  void testLeaf(const Node &node, const Query &query, Visit &&visit) const {
+    std::array<Result, LEAF_CHUNK> results;
+    for (uint32_t first{node.first}; first < node.first + node.count;
+         first += LEAF_CHUNK) {
+      const size_t count{
+          glm::min<size_t>(LEAF_CHUNK, node.first + node.count - first)};
+      if (intersectBatch(query, m_bounds, first, count, results.data()) ==
+          0) {
+        continue;
+      }
+      for (size_t i{0}; i < count; ++i) {
+        visit(first + static_cast<uint32_t>(i), results[i]);
+      }
+    }
+  }
+
+  // Every primitive below a node which is entirely inside the query
+  void collect(const uint32_t root, std::vector<uint32_t> &result) const {
+    std::array<uint32_t, STACK_SIZE> stack;
+    size_t size{0};
+    stack[size++] = root;
+
+    while (size > 0) {
+      const Node &node{m_nodes[stack[--size]]};
+      if (node.count > 0) {
+        result.insert(result.end(), m_primitives.begin() + node.first,
+                      m_primitives.begin() + node.first + node.count);
+      } else {
+        stack[size++] = node.first;
+        stack[size++] = node.first + 1;
+      }
+    }
+  }
+
+public:
+  void build(const std::vector<AABB> &bounds) {
+    m_nodes.clear();
+    m_primitives.resize(bounds.size());
+    std::iota(m_primitives.begin(), m_primitives.end(), 0);
+
+    if (bounds.empty()) {
+      m_bounds.resize(0);
+      return;
+    }
+
+    std::vector<glm::vec3> centroids(bounds.size());
+    AABB rootBounds{bounds[0]};
+    for (size_t i{0}; i < bounds.size(); ++i) {
+      centroids[i] = (bounds[i].min + bounds[i].max) * 0.5f;
+      rootBounds = merge(rootBounds, bounds[i]);
+    }
+
+    // A binary tree with n leaves at most has 2n - 1 nodes
+    m_nodes.reserve(2 * bounds.size() - 1);
+    m_nodes.push_back(Node{.bounds = rootBounds,
+                           .first = 0,
+                           .count = static_cast<uint32_t>(bounds.size())});
+    subdivide(0, 0, bounds, centroids);
+
+    m_bounds.resize(bounds.size());
+    for (size_t i{0}; i < m_primitives.size(); ++i) {
+      m_bounds.set(i, bounds[m_primitives[i]]);
+    }
+  }
+
+  // Moves the nodes to new bounds of the same primitives without changing the
+  // tree. Linear, but the tree degrades when primitives move far from where
+  // they were built.
+  void refit(const std::vector<AABB> &bounds) {
+    assert(bounds.size() == m_primitives.size() &&
+           "Refit must keep the primitive count.");
+
+    for (size_t i{0}; i < m_primitives.size(); ++i) {
+      m_bounds.set(i, bounds[m_primitives[i]]);
+    }
+
+    // Children come after their parents
+    for (size_t i{m_nodes.size()}; i-- > 0;) {
+      Node &node{m_nodes[i]};
+      if (node.count > 0) {
+        node.bounds = m_bounds.get(node.first);
+        for (uint32_t j{node.first + 1}; j < node.first + node.count; ++j) {
+          node.bounds = merge(node.bounds, m_bounds.get(j));
+        }
+      } else {
+        node.bounds =
+            merge(m_nodes[node.first].bounds, m_nodes[node.first + 1].bounds);
+      }
+    }
+  }
+
+  // Appends every primitive whose box intersects the frustum
+  void query(const Frustum &frustum, std::vector<uint32_t> &result) const {
+    if (m_nodes.empty()) {
+      return;
+    }
+
+    std::array<uint32_t, STACK_SIZE> stack;
+    size_t size{0};
+    stack[size++] = 0;
+
+    while (size > 0) {
+      const uint32_t index{stack[--size]};
+      const Node &node{m_nodes[index]};
+
+      const Containment containment{classify(frustum, node.bounds)};
+      if (containment == Containment::OUTSIDE) {
+        continue;
+      }
+      if (containment == Containment::INSIDE) {
+        collect(index, result);
+        continue;
+      }
+
+      if (node.count > 0) {
+        testLeaf<uint8_t>(node, frustum,
+                          [&](const uint32_t entry, const uint8_t hit) {
+                            if (hit) {
+                              result.push_back(m_primitives[entry]);
+                            }
+                          });
+      } else {
+        stack[size++] = node.first;
+        stack[size++] = node.first + 1;
+      }
+    }
+  }
+
+  // Appends every primitive whose box intersects the sphere, e.g. the objects
+  // a point light reaches
+  void query(const Sphere &sphere, std::vector<uint32_t> &result) const {
+    if (m_nodes.empty()) {
+      return;
+    }
+
+    std::array<uint32_t, STACK_SIZE> stack;
+    size_t size{0};
+    stack[size++] = 0;
+
+    while (size > 0) {
+      const Node &node{m_nodes[stack[--size]]};
+      if (!intersects(sphere, node.bounds)) {
+        continue;
+      }
+
+      if (node.count > 0) {
+        testLeaf<uint8_t>(node, sphere,
+                          [&](const uint32_t entry, const uint8_t hit) {
+                            if (hit) {
+                              result.push_back(m_primitives[entry]);
+                            }
+                          });
+      } else {
+        stack[size++] = node.first;
+        stack[size++] = node.first + 1;
+      }
+    }
+  }
+
+  // The nearest box along the ray. The nearer child is visited first, and
+  // nodes further than the best hit so far are skipped.
+  RayHit raycast(const Ray &ray) const {
+    RayHit hit{.primitive = NO_HIT,
+               .distance = std::numeric_limits<float>::infinity()};
+    if (m_nodes.empty()) {
+      return hit;
+    }
+
+    std::array<std::pair<uint32_t, float>, STACK_SIZE> stack;
+    size_t size{0};
+    stack[size++] = {0, intersect(ray, m_nodes[0].bounds)};
+
+    while (size > 0) {
+      const auto [index, entry]{stack[--size]};
+      if (entry >= hit.distance) {
+        continue;
+      }
+
+      const Node &node{m_nodes[index]};
+      if (node.count > 0) {
+        testLeaf<float>(node, ray,
+                        [&](const uint32_t entry, const float distance) {
+                          if (distance < hit.distance) {
+                            hit = RayHit{.primitive = m_primitives[entry],
+                                         .distance = distance};
+                          }
+                        });
+        continue;
+      }
+
+      std::pair<uint32_t, float> near{
+          node.first, intersect(ray, m_nodes[node.first].bounds)};
+      std::pair<uint32_t, float> far{
+          node.first + 1, intersect(ray, m_nodes[node.first + 1].bounds)};
+      if (far.second < near.second) {
+        std::swap(near, far);
+      }
+
+      // Popped last, visited first
+      if (far.second < hit.distance) {
+        stack[size++] = far;
+      }
+      if (near.second < hit.distance) {
+        stack[size++] = near;
+      }
+    }
+
+    return hit;
+  }
+
+  size_t size() const { return m_primitives.size(); }
+
+  const std::vector<Node> &nodes() const { return m_nodes; }
+};
+
+} // namespace Geometry
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Shadows the GL state a frame changes most: the bound vertex array, program
+// and framebuffers, the texture of every unit and target, and the depth, cull
+// and blend state. A call which sets what is already set is skipped.
+//
+// It starts out with the defaults of a new context, so this state must only
+// be changed through here. GL hands out the name of a deleted object again,
+// so tracked objects are deleted through here too.
+class GLState {
+public:
+  struct Counters {
+    size_t issued;
+    size_t skipped;
+  };
+
+private:
+  static constexpr size_t TEXTURE_UNITS{16};
+  static constexpr std::array<GLenum, 3> TEXTURE_TARGETS{
+      GL_TEXTURE_2D, GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BUFFER};
+  static constexpr std::array<GLenum, 3> CAPABILITIES{
+      GL_DEPTH_TEST, GL_CULL_FACE, GL_BLEND};
+
+  inline static GLuint s_vertexArray{0};
+  inline static GLuint s_program{0};
+  inline static GLuint s_readFramebuffer{0};
+  inline static GLuint s_drawFramebuffer{0};
+  inline static GLuint s_activeUnit{0};
+  // Per unit, in the order of TEXTURE_TARGETS
+  inline static std::array<std::array<GLuint, TEXTURE_TARGETS.size()>,
+                           TEXTURE_UNITS>
+      s_textures{};
+  // In the order of CAPABILITIES
+  inline static std::array<bool, CAPABILITIES.size()> s_enabled{};
+  inline static GLenum s_cullFace{GL_BACK};
+  inline static GLenum s_depthFunc{GL_LESS};
+  inline static GLboolean s_depthMask{GL_TRUE};
+
+  inline static Counters s_counters{};
+
+  // Makes value the current one, false when it already was
+  template <typename T> static bool change(T &current, const T value) {
+    if (current == value) {
+      ++s_counters.skipped;
+      return false;
+    }
+    current = value;
+    ++s_counters.issued;
+    return true;
+  }
+
+  template <size_t N>
+  static size_t indexOf(const std::array<GLenum, N> &values,
+                        const GLenum value) {
+    const auto it{std::find(values.begin(), values.end(), value)};
+    assert(it != values.end() && "GL state is not tracked.");
+    return it - values.begin();
+  }
+
+  static void activeTexture(const GLuint unit) {
+    if (change(s_activeUnit, unit)) {
+      glActiveTexture(GL_TEXTURE0 + unit);
+    }
+  }
+
+  static void setCapability(const GLenum capability, const bool enabled) {
+    if (change(s_enabled[indexOf(CAPABILITIES, capability)], enabled)) {
+      if (enabled) {
+        glEnable(capability);
+      } else {
+        glDisable(capability);
+      }
+    }
+  }
+
+public:
+  static void bindVertexArray(const GLuint vertexArray) {
+    if (change(s_vertexArray, vertexArray)) {
+      glBindVertexArray(vertexArray);
+    }
+  }
+
+  static void useProgram(const GLuint program) {
+    if (change(s_program, program)) {
+      glUseProgram(program);
+    }
+  }
+
+  // GL_FRAMEBUFFER binds both the read and the draw framebuffer
+  static void bindFramebuffer(const GLenum target, const GLuint framebuffer) {
+    if (target == GL_READ_FRAMEBUFFER || target == GL_DRAW_FRAMEBUFFER) {
+      GLuint &current{target == GL_READ_FRAMEBUFFER ? s_readFramebuffer
+                                                    : s_drawFramebuffer};
+      if (change(current, framebuffer)) {
+        glBindFramebuffer(target, framebuffer);
+      }
+      return;
+    }
+
+    if (s_readFramebuffer == framebuffer && s_drawFramebuffer == framebuffer) {
+      ++s_counters.skipped;
+      return;
+    }
+    s_readFramebuffer = framebuffer;
+    s_drawFramebuffer = framebuffer;
+    ++s_counters.issued;
+    glBindFramebuffer(target, framebuffer);
+  }
+
+  // Also makes unit the active one when the texture has to be bound
+  static void bindTexture(const GLuint unit, const GLenum target,
+                          const GLuint texture) {
+    assert(unit < TEXTURE_UNITS && "Texture unit is not tracked.");
+
+    GLuint &current{s_textures[unit][indexOf(TEXTURE_TARGETS, target)]};
+    if (current == texture) {
+      ++s_counters.skipped;
+      return;
+    }
+    activeTexture(unit);
+    change(current, texture);
+    glBindTexture(target, texture);
+  }
+
+  // To the active unit, to create or update a texture
+  static void bindTexture(const GLenum target, const GLuint texture) {
+    bindTexture(s_activeUnit, target, texture);
+  }
+
+  static void enable(const GLenum capability) {
+    setCapability(capability, true);
+  }
+
+  static void disable(const GLenum capability) {
+    setCapability(capability, false);
+  }
+
+  static void cullFace(const GLenum face) {
+    if (change(s_cullFace, face)) {
+      glCullFace(face);
+    }
+  }
+
+  static void depthFunc(const GLenum func) {
+    if (change(s_depthFunc, func)) {
+      glDepthFunc(func);
+    }
+  }
+
+  static void depthMask(const GLboolean flag) {
+    if (change(s_depthMask, flag)) {
+      glDepthMask(flag);
+    }
+  }
+
+  // Deleting a bound object binds 0 in its place
+  static void deleteVertexArray(const GLuint vertexArray) {
+    if (s_vertexArray == vertexArray) {
+      s_vertexArray = 0;
+    }
+    glDeleteVertexArrays(1, &vertexArray);
+  }
+
+  static void deleteFramebuffer(const GLuint framebuffer) {
+    for (GLuint *current : {&s_readFramebuffer, &s_drawFramebuffer}) {
+      if (*current == framebuffer) {
+        *current = 0;
+      }
+    }
+    glDeleteFramebuffers(1, &framebuffer);
+  }
+
+  static void deleteTexture(const GLuint texture) {
+    for (auto &unit : s_textures) {
+      std::replace(unit.begin(), unit.end(), texture, GLuint{0});
+    }
+    glDeleteTextures(1, &texture);
+  }
+
+  // Since the last call
+  static Counters takeCounters() {
+    return std::exchange(s_counters, Counters{});
+  }
+};
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Local space bounds of a mesh
+struct Bounds {
+  Geometry::AABB box{};
+};
+
+// Positions are attribute 0, like aPos in the vertex shaders
+Bounds computeBounds(const std::byte *vertices, const size_t vertexCount,
+                     const VertexLayout &layout) {
+  const auto position{std::find_if(
+      layout.attributes().begin(), layout.attributes().end(),
+      [](const VertexAttribute &attribute) { return attribute.index == 0; })};
+  if (vertexCount == 0 || position == layout.attributes().end()) {
+    return Bounds{};
+  }
+  assert(position->type == GL_FLOAT && position->size >= 3 &&
+         "Vertex position must be at least 3 floats.");
+
+  const auto read{[&](const size_t vertex) {
+    glm::vec3 point;
+    std::memcpy(&point, vertices + vertex * layout.stride() + position->offset,
+                sizeof(point));
+    return point;
   }};
 
-  std::vector<Vertex> vertices{
-      createVertex({-edge, 0, -edge}), //
-      createVertex({edge, 0, -edge}),  //
-      createVertex({edge, 0, edge}),   //
-      createVertex({-edge, 0, edge}),  //
-  };
+  Bounds bounds{.box = {.min = read(0), .max = read(0)}};
+  for (size_t i{1}; i < vertexCount; ++i) {
+    bounds.box.min = glm::min(bounds.box.min, read(i));
+    bounds.box.max = glm::max(bounds.box.max, read(i));
+  }
+
+  return bounds;
+}
+
+// Per instance vertex attributes, one per copy of a mesh
+struct InstanceData {
+  glm::mat4 model;
+  glm::vec4 color;
+};
+
+class InstanceBuffer {
+private:
+  GLuint m_bufferId{0};
+  // In instances
+  size_t m_capacity{0};
+
+public:
+  // A mat4 attribute takes 4 consecutive locations, one per column
+  static constexpr GLuint MODEL_LOCATION{3};
+  static constexpr GLuint COLOR_LOCATION{7};
+
+  InstanceBuffer() { glGenBuffers(1, &m_bufferId); }
+
+  InstanceBuffer(const InstanceBuffer &) = delete;
+  InstanceBuffer &operator=(const InstanceBuffer &) = delete;
+
+  ~InstanceBuffer() { glDeleteBuffers(1, &m_bufferId); }
+
+  void upload(const std::vector<InstanceData> &instances) {
+    glBindBuffer(GL_ARRAY_BUFFER, m_bufferId);
+
+    if (instances.size() > m_capacity) {
+      m_capacity = instances.size();
+      glBufferData(GL_ARRAY_BUFFER, m_capacity * sizeof(InstanceData),
+                   instances.data(), GL_STREAM_DRAW);
+    } else {
+      // Orphan the old storage, so the driver doesn't wait for draws which
+      // still read it
+      glBufferData(GL_ARRAY_BUFFER, m_capacity * sizeof(InstanceData),
+                   nullptr, GL_STREAM_DRAW);
+      glBufferSubData(GL_ARRAY_BUFFER, 0,
+                      instances.size() * sizeof(InstanceData),
+                      instances.data());
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+
+  GLuint id() const { return m_bufferId; }
+
+  // Points the instance attributes of the bound VAO at the instances,
+  // starting at firstInstance
+  void attach(const size_t firstInstance) const {
+    glBindBuffer(GL_ARRAY_BUFFER, m_bufferId);
+
+    const size_t base{firstInstance * sizeof(InstanceData)};
+
+    for (GLuint column{0}; column < 4; ++column) {
+      const GLuint location{MODEL_LOCATION + column};
+      glEnableVertexAttribArray(location);
+      glVertexAttribPointer(
+          location, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+          reinterpret_cast<const void *>(base + offsetof(InstanceData, model) +
+                                         column * sizeof(glm::vec4)));
+      glVertexAttribDivisor(location, 1);
+    }
+
+    glEnableVertexAttribArray(COLOR_LOCATION);
+    glVertexAttribPointer(
+        COLOR_LOCATION, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+        reinterpret_cast<const void *>(base + offsetof(InstanceData, color)));
+    glVertexAttribDivisor(COLOR_LOCATION, 1);
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+};
+
+class MeshArena;
+
+class Mesh {
+public:
+  // Where a MeshArena keeps a copy of the mesh
+  struct ArenaRange {
+    const MeshArena *arena;
+    GLuint firstIndex;
+    GLint baseVertex;
+  };
+
+private:
+  // TODO: Create VAO class
+  // https://gamedev.stackexchange.com/questions/204015/how-to-abstract-vao-as-a-class-in-c
+  //
+  // TODO: Create VBO class
+  // https://gamedev.stackexchange.com/questions/204015/how-to-abstract-vao-as-a-class-in-c
+
+  GLuint m_vertexArrayObjectId{0};
+  GLuint m_vertexBufferObjectId{0};
+  GLuint m_elementBufferObjectId{0};
+
+  GLenum m_indexType{0};
+  GLsizei m_indicesCount{0};
+
+  VertexLayout m_layout{};
+  GLsizei m_vertexCount{0};
+
+  Bounds m_bounds{};
+  ArenaRange m_arenaRange{};
+
+  void cleanup() {
+    if (m_vertexArrayObjectId != 0) {
+      GLState::deleteVertexArray(m_vertexArrayObjectId);
+    }
+    if (m_vertexBufferObjectId != 0) {
+      glDeleteBuffers(1, &m_vertexBufferObjectId);
+    }
+    if (m_elementBufferObjectId != 0) {
+      glDeleteBuffers(1, &m_elementBufferObjectId);
+    }
+  }
+
+public:
+  // TODO: Default constructor, no parameters
+  // TODO: Add getter/setter for vertices & indices.
+  template <typename VertexType, typename IndexType>
+  Mesh(const std::vector<VertexType> &vertices,
+       const std::vector<IndexType> &indices, const VertexLayout &layout) {
+    if constexpr (!std::is_fundamental_v<VertexType>) {
+      assert(layout.stride() == sizeof(VertexType) &&
+             "VertexType has padded data. Layout stride does not match C++ "
+             "struct size.");
+    }
+
+    // GLTypeTraits limits IndexType to fundamental type and sizeof() won't
+    // return padded data
+    m_indexType = GLIndexTraits<IndexType>::type;
+    m_indicesCount = static_cast<GLsizei>(indices.size());
+
+    m_layout = layout;
+    m_vertexCount = static_cast<GLsizei>(vertices.size() *
+                                         sizeof(VertexType) / layout.stride());
+
+    m_bounds = computeBounds(
+        reinterpret_cast<const std::byte *>(vertices.data()),
+        vertices.size() * sizeof(VertexType) / layout.stride(), layout);
+
+    glGenVertexArrays(1, &m_vertexArrayObjectId);
+    glGenBuffers(1, &m_vertexBufferObjectId);
+    glGenBuffers(1, &m_elementBufferObjectId);
+
+    GLState::bindVertexArray(m_vertexArrayObjectId);
+
+    // TODO: What if sizeof() gives compiler-padded size?
+    glBindBuffer(GL_ARRAY_BUFFER, m_vertexBufferObjectId);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(VertexType),
+                 vertices.data(), GL_STATIC_DRAW);
+
+    // TODO: What if sizeof() gives compiler-padded size?
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_elementBufferObjectId);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(IndexType),
+                 indices.data(), GL_STATIC_DRAW);
+
+    for (const auto &attribute : layout.attributes()) {
+      glEnableVertexAttribArray(attribute.index);
+      glVertexAttribPointer(                               //
+          attribute.index,                                 //
+          attribute.size,                                  //
+          attribute.type,                                  //
+          attribute.normalized,                            //
+          layout.stride(),                                 //
+          reinterpret_cast<const void *>(attribute.offset) //
+      );
+    }
+
+    // Unbind VAO first to protect its state
+    GLState::bindVertexArray(0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  }
+
+  Mesh(const Mesh &) = delete;
+
+  Mesh &operator=(const Mesh &) = delete;
+
+  Mesh(Mesh &&other) noexcept
+      : m_vertexArrayObjectId{std::exchange(other.m_vertexArrayObjectId, 0)},
+        m_vertexBufferObjectId{std::exchange(other.m_vertexBufferObjectId, 0)},
+        m_elementBufferObjectId{
+            std::exchange(other.m_elementBufferObjectId, 0)},
+        m_indexType{std::exchange(other.m_indexType, 0)},
+        m_indicesCount{std::exchange(other.m_indicesCount, 0)},
+        m_layout{std::move(other.m_layout)},
+        m_vertexCount{std::exchange(other.m_vertexCount, 0)},
+        m_bounds{other.m_bounds},
+        m_arenaRange{std::exchange(other.m_arenaRange, {})} {}
+
+  Mesh &operator=(Mesh &&other) noexcept {
+    if (this != &other) {
+      cleanup();
+
+      m_vertexArrayObjectId = std::exchange(other.m_vertexArrayObjectId, 0);
+      m_vertexBufferObjectId = std::exchange(other.m_vertexBufferObjectId, 0);
+      m_elementBufferObjectId = std::exchange(other.m_elementBufferObjectId, 0);
+      m_indexType = std::exchange(other.m_indexType, 0);
+      m_indicesCount = std::exchange(other.m_indicesCount, 0);
+      m_layout = std::move(other.m_layout);
+      m_vertexCount = std::exchange(other.m_vertexCount, 0);
+      m_bounds = other.m_bounds;
+      m_arenaRange = std::exchange(other.m_arenaRange, {});
+    }
+    return *this;
+  }
+
+  ~Mesh() { cleanup(); }
+
+  GLenum indexType() const { return m_indexType; }
+
+  GLsizei indicesCount() const { return m_indicesCount; }
+
+  const VertexLayout &layout() const { return m_layout; }
+
+  GLsizei vertexCount() const { return m_vertexCount; }
+
+  GLuint vertexBufferId() const { return m_vertexBufferObjectId; }
+
+  GLuint elementBufferId() const { return m_elementBufferObjectId; }
+
+  const Bounds &bounds() const { return m_bounds; }
+
+  // The arena is null until the mesh is added to one
+  const ArenaRange &arenaRange() const { return m_arenaRange; }
+
+  // Called by the arena once it copied the mesh. The mesh's own VAO and
+  // buffers are freed, so its data is only in GPU memory once, and it's only
+  // drawn through the arena from then on.
+  void setArenaRange(const ArenaRange &range) {
+    m_arenaRange = range;
+    cleanup();
+    m_vertexArrayObjectId = 0;
+    m_vertexBufferObjectId = 0;
+    m_elementBufferObjectId = 0;
+  }
+
+  void bind() const {
+    assert(m_vertexArrayObjectId != 0 && "Mesh was moved into an arena.");
+    GLState::bindVertexArray(m_vertexArrayObjectId);
+  }
+
+  void unbind() const { GLState::bindVertexArray(0); }
+
+  // Points the instance attributes of the VAO at instances, starting at
+  // firstInstance. GL 3.3 has no base instance for draws, so a draw of a
+  // range within the buffer moves the attribute offsets instead. Leaves the
+  // VAO bound for glDrawElementsInstanced.
+  void attachInstances(const InstanceBuffer &instances,
+                       const size_t firstInstance) const {
+    assert(m_vertexArrayObjectId != 0 && "Mesh was moved into an arena.");
+    GLState::bindVertexArray(m_vertexArrayObjectId);
+    instances.attach(firstInstance);
+  }
+};
+
+// GL 4.3 or ARB_multi_draw_indirect, loaded by hand like the program binary
+// functions
+#define GL_DRAW_INDIRECT_BUFFER 0x8F3F
+
+// One vertex buffer and one index buffer shared by meshes with the same
+// vertex layout, behind one VAO. Each mesh is a range of them, drawn with a
+// base vertex, so draws of different meshes switch no VAO or buffer.
+//
+// With GL 4.3 a list of draws is one glMultiDrawElementsIndirect. The base
+// instance of each command picks its instances, so the instance attributes
+// are set up once. GL 3.3 has no base instance, the draws are a loop of
+// glDrawElementsInstancedBaseVertex which moves the instance attributes to
+// each draw's first instance.
+class MeshArena {
+public:
+  // Layout of GL's DrawElementsIndirectCommand
+  struct DrawCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+  };
+
+private:
+  using MultiDrawElementsIndirectProc = void(APIENTRYP)(GLenum, GLenum,
+                                                        const void *, GLsizei,
+                                                        GLsizei);
+
+  GLuint m_vertexArrayObjectId{0};
+  GLuint m_vertexBufferObjectId{0};
+  GLuint m_elementBufferObjectId{0};
+  GLuint m_indirectBufferId{0};
+
+  MultiDrawElementsIndirectProc m_multiDrawElementsIndirect{nullptr};
+
+  size_t m_meshCount{0};
+  GLsizei m_vertexCount{0};
+  GLsizei m_indexCount{0};
+
+public:
+  // Copies the meshes into the arena and records their ranges in them, which
+  // frees their own buffers. A mesh drawn outside of an arena, e.g. the
+  // post-processing quad, must not be added to one. multiDrawIndirect
+  // false keeps the GL 3.3 loop even when the driver has GL 4.3.
+  MeshArena(const std::vector<Mesh *> &meshes, const bool multiDrawIndirect) {
+    assert(!meshes.empty() && "Mesh arena needs a mesh.");
+    const VertexLayout &layout{meshes.front()->layout()};
+    for (const Mesh *mesh : meshes) {
+      assert(mesh->layout() == layout &&
+             "Meshes of an arena must have the same vertex layout.");
+      assert(mesh->indexType() == GL_UNSIGNED_INT &&
+             "Mesh arena indices are GL_UNSIGNED_INT.");
+      m_vertexCount += mesh->vertexCount();
+      m_indexCount += mesh->indicesCount();
+    }
+    m_meshCount = meshes.size();
+
+    glGenVertexArrays(1, &m_vertexArrayObjectId);
+    glGenBuffers(1, &m_vertexBufferObjectId);
+    glGenBuffers(1, &m_elementBufferObjectId);
+
+    GLState::bindVertexArray(m_vertexArrayObjectId);
+
+    glBindBuffer(GL_ARRAY_BUFFER, m_vertexBufferObjectId);
+    glBufferData(GL_ARRAY_BUFFER,
+                 static_cast<GLsizeiptr>(m_vertexCount) * layout.stride(),
+                 nullptr, GL_STATIC_DRAW);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_elementBufferObjectId);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                 static_cast<GLsizeiptr>(m_indexCount) * sizeof(GLuint),
+                 nullptr, GL_STATIC_DRAW);
+
+    for (const auto &attribute : layout.attributes()) {
+      glEnableVertexAttribArray(attribute.index);
+      glVertexAttribPointer(attribute.index, attribute.size, attribute.type,
+                            attribute.normalized, layout.stride(),
+                            reinterpret_cast<const void *>(attribute.offset));
+    }
+
+    GLint baseVertex{0};
+    GLuint firstIndex{0};
+    for (Mesh *mesh : meshes) {
+      glBindBuffer(GL_COPY_READ_BUFFER, mesh->vertexBufferId());
+      glCopyBufferSubData(
+          GL_COPY_READ_BUFFER, GL_ARRAY_BUFFER, 0,
+          static_cast<GLintptr>(baseVertex) * layout.stride(),
+          static_cast<GLsizeiptr>(mesh->vertexCount()) * layout.stride());
+
+      glBindBuffer(GL_COPY_READ_BUFFER, mesh->elementBufferId());
+      glCopyBufferSubData(
+          GL_COPY_READ_BUFFER, GL_ELEMENT_ARRAY_BUFFER, 0,
+          static_cast<GLintptr>(firstIndex) * sizeof(GLuint),
+          static_cast<GLsizeiptr>(mesh->indicesCount()) * sizeof(GLuint));
+
+      mesh->setArenaRange(Mesh::ArenaRange{
+          .arena = this, .firstIndex = firstIndex, .baseVertex = baseVertex});
+      baseVertex += mesh->vertexCount();
+      firstIndex += mesh->indicesCount();
+    }
+
+    // Unbind VAO first to protect its state
+    GLState::bindVertexArray(0);
+
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    // Base instances are part of GL 4.2, and of GL 4.3's multi draw
+    GLint major{0};
+    GLint minor{0};
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    const bool supported{
+        major * 10 + minor >= 43 ||
+        (SDL_GL_ExtensionSupported("GL_ARB_multi_draw_indirect") &&
+         SDL_GL_ExtensionSupported("GL_ARB_base_instance"))};
+    if (multiDrawIndirect && supported) {
+      m_multiDrawElementsIndirect =
+          reinterpret_cast<MultiDrawElementsIndirectProc>(
+              SDL_GL_GetProcAddress("glMultiDrawElementsIndirect"));
+    }
+    if (m_multiDrawElementsIndirect != nullptr) {
+      glGenBuffers(1, &m_indirectBufferId);
+    }
+  }
+
+  // The meshes point at the arena
+  MeshArena(const MeshArena &) = delete;
+  MeshArena &operator=(const MeshArena &) = delete;
+
+  ~MeshArena() {
+    GLState::deleteVertexArray(m_vertexArrayObjectId);
+    glDeleteBuffers(1, &m_vertexBufferObjectId);
+    glDeleteBuffers(1, &m_elementBufferObjectId);
+    if (m_indirectBufferId != 0) {
+      glDeleteBuffers(1, &m_indirectBufferId);
+    }
+  }
+
+  bool multiDrawIndirect() const {
+    return m_multiDrawElementsIndirect != nullptr;
+  }
+
+  size_t meshCount() const { return m_meshCount; }
+
+  GLsizei vertexCount() const { return m_vertexCount; }
+
+  GLsizei indexCount() const { return m_indexCount; }
+
+  // Base instances index into instances
+  void draw(const InstanceBuffer &instances,
+            const std::vector<DrawCommand> &commands) const {
+    if (commands.empty()) {
+      return;
+    }
+
+    GLState::bindVertexArray(m_vertexArrayObjectId);
+
+    if (m_multiDrawElementsIndirect != nullptr) {
+      instances.attach(0);
+
+      // Orphaned like the instances, earlier draws may still read it
+      glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_indirectBufferId);
+      glBufferData(GL_DRAW_INDIRECT_BUFFER,
+                   commands.size() * sizeof(DrawCommand), commands.data(),
+                   GL_STREAM_DRAW);
+      m_multiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, nullptr,
+                                  static_cast<GLsizei>(commands.size()), 0);
+      glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+      return;
+    }
+
+    for (const DrawCommand &command : commands) {
+      instances.attach(command.baseInstance);
+      glDrawElementsInstancedBaseVertex(
+          GL_TRIANGLES, command.count, GL_UNSIGNED_INT,
+          reinterpret_cast<const void *>(command.firstIndex * sizeof(GLuint)),
+          command.instanceCount, command.baseVertex);
+    }
+  }
+};
+
+struct Vertex {
+  glm::vec3 pos;
+  glm::vec3 color;
+  glm::vec3 normal;
+};
+
+Mesh generateCube(float side) {
+  float h = side / 2.0f;
+
+  struct Face {
+    glm::vec3 normal, right, up, color;
+  };
+
+  glm::vec3 white{1.0f, 1.0f, 1.0f};
+
+  std::vector<Face> faces = {
+      {{0, 0, 1}, {1, 0, 0}, {0, 1, 0}, white},   // Front
+      {{0, 0, -1}, {-1, 0, 0}, {0, 1, 0}, white}, // Back
+      {{0, 1, 0}, {1, 0, 0}, {0, 0, -1}, white},  // Top
+      {{0, -1, 0}, {1, 0, 0}, {0, 0, 1}, white},  // Bottom
+      {{1, 0, 0}, {0, 0, -1}, {0, 1, 0}, white},  // Right
+      {{-1, 0, 0}, {0, 0, 1}, {0, 1, 0}, white}   // Left
+  };
+
+  std::vector<Vertex> vertices;
+  std::vector<unsigned int> indices;
+
+  for (int i = 0; i < faces.size(); i++) {
+    const auto &f = faces[i];
+    glm::vec3 center = f.normal * h;
+
+    // Add 4 edge vertices
+    vertices.push_back({.pos = center - (f.right * h) - (f.up * h),
+                        .color = f.color,
+                        .normal = f.normal}); // BottomLeft
+    vertices.push_back({.pos = center + (f.right * h) - (f.up * h),
+                        .color = f.color,
+                        .normal = f.normal}); // TopLeft
+    vertices.push_back({.pos = center + (f.right * h) + (f.up * h),
+                        .color = f.color,
+                        .normal = f.normal}); // TopRight
+    vertices.push_back({.pos = center - (f.right * h) + (f.up * h),
+                        .color = f.color,
+                        .normal = f.normal}); // BottomRight
+
+    // Add face indices
+    unsigned int offset = i * 4;
+
+    indices.push_back(offset + 0);
+    indices.push_back(offset + 1);
+    indices.push_back(offset + 2);
+    indices.push_back(offset + 2);
+    indices.push_back(offset + 3);
+    indices.push_back(offset + 0);
+  }
+
+  VertexLayout layout;
+  layout.push<float>(3);
+  layout.push<float>(3);
+  layout.push<float>(3);
+
+  Mesh mesh{vertices, indices, layout};
+
+  return mesh;
+}
+
+glm::vec3 sphericalCoord(const float yaw, const float pitch,
+                         const float r = 1) {
+  glm::vec3 coord{
+      glm::sin(yaw) * glm::cos(pitch), //
+      glm::sin(pitch),                 //
+      -glm::cos(yaw) * glm::cos(pitch) //
+  };
+  return r * coord;
+}
+
+// TODO: Figure out if it's beneficial to refactor this function to use
+// generateMesh
+Mesh generateSphere(const int latitudeBands, const int longitudeBands,
+                    const float r = 1,
+                    const glm::vec3 &color = {1.0f, 1.0f, 1.0f}) {
+  std::vector<Vertex> vertices;
+
+  const float pi{glm::pi<float>()};
+
+  for (int i{0}; i <= latitudeBands; ++i) {
+    const float floatI{static_cast<float>(i)};
+    const float floatLatitudeBands{static_cast<float>(latitudeBands)};
+
+    const float pitch{pi / 2 - (floatI / floatLatitudeBands) * pi};
+
+    for (int j{0}; j <= longitudeBands; ++j) {
+      const float floatJ{static_cast<float>(j)};
+      const float floatLongitudeBands{static_cast<float>(longitudeBands)};
+
+      const float yaw{(floatJ / floatLongitudeBands) * 2 * pi};
+
+      const glm::vec3 normal{sphericalCoord(yaw, pitch, 1)};
+
+      const glm::vec3 white{1.0f, 1.0f, 1.0f};
+
+      vertices.push_back({
+          .pos = r * normal,
+          .color = color,
+          .normal = normal,
+      });
+    }
+  }
+
+  std::vector<unsigned int> indices;
+
+  for (int i{0}; i < latitudeBands; ++i) {
+    for (int j{0}; j < longitudeBands; ++j) {
+      const int rowStride{longitudeBands + 1};
+
+      const int topLeft{i * rowStride + j};
+      const int topRight{topLeft + 1};
+      const int bottomLeft{(i + 1) * rowStride + j};
+      const int bottomRight{bottomLeft + 1};
+
+      indices.push_back(topLeft);
+      indices.push_back(topRight);
+      indices.push_back(bottomLeft);
+
+      indices.push_back(topRight);
+      indices.push_back(bottomRight);
+      indices.push_back(bottomLeft);
+    }
+  }
+
+  VertexLayout layout;
+
+  layout.push<float>(3);
+  layout.push<float>(3);
+  layout.push<float>(3);
+
+  Mesh mesh{vertices, indices, layout};
+
+  return mesh;
+}
+
+Mesh generateQuad(const float edge = 0.5f) {
+  auto createVertex{[](const glm::vec3 &pos) -> Vertex {
+    const glm::vec3 color{1.0f, 1.0f, 1.0f};
+    const glm::vec3 normal{0.0f, 1.0f, 0.0f};
+
+    return {.pos = pos, .color = color, .normal = normal};
+  }};
+
+  std::vector<Vertex> vertices{
+      createVertex({-edge, 0, -edge}), //
+      createVertex({edge, 0, -edge}),  //
+      createVertex({edge, 0, edge}),   //
+      createVertex({-edge, 0, edge}),  //
+  };
+
+  std::vector<unsigned int> indices{0, 1, 2, 2, 3, 0};
+
+  VertexLayout layout;
+
+  // 3 floats for position, color, normal
+  layout.push<float>(3);
+  layout.push<float>(3);
+  layout.push<float>(3);
+
+  Mesh mesh{vertices, indices, layout};
+
+  return mesh;
+}
+
+using UVMapCallback = std::function<void(const float, const float)>;
+
+void generateUVMap(const int uSteps, const int vSteps,
+                   const UVMapCallback &callback) {
+  for (int i{0}; i < uSteps; ++i) {
+    for (int j{0}; j < vSteps; ++j) {
+      const float u{static_cast<float>(i) / static_cast<float>(uSteps - 1)};
+      const float v{static_cast<float>(j) / static_cast<float>(vSteps - 1)};
+
+      callback(u, v);
+    }
+  }
+}
+
+struct UVIndexParam {
+  uint32_t topLeft;
+  uint32_t topRight;
+  uint32_t bottomLeft;
+  uint32_t bottomRight;
+};
+
+using UVMapIndexCallback = std::function<void(UVIndexParam)>;
+
+// NOTE: To wrap the grid, generate 1 more row or column (whichever expects
+// wrapping)
+void generateUVMapIndices(const int uSteps, const int vSteps,
+                          const UVMapIndexCallback &callback) {
+  for (int i{0}; i < uSteps - 1; ++i) {
+    for (int j{0}; j < vSteps - 1; ++j) {
+      const int nextI{(i + 1)};
+      const int nextJ{(j + 1)};
+
+      const uint32_t topLeft{static_cast<uint32_t>(i * vSteps + j)};
+      const uint32_t topRight{static_cast<uint32_t>(i * vSteps + nextJ)};
+      const uint32_t bottomLeft{static_cast<uint32_t>(nextI * vSteps + j)};
+      const uint32_t bottomRight{static_cast<uint32_t>(nextI * vSteps + nextJ)};
+
+      callback({
+          .topLeft = topLeft,
+          .topRight = topRight,
+          .bottomLeft = bottomLeft,
+          .bottomRight = bottomRight,
+      });
+    }
+  }
+}
+
+Vertex generateCylinderVertex(const float u, const float v) {
+  std::vector<Vertex> vertices;
+  const float angle{u * 2.0f * glm::pi<float>()};
+  const float z{v - 0.5f};
+
+  glm::vec3 position{glm::cos(angle), glm::sin(angle), z};
+  const glm::vec3 center{0.0f, 0.0f, z};
+  glm::vec3 normal{glm::normalize(position - center)};
+  glm::vec3 color{1.0f, 1.0f, 1.0f};
+
+  return {
+      .pos = std::move(position),
+      .color = std::move(color),
+      .normal = std::move(normal),
+  };
+}
+
+// TODO: Scaling cylinder length reduces curvature. Allow curvature to be
+// size-relative so stretching does not stretch out the curve.
+// TODO: Allow larger than unit length cylinders.
+Vertex generateWavyCylinderVertex(const float u, const float v) {
+  std::vector<Vertex> vertices;
+  const float angle{u * 2.0f * glm::pi<float>()};
+  const float z{v - 0.5f};
+
+  glm::vec3 position{
+      glm::cos(angle),                                         //
+      glm::sin(z * 2.0f * glm::pi<float>()) + glm::sin(angle), //
+      z                                                        //
+  };
+  // Analytical Partial Derivative of the position parametric function
+  glm::vec3 d_angle{
+      -glm::sin(angle), //
+      glm::cos(angle),  //
+      0.0               //
+  };
+  glm::vec3 d_z{
+      0.0f,                                                            //
+      2.0f * glm::pi<float>() * glm::cos(z * 2.0f * glm::pi<float>()), //
+      1.0f                                                             //
+  };
+  glm::vec3 normal{glm::normalize(glm::cross(d_angle, d_z))};
+  glm::vec3 color{1.0f, 1.0f, 1.0f};
+
+  return {
+      .pos = std::move(position),
+      .color = std::move(color),
+      .normal = std::move(normal),
+  };
+}
+
+Vertex generateTorusVertex(const float u, const float v) {
+  const float theta{u * 2.0f * glm::pi<float>()};
+  const float phi{v * 2.0f * glm::pi<float>()};
+  const float z{v - 0.5f};
+
+  // TODO: Configurable parameters, make radius configurable.
+  const float ringRadius{1.0f};
+  const float torusRadius{4.0f};
+
+  glm::vec3 position{ringRadius * glm::cos(theta), ringRadius * glm::sin(theta),
+                     0.0f};
+  glm::mat4 model{glm::identity<glm::mat4>()};
+  model = glm::rotate(model, phi, glm::vec3{0.0f, 1.0f, 0.0f});
+  model = glm::translate(model, glm::vec3{torusRadius, 0.0f, 0.0f});
+  position = glm::vec3{model * glm::vec4{position, 1.0f}};
+  const glm::vec3 center{model * glm::vec4{0.0f, 0.0f, 0.0, 1.0f}};
+  glm::vec3 normal{glm::normalize(position - center)};
+
+  glm::vec3 color{1.0f, 1.0f, 1.0f};
+
+  return {.pos = std::move(position),
+          .color = std::move(color),
+          .normal = std::move(normal)};
+}
+
+// TODO: Add disc generator
+
+using GenerateMeshCallback = std::function<Vertex(const float, const float)>;
+
+// TODO: Consider Finite Difference method in case of more geometry
+Mesh generateMesh(const GenerateMeshCallback &callback, const int uSteps = 32,
+                  const int vSteps = 32) {
+  std::vector<Vertex> vertices;
+
+  const int uCount{uSteps + 1};
+
+  generateUVMap(uCount, vSteps,
+                [&vertices, &callback](const float u, const float v) {
+                  vertices.push_back(callback(u, v));
+                });
+
+  std::vector<uint32_t> indices;
+
+  generateUVMapIndices(uCount, vSteps, [&indices](const auto idxParam) {
+    indices.push_back(idxParam.topLeft);
+    indices.push_back(idxParam.topRight);
+    indices.push_back(idxParam.bottomLeft);
+    indices.push_back(idxParam.bottomLeft);
+    indices.push_back(idxParam.topRight);
+    indices.push_back(idxParam.bottomRight);
+  });
+
+  VertexLayout layout;
+
+  layout.push<float>(3);
+  layout.push<float>(3);
+  layout.push<float>(3);
+
+  return {std::move(vertices), std::move(indices), std::move(layout)};
+}
+
+std::string loadShaderSource(const std::string &filePath) {
+  std::ifstream file(filePath);
+  if (!file.is_open()) {
+    throw std::runtime_error("Failed to open shader file: " + filePath);
+  }
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  return buffer.str();
+}
+
+enum class ShaderType : GLenum {
+  Vertex = GL_VERTEX_SHADER,
+  Fragment = GL_FRAGMENT_SHADER,
+  Geometry = GL_GEOMETRY_SHADER
+};
+
+GLenum shaderTypeToGLenum(ShaderType shaderType) {
+  if (shaderType == ShaderType::Vertex) {
+    return GL_VERTEX_SHADER;
+  }
+  if (shaderType == ShaderType::Fragment) {
+    return GL_FRAGMENT_SHADER;
+  }
+  if (shaderType == ShaderType::Geometry) {
+    return GL_GEOMETRY_SHADER;
+  }
+
+  throw std::runtime_error("Received unsupported shader type.");
+}
+
+class AbstractShader {
+public:
+  virtual ~AbstractShader() = default;
+  virtual AbstractShader &replace(const std::string &, const std::string &) = 0;
+  virtual std::string src() const = 0;
+  virtual ShaderType type() const = 0;
+  virtual AbstractShader &
+  insertDefines(const std::vector<std::string> &defines) = 0;
+  virtual AbstractShader &clearDefines() = 0;
+};
+
+template <ShaderType Type> //
+class Shader final : public AbstractShader {
+private:
+  std::string m_src;
+
+  struct DefinesRange {
+    size_t begin{0};
+    size_t length{0};
+    bool valid{false};
+  };
+
+  DefinesRange getDefinesRange() const {
+    const std::string definesBegin{"/*{{defines_begin}}*/"};
+    const std::string definesEnd{"/*{{defines_end}}*/"};
+
+    size_t posBegin{m_src.find(definesBegin)};
+    size_t posEnd{m_src.find(definesEnd)};
+
+    if (posBegin != std::string::npos && posEnd != std::string::npos) {
+      size_t contentStart{posBegin + definesBegin.length()};
+      size_t contentLength{posEnd - contentStart};
+      const DefinesRange definesRange{
+          .begin = contentStart, .length = contentLength, .valid = true};
+      return definesRange;
+    }
+
+    return DefinesRange{.valid = false};
+  }
+
+public:
+  Shader(std::string src,
+         const std::unordered_map<std::string, std::string> &replacements = {},
+         const std::vector<std::string> &defines = {})
+      : m_src{std::move(src)} {
+    for (const auto &[key, value] : replacements) {
+      this->replace(key, value);
+    }
+    insertDefines(defines);
+  }
+
+  Shader &insertDefines(const std::vector<std::string> &defines = {}) override {
+    // TODO: Maybe prevent inserting multiple defines.
+    //
+    // Currently allows inserting multiple defines. It makes adding method to
+    // define a single define and remove it more difficult, as we have to
+    // currently treat every define we want to remove, as if there are multiple
+    // #defines of it.
+
+    if (defines.empty()) {
+      return *this;
+    }
+
+    const DefinesRange range{getDefinesRange()};
+    if (!range.valid) {
+      return *this;
+    }
+
+    std::string strDefines{"\n"};
+
+    for (const auto &value : defines) {
+      strDefines += "#define " + value + "\n";
+    }
+
+    m_src.insert(range.begin, strDefines);
+
+    return *this;
+  }
+
+  Shader &clearDefines() override {
+    const DefinesRange range{getDefinesRange()};
+    if (range.valid) {
+      m_src.replace(range.begin, range.length, "\n");
+    }
+    return *this;
+  }
+
+  Shader &replace(const std::string &key, const std::string &value) override {
+    const std::string searchKey{"{{" + key + "}}"};
+    size_t pos{0};
+    while ((pos = m_src.find(searchKey, pos)) != std::string::npos) {
+      m_src.replace(pos, searchKey.length(), value);
+      pos += value.length();
+    }
+    return *this;
+  }
+
+  std::string src() const override { return m_src; }
+
+  ShaderType type() const override { return Type; }
+};
+
+// 64 bit FNV-1a, chain calls through hash to cover several strings
+constexpr uint64_t fnv1a(const std::string_view text,
+                         uint64_t hash = 0xcbf29ce484222325ull) {
+  for (const char c : text) {
+    hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// Every uniform name written as "u_view"_uniform gets a slot, numbered
+// before main runs. A ShaderProgram resolves each slot to its location once
+// after linking, so setting a uniform indexes an array of locations.
+class UniformSlots {
+private:
+  static std::vector<uint64_t> &hashes() {
+    static std::vector<uint64_t> s_hashes;
+    return s_hashes;
+  }
+
+public:
+  static size_t add(const uint64_t hash) {
+    std::vector<uint64_t> &slots{hashes()};
+    const auto it{std::find(slots.begin(), slots.end(), hash)};
+    if (it != slots.end()) {
+      return it - slots.begin();
+    }
+    slots.push_back(hash);
+    return slots.size() - 1;
+  }
+
+  static const std::vector<uint64_t> &all() { return hashes(); }
+};
+
+// The characters of a uniform name literal, as a template argument
+template <size_t N> struct UniformLiteral {
+  char name[N];
+
+  consteval UniformLiteral(const char (&literal)[N]) {
+    std::copy_n(literal, N, name);
+  }
+};
+
+// One per name, its slot is taken during static initialization
+template <UniformLiteral Literal> struct UniformSlot {
+  static constexpr uint64_t hash{fnv1a(Literal.name)};
+  inline static const size_t index{UniformSlots::add(hash)};
+};
+
+struct UniformName {
+  uint64_t hash;
+  const char *name;
+  size_t slot;
+};
+
+template <UniformLiteral Literal> UniformName operator""_uniform() {
+  return UniformName{.hash = UniformSlot<Literal>::hash,
+                     .name = Literal.name,
+                     .slot = UniformSlot<Literal>::index};
+}
+
+// GL 4.1 or ARB_get_program_binary. glad is generated for 3.3 core, so the
+// entry points are loaded by hand.
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+
+// Linked programs saved to disk with glGetProgramBinary, so the next launch
+// loads them instead of compiling and linking. A binary only works with the
+// driver which made it, so the key hashes GL_VENDOR, GL_RENDERER and
+// GL_VERSION along with the final sources. A binary the driver rejects, e.g.
+// after an update with the same version string, is compiled and stored again.
+class ProgramBinaryCache {
+private:
+  using GetProgramBinaryProc = void(APIENTRYP)(GLuint, GLsizei, GLsizei *,
+                                               GLenum *, void *);
+  using ProgramBinaryProc = void(APIENTRYP)(GLuint, GLenum, const void *,
+                                            GLsizei);
+  using ProgramParameteriProc = void(APIENTRYP)(GLuint, GLenum, GLint);
+
+  // Start of every file, "PBIN"
+  static constexpr uint32_t MAGIC{0x4e494250};
+
+  struct Header {
+    uint32_t magic;
+    GLenum format;
+    GLsizei length;
+  };
+
+  std::filesystem::path m_directory;
+  uint64_t m_driverHash{0};
+
+  GetProgramBinaryProc m_getProgramBinary{nullptr};
+  ProgramBinaryProc m_programBinary{nullptr};
+  ProgramParameteriProc m_programParameteri{nullptr};
+  bool m_supported{false};
+
+  size_t m_hits{0};
+  size_t m_misses{0};
+  size_t m_rejected{0};
+
+  std::filesystem::path filePath(uint64_t key) const {
+    std::string name(16, '0');
+    for (int i{15}; i >= 0; --i, key >>= 4) {
+      name[i] = "0123456789abcdef"[key & 0xf];
+    }
+    return m_directory / (name + ".bin");
+  }
+
+  static std::string glString(const GLenum name) {
+    const GLubyte *value{glGetString(name)};
+    return value != nullptr ? reinterpret_cast<const char *>(value) : "";
+  }
+
+public:
+  // Needs a current context with the GL functions loaded
+  explicit ProgramBinaryCache(std::filesystem::path directory)
+      : m_directory{std::move(directory)} {
+    m_driverHash = fnv1a(glString(GL_VENDOR));
+    m_driverHash = fnv1a(glString(GL_RENDERER), m_driverHash);
+    m_driverHash = fnv1a(glString(GL_VERSION), m_driverHash);
+
+    m_getProgramBinary = reinterpret_cast<GetProgramBinaryProc>(
+        SDL_GL_GetProcAddress("glGetProgramBinary"));
+    m_programBinary = reinterpret_cast<ProgramBinaryProc>(
+        SDL_GL_GetProcAddress("glProgramBinary"));
+    m_programParameteri = reinterpret_cast<ProgramParameteriProc>(
+        SDL_GL_GetProcAddress("glProgramParameteri"));
+
+    // Drivers may export the functions and still support no binary format
+    GLint formats{0};
+    if (m_getProgramBinary != nullptr && m_programBinary != nullptr &&
+        m_programParameteri != nullptr) {
+      glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    }
+    m_supported = formats > 0;
+    // Clear GL_INVALID_ENUM from drivers without the extension
+    while (glGetError() != GL_NO_ERROR) {
+    }
+
+    std::error_code error;
+    if (m_supported) {
+      std::filesystem::create_directories(m_directory, error);
+    }
+    if (error) {
+      std::cerr << "Shader cache directory " << m_directory << " failed: "
+                << error.message() << "\n";
+      m_supported = false;
+    }
+  }
+
+  ProgramBinaryCache(const ProgramBinaryCache &) = delete;
+  ProgramBinaryCache &operator=(const ProgramBinaryCache &) = delete;
+
+  bool supported() const { return m_supported; }
+
+  size_t hits() const { return m_hits; }
+
+  // Compiled from source, including rejected binaries
+  size_t misses() const { return m_misses; }
+
+  size_t rejected() const { return m_rejected; }
+
+  uint64_t key(const std::initializer_list<
+               std::reference_wrapper<const AbstractShader>>
+                   shaders) const {
+    uint64_t hash{m_driverHash};
+    for (const AbstractShader &shader : shaders) {
+      hash = fnv1a(std::to_string(static_cast<GLenum>(shader.type())), hash);
+      hash = fnv1a(shader.src(), hash);
+    }
+    return hash;
+  }
+
+  // Links program from the stored binary, false when there is none or the
+  // driver rejected it
+  bool load(const GLuint program, const uint64_t key) {
+    if (!m_supported) {
+      return false;
+    }
+
+    const std::filesystem::path path{filePath(key)};
+    std::ifstream file{path, std::ios::binary};
+    Header header{};
+    std::vector<char> binary;
+    // The length is only trusted when the rest of the file is exactly that
+    // long, a truncated or corrupt file is a miss instead of a huge
+    // allocation
+    std::error_code error;
+    if (file.read(reinterpret_cast<char *>(&header), sizeof(header)) &&
+        header.magic == MAGIC && header.length > 0 &&
+        std::filesystem::file_size(path, error) - sizeof(header) ==
+            static_cast<uintmax_t>(header.length) &&
+        !error) {
+      binary.resize(header.length);
+      file.read(binary.data(), binary.size());
+    }
+    if (binary.empty() || !file) {
+      ++m_misses;
+      return false;
+    }
+
+    m_programBinary(program, header.format, binary.data(), header.length);
+
+    GLint success{GL_FALSE};
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (success != GL_TRUE) {
+      ++m_rejected;
+      ++m_misses;
+      return false;
+    }
+
+    ++m_hits;
+    return true;
+  }
+
+  // Before glLinkProgram, some drivers only keep the binary when asked to
+  void prepare(const GLuint program) const {
+    if (m_supported) {
+      m_programParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+  }
+
+  // After a successful glLinkProgram
+  void store(const GLuint program, const uint64_t key) const {
+    if (!m_supported) {
+      return;
+    }
+
+    GLint length{0};
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) {
+      return;
+    }
+
+    Header header{.magic = MAGIC, .format = 0, .length = 0};
+    std::vector<char> binary(length);
+    m_getProgramBinary(program, length, &header.length, &header.format,
+                       binary.data());
+
+    // Written next to the final file and renamed, so a crash or a second
+    // instance never leaves a truncated binary behind
+    const std::filesystem::path path{filePath(key)};
+    std::filesystem::path temporary{path};
+    temporary += ".tmp";
+    {
+      std::ofstream file{temporary, std::ios::binary | std::ios::trunc};
+      file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+      file.write(binary.data(), header.length);
+      if (!file) {
+        std::cerr << "Failed to write: " << temporary << "\n";
+        return;
+      }
+    }
+    std::error_code error;
+    std::filesystem::rename(temporary, path, error);
+    if (error) {
+      std::cerr << "Failed to write: " << path << ": " << error.message()
+                << "\n";
+    }
+  }
+};
+
+class ShaderProgram {
+private:
+  GLuint m_id{0};
+  mutable std::unordered_map<std::string, GLint> m_uniformCache;
+
+  // Location of every UniformSlots slot, -1 when the program doesn't have
+  // the uniform
+  std::vector<GLint> m_slotLocations;
+  // Requested but not active, each one is reported once
+  mutable std::vector<uint64_t> m_missingUniforms;
+
+  // Every program linked after setBinaryCache goes through it
+  inline static ProgramBinaryCache *s_binaryCache{nullptr};
+  // Time spent creating programs, loaded or compiled
+  inline static double s_buildMilliseconds{0.0};
+
+  static GLuint compileShader(const AbstractShader &shader) {
+    GLuint shaderId{glCreateShader(shaderTypeToGLenum(shader.type()))};
+
+    const std::string src{shader.src()};
+    const char *asd{src.c_str()};
+
+    glShaderSource(shaderId, 1, &asd, nullptr);
+    glCompileShader(shaderId);
+
+    GLint success;
+    glGetShaderiv(shaderId, GL_COMPILE_STATUS, &success);
+
+    if (!success) {
+      char infoLog[512];
+      glGetShaderInfoLog(shaderId, 512, nullptr, infoLog);
+      std::cerr << "Shader compile error:\n" << infoLog << std::endl;
+    }
+
+    return shaderId;
+  }
+
+  static void logLinkStatus(const GLuint shaderProgram,
+                            const std::string &prefix = "") {
+    GLint success;
+
+    glGetProgramiv(shaderProgram, GL_LINK_STATUS, &success);
+    if (!success) {
+      char infoLog[512];
+      glGetProgramInfoLog(shaderProgram, 512, nullptr, infoLog);
+      std::cerr << prefix << "Program link error:\n" << infoLog << std::endl;
+    }
+    std::cout << prefix << "Program link success.\n";
+  }
+
+  void finalizeProgram(
+      const std::initializer_list<std::reference_wrapper<const AbstractShader>>
+          shaders) {
+    const Uint64 begin{SDL_GetPerformanceCounter()};
+    const auto addBuildTime{[&]() {
+      s_buildMilliseconds += (SDL_GetPerformanceCounter() - begin) * 1000.0 /
+                             SDL_GetPerformanceFrequency();
+    }};
+
+    m_id = glCreateProgram();
+
+    uint64_t key{0};
+    if (s_binaryCache != nullptr) {
+      key = s_binaryCache->key(shaders);
+      if (s_binaryCache->load(m_id, key)) {
+        std::cout << "Program loaded from the binary cache.\n";
+        resolveUniforms();
+        addBuildTime();
+        return;
+      }
+      s_binaryCache->prepare(m_id);
+    }
+
+    std::vector<GLuint> compiledIds;
+
+    for (const AbstractShader &shader : shaders) {
+      GLuint id{compileShader(shader)};
+      glAttachShader(m_id, id);
+      compiledIds.push_back(id);
+    }
+
+    glLinkProgram(m_id);
+    logLinkStatus(m_id);
+
+    for (const GLuint id : compiledIds) {
+      // https://gamedev.stackexchange.com/questions/47910/after-a-succesful-gllinkprogram-should-i-delete-detach-my-shaders
+      // https://registry.khronos.org/OpenGL-Refpages/gl4/html/glDetachShader.xhtml
+      glDetachShader(m_id, id);
+      glDeleteShader(id);
+    }
+
+    GLint success{GL_FALSE};
+    glGetProgramiv(m_id, GL_LINK_STATUS, &success);
+    if (s_binaryCache != nullptr && success == GL_TRUE) {
+      s_binaryCache->store(m_id, key);
+    }
+
+    resolveUniforms();
+    addBuildTime();
+  }
+
+  void resolveUniforms() {
+    struct UniformLocation {
+      uint64_t hash;
+      GLint location;
+    };
+    // Every active uniform outside a block
+    std::vector<UniformLocation> uniformLocations;
+
+    GLint count{0};
+    GLint maxLength{0};
+    glGetProgramiv(m_id, GL_ACTIVE_UNIFORMS, &count);
+    glGetProgramiv(m_id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+
+    std::string name(std::max(maxLength, 1), '\0');
+    for (GLint i{0}; i < count; ++i) {
+      GLsizei length{0};
+      GLint size{0};
+      GLenum type{0};
+      glGetActiveUniform(m_id, i, name.size(), &length, &size, &type,
+                         name.data());
+      std::string_view view{name.data(), static_cast<size_t>(length)};
+      // Arrays are reported as "u_name[0]"
+      if (view.ends_with("[0]")) {
+        view.remove_suffix(3);
+      }
+
+      // -1 for members of uniform blocks
+      const GLint location{glGetUniformLocation(m_id, name.c_str())};
+      if (location != -1) {
+        uniformLocations.push_back(
+            UniformLocation{.hash = fnv1a(view), .location = location});
+      }
+    }
+
+    std::sort(uniformLocations.begin(), uniformLocations.end(),
+              [](const UniformLocation &a, const UniformLocation &b) {
+                return a.hash < b.hash;
+              });
+    const auto collision{std::adjacent_find(
+        uniformLocations.begin(), uniformLocations.end(),
+        [](const UniformLocation &a, const UniformLocation &b) {
+          return a.hash == b.hash;
+        })};
+    if (collision != uniformLocations.end()) {
+      throw std::runtime_error("Two uniform names share a hash.");
+    }
+
+    m_slotLocations.clear();
+    for (const uint64_t hash : UniformSlots::all()) {
+      const auto it{std::lower_bound(
+          uniformLocations.begin(), uniformLocations.end(), hash,
+          [](const UniformLocation &uniform, const uint64_t value) {
+            return uniform.hash < value;
+          })};
+      m_slotLocations.push_back(
+          it != uniformLocations.end() && it->hash == hash ? it->location
+                                                            : -1);
+    }
+  }
+
+  GLint getUniformLocation(const UniformName name) const {
+    assert(name.slot < m_slotLocations.size() &&
+           "Uniform slot was added after the program was linked.");
+    const GLint location{m_slotLocations[name.slot]};
+    if (location != -1) {
+      return location;
+    }
+
+    if (std::find(m_missingUniforms.begin(), m_missingUniforms.end(),
+                  name.hash) == m_missingUniforms.end()) {
+      m_missingUniforms.push_back(name.hash);
+      std::cerr << "Warning: Uniform '" << name.name
+                << "' does not exist or was optimized out." << std::endl;
+    }
+    return -1;
+  }
+
+  GLint getUniformLocation(const std::string &name) const {
+    if (auto it{m_uniformCache.find(name)}; it != m_uniformCache.end()) {
+      return it->second;
+    }
+
+    GLint location{glGetUniformLocation(m_id, name.c_str())};
+
+    m_uniformCache[name] = location;
+
+    if (location == -1) {
+      std::cerr << "Warning: Uniform '" << name
+                << "' does not exist or was optimized out." << std::endl;
+    }
+
+    return location;
+  }
+
+public:
+  // nullptr compiles every program from source
+  static void setBinaryCache(ProgramBinaryCache *cache) {
+    s_binaryCache = cache;
+  }
+
+  static double buildMilliseconds() { return s_buildMilliseconds; }
+
+  ShaderProgram(const Shader<ShaderType::Vertex> &vertexShader) {
+    finalizeProgram({vertexShader});
+  }
+
+  // Depth only, with a geometry shader
+  ShaderProgram(const Shader<ShaderType::Vertex> &vertexShader,
+                const Shader<ShaderType::Geometry> &geometryShader) {
+    finalizeProgram({vertexShader, geometryShader});
+  }
+
+  ShaderProgram(const Shader<ShaderType::Vertex> &vertexShader,
+                const Shader<ShaderType::Fragment> &fragmentShader) {
+
+    finalizeProgram({vertexShader, fragmentShader});
+  }
+
+  ShaderProgram(const Shader<ShaderType::Vertex> &vertexShader,
+                const Shader<ShaderType::Geometry> &geometryShader,
+                const Shader<ShaderType::Fragment> &fragmentShader) {
+    finalizeProgram({vertexShader, geometryShader, fragmentShader});
+  }
+
+  ShaderProgram(const ShaderProgram &) = delete;
+
+  ShaderProgram(ShaderProgram &&other) noexcept
+      : m_id{other.m_id}, m_uniformCache{std::move(other.m_uniformCache)},
+        m_slotLocations{std::move(other.m_slotLocations)},
+        m_missingUniforms{std::move(other.m_missingUniforms)} {
+    other.m_id = 0;
+  }
+
+  ~ShaderProgram() { glDeleteProgram(m_id); }
+
+  ShaderProgram &operator=(const ShaderProgram &) = delete;
+
+  ShaderProgram &operator=(ShaderProgram &&other) noexcept {
+    if (this != &other) {
+      if (m_id != 0) {
+        glDeleteProgram(m_id);
+      }
+      m_id = other.m_id;
+      m_uniformCache = std::move(other.m_uniformCache);
+      m_slotLocations = std::move(other.m_slotLocations);
+      m_missingUniforms = std::move(other.m_missingUniforms);
+      other.m_id = 0;
+      return *this;
+    }
+    return *this;
+  }
+
+  GLuint id() const { return m_id; }
+
+  void use() const { GLState::useProgram(m_id); }
+
+  // GL 3.3 has no layout(binding) for blocks. A block the program doesn't
+  // have, or which was optimized out, is skipped.
+  void bindUniformBlock(const std::string &name, const GLuint binding) const {
+    const GLuint index{glGetUniformBlockIndex(m_id, name.c_str())};
+    if (index != GL_INVALID_INDEX) {
+      glUniformBlockBinding(m_id, index, binding);
+    }
+  }
+
+  void unuse() const { GLState::useProgram(0); }
+
+  // Name is a UniformName, or a std::string which is looked up by name and
+  // kept in m_uniformCache
+  template <typename Name>
+  void setUniform(const Name &name, int value) const {
+    glUniform1i(getUniformLocation(name), value);
+  }
+
+  template <typename Name>
+  void setUniform(const Name &name, float value) const {
+    glUniform1f(getUniformLocation(name), value);
+  }
+
+  template <typename Name>
+  void setUniform(const Name &name, const glm::vec2 &value) const {
+    glUniform2fv(getUniformLocation(name), 1, glm::value_ptr(value));
+  }
+
+  template <typename Name>
+  void setUniform(const Name &name, const glm::ivec3 &value) const {
+    glUniform3iv(getUniformLocation(name), 1, glm::value_ptr(value));
+  }
+
+  template <typename Name>
+  void setUniform(const Name &name, const glm::vec3 &value) const {
+    glUniform3fv(getUniformLocation(name), 1, glm::value_ptr(value));
+  }
+
+  template <typename Name>
+  void setUniform(const Name &name, const glm::mat4 &value) const {
+    glUniformMatrix4fv(getUniformLocation(name), 1, GL_FALSE,
+                       glm::value_ptr(value));
+  }
+
+  // Uniform arrays, from the first element
+  template <typename Name>
+  void setUniform(const Name &name, const std::vector<float> &values) const {
+    glUniform1fv(getUniformLocation(name), values.size(), values.data());
+  }
+
+  template <typename Name>
+  void setUniform(const Name &name,
+                  const std::vector<glm::vec4> &values) const {
+    glUniform4fv(getUniformLocation(name), values.size(),
+                 glm::value_ptr(values.front()));
+  }
+
+  template <typename Name>
+  void setUniform(const Name &name,
+                  const std::vector<glm::mat4> &values) const {
+    glUniformMatrix4fv(getUniformLocation(name), values.size(), GL_FALSE,
+                       glm::value_ptr(values.front()));
+  }
+};
+
+// A buffer object exposed to shaders as a `samplerBuffer`. GL 3.3 has no
+// storage buffers, so this is how we hand large per-frame arrays to shaders.
+class TextureBuffer {
+private:
+  GLuint m_bufferId{0};
+  GLuint m_textureId{0};
+  GLenum m_internalFormat{0};
+  GLsizeiptr m_capacity{0};
+
+  void cleanup() {
+    if (m_textureId != 0) {
+      GLState::deleteTexture(m_textureId);
+    }
+    if (m_bufferId != 0) {
+      glDeleteBuffers(1, &m_bufferId);
+    }
+  }
+
+public:
+  explicit TextureBuffer(const GLenum internalFormat)
+      : m_internalFormat{internalFormat} {
+    glGenBuffers(1, &m_bufferId);
+    glGenTextures(1, &m_textureId);
+
+    // Texture buffer must never be attached to an empty buffer store
+    glBindBuffer(GL_TEXTURE_BUFFER, m_bufferId);
+    m_capacity = 16;
+    glBufferData(GL_TEXTURE_BUFFER, m_capacity, nullptr, GL_STREAM_DRAW);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    GLState::bindTexture(GL_TEXTURE_BUFFER, m_textureId);
+    glTexBuffer(GL_TEXTURE_BUFFER, m_internalFormat, m_bufferId);
+    GLState::bindTexture(GL_TEXTURE_BUFFER, 0);
+  }
+
+  TextureBuffer(const TextureBuffer &) = delete;
+
+  TextureBuffer &operator=(const TextureBuffer &) = delete;
+
+  TextureBuffer(TextureBuffer &&other) noexcept
+      : m_bufferId{std::exchange(other.m_bufferId, 0)},
+        m_textureId{std::exchange(other.m_textureId, 0)},
+        m_internalFormat{std::exchange(other.m_internalFormat, 0)},
+        m_capacity{std::exchange(other.m_capacity, 0)} {}
+
+  TextureBuffer &operator=(TextureBuffer &&other) noexcept {
+    if (this != &other) {
+      cleanup();
+
+      m_bufferId = std::exchange(other.m_bufferId, 0);
+      m_textureId = std::exchange(other.m_textureId, 0);
+      m_internalFormat = std::exchange(other.m_internalFormat, 0);
+      m_capacity = std::exchange(other.m_capacity, 0);
+    }
+    return *this;
+  }
+
+  ~TextureBuffer() { cleanup(); }
+
+  template <typename T> void upload(const std::vector<T> &data) {
+    const GLsizeiptr size{static_cast<GLsizeiptr>(data.size() * sizeof(T))};
+
+    glBindBuffer(GL_TEXTURE_BUFFER, m_bufferId);
+    if (size > m_capacity) {
+      // Grow geometrically so a slowly growing light count does not
+      // reallocate every frame
+      m_capacity = std::max(size, m_capacity * 2);
+      glBufferData(GL_TEXTURE_BUFFER, m_capacity, nullptr, GL_STREAM_DRAW);
+    } else {
+      // Orphan the previous store, the driver may still be reading it
+      glBufferData(GL_TEXTURE_BUFFER, m_capacity, nullptr, GL_STREAM_DRAW);
+    }
+    if (size > 0) {
+      glBufferSubData(GL_TEXTURE_BUFFER, 0, size, data.data());
+    }
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+  }
+
+  void bind(const GLuint unit) const {
+    GLState::bindTexture(unit, GL_TEXTURE_BUFFER, m_textureId);
+  }
+};
+
+namespace ShaderSource {
+
+// Source for `glsl` in c++ raw string literals: https://open.gl/geometry
+
+// Compile time features of a program permutation. Each bit is the define of
+// the same name, tested with #ifdef by the shaders below.
+enum Features : uint32_t {
+  NO_FEATURES = 0,
+  INSTANCED = 1 << 0,
+  HAS_GEOMETRY_SHADER = 1 << 1,
+  COMPUTE_CHECKER = 1 << 2,
+  // Where the local lights come from, at most one
+  FORWARD_SHADING = 1 << 3,
+  CLUSTERED_SHADING = 1 << 4,
+  TILED_SHADING = 1 << 5,
+  // Directional shadow filter, at most one, 3x3 PCF without any. See
+  // ShadowMapping::Filter.
+  SHADOW_FILTER_HARDWARE = 1 << 6,
+  SHADOW_FILTER_POISSON = 1 << 7,
+  SHADOW_FILTER_PCSS = 1 << 8,
+  SHADOW_FILTER_VSM = 1 << 9,
+  SHADOW_FILTER_ESM = 1 << 10,
+  // The moments pass reads the depth map, see shadowMomentsFrag
+  FROM_DEPTH = 1 << 11,
+};
+
+// In bit order of Features
+constexpr std::array<const char *, 12> FEATURE_DEFINES{
+    "INSTANCED",
+    "HAS_GEOMETRY_SHADER",
+    "COMPUTE_CHECKER",
+    "FORWARD_SHADING",
+    "CLUSTERED_SHADING",
+    "TILED_SHADING",
+    "SHADOW_FILTER_HARDWARE",
+    "SHADOW_FILTER_POISSON",
+    "SHADOW_FILTER_PCSS",
+    "SHADOW_FILTER_VSM",
+    "SHADOW_FILTER_ESM",
+    "FROM_DEPTH",
+};
+
+std::vector<std::string> featureDefines(const uint32_t features) {
+  std::vector<std::string> defines;
+  for (size_t bit{0}; bit < FEATURE_DEFINES.size(); ++bit) {
+    if ((features & (1u << bit)) != 0) {
+      defines.emplace_back(FEATURE_DEFINES[bit]);
+    }
+  }
+  return defines;
+}
+
+// The camera, or the light's view while drawing a shadow map. Shared by
+// every program, see Rendering::FrameUniforms.
+const std::string viewBlock{R"glsl(
+layout(std140) uniform ViewBlock {
+  mat4 u_projection;
+  mat4 u_view;
+  vec3 u_eyePosition;
+};
+)glsl"};
+
+// Requires viewBlock. The filter is picked with one of the SHADOW_FILTER
+// features, 3x3 PCF without one.
+const std::string computeShadow{R"glsl(
+// Cascaded shadow map, see ShadowMapping::Cascades
+#define MAX_CASCADES 4
+// Same as in shadowMomentsFrag
+#define ESM_EXPONENT 80.0
+
+// The directional light, see Rendering::FrameUniforms
+layout(std140) uniform ShadowBlock {
+  mat4 u_cascadeMatrices[MAX_CASCADES];
+  vec4 u_cascadeSplits;
+  vec4 u_cascadeDepthBias;
+  vec4 u_cascadeTexelSize;
+  vec3 u_lightDirection;
+  int u_cascadeCount;
+};
+
+int selectCascade(vec3 fragPos) {
+  float viewDepth = -(u_view * vec4(fragPos, 1.0)).z;
+
+  for (int i = 0; i < u_cascadeCount - 1; ++i) {
+    if (viewDepth < u_cascadeSplits[i]) {
+      return i;
+    }
+  }
+  return u_cascadeCount - 1;
+}
+
+#if defined(SHADOW_FILTER_POISSON) || defined(SHADOW_FILTER_PCSS)
+const vec2 POISSON_DISK[16] = vec2[](
+  vec2(-0.94201624, -0.39906216), vec2(0.94558609, -0.76890725),
+  vec2(-0.09418410, -0.92938870), vec2(0.34495938, 0.29387760),
+  vec2(-0.91588581, 0.45771432), vec2(-0.81544232, -0.87912464),
+  vec2(-0.38277543, 0.27676845), vec2(0.97484398, 0.75648379),
+  vec2(0.44323325, -0.97511554), vec2(0.53742981, -0.47373420),
+  vec2(-0.26496911, -0.41893023), vec2(0.79197514, 0.19090188),
+  vec2(-0.24188840, 0.99706507), vec2(-0.81409955, 0.91437590),
+  vec2(0.19984126, 0.78641367), vec2(0.14383161, -0.14100790));
+
+// Rotates the disk per pixel, trading banding for noise
+mat2 poissonRotation() {
+  // Interleaved gradient noise (Jimenez)
+  float noise = fract(52.9829189 * fract(dot(gl_FragCoord.xy, vec2(0.06711056, 0.00583715))));
+  float angle = noise * 6.28318531;
+  return mat2(cos(angle), sin(angle), -sin(angle), cos(angle));
+}
+
+// Radius in texels
+float poissonShadow(sampler2DArrayShadow shadowMap, vec3 projCoords, int cascade, float depth, float radius) {
+  vec2 texelSize = 1.0 / textureSize(shadowMap, 0).xy;
+  mat2 rotation = poissonRotation();
+
+  float shadow = 0.0;
+  for (int i = 0; i < 16; ++i) {
+    vec2 offset = rotation * POISSON_DISK[i] * radius * texelSize;
+    shadow += texture(shadowMap, vec4(projCoords.xy + offset, cascade, depth));
+  }
+  return shadow / 16.0;
+}
+#endif
+
+#ifdef SHADOW_FILTER_PCSS
+// The depth map without comparison, for the blocker search
+uniform sampler2DArray u_shadowDepth;
+
+// Tangent of the directional light's angular radius, larger is softer
+#define PCSS_LIGHT_SIZE 0.04
+#define PCSS_SEARCH_RADIUS 8.0
+#define PCSS_MAX_RADIUS 16.0
+
+float pcssShadow(sampler2DArrayShadow shadowMap, vec3 projCoords, int cascade, float depth) {
+  vec2 texelSize = 1.0 / textureSize(u_shadowDepth, 0).xy;
+  mat2 rotation = poissonRotation();
+
+  // Average depth of the occluders around the fragment
+  float blockerDepth = 0.0;
+  float blockers = 0.0;
+  for (int i = 0; i < 16; ++i) {
+    vec2 offset = rotation * POISSON_DISK[i] * PCSS_SEARCH_RADIUS * texelSize;
+    float sampleDepth = texture(u_shadowDepth, vec3(projCoords.xy + offset, cascade)).r;
+    if (sampleDepth < depth) {
+      blockerDepth += sampleDepth;
+      blockers += 1.0;
+    }
+  }
+  if (blockers == 0.0) {
+    return 1.0;
+  }
+  blockerDepth /= blockers;
+
+  // The light is orthographic, the penumbra only depends on the distance to
+  // the blockers. A texel covers u_cascadeDepthBias of the cascade's depth.
+  float penumbra = (depth - blockerDepth) * PCSS_LIGHT_SIZE / u_cascadeDepthBias[cascade];
+  return poissonShadow(shadowMap, projCoords, cascade, depth, clamp(penumbra, 1.0, PCSS_MAX_RADIUS));
+}
+#endif // SHADOW_FILTER_PCSS
+
+#if defined(SHADOW_FILTER_VSM) || defined(SHADOW_FILTER_ESM)
+// Blurred moments of the depth map, see shadowMomentsFrag
+uniform sampler2DArray u_shadowMoments;
+
+float momentsShadow(vec3 projCoords, int cascade, float depth) {
+  // Nothing was drawn outside of the cascade
+  if (any(lessThan(projCoords.xy, vec2(0.0))) || any(greaterThan(projCoords.xy, vec2(1.0)))) {
+    return 1.0;
+  }
+
+  vec2 moments = texture(u_shadowMoments, vec3(projCoords.xy, cascade)).rg;
+
+#ifdef SHADOW_FILTER_VSM
+  if (depth <= moments.x) {
+    return 1.0;
+  }
+
+  // Chebyshev's upper bound on the lit fraction
+  float variance = max(moments.y - moments.x * moments.x, 0.00002);
+  float difference = depth - moments.x;
+  float pMax = variance / (variance + difference * difference);
+
+  // Cut off the tail which bleeds light through overlapping occluders
+  return clamp((pMax - 0.3) / 0.7, 0.0, 1.0);
+#else
+  return clamp(moments.x * exp(-ESM_EXPONENT * depth), 0.0, 1.0);
+#endif // SHADOW_FILTER_VSM
+}
+#endif
+
+float computeShadow(vec3 fragPos, vec3 normal, vec3 lightDir, sampler2DArrayShadow shadowMap) {
+  int cascade = selectCascade(fragPos);
+
+  // Look up from slightly above the surface, by more where it faces away
+  // from the light
+  float cosTheta = clamp(dot(normal, lightDir), 0.05, 1.0);
+  vec3 offset = normal * u_cascadeTexelSize[cascade] * 1.5 * (1.0 - cosTheta);
+
+  vec4 fragPosLightSpace = u_cascadeMatrices[cascade] * vec4(fragPos + offset, 1.0);
+  vec3 projCoords = fragPosLightSpace.xyz / fragPosLightSpace.w;
+
+  // Normalize to [0, 1]
+  projCoords = projCoords * 0.5 + 0.5;
+
+  float currentDepth = projCoords.z;
+
+  // Slope scaled, a texel of the cascade covers more depth on a surface
+  // which faces away from the light
+  float slope = min(sqrt(1.0 - cosTheta * cosTheta) / cosTheta, 8.0);
+  float bias = u_cascadeDepthBias[cascade] * (1.5 + 3.0 * slope);
+
+#if defined(SHADOW_FILTER_HARDWARE)
+  // Linear filtering compares the 2x2 texels around the coordinate
+  return texture(shadowMap, vec4(projCoords.xy, cascade, currentDepth - bias));
+#elif defined(SHADOW_FILTER_POISSON)
+  return poissonShadow(shadowMap, projCoords, cascade, currentDepth - bias, 1.5);
+#elif defined(SHADOW_FILTER_PCSS)
+  return pcssShadow(shadowMap, projCoords, cascade, currentDepth - bias);
+#elif defined(SHADOW_FILTER_VSM) || defined(SHADOW_FILTER_ESM)
+  return momentsShadow(projCoords, cascade, currentDepth - bias);
+#else
+  float shadow = 0.0;
+
+  vec2 texelSize = 1.0 / textureSize(shadowMap, 0).xy;
+
+  for(int x = -1; x <= 1; ++x) {
+    for(int y = -1; y <= 1; ++y) {
+      // The w-component is the reference depth to compare against
+      vec4 UVC = vec4(projCoords.xy + vec2(x, y) * texelSize, cascade, currentDepth - bias);
+
+      // This returns a smoothly interpolated value between 0.0 and 1.0 automatically
+      shadow += texture(shadowMap, UVC); 
+    }    
+  }
+
+  // Average out the shadow for this pixel
+  shadow /= 9.0;
+
+  return shadow;
+#endif
+}
+)glsl"};
+
+const std::string computeColor{R"glsl(
+// -----------------------
+// Phong & Lambert shading
+
+vec3 computeAmbient(vec3 lightColor) {
+  float ambientStrength = 0.15;
+  vec3 ambient = ambientStrength * lightColor;
+
+  return ambient;
+}
+
+vec3 computeDiffuse(vec3 lightColor, vec3 lightDirection, vec3 normal) {
+  float diffuseIntensity = max(dot(lightDirection, normal), 0.0);
+  vec3 diffuse = diffuseIntensity * lightColor;
+
+  return diffuse;
+}
+
+vec3 computeSpecular(vec3 lightColor, vec3 eyeDirection, vec3 lightReflection) {
+  float specularStrength = 0.2;
+  float specularIntensity = pow(max(dot(eyeDirection, lightReflection), 0.0), 128);
+  vec3 specular = specularStrength * specularIntensity * lightColor;
+
+  return specular;
+}
+
+struct LightingComponent {
+  vec3 ambient;
+  vec3 diffuse;
+  vec3 specular;
+};
+
+vec3 computeFragColor(LightingComponent light, vec3 baseColor, float shadow) {
+  return baseColor * (light.ambient + shadow * (light.diffuse + light.specular));
+}
+)glsl"};
+
+const std::string getColor{R"glsl(
+#ifdef COMPUTE_CHECKER
+vec3 computeChecker(vec3 fragPos) {
+  // Make each checker sides 1 unit long
+  vec2 pos = fragPos.xz * 0.5;
+
+  vec2 f = fract(pos);
+
+  // The step() is faster if (f.x < 0.5) on GPU
+  float sX = step(0.5, f.x);
+  float sY = step(0.5, f.y);
+
+  // XOR
+  float checker = abs(sX - sY);
+
+  return vec3(checker);
+}
+
+vec3 getColor(vec3 fragPos, vec3 color) {
+  return computeChecker(fragPos);
+}
+#else
+vec3 getColor(vec3 fragPos, vec3 color) {
+  return color;
+}
+#endif // COMPUTE_CHECKER
+)glsl"};
+
+// Requires computeColor. Each light is 4 texels in u_lightData:
+// (position, radius), (color, cos inner cone), (direction, cos outer cone),
+// (first texel in u_shadowData or -1, unused). See Lighting::ShadowAtlas for
+// the shadow data layout.
+const std::string computeLocalLights{R"glsl(
+// -----------------------
+// Point & spot lights
+
+uniform samplerBuffer u_lightData;
+// (offset, count) into u_lightIndices for each cluster or tile
+uniform usamplerBuffer u_lightGrid;
+uniform usamplerBuffer u_lightIndices;
+
+#ifdef CLUSTERED_SHADING
+// u_view comes from viewBlock, which is included first
+uniform vec2 u_screenSize;
+uniform ivec3 u_clusterGrid;
+// Scale and bias which map log(view depth) to a depth slice
+uniform vec2 u_clusterDepthParams;
+
+int computeClusterIndex(vec3 fragPos) {
+  float viewDepth = -(u_view * vec4(fragPos, 1.0)).z;
+
+  int slice = int(max(log(viewDepth) * u_clusterDepthParams.x + u_clusterDepthParams.y, 0.0));
+  slice = min(slice, u_clusterGrid.z - 1);
+
+  ivec2 tile = ivec2(gl_FragCoord.xy / u_screenSize * vec2(u_clusterGrid.xy));
+  tile = clamp(tile, ivec2(0), u_clusterGrid.xy - 1);
+
+  return tile.x + u_clusterGrid.x * (tile.y + u_clusterGrid.y * slice);
+}
+
+uvec2 lightListRange(vec3 fragPos) {
+  return texelFetch(u_lightGrid, computeClusterIndex(fragPos)).xy;
+}
+#endif // CLUSTERED_SHADING
+
+#ifdef TILED_SHADING
+uniform int u_tileSize;
+uniform int u_tileCountX;
+
+uvec2 lightListRange(vec3 fragPos) {
+  ivec2 tile = ivec2(gl_FragCoord.xy) / u_tileSize;
+  return texelFetch(u_lightGrid, tile.x + tile.y * u_tileCountX).xy;
+}
+#endif // TILED_SHADING
+
+#ifdef FORWARD_SHADING
+// No culling, every fragment visits every light
+uniform int u_lightCount;
+#endif // FORWARD_SHADING
+
+// Per shadowed light (face count, texel size at unit distance), then per face
+// the atlas matrix columns and the tile's (min, max) coordinates
+uniform samplerBuffer u_shadowData;
+uniform sampler2DArrayShadow u_shadowAtlas;
+
+// Cube face of a point light, in the order +x, -x, +y, -y, +z, -z
+int cubeFace(vec3 v) {
+  vec3 a = abs(v);
+  if (a.x >= a.y && a.x >= a.z) {
+    return v.x > 0.0 ? 0 : 1;
+  }
+  if (a.y >= a.z) {
+    return v.y > 0.0 ? 2 : 3;
+  }
+  return v.z > 0.0 ? 4 : 5;
+}
+
+float computeLocalShadow(int shadowIndex, vec3 lightPosition, vec3 fragPos, vec3 normal, vec3 lightDirection) {
+  vec4 header = texelFetch(u_shadowData, shadowIndex);
+
+  // Move along the normal by a couple of texels at the fragment's distance,
+  // more at grazing angles, and a little toward the light. Both sides of a
+  // caster are in the map, so the receiver must clear its own depth.
+  float cosTheta = clamp(dot(normal, lightDirection), 0.0, 1.0);
+  float texelSize = header.y * distance(fragPos, lightPosition);
+  vec3 samplePos = fragPos + normal * texelSize * (1.5 + 1.5 * (1.0 - cosTheta)) +
+                   lightDirection * texelSize;
+
+  int face = header.x > 1.0 ? cubeFace(samplePos - lightPosition) : 0;
+  int faceIndex = shadowIndex + 1 + face * 5;
+  mat4 atlasMatrix = mat4(texelFetch(u_shadowData, faceIndex + 0),
+                          texelFetch(u_shadowData, faceIndex + 1),
+                          texelFetch(u_shadowData, faceIndex + 2),
+                          texelFetch(u_shadowData, faceIndex + 3));
+  vec4 tile = texelFetch(u_shadowData, faceIndex + 4);
+
+  vec4 position = atlasMatrix * vec4(samplePos, 1.0);
+  vec3 coords = position.xyz / position.w;
+  float depth = coords.z - 0.0002;
+
+  // 3x3 PCF, the taps stay inside the light's tile
+  vec2 atlasTexel = 1.0 / vec2(textureSize(u_shadowAtlas, 0).xy);
+  float shadow = 0.0;
+  for (int x = -1; x <= 1; ++x) {
+    for (int y = -1; y <= 1; ++y) {
+      vec2 uv = clamp(coords.xy + vec2(x, y) * atlasTexel, tile.xy, tile.zw);
+      shadow += texture(u_shadowAtlas, vec4(uv, 0.0, depth));
+    }
+  }
+
+  return shadow / 9.0;
+}
+
+vec3 computeLocalLight(int lightIndex, vec3 fragPos, vec3 normal, vec3 eyeDirection) {
+  vec4 positionRadius = texelFetch(u_lightData, lightIndex * 4 + 0);
+  vec4 colorInnerCone = texelFetch(u_lightData, lightIndex * 4 + 1);
+  vec4 directionOuterCone = texelFetch(u_lightData, lightIndex * 4 + 2);
+
+  vec3 toLight = positionRadius.xyz - fragPos;
+  float distance = length(toLight);
+  float radius = positionRadius.w;
+
+  if (distance >= radius) {
+    return vec3(0.0);
+  }
+
+  vec3 lightDirection = toLight / distance;
+
+  // Smoothly reach zero at the radius, so culling by radius leaves no seams
+  float window = clamp(1.0 - pow(distance / radius, 4.0), 0.0, 1.0);
+  float attenuation = (window * window) / (1.0 + 0.25 * distance * distance);
+
+  // Point lights store cones which always pass
+  float spot = smoothstep(directionOuterCone.w, colorInnerCone.w,
+                          dot(-lightDirection, directionOuterCone.xyz));
+
+  vec3 lightColor = colorInnerCone.rgb * attenuation * spot;
+
+  int shadowIndex = int(texelFetch(u_lightData, lightIndex * 4 + 3).x);
+  if (shadowIndex >= 0 && spot > 0.0) {
+    lightColor *= computeLocalShadow(shadowIndex, positionRadius.xyz, fragPos, normal, lightDirection);
+  }
+
+  vec3 lightReflection = reflect(-lightDirection, normal);
+
+  return computeDiffuse(lightColor, lightDirection, normal) +
+         computeSpecular(lightColor, eyeDirection, lightReflection);
+}
+
+vec3 computeLocalLighting(vec3 fragPos, vec3 normal, vec3 eyeDirection) {
+  vec3 lighting = vec3(0.0);
+
+#ifdef FORWARD_SHADING
+  for (int i = 0; i < u_lightCount; ++i) {
+    lighting += computeLocalLight(i, fragPos, normal, eyeDirection);
+  }
+#else
+  uvec2 range = lightListRange(fragPos);
+
+  for (uint i = 0u; i < range.y; ++i) {
+    int lightIndex = int(texelFetch(u_lightIndices, int(range.x + i)).r);
+    lighting += computeLocalLight(lightIndex, fragPos, normal, eyeDirection);
+  }
+#endif // FORWARD_SHADING
+
+  return lighting;
+}
+)glsl"};
+
+const Shader<ShaderType::Vertex> vertexShader{
+    R"glsl(
+#version 330 core
+
+/*{{defines_begin}}*/
+/*{{defines_end}}*/
+
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aColor;
+layout (location = 2) in vec3 aNormal;
+
+#ifdef INSTANCED
+// Per instance, see InstanceBuffer
+layout (location = 3) in mat4 aModel;
+// Tints the vertex color
+layout (location = 7) in vec4 aInstanceColor;
+#endif // INSTANCED
+
+out vec3 vColor;
+out vec3 vNormal;
+out vec3 vFragPos;
+
+#ifdef HAS_GEOMETRY_SHADER
+// Does it matter if we output this and we don't have geometry shader in the next stage?
+// Do we have to match VS_OUT and vs_out to be exactly same with different casing?
+out VS_OUT {
+  vec3 worldPos;
+  vec3 vNormal;
+  vec3 vColor;
+} vs_out;
+#endif // HAS_GEOMETRY_SHADER
+
+{{viewBlock}}
+
+#ifndef INSTANCED
+uniform mat4 u_model;
+#endif // INSTANCED
+
+// TODO: Normal, Tangent, Bitangent (Allow us to apply Finite Difference method on any position)
+// We can not do vertex displacement without Tangent, Bitangent, Normal data (to compute new normal)
+//
+// NOTE: We can use GLSL partial derivatives to guess/approximate UV coordinate
+// vec3 dPdx = dFdx(FragPos);
+// vec3 dPdy = dFdy(FragPos);
+// vec2 dUdx = dFdx(vec2(FragPos.x, FragPos.z)); // Guessing a UV
+
+void main() {
+#ifdef INSTANCED
+  mat4 model = aModel;
+#else
+  mat4 model = u_model;
+#endif // INSTANCED
+
+  vec4 worldPosition = model * vec4(aPos, 1.0);
+
+  gl_Position = u_projection * u_view * worldPosition;
+
+  // To make the lighting color math to work, the computation must happen in the same space. We must not mix spaces.
+  vFragPos = vec3(worldPosition);
+
+#ifdef INSTANCED
+  vColor = aColor * aInstanceColor.rgb;
+#else
+  vColor = aColor;
+#endif // INSTANCED
+
+  // Rotate and move normal with the vertex, but prevent scaling from messing
+  // up the normals perpendicularity.
+  vNormal = mat3(transpose(inverse(model))) * aNormal;
+
+#ifdef HAS_GEOMETRY_SHADER
+  vs_out.worldPos = vec3(worldPosition);
+  // Keep the outputs to keep the compatibility with fragment shader.
+  // Is it fine to access vNormal like this? Since it's marked as 'out'?
+  vs_out.vNormal = vNormal;
+  vs_out.vColor = vColor;
+#endif // HAS_GEOMETRY_SHADER
+}
+)glsl",
+    {{"viewBlock", viewBlock}}};
+
+const Shader<ShaderType::Geometry> geometryShader{
+    R"glsl(
+#version 330 core
+layout (triangles) in;
+layout (line_strip, max_vertices = 6) out;
+
+in VS_OUT {
+  vec3 worldPos;
+  vec3 vNormal;
+  vec3 vColor;
+} gs_in[];
+
+out vec3 vColor;
+
+{{viewBlock}}
+
+// TODO: Make arrows instead of lines.
+void drawLine(int i) {
+  vColor = gs_in[i].vColor;
+
+  gl_Position = u_projection * u_view * vec4(gs_in[i].worldPos, 1.0);
+  EmitVertex();
+
+  vec3 tip = gs_in[i].worldPos + (gs_in[i].vNormal * 1.0);
+  gl_Position = u_projection * u_view * vec4(tip, 1.0);
+  EmitVertex();
+
+  EndPrimitive();
+}
+
+void main() {
+  // We should already have a normal? among regular input from vertex shader?
+  drawLine(0);
+  drawLine(1);
+  drawLine(2);
+}
+)glsl",
+    {{"viewBlock", viewBlock}}};
+
+// Draws a triangle into every view of a local light, see
+// Lighting::ShadowAtlas. GL 3.3 has no viewport arrays, so each face's clip
+// space is squeezed into its tile and the clip distances cut off what would
+// spill into the neighbouring tiles.
+const Shader<ShaderType::Geometry> shadowAtlasGeometryShader{
+    R"glsl(
+#version 330 core
+layout (triangles) in;
+layout (triangle_strip, max_vertices = 18) out;
+
+in VS_OUT {
+  vec3 worldPos;
+  vec3 vNormal;
+  vec3 vColor;
+} gs_in[];
+
+// Six cube faces of a point light, or the one view of a spot light
+uniform mat4 u_faceMatrices[6];
+// Center and half size of each face's tile in the atlas' clip space
+uniform vec4 u_faceTiles[6];
+uniform int u_faceCount;
+
+// Distances to the left, right, bottom and top planes of the face
+vec4 sidePlanes(vec4 clip) {
+  return vec4(clip.w + clip.x, clip.w - clip.x, clip.w + clip.y, clip.w - clip.y);
+}
+
+void main() {
+  for (int face = 0; face < u_faceCount; ++face) {
+    vec4 clip[3];
+    vec4 nearest = vec4(-1.0);
+    for (int i = 0; i < 3; ++i) {
+      clip[i] = u_faceMatrices[face] * vec4(gs_in[i].worldPos, 1.0);
+      nearest = max(nearest, sidePlanes(clip[i]));
+    }
+
+    // Every vertex is outside the same side of this face
+    if (any(lessThan(nearest, vec4(0.0)))) {
+      continue;
+    }
+
+    for (int i = 0; i < 3; ++i) {
+      vec4 planes = sidePlanes(clip[i]);
+      gl_ClipDistance[0] = planes.x;
+      gl_ClipDistance[1] = planes.y;
+      gl_ClipDistance[2] = planes.z;
+      gl_ClipDistance[3] = planes.w;
+
+      gl_Position = vec4(clip[i].xy * u_faceTiles[face].zw + u_faceTiles[face].xy * clip[i].w,
+                         clip[i].zw);
+      EmitVertex();
+    }
+    EndPrimitive();
+  }
+}
+)glsl"};
+
+const Shader<ShaderType::Fragment> basicFragmentShader{
+    R"glsl(
+#version 330 core
+
+out vec4 FragColor;
+
+in vec3 vColor;
+
+void main() {
+  FragColor = vec4(vColor, 1.0);
+}
+)glsl"};
+
+const Shader<ShaderType::Fragment> fragmentShader{
+    R"glsl(
+#version 330 core
+
+/*{{defines_begin}}*/
+/*{{defines_end}}*/
+
+in vec3 vColor;
+in vec3 vNormal;
+in vec3 vFragPos;
+
+out vec4 FragColor;
+
+{{viewBlock}}
+
+uniform sampler2DArrayShadow u_shadowMap;
+
+{{computeShadow}}
+
+{{computeColor}}
+
+#if defined(CLUSTERED_SHADING) || defined(TILED_SHADING) || \
+    defined(FORWARD_SHADING)
+{{computeLocalLights}}
+#endif
+
+{{getColor}}
+
+void main() {
+  vec3 normal = normalize(vNormal);
+
+  vec3 lightColor = vec3(1.0, 0.98, 0.9);
+
+  // From fragment to the directional light source
+  vec3 lightDirection = -u_lightDirection;
+  vec3 lightReflection = reflect(-lightDirection, normal);
+  vec3 eyeDirection = normalize(u_eyePosition - vFragPos);
+
+  LightingComponent lightComponent;
+  lightComponent.ambient = computeAmbient(lightColor);
+  lightComponent.diffuse = computeDiffuse(lightColor, lightDirection, normal);
+  lightComponent.specular = computeSpecular(lightColor, eyeDirection, lightReflection);
+
+  float shadow = computeShadow(vFragPos, normal, lightDirection, u_shadowMap);
+
+  vec3 baseColor = getColor(vFragPos, vColor);
+
+  vec3 fragmentColor = computeFragColor(lightComponent, baseColor, shadow);
+
+#if defined(CLUSTERED_SHADING) || defined(TILED_SHADING) || \
+    defined(FORWARD_SHADING)
+  fragmentColor += baseColor * computeLocalLighting(vFragPos, normal, eyeDirection);
+#endif
+
+  FragColor = vec4(fragmentColor, 1.0);
+}
+)glsl",
+    {{"viewBlock", viewBlock},                    //
+     {"computeColor", computeColor},              //
+     {"computeShadow", computeShadow},            //
+     {"computeLocalLights", computeLocalLights}, //
+     {"getColor", getColor}}};
+
+// Deferred shading geometry pass, pairs with vertexShader
+const Shader<ShaderType::Fragment> gBufferFragmentShader{
+    R"glsl(
+#version 330 core
+
+/*{{defines_begin}}*/
+/*{{defines_end}}*/
+
+in vec3 vColor;
+in vec3 vNormal;
+in vec3 vFragPos;
+
+layout (location = 0) out vec3 gPosition;
+layout (location = 1) out vec3 gNormal;
+layout (location = 2) out vec3 gAlbedo;
+
+{{getColor}}
+
+void main() {
+  gPosition = vFragPos;
+  gNormal = normalize(vNormal);
+  gAlbedo = getColor(vFragPos, vColor);
+}
+)glsl",
+    {{"getColor", getColor}}};
+
+// Deferred shading lighting pass, a full screen quad drawn with
+// postProcessingVert
+const Shader<ShaderType::Fragment> deferredLightingFrag{
+    R"glsl(
+#version 330 core
+
+/*{{defines_begin}}*/
+/*{{defines_end}}*/
+
+in vec2 TexCoords;
+
+out vec4 FragColor;
+
+uniform sampler2D u_gPosition;
+uniform sampler2D u_gNormal;
+uniform sampler2D u_gAlbedo;
+
+{{viewBlock}}
+
+uniform sampler2DArrayShadow u_shadowMap;
+
+{{computeShadow}}
+
+{{computeColor}}
+
+{{computeLocalLights}}
+
+void main() {
+  vec3 normal = texture(u_gNormal, TexCoords).rgb;
+
+  // Nothing was drawn here, keep the clear color
+  if (dot(normal, normal) < 0.5) {
+    discard;
+  }
+
+  vec3 fragPos = texture(u_gPosition, TexCoords).rgb;
+  vec3 baseColor = texture(u_gAlbedo, TexCoords).rgb;
+
+  vec3 lightColor = vec3(1.0, 0.98, 0.9);
+
+  // From fragment to the directional light source
+  vec3 lightDirection = -u_lightDirection;
+  vec3 lightReflection = reflect(-lightDirection, normal);
+  vec3 eyeDirection = normalize(u_eyePosition - fragPos);
+
+  LightingComponent lightComponent;
+  lightComponent.ambient = computeAmbient(lightColor);
+  lightComponent.diffuse = computeDiffuse(lightColor, lightDirection, normal);
+  lightComponent.specular = computeSpecular(lightColor, eyeDirection, lightReflection);
+
+  float shadow = computeShadow(fragPos, normal, lightDirection, u_shadowMap);
+
+  vec3 fragmentColor = computeFragColor(lightComponent, baseColor, shadow);
+  fragmentColor += baseColor * computeLocalLighting(fragPos, normal, eyeDirection);
+
+  FragColor = vec4(fragmentColor, 1.0);
+}
+)glsl",
+    {{"viewBlock", viewBlock},                    //
+     {"computeColor", computeColor},              //
+     {"computeShadow", computeShadow},            //
+     {"computeLocalLights", computeLocalLights}}};
+
+// Separable blur of the shadow map moments for VSM and ESM, drawn over a full
+// screen quad. With FROM_DEPTH, the horizontal pass reads a cascade of the
+// depth map and turns every tap into moments, the vertical pass blurs those.
+const Shader<ShaderType::Fragment> shadowMomentsFrag{R"glsl(
+#version 330 core
+
+/*{{defines_begin}}*/
+/*{{defines_end}}*/
+
+// Same as in computeShadow
+#define ESM_EXPONENT 80.0
+
+in vec2 TexCoords;
+
+out vec2 FragMoments;
+
+#ifdef FROM_DEPTH
+// Sampled without comparison
+uniform sampler2DArray u_source;
+uniform int u_layer;
+#else
+uniform sampler2D u_source;
+#endif // FROM_DEPTH
+
+// One texel along the blur
+uniform vec2 u_direction;
+
+// Binomial weights, close to a Gaussian
+const float WEIGHTS[7] = float[](1.0, 6.0, 15.0, 20.0, 15.0, 6.0, 1.0);
+
+vec2 fetch(vec2 coords) {
+#ifdef FROM_DEPTH
+  float depth = texture(u_source, vec3(coords, u_layer)).r;
+#ifdef SHADOW_FILTER_ESM
+  return vec2(exp(ESM_EXPONENT * depth), 0.0);
+#else
+  return vec2(depth, depth * depth);
+#endif // SHADOW_FILTER_ESM
+#else
+  return texture(u_source, coords).rg;
+#endif // FROM_DEPTH
+}
+
+void main() {
+  vec2 moments = vec2(0.0);
+  for (int i = 0; i < 7; ++i) {
+    moments += WEIGHTS[i] * fetch(TexCoords + float(i - 3) * u_direction);
+  }
+  FragMoments = moments / 64.0;
+}
+)glsl"};
+
+// Forward+ depth bounds, one fragment per tile reduces the tile's texels of
+// the depth pre-pass into (min, max)
+const Shader<ShaderType::Fragment> tileDepthBoundsFrag{R"glsl(
+#version 330 core
+
+out vec2 FragDepthBounds;
+
+uniform sampler2D u_depthTexture;
+uniform int u_tileSize;
+
+void main() {
+  ivec2 begin = ivec2(gl_FragCoord.xy) * u_tileSize;
+  ivec2 end = min(begin + u_tileSize, textureSize(u_depthTexture, 0));
+
+  float minDepth = 1.0;
+  float maxDepth = 0.0;
+
+  for (int y = begin.y; y < end.y; ++y) {
+    for (int x = begin.x; x < end.x; ++x) {
+      float depth = texelFetch(u_depthTexture, ivec2(x, y), 0).r;
+      minDepth = min(minDepth, depth);
+      maxDepth = max(maxDepth, depth);
+    }
+  }
+
+  FragDepthBounds = vec2(minDepth, maxDepth);
+}
+)glsl"};
+
+const Shader<ShaderType::Vertex> postProcessingVert{R"glsl(
+#version 330
+
+layout(location = 0) in vec3 aPos;
+
+out vec2 TexCoords;
+
+void main() {
+  gl_Position = vec4(aPos.x, aPos.z, 0.0, 1.0);
+  TexCoords = vec2(aPos.x, aPos.z) * 0.5 + 0.5;
+}
+)glsl"};
+
+const Shader<ShaderType::Fragment> postProcessingFrag{R"glsl(
+#version 330
+
+out vec4 FragColor;
+
+in vec2 TexCoords;
+
+uniform sampler2D u_screenTexture;
+
+void main() {
+  vec3 color = texture(u_screenTexture, TexCoords).rgb;
+
+  // Fade the pixels the further we are from the center of the screen
+  float dist = distance(TexCoords, vec2(0.5, 0.5));
+  float vignette = smoothstep(1.0, 0.2, dist);
+
+  color *= vignette;
+
+  FragColor = vec4(color, 1.0);
+}
+)glsl"};
+
+// Programs built from the shaders above, see Rendering::ShaderPermutations
+enum class Program {
+  // Normals drawn as lines by geometryShader
+  DEBUG_NORMALS,
+  // Vertex color only, e.g. the light source marker
+  EMISSIVE,
+  // Depth only, for shadow maps and depth pre-passes
+  DEPTH,
+  // Depth only, every view of a light in the shadow atlas at once
+  SHADOW_ATLAS,
+  LIT,
+  G_BUFFER,
+  DEFERRED_LIGHTING,
+  TILE_DEPTH_BOUNDS,
+  // VSM and ESM moments, converted and blurred
+  SHADOW_MOMENTS,
+  POST_PROCESSING,
+};
+
+// The stages of a program and the features they read. Required features are
+// always defined. Requested features which no stage reads are dropped, so they
+// don't make another permutation.
+struct ProgramStages {
+  const Shader<ShaderType::Vertex> *vertex;
+  const Shader<ShaderType::Geometry> *geometry;
+  const Shader<ShaderType::Fragment> *fragment;
+  uint32_t required;
+  uint32_t optional;
+};
+
+constexpr uint32_t SHADOW_FILTERS{SHADOW_FILTER_HARDWARE |
+                                  SHADOW_FILTER_POISSON | SHADOW_FILTER_PCSS |
+                                  SHADOW_FILTER_VSM | SHADOW_FILTER_ESM};
+
+// In the order of Program
+constexpr std::array<ProgramStages, 10> PROGRAMS{{
+    {&vertexShader, &geometryShader, &basicFragmentShader,
+     INSTANCED | HAS_GEOMETRY_SHADER, NO_FEATURES},
+    {&vertexShader, nullptr, &basicFragmentShader, INSTANCED, NO_FEATURES},
+    {&vertexShader, nullptr, nullptr, INSTANCED, NO_FEATURES},
+    {&vertexShader, &shadowAtlasGeometryShader, nullptr,
+     INSTANCED | HAS_GEOMETRY_SHADER, NO_FEATURES},
+    {&vertexShader, nullptr, &fragmentShader, INSTANCED,
+     COMPUTE_CHECKER | FORWARD_SHADING | CLUSTERED_SHADING | TILED_SHADING |
+         SHADOW_FILTERS},
+    {&vertexShader, nullptr, &gBufferFragmentShader, INSTANCED,
+     COMPUTE_CHECKER},
+    {&postProcessingVert, nullptr, &deferredLightingFrag, CLUSTERED_SHADING,
+     SHADOW_FILTERS},
+    {&postProcessingVert, nullptr, &tileDepthBoundsFrag, NO_FEATURES,
+     NO_FEATURES},
+    {&postProcessingVert, nullptr, &shadowMomentsFrag, NO_FEATURES,
+     FROM_DEPTH | SHADOW_FILTER_VSM | SHADOW_FILTER_ESM},
+    {&postProcessingVert, nullptr, &postProcessingFrag, NO_FEATURES,
+     NO_FEATURES},
+}};
+
+} // namespace ShaderSource
+
+// TODO: Render a plane and use calculus to make it more interesting. Procedural
+// terrain generation?
+
+// TODO: Render a pipe in a sinus & cosinus shape. Remove the dead code which
+// used to render sinus wave.
+
+namespace ShadowMapping {
+
+// Layers of the shadow map array, computeShadow declares the same
+constexpr int MAX_CASCADES{4};
+
+// How computeShadow filters the cascades. The lit programs are a permutation
+// with the filter's feature, see Rendering::ShaderPermutations.
+enum class Filter {
+  // 3x3 bilinear comparisons, 9 taps
+  PCF,
+  // One bilinear 2x2 comparison
+  HARDWARE,
+  // 16 comparisons on a Poisson disk, rotated per pixel
+  POISSON,
+  // Percentage closer soft shadows, the penumbra widens with the distance
+  // between the receiver and its blockers
+  PCSS,
+  // Variance and exponential shadow maps, one tap of a blurred moments map
+  VSM,
+  ESM,
+};
+
+struct NamedFilter {
+  Filter filter;
+  const char *name;
+  // ShaderSource::Features bit of the lit programs
+  uint32_t feature;
+};
+
+// In the order of Filter
+constexpr std::array<NamedFilter, 6> FILTERS{{
+    {Filter::PCF, "pcf", ShaderSource::NO_FEATURES},
+    {Filter::HARDWARE, "hardware", ShaderSource::SHADOW_FILTER_HARDWARE},
+    {Filter::POISSON, "poisson", ShaderSource::SHADOW_FILTER_POISSON},
+    {Filter::PCSS, "pcss", ShaderSource::SHADOW_FILTER_PCSS},
+    {Filter::VSM, "vsm", ShaderSource::SHADOW_FILTER_VSM},
+    {Filter::ESM, "esm", ShaderSource::SHADOW_FILTER_ESM},
+}};
+
+const NamedFilter &namedFilter(const Filter filter) {
+  return FILTERS[static_cast<size_t>(filter)];
+}
+
+// VSM and ESM sample a moments map derived from the depth map, see
+// ShaderSource::shadowMomentsFrag
+bool usesMoments(const Filter filter) {
+  return filter == Filter::VSM || filter == Filter::ESM;
+}
+
+struct LightMatrix {
+  glm::mat4 view;
+  glm::mat4 projection;
+};
+
+// The view frustum is split along the view depth, every slice gets its own
+// light matrix and layer of the shadow map. Close slices are small, so a
+// texel covers less of the scene near the camera.
+struct Cascades {
+  std::vector<LightMatrix> matrices;
+  // Projection * view of each cascade, u_cascadeMatrices
+  std::vector<glm::mat4> viewProjections;
+  // View space depth where each cascade ends
+  std::vector<float> splits;
+  // World size of a texel of each cascade, u_cascadeTexelSize
+  std::vector<float> texelSizes;
+  // The same in the depth of each cascade, u_cascadeDepthBias
+  std::vector<float> depthBiases;
+  // Encloses every cascade, shadow casters are culled with it
+  LightMatrix bounds;
+};
+
+struct CreateCascadesParam {
+  glm::mat4 projectionMatrix;
+  glm::mat4 viewMatrix;
+  float near;
+  float far;
+  glm::vec3 worldUp;
+  glm::vec3 lightDirection;
+  int cascadeCount;
+  // 0 splits uniformly, 1 logarithmically
+  float splitLambda;
+  // Width and height of a shadow map layer
+  int resolution;
+  // Every shadow caster, a cascade's near plane is pulled back to it
+  Geometry::AABB casterBounds;
+  // Fit spheres snapped to texels instead of tight boxes, see
+  // fitStableLightMatrix
+  bool stable;
+};
+
+// The practical split scheme (Zhang et al.), a blend of the logarithmic split,
+// which spreads the texels evenly over the screen, and the uniform one, which
+// keeps the far cascades from getting too large. Returns where each cascade
+// ends.
+std::vector<float> practicalSplits(const float near, const float far,
+                                   const int count, const float lambda) {
+  std::vector<float> splits(count);
+  for (int i{1}; i <= count; ++i) {
+    const float fraction{static_cast<float>(i) / count};
+    const float logarithmic{near * glm::pow(far / near, fraction)};
+    const float uniform{near + (far - near) * fraction};
+    splits[i - 1] = glm::mix(uniform, logarithmic, lambda);
+  }
+  return splits;
+}
+
+// Fits a sphere around the slice instead of a box. The sphere keeps its size
+// when the camera turns, and its center is snapped to whole texels in light
+// space. Texels then land on the same spots of the scene every frame, so
+// shadow edges don't shimmer, and a camera which didn't move gets exactly the
+// same matrix. Costs resolution, the sphere is larger than the box.
+LightMatrix fitStableLightMatrix(const std::array<glm::vec3, 8> &corners,
+                                 const CreateCascadesParam &param) {
+  glm::vec3 center{0.0f};
+  for (const auto &corner : corners) {
+    center += corner;
+  }
+  center /= corners.size();
+
+  float radius{0.0f};
+  for (const auto &corner : corners) {
+    radius = glm::max(radius, glm::length(corner - center));
+  }
+  // Float noise in the corners must not change the size
+  radius = glm::ceil(radius * 16.0f) / 16.0f;
+
+  const float texelSize{2.0f * radius / param.resolution};
+
+  // Only the ortho bounds follow the camera, the orientation never changes
+  const glm::mat4 lightView{
+      glm::lookAt(glm::vec3{0.0f}, param.lightDirection, param.worldUp)};
+  glm::vec3 lightSpaceCenter{lightView * glm::vec4{center, 1.0f}};
+  lightSpaceCenter = glm::floor(lightSpaceCenter / texelSize) * texelSize;
+
+  // The near plane is snapped outward in quarter radius steps, so casters
+  // which move a little don't change the matrix
+  const Geometry::AABB casters{
+      Geometry::transform(param.casterBounds, lightView)};
+  const float nearStep{radius / 4.0f};
+  const float near{
+      -glm::ceil(glm::max(lightSpaceCenter.z + radius, casters.max.z) /
+                 nearStep) *
+      nearStep};
+  const float far{-(lightSpaceCenter.z - radius)};
+
+  const glm::mat4 lightProjection{glm::ortho(
+      lightSpaceCenter.x - radius, lightSpaceCenter.x + radius,
+      lightSpaceCenter.y - radius, lightSpaceCenter.y + radius, near, far)};
+
+  return {.view = lightView, .projection = lightProjection};
+}
+
+LightMatrix fitLightMatrix(const std::array<glm::vec3, 8> &corners,
+                           const CreateCascadesParam &param) {
+  if (param.stable) {
+    return fitStableLightMatrix(corners, param);
+  }
+
+  // Find frustum center
+  glm::vec3 center{0.0f};
+  // Note: Centroid formula, a center of a mass
+  for (const auto &corner : corners) {
+    center += corner;
+  }
+  center /= corners.size();
+
+  // Find the largest enclosing radius as light position distance
+  //
+  // Note: This is required to precisely illuminate visible area in the frustum.
+  float radius{0.0f};
+  for (const auto &corner : corners) {
+    radius = glm::max(radius, glm::length(corner - center));
+  }
+  glm::vec3 position{center - radius * param.lightDirection};
+
+  // The light position and orientation matrix
+  glm::mat4 lightView{glm::lookAt(position, center, param.worldUp)};
+
+  // Get the ortho projection bounds
+  // Note: Shadows jitter due to subpixel changes in minBound & maxBound, the
+  // stable fit uses a spherical bounding box.
+  glm::vec3 minBound{std::numeric_limits<float>::max()};
+  glm::vec3 maxBound{std::numeric_limits<float>::lowest()};
+  for (const auto &corner : corners) {
+    const glm::vec3 lightSpaceCorner{lightView * glm::vec4(corner, 1.0f)};
+    minBound = glm::min(minBound, lightSpaceCorner);
+    maxBound = glm::max(maxBound, lightSpaceCorner);
+  }
+
+  // A caster outside the slice, between it and the light, still shadows the
+  // slice. Pull the near plane back to the closest caster.
+  const Geometry::AABB casters{
+      Geometry::transform(param.casterBounds, lightView)};
+  maxBound.z = glm::max(maxBound.z, casters.max.z);
+
+  // Looking down the -z axis, adjust to positive values.
+  const float near{-maxBound.z};
+  const float far{-minBound.z};
+
+  glm::mat4 lightProjection{
+      glm::ortho(minBound.x, maxBound.x, minBound.y, maxBound.y, near, far)};
+
+  return {.view = lightView, .projection = lightProjection};
+}
+
+Cascades createCascades(const CreateCascadesParam &param) {
+  if (glm::abs(glm::dot(param.lightDirection, param.worldUp)) >= 0.9999f) {
+    throw std::runtime_error(
+        "Light direction and world up must not be parallel.");
+  }
+  if (param.cascadeCount < 1 || param.cascadeCount > MAX_CASCADES) {
+    throw std::runtime_error("Cascade count must be from 1 to " +
+                             std::to_string(MAX_CASCADES) + ".");
+  }
+
+  // The corners of the near and far plane, a slice at some view depth lies
+  // on the lines between them
+  const glm::mat4 cameraInverse{
+      glm::inverse(param.projectionMatrix * param.viewMatrix)};
+  std::array<glm::vec3, 4> nearCorners;
+  std::array<glm::vec3, 4> farCorners;
+  for (int i{0}; i < 4; ++i) {
+    const glm::vec2 ndc{2.0f * (i & 1) - 1.0f, 2.0f * (i >> 1) - 1.0f};
+    const glm::vec4 nearCorner{cameraInverse * glm::vec4{ndc, -1.0f, 1.0f}};
+    const glm::vec4 farCorner{cameraInverse * glm::vec4{ndc, 1.0f, 1.0f}};
+    nearCorners[i] = glm::vec3{nearCorner} / nearCorner.w;
+    farCorners[i] = glm::vec3{farCorner} / farCorner.w;
+  }
+
+  const auto sliceCorners{[&](const float begin, const float end) {
+    std::array<glm::vec3, 8> corners;
+    for (int i{0}; i < 4; ++i) {
+      corners[i] = glm::mix(nearCorners[i], farCorners[i],
+                            (begin - param.near) / (param.far - param.near));
+      corners[i + 4] = glm::mix(nearCorners[i], farCorners[i],
+                                (end - param.near) / (param.far - param.near));
+    }
+    return corners;
+  }};
+
+  Cascades cascades;
+  cascades.splits = practicalSplits(param.near, param.far,
+                                    param.cascadeCount, param.splitLambda);
+
+  float begin{param.near};
+  for (const float end : cascades.splits) {
+    const LightMatrix matrix{fitLightMatrix(sliceCorners(begin, end), param)};
+    cascades.matrices.push_back(matrix);
+    cascades.viewProjections.push_back(matrix.projection * matrix.view);
+
+    // The ortho projection scales x by 2 / width and depth by 2 / range
+    const float texelSize{2.0f / matrix.projection[0][0] / param.resolution};
+    const float depthRange{2.0f / -matrix.projection[2][2]};
+    cascades.texelSizes.push_back(texelSize);
+    cascades.depthBiases.push_back(texelSize / depthRange);
+
+    begin = end;
+  }
+
+  cascades.bounds = fitLightMatrix(sliceCorners(param.near, param.far), param);
+
+  return cascades;
+}
+} // namespace ShadowMapping
+
+// Fixed set of SDL worker threads. The calling thread works alongside them,
+// so a pool of N threads runs tasks on N + 1 threads.
+class ThreadPool {
+private:
+  using Task = std::function<void(size_t)>;
+
+  std::vector<SDL_Thread *> m_threads;
+  SDL_Semaphore *m_start{nullptr};
+  SDL_Semaphore *m_done{nullptr};
+
+  // Shared with the workers, valid only during parallelFor
+  const Task *m_task{nullptr};
+  size_t m_taskCount{0};
+  SDL_AtomicInt m_nextTask{};
+  SDL_AtomicInt m_quit{};
+
+  void runTasks() {
+    while (true) {
+      const size_t task{static_cast<size_t>(SDL_AddAtomicInt(&m_nextTask, 1))};
+      if (task >= m_taskCount) {
+        return;
+      }
+      (*m_task)(task);
+    }
+  }
+
+  static int SDLCALL workerMain(void *data) {
+    auto &pool{*static_cast<ThreadPool *>(data)};
+
+    while (true) {
+      SDL_WaitSemaphore(pool.m_start);
+      if (SDL_GetAtomicInt(&pool.m_quit) != 0) {
+        return 0;
+      }
+      pool.runTasks();
+      SDL_SignalSemaphore(pool.m_done);
+    }
+  }
+
+public:
+  // By default one thread for each logical core, including the caller
+  explicit ThreadPool(int threadCount = SDL_GetNumLogicalCPUCores() - 1) {
+    m_start = SDL_CreateSemaphore(0);
+    m_done = SDL_CreateSemaphore(0);
+
+    if (m_start == nullptr || m_done == nullptr) {
+      throw std::runtime_error(std::string{"Failed to create semaphore: "} +
+                               SDL_GetError());
+    }
+
+    for (int i{0}; i < threadCount; ++i) {
+      SDL_Thread *thread{SDL_CreateThread(workerMain, "worker", this)};
+      if (thread == nullptr) {
+        // Fewer workers is fine, the caller still makes progress
+        std::cerr << "SDL_CreateThread failed: " << SDL_GetError() << "\n";
+        break;
+      }
+      m_threads.push_back(thread);
+    }
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  ~ThreadPool() {
+    SDL_SetAtomicInt(&m_quit, 1);
+    for (size_t i{0}; i < m_threads.size(); ++i) {
+      SDL_SignalSemaphore(m_start);
+    }
+    for (SDL_Thread *thread : m_threads) {
+      SDL_WaitThread(thread, nullptr);
+    }
+    SDL_DestroySemaphore(m_start);
+    SDL_DestroySemaphore(m_done);
+  }
+
+  size_t threadCount() const { return m_threads.size() + 1; }
+
+  // Calls task(i) for every i in [0, taskCount) and returns once all of them
+  // finished. Tasks are claimed dynamically, so the order is unspecified.
+  void parallelFor(const size_t taskCount, const Task &task) {
+    if (taskCount == 0) {
+      return;
+    }
+
+    m_task = &task;
+    m_taskCount = taskCount;
+    SDL_SetAtomicInt(&m_nextTask, 0);
+
+    // Don't wake more workers than there is work for
+    const size_t workers{std::min(m_threads.size(), taskCount - 1)};
+    for (size_t i{0}; i < workers; ++i) {
+      SDL_SignalSemaphore(m_start);
+    }
+
+    runTasks();
+
+    for (size_t i{0}; i < workers; ++i) {
+      SDL_WaitSemaphore(m_done);
+    }
+
+    m_task = nullptr;
+    m_taskCount = 0;
+  }
+};
+
+namespace Lighting {
+
+enum class LightType : uint32_t { Point, Spot };
+
+struct Light {
+  LightType type;
+  glm::vec3 position;
+  glm::vec3 color;
+  // The light contributes nothing beyond this distance, culling relies on it
+  float radius;
+  // Spot light only
+  glm::vec3 direction;
+  float cosInnerCone;
+  float cosOuterCone;
+  // First texel of the light's views in `u_shadowData`, -1 casts no shadow.
+  // Assigned every frame by ShadowAtlas::allocate.
+  int32_t shadow{-1};
+};
+
+// Texels per light in the `u_lightData` texture buffer
+constexpr size_t LIGHT_TEXELS{4};
+
+struct GenerateLightsParam {
+  size_t count;
+  glm::vec3 minBound;
+  glm::vec3 maxBound;
+  float minRadius;
+  float maxRadius;
+  // Every n-th light is a spot light
+  size_t spotLightStride;
+  uint32_t seed;
+};
+
+// Fixed seed keeps the light field identical between runs, otherwise frame
+// times can't be compared.
+std::vector<Light> generateLights(const GenerateLightsParam &param) {
+  std::mt19937 engine{param.seed};
+  std::uniform_real_distribution<float> unit{0.0f, 1.0f};
+
+  std::vector<Light> lights;
+  lights.reserve(param.count);
+
+  for (size_t i{0}; i < param.count; ++i) {
+    const glm::vec3 t{unit(engine), unit(engine), unit(engine)};
+    const glm::vec3 position{glm::mix(param.minBound, param.maxBound, t)};
+    const float radius{glm::mix(param.minRadius, param.maxRadius, unit(engine))};
+
+    // Saturated colors, so overlapping lights remain distinguishable
+    const float hue{unit(engine) * 2.0f * glm::pi<float>()};
+    const glm::vec3 color{
+        0.5f + 0.5f * glm::cos(hue),                                //
+        0.5f + 0.5f * glm::cos(hue - 2.0f * glm::pi<float>() / 3), //
+        0.5f + 0.5f * glm::cos(hue + 2.0f * glm::pi<float>() / 3)  //
+    };
+
+    const bool isSpot{param.spotLightStride != 0 &&
+                      i % param.spotLightStride == 0};
+
+    if (isSpot) {
+      const glm::vec3 direction{glm::normalize(glm::vec3{
+          unit(engine) - 0.5f, -1.0f, unit(engine) - 0.5f})};
+
+      lights.push_back({.type = LightType::Spot,
+                        .position = position,
+                        .color = 2.0f * color,
+                        .radius = radius * 1.5f,
+                        .direction = direction,
+                        .cosInnerCone = glm::cos(glm::radians(20.0f)),
+                        .cosOuterCone = glm::cos(glm::radians(30.0f))});
+    } else {
+      // Cones which always pass, the shader treats every light as a spot light
+      lights.push_back({.type = LightType::Point,
+                        .position = position,
+                        .color = color,
+                        .radius = radius,
+                        .direction = glm::vec3{0.0f, -1.0f, 0.0f},
+                        .cosInnerCone = -1.0f,
+                        .cosOuterCone = -2.0f});
+    }
+  }
+
+  return lights;
+}
+
+// Move each light on a small circle around its initial position
+void animateLights(std::vector<Light> &lights,
+                   const std::vector<Light> &initialLights,
+                   const float time) {
+  for (size_t i{0}; i < lights.size(); ++i) {
+    const float phase{static_cast<float>(i) * 0.618f};
+    const float angle{time * 0.5f + phase * 2.0f * glm::pi<float>()};
+
+    lights[i].position = initialLights[i].position +
+                         2.0f * glm::vec3{glm::cos(angle), 0.0f,
+                                          glm::sin(angle)};
+  }
+}
+
+void packLights(const std::vector<Light> &lights,
+                std::vector<glm::vec4> &texels) {
+  texels.resize(lights.size() * LIGHT_TEXELS);
+
+  for (size_t i{0}; i < lights.size(); ++i) {
+    const auto &light{lights[i]};
+    texels[i * LIGHT_TEXELS + 0] = glm::vec4{light.position, light.radius};
+    texels[i * LIGHT_TEXELS + 1] = glm::vec4{light.color, light.cosInnerCone};
+    texels[i * LIGHT_TEXELS + 2] =
+        glm::vec4{light.direction, light.cosOuterCone};
+    texels[i * LIGHT_TEXELS + 3] =
+        glm::vec4{static_cast<float>(light.shadow), 0.0f, 0.0f, 0.0f};
+  }
+}
+
+// Rectangle in normalized device coordinates
+struct ScreenRect {
+  glm::vec2 min;
+  glm::vec2 max;
+};
+
+// Conservative NDC rectangle of a view space sphere. The sphere is inside its
+// bounding box, and the projected box corners enclose the projected sphere.
+ScreenRect projectSphere(const glm::vec3 &center, const float radius,
+                         const glm::mat4 &projectionMatrix, const float near) {
+  const ScreenRect fullScreen{.min = glm::vec2{-1.0f}, .max = glm::vec2{1.0f}};
+
+  // Looking down the -z axis, the box crosses the near plane
+  if (center.z + radius > -near) {
+    return fullScreen;
+  }
+
+  ScreenRect rect{.min = glm::vec2{1.0f}, .max = glm::vec2{-1.0f}};
+
+  for (float x = -1.0f; x <= 1.0f; x += 2.0f) {
+    for (float y = -1.0f; y <= 1.0f; y += 2.0f) {
+      for (float z = -1.0f; z <= 1.0f; z += 2.0f) {
+        const glm::vec4 clip{projectionMatrix *
+                             glm::vec4{center + radius * glm::vec3{x, y, z},
+                                       1.0f}};
+        const glm::vec2 ndc{glm::vec2{clip} / clip.w};
+        rect.min = glm::min(rect.min, ndc);
+        rect.max = glm::max(rect.max, ndc);
+      }
+    }
+  }
+
+  rect.min = glm::clamp(rect.min, fullScreen.min, fullScreen.max);
+  rect.max = glm::clamp(rect.max, fullScreen.min, fullScreen.max);
+
+  return rect;
+}
+
+// Bins lights into cells (clusters, screen tiles) and produces per cell
+// (offset, count) ranges into a flat light index list.
+//
+// Lights are processed in fixed size chunks spread over the thread pool:
+//
+// 1. each chunk collects its (cell, light) hits and counts them per cell,
+// 2. per cell, the chunk counts become chunk write offsets,
+// 3. a serial prefix sum over the cells gives the cell ranges,
+// 4. each chunk scatters its hits into its own sub ranges.
+//
+// Chunk boundaries don't depend on the thread count or scheduling, which
+// keeps the result identical to a single threaded run, with lights in
+// ascending order within each cell.
+class LightBinner {
+private:
+  static constexpr size_t LIGHTS_PER_CHUNK{128};
+  static constexpr size_t CELLS_PER_TASK{512};
+
+  ThreadPool &m_threadPool;
+
+  // (offset, count) into m_lightIndices for each cell
+  std::vector<glm::uvec2> m_lightGrid;
+  std::vector<uint32_t> m_lightIndices;
+
+  // Scratch (cell, light) pairs of each chunk, and a per chunk and cell
+  // count which turns into the chunk's write cursor inside the cell's range.
+  // Kept around to avoid per frame allocation.
+  std::vector<std::vector<glm::uvec2>> m_chunkPairs;
+  std::vector<uint32_t> m_chunkCursors;
+
+  double m_binningMilliseconds{0.0};
+
+public:
+  // Appends a (cell, light) pair for every cell the light touches
+  using BinLight =
+      std::function<void(uint32_t light, std::vector<glm::uvec2> &pairs)>;
+
+  explicit LightBinner(ThreadPool &threadPool) : m_threadPool{threadPool} {}
+
+  void bin(const size_t lightCount, const size_t cellCount,
+           const BinLight &binLight) {
+    const Uint64 begin{SDL_GetPerformanceCounter()};
+
+    const size_t chunks{(lightCount + LIGHTS_PER_CHUNK - 1) /
+                        LIGHTS_PER_CHUNK};
+    const size_t cellTasks{(cellCount + CELLS_PER_TASK - 1) / CELLS_PER_TASK};
+
+    m_chunkPairs.resize(chunks);
+    m_chunkCursors.assign(chunks * cellCount, 0);
+    m_lightGrid.resize(cellCount);
+
+    // 1. Collect and count the hits of each chunk
+    m_threadPool.parallelFor(chunks, [&](const size_t chunk) {
+      auto &pairs{m_chunkPairs[chunk]};
+      pairs.clear();
+
+      const size_t lightBegin{chunk * LIGHTS_PER_CHUNK};
+      const size_t lightEnd{std::min(lightBegin + LIGHTS_PER_CHUNK,
+                                     lightCount)};
+
+      for (size_t i{lightBegin}; i < lightEnd; ++i) {
+        binLight(static_cast<uint32_t>(i), pairs);
+      }
+
+      uint32_t *counts{&m_chunkCursors[chunk * cellCount]};
+      for (const auto &pair : pairs) {
+        ++counts[pair.x];
+      }
+    });
+
+    // 2. Chunk counts become chunk offsets relative to the cell's range
+    m_threadPool.parallelFor(cellTasks, [&](const size_t task) {
+      const size_t cellBegin{task * CELLS_PER_TASK};
+      const size_t cellEnd{std::min(cellBegin + CELLS_PER_TASK, cellCount)};
+
+      for (size_t cell{cellBegin}; cell < cellEnd; ++cell) {
+        uint32_t count{0};
+        for (size_t chunk{0}; chunk < chunks; ++chunk) {
+          uint32_t &cursor{m_chunkCursors[chunk * cellCount + cell]};
+          const uint32_t chunkCount{cursor};
+          cursor = count;
+          count += chunkCount;
+        }
+        m_lightGrid[cell].y = count;
+      }
+    });
+
+    // 3. Prefix sum over the cells, cheap enough to stay serial
+    uint32_t offset{0};
+    for (auto &cell : m_lightGrid) {
+      cell.x = offset;
+      offset += cell.y;
+    }
+    m_lightIndices.resize(offset);
+
+    // 4. Scatter, every chunk writes to its own disjoint sub ranges
+    m_threadPool.parallelFor(chunks, [&](const size_t chunk) {
+      uint32_t *cursors{&m_chunkCursors[chunk * cellCount]};
+
+      for (const auto &pair : m_chunkPairs[chunk]) {
+        m_lightIndices[m_lightGrid[pair.x].x + cursors[pair.x]++] = pair.y;
+      }
+    });
+
+    m_binningMilliseconds =
+        static_cast<double>(SDL_GetPerformanceCounter() - begin) * 1000.0 /
+        static_cast<double>(SDL_GetPerformanceFrequency());
+  }
+
+  const std::vector<glm::uvec2> &lightGrid() const { return m_lightGrid; }
+
+  const std::vector<uint32_t> &lightIndices() const { return m_lightIndices; }
+
+  // Wall time of the last bin call
+  double binningMilliseconds() const { return m_binningMilliseconds; }
+};
+
+// Shadow maps of the local lights which matter most on screen, packed into
+// one depth texture. A spot light gets one square tile, a point light six,
+// one per cube face, which a geometry shader draws in a single pass.
+//
+// A light's tile size follows its share of the screen. When the tiles don't
+// fit, the least important lights are halved first, and dropped once they
+// are at the smallest size. Tiles are powers of two placed largest first
+// along a Morton curve, so every tile lands on a free, aligned square.
+class ShadowAtlas {
+public:
+  static constexpr int SIZE{4096};
+  static constexpr int MIN_TILE{64};
+  static constexpr int MAX_TILE{1024};
+  static constexpr float NEAR{0.1f};
+  // Texels per view in `u_shadowData`: the atlas matrix, then the tile
+  static constexpr size_t FACE_TEXELS{5};
+
+  // One perspective view of a light, its tile in texels
+  struct Face {
+    glm::mat4 viewProjection;
+    glm::ivec2 offset;
+  };
+
+  struct Allocation {
+    uint32_t light;
+    float importance;
+    int tileSize;
+    int faceCount;
+    std::array<Face, 6> faces;
+  };
+
+private:
+  std::vector<Allocation> m_allocations;
+  // (size, allocation, face) of every tile, in placement order
+  std::vector<glm::ivec3> m_tiles;
+  std::vector<glm::vec4> m_texels;
+
+  // Every other bit of a Morton code
+  static uint32_t compactBits(uint32_t x) {
+    x &= 0x55555555u;
+    x = (x | (x >> 1)) & 0x33333333u;
+    x = (x | (x >> 2)) & 0x0f0f0f0fu;
+    x = (x | (x >> 4)) & 0x00ff00ffu;
+    x = (x | (x >> 8)) & 0x0000ffffu;
+    return x;
+  }
+
+  static size_t area(const Allocation &allocation) {
+    return static_cast<size_t>(allocation.faceCount) * allocation.tileSize *
+           allocation.tileSize;
+  }
+
+  // Shrinks the least important lights until every tile fits
+  void fitBudget() {
+    const size_t budget{static_cast<size_t>(SIZE) * SIZE};
+    size_t total{0};
+    for (const Allocation &allocation : m_allocations) {
+      total += area(allocation);
+    }
+
+    while (total > budget) {
+      const auto it{std::find_if(m_allocations.rbegin(), m_allocations.rend(),
+                                 [](const Allocation &allocation) {
+                                   return allocation.tileSize > MIN_TILE;
+                                 })};
+      if (it == m_allocations.rend()) {
+        total -= area(m_allocations.back());
+        m_allocations.pop_back();
+        continue;
+      }
+      total -= area(*it);
+      it->tileSize /= 2;
+      total += area(*it);
+    }
+  }
+
+  void place() {
+    m_tiles.clear();
+    for (size_t i{0}; i < m_allocations.size(); ++i) {
+      for (int face{0}; face < m_allocations[i].faceCount; ++face) {
+        m_tiles.push_back(glm::ivec3{m_allocations[i].tileSize, i, face});
+      }
+    }
+    std::stable_sort(m_tiles.begin(), m_tiles.end(),
+                     [](const glm::ivec3 &a, const glm::ivec3 &b) {
+                       return a.x > b.x;
+                     });
+
+    // In MIN_TILE cells. A tile covers a whole aligned block of cells, and
+    // the cursor stays aligned because the sizes only decrease.
+    uint32_t cell{0};
+    for (const glm::ivec3 &tile : m_tiles) {
+      m_allocations[tile.y].faces[tile.z].offset =
+          glm::ivec2{compactBits(cell), compactBits(cell >> 1)} * MIN_TILE;
+      const uint32_t side{static_cast<uint32_t>(tile.x / MIN_TILE)};
+      cell += side * side;
+    }
+  }
+
+  void pack(std::vector<Light> &lights) {
+    m_texels.clear();
+    for (const Allocation &allocation : m_allocations) {
+      Light &light{lights[allocation.light]};
+      light.shadow = static_cast<int32_t>(m_texels.size());
+
+      // World space size of a texel at unit distance from the light
+      const float fov{allocation.faceCount == 6
+                          ? glm::half_pi<float>()
+                          : 2.0f * glm::acos(light.cosOuterCone)};
+      m_texels.push_back(
+          glm::vec4{static_cast<float>(allocation.faceCount),
+                    2.0f * glm::tan(0.5f * fov) / allocation.tileSize, 0.0f,
+                    0.0f});
+
+      const float scale{static_cast<float>(allocation.tileSize) / SIZE};
+      const float halfTexel{0.5f / SIZE};
+      for (int i{0}; i < allocation.faceCount; ++i) {
+        const Face &face{allocation.faces[i]};
+        const glm::vec2 offset{glm::vec2{face.offset} /
+                               static_cast<float>(SIZE)};
+
+        // From clip space to the tile's atlas coordinates and [0, 1] depth
+        const glm::mat4 toTile{
+            glm::translate(glm::mat4{1.0f},
+                           glm::vec3{offset + 0.5f * scale, 0.5f}) *
+            glm::scale(glm::mat4{1.0f}, glm::vec3{0.5f * scale, 0.5f * scale,
+                                                  0.5f})};
+        const glm::mat4 atlasMatrix{toTile * face.viewProjection};
+        for (int column{0}; column < 4; ++column) {
+          m_texels.push_back(atlasMatrix[column]);
+        }
+        // Filter taps are clamped to the tile
+        m_texels.push_back(glm::vec4{offset + halfTexel,
+                                     offset + scale - halfTexel});
+      }
+    }
+  }
+
+public:
+  // Picks up to maxLights lights which are on screen and assigns their tiles
+  // and views. Sets Light::shadow of every light, call before packLights.
+  void allocate(std::vector<Light> &lights, const glm::mat4 &viewMatrix,
+                const glm::mat4 &projectionMatrix, const float near,
+                const size_t maxLights) {
+    m_allocations.clear();
+    for (Light &light : lights) {
+      light.shadow = -1;
+    }
+
+    const Geometry::Frustum frustum{
+        Geometry::extractFrustum(projectionMatrix * viewMatrix)};
+
+    for (uint32_t i{0}; i < lights.size(); ++i) {
+      const Light &light{lights[i]};
+      if (!Geometry::intersects(frustum,
+                                Geometry::Sphere{.center = light.position,
+                                                 .radius = light.radius})) {
+        continue;
+      }
+
+      // Share of the screen covered by the projected sphere. It keeps growing
+      // past 1 as the camera gets deeper inside the light's reach, which
+      // orders the lights around the camera.
+      const glm::vec3 center{viewMatrix * glm::vec4{light.position, 1.0f}};
+      const float ndcRadius{light.radius * projectionMatrix[1][1] /
+                            glm::max(glm::length(center), near)};
+      const float importance{0.25f * glm::pi<float>() * ndcRadius *
+                             ndcRadius};
+
+      m_allocations.push_back(Allocation{
+          .light = i,
+          .importance = importance,
+          .tileSize = 0,
+          .faceCount = light.type == LightType::Point ? 6 : 1,
+          .faces = {},
+      });
+    }
+
+    // Ties keep the light order, so the result doesn't depend on the sort
+    const size_t count{std::min(maxLights, m_allocations.size())};
+    std::partial_sort(m_allocations.begin(), m_allocations.begin() + count,
+                      m_allocations.end(),
+                      [](const Allocation &a, const Allocation &b) {
+                        return a.importance > b.importance ||
+                               (a.importance == b.importance &&
+                                a.light < b.light);
+                      });
+    m_allocations.resize(count);
+
+    // The tile edge follows the light's extent on screen
+    for (Allocation &allocation : m_allocations) {
+      const int edge{static_cast<int>(
+          glm::sqrt(glm::min(allocation.importance, 1.0f)) * MAX_TILE)};
+      allocation.tileSize = std::clamp(
+          static_cast<int>(std::bit_ceil(static_cast<uint32_t>(edge))),
+          MIN_TILE, MAX_TILE);
+    }
+
+    fitBudget();
+    place();
+
+    // Cube faces in the order of GL_TEXTURE_CUBE_MAP_POSITIVE_X onwards
+    const std::array<std::pair<glm::vec3, glm::vec3>, 6> cubeFaces{{
+        {glm::vec3{1.0f, 0.0f, 0.0f}, glm::vec3{0.0f, -1.0f, 0.0f}},
+        {glm::vec3{-1.0f, 0.0f, 0.0f}, glm::vec3{0.0f, -1.0f, 0.0f}},
+        {glm::vec3{0.0f, 1.0f, 0.0f}, glm::vec3{0.0f, 0.0f, 1.0f}},
+        {glm::vec3{0.0f, -1.0f, 0.0f}, glm::vec3{0.0f, 0.0f, -1.0f}},
+        {glm::vec3{0.0f, 0.0f, 1.0f}, glm::vec3{0.0f, -1.0f, 0.0f}},
+        {glm::vec3{0.0f, 0.0f, -1.0f}, glm::vec3{0.0f, -1.0f, 0.0f}},
+    }};
+
+    for (Allocation &allocation : m_allocations) {
+      const Light &light{lights[allocation.light]};
+
+      if (light.type == LightType::Point) {
+        const glm::mat4 projection{
+            glm::perspective(glm::half_pi<float>(), 1.0f, NEAR, light.radius)};
+        for (int i{0}; i < 6; ++i) {
+          allocation.faces[i].viewProjection =
+              projection * glm::lookAt(light.position,
+                                       light.position + cubeFaces[i].first,
+                                       cubeFaces[i].second);
+        }
+      } else {
+        const glm::vec3 up{glm::abs(light.direction.y) > 0.99f
+                               ? glm::vec3{0.0f, 0.0f, 1.0f}
+                               : glm::vec3{0.0f, 1.0f, 0.0f}};
+        const float fov{2.0f * glm::acos(light.cosOuterCone)};
+        allocation.faces[0].viewProjection =
+            glm::perspective(fov, 1.0f, NEAR, light.radius) *
+            glm::lookAt(light.position, light.position + light.direction, up);
+      }
+    }
+
+    pack(lights);
+  }
+
+  // Most important first
+  const std::vector<Allocation> &allocations() const { return m_allocations; }
+
+  // The `u_shadowData` texture buffer, Light::shadow points into it
+  const std::vector<glm::vec4> &texels() const { return m_texels; }
+
+  // Share of the atlas in use
+  float occupancy() const {
+    size_t total{0};
+    for (const Allocation &allocation : m_allocations) {
+      total += area(allocation);
+    }
+    return static_cast<float>(total) / (static_cast<float>(SIZE) * SIZE);
+  }
+};
+
+} // namespace Lighting
+
+// C++ port of prototype/clusters.py
+namespace ClusteredShading {
+
+class ClusterGrid {
+private:
+  ThreadPool &m_threadPool;
+  Lighting::LightBinner m_binner;
+
+  glm::ivec3 m_dimensions;
+  float m_near{0.0f};
+  float m_far{0.0f};
+  glm::mat4 m_projectionMatrix{0.0f};
+
+  // View space bounds, x runs left to right, y bottom to top, z near to far
+  Geometry::AABBBatch m_clusters;
+
+  size_t clusterIndex(const int x, const int y, const int z) const {
+    return static_cast<size_t>(x + m_dimensions.x * (y + m_dimensions.y * z));
+  }
+
+  size_t clusterCount() const {
+    return static_cast<size_t>(m_dimensions.x) * m_dimensions.y *
+           m_dimensions.z;
+  }
+
+  // Exponential depth slicing, see compute_depth_percent in the prototype
+  float sliceDepth(const int slice) const {
+    return m_near * glm::pow(m_far / m_near, static_cast<float>(slice) /
+                                                 m_dimensions.z);
+  }
+
+  int depthSlice(const float viewDepth) const {
+    const int slice{static_cast<int>(glm::log(viewDepth / m_near) /
+                                     glm::log(m_far / m_near) *
+                                     m_dimensions.z)};
+    return glm::clamp(slice, 0, m_dimensions.z - 1);
+  }
+
+  int tile(const float ndc, const int count) const {
+    const int index{static_cast<int>((ndc * 0.5f + 0.5f) * count)};
+    return glm::clamp(index, 0, count - 1);
+  }
+
+  void binLight(const Lighting::Light &light, const uint32_t lightIndex,
+                const glm::mat4 &viewMatrix,
+                std::vector<glm::uvec2> &pairs) const {
+    // Spot lights are binned conservatively by their bounding sphere, the
+    // shader's cone falloff leaves the fragments outside the cone unlit
+    const glm::vec3 center{viewMatrix * glm::vec4{light.position, 1.0f}};
+    const float radius{light.radius};
+
+    const float viewDepth{-center.z};
+    if (viewDepth + radius < m_near || viewDepth - radius > m_far) {
+      return;
+    }
+
+    const int zBegin{depthSlice(glm::max(viewDepth - radius, m_near))};
+    const int zEnd{depthSlice(glm::min(viewDepth + radius, m_far))};
+
+    const Lighting::ScreenRect rect{
+        Lighting::projectSphere(center, radius, m_projectionMatrix, m_near)};
+    const int xBegin{tile(rect.min.x, m_dimensions.x)};
+    const int xEnd{tile(rect.max.x, m_dimensions.x)};
+    const int yBegin{tile(rect.min.y, m_dimensions.y)};
+    const int yEnd{tile(rect.max.y, m_dimensions.y)};
+
+    const Geometry::Sphere sphere{.center = center, .radius = radius};
+
+    // A row of clusters is contiguous, test it in chunks
+    constexpr size_t CHUNK{32};
+    std::array<uint8_t, CHUNK> hits;
+
+    for (int z{zBegin}; z <= zEnd; ++z) {
+      for (int y{yBegin}; y <= yEnd; ++y) {
+        for (int x{xBegin}; x <= xEnd; x += CHUNK) {
+          const size_t first{clusterIndex(x, y, z)};
+          const size_t count{glm::min<size_t>(CHUNK, xEnd - x + 1)};
+
+          if (Geometry::intersectBatch(sphere, m_clusters, first, count,
+                                       hits.data()) == 0) {
+            continue;
+          }
+          for (size_t i{0}; i < count; ++i) {
+            if (hits[i]) {
+              pairs.push_back(glm::uvec2{first + i, lightIndex});
+            }
+          }
+        }
+      }
+    }
+  }
+
+public:
+  explicit ClusterGrid(ThreadPool &threadPool,
+                       const glm::ivec3 &dimensions = {16, 9, 24})
+      : m_threadPool{threadPool}, m_binner{threadPool},
+        m_dimensions{dimensions} {}
+
+  // Rebuilds the cluster bounds only when the projection changes
+  void build(const glm::mat4 &projectionMatrix, const float near,
+             const float far) {
+    if (m_clusters.count > 0 && projectionMatrix == m_projectionMatrix &&
+        near == m_near && far == m_far) {
+      return;
+    }
+
+    m_projectionMatrix = projectionMatrix;
+    m_near = near;
+    m_far = far;
+
+    const glm::mat4 projectionInverse{glm::inverse(projectionMatrix)};
+    const auto unproject{[&projectionInverse](const glm::vec3 &ndc) {
+      const glm::vec4 point{projectionInverse * glm::vec4{ndc, 1.0f}};
+      return glm::vec3{point} / point.w;
+    }};
+
+    // Lattice of cluster corner points, same as build_cluster
+    const glm::ivec3 points{m_dimensions + 1};
+    std::vector<glm::vec3> lattice(static_cast<size_t>(points.x) * points.y *
+                                   points.z);
+
+    // Every lattice column (w, h) is independent
+    m_threadPool.parallelFor(
+        static_cast<size_t>(points.x) * points.y, [&](const size_t column) {
+          const int w{static_cast<int>(column) % points.x};
+          const int h{static_cast<int>(column) / points.x};
+
+          const float ndcX{2.0f * w / m_dimensions.x - 1.0f};
+          const float ndcY{2.0f * h / m_dimensions.y - 1.0f};
+
+          const glm::vec3 nearPoint{unproject({ndcX, ndcY, -1.0f})};
+          const glm::vec3 farPoint{unproject({ndcX, ndcY, 1.0f})};
+
+          for (int d{0}; d < points.z; ++d) {
+            const float depthPercent{(sliceDepth(d) - m_near) /
+                                     (m_far - m_near)};
+
+            lattice[w + points.x * (h + points.y * d)] =
+                glm::mix(nearPoint, farPoint, depthPercent);
+          }
+        });
+
+    m_clusters.resize(clusterCount());
+
+    // Every depth slice is independent
+    m_threadPool.parallelFor(m_dimensions.z, [&](const size_t slice) {
+      const int z{static_cast<int>(slice)};
+
+      for (int y{0}; y < m_dimensions.y; ++y) {
+        for (int x{0}; x < m_dimensions.x; ++x) {
+          Geometry::AABB box{
+              .min = glm::vec3{std::numeric_limits<float>::max()},
+              .max = glm::vec3{std::numeric_limits<float>::lowest()}};
+
+          for (int corner{0}; corner < 8; ++corner) {
+            const int w{x + (corner & 1)};
+            const int h{y + ((corner >> 1) & 1)};
+            const int d{z + ((corner >> 2) & 1)};
+            const glm::vec3 &point{lattice[w + points.x * (h + points.y * d)]};
+
+            box.min = glm::min(box.min, point);
+            box.max = glm::max(box.max, point);
+          }
+
+          m_clusters.set(clusterIndex(x, y, z), box);
+        }
+      }
+    });
+  }
+
+  void assignLights(const std::vector<Lighting::Light> &lights,
+                    const glm::mat4 &viewMatrix) {
+    m_binner.bin(lights.size(), clusterCount(),
+                 [&](const uint32_t light, std::vector<glm::uvec2> &pairs) {
+                   binLight(lights[light], light, viewMatrix, pairs);
+                 });
+  }
+
+  const glm::ivec3 &dimensions() const { return m_dimensions; }
+
+  // Scale and bias which map log(view depth) to a depth slice in the shader
+  glm::vec2 depthParams() const {
+    const float scale{m_dimensions.z / glm::log(m_far / m_near)};
+    return {scale, -glm::log(m_near) * scale};
+  }
+
+  const Geometry::AABBBatch &clusters() const { return m_clusters; }
+
+  const std::vector<glm::uvec2> &lightGrid() const {
+    return m_binner.lightGrid();
+  }
+
+  const std::vector<uint32_t> &lightIndices() const {
+    return m_binner.lightIndices();
+  }
+
+  // Wall time of the last assignLights call
+  double binningMilliseconds() const { return m_binner.binningMilliseconds(); }
+};
+
+} // namespace ClusteredShading
+
+// Forward+, the screen is split into a grid of 16x16 pixel tiles, each with
+// a depth range taken from a depth pre-pass
+namespace TiledShading {
+
+constexpr int TILE_SIZE{16};
+
+class TileGrid {
+private:
+  Lighting::LightBinner m_binner;
+
+  glm::ivec2 m_screenSize{0};
+  glm::ivec2 m_tileCount{0};
+  float m_near{0.0f};
+  float m_far{0.0f};
+  glm::mat4 m_projectionMatrix{0.0f};
+
+  // Inward facing normals of the 4 side planes of each tile's sub-frustum.
+  // The planes pass through the eye, so they have no distance term.
+  std::vector<std::array<glm::vec3, 4>> m_tilePlanes;
+
+  // View depth (min, max) of the geometry in each tile, min > max marks a
+  // tile without geometry
+  std::vector<glm::vec2> m_depthRanges;
+
+  size_t tileCount() const {
+    return static_cast<size_t>(m_tileCount.x) * m_tileCount.y;
+  }
+
+  int tile(const float ndc, const int screenSize, const int count) const {
+    const int index{static_cast<int>((ndc * 0.5f + 0.5f) * screenSize) /
+                    TILE_SIZE};
+    return glm::clamp(index, 0, count - 1);
+  }
+
+  float linearizeDepth(const float depth) const {
+    const float ndcDepth{2.0f * depth - 1.0f};
+    return 2.0f * m_near * m_far /
+           (m_far + m_near - ndcDepth * (m_far - m_near));
+  }
+
+  void binLight(const Lighting::Light &light, const uint32_t lightIndex,
+                const glm::mat4 &viewMatrix,
+                std::vector<glm::uvec2> &pairs) const {
+    const glm::vec3 center{viewMatrix * glm::vec4{light.position, 1.0f}};
+    const float radius{light.radius};
+
+    const float viewDepth{-center.z};
+    if (viewDepth + radius < m_near || viewDepth - radius > m_far) {
+      return;
+    }
+
+    const Lighting::ScreenRect rect{
+        Lighting::projectSphere(center, radius, m_projectionMatrix, m_near)};
+    const int xBegin{tile(rect.min.x, m_screenSize.x, m_tileCount.x)};
+    const int xEnd{tile(rect.max.x, m_screenSize.x, m_tileCount.x)};
+    const int yBegin{tile(rect.min.y, m_screenSize.y, m_tileCount.y)};
+    const int yEnd{tile(rect.max.y, m_screenSize.y, m_tileCount.y)};
+
+    for (int y{yBegin}; y <= yEnd; ++y) {
+      for (int x{xBegin}; x <= xEnd; ++x) {
+        const size_t tileIndex{static_cast<size_t>(x + y * m_tileCount.x)};
+
+        // Skips empty tiles too, their range is inverted
+        const glm::vec2 &depthRange{m_depthRanges[tileIndex]};
+        if (viewDepth + radius < depthRange.x ||
+            viewDepth - radius > depthRange.y) {
+          continue;
+        }
+
+        bool inside{true};
+        for (const glm::vec3 &normal : m_tilePlanes[tileIndex]) {
+          if (glm::dot(normal, center) < -radius) {
+            inside = false;
+            break;
+          }
+        }
+
+        if (inside) {
+          pairs.push_back(glm::uvec2{tileIndex, lightIndex});
+        }
+      }
+    }
+  }
+
+public:
+  explicit TileGrid(ThreadPool &threadPool) : m_binner{threadPool} {}
+
+  // Rebuilds the tile planes only when the projection or screen changes
+  void build(const glm::mat4 &projectionMatrix, const float near,
+             const float far, const glm::ivec2 &screenSize) {
+    if (!m_tilePlanes.empty() && projectionMatrix == m_projectionMatrix &&
+        near == m_near && far == m_far && screenSize == m_screenSize) {
+      return;
+    }
+
+    m_projectionMatrix = projectionMatrix;
+    m_near = near;
+    m_far = far;
+    m_screenSize = screenSize;
+    m_tileCount = (screenSize + TILE_SIZE - 1) / TILE_SIZE;
+
+    const glm::mat4 projectionInverse{glm::inverse(projectionMatrix)};
+    const auto unproject{[&](const glm::ivec2 &pixel) {
+      const glm::vec2 ndc{2.0f * glm::vec2{pixel} / glm::vec2{screenSize} -
+                          1.0f};
+      const glm::vec4 point{projectionInverse * glm::vec4{ndc, 1.0f, 1.0f}};
+      return glm::vec3{point} / point.w;
+    }};
+
+    m_tilePlanes.resize(tileCount());
+    m_depthRanges.assign(tileCount(), glm::vec2{near, far});
+
+    for (int y{0}; y < m_tileCount.y; ++y) {
+      for (int x{0}; x < m_tileCount.x; ++x) {
+        const glm::ivec2 begin{x * TILE_SIZE, y * TILE_SIZE};
+        const glm::ivec2 end{glm::min(begin + TILE_SIZE, screenSize)};
+
+        // Far plane corners
+        const glm::vec3 bottomLeft{unproject({begin.x, begin.y})};
+        const glm::vec3 bottomRight{unproject({end.x, begin.y})};
+        const glm::vec3 topRight{unproject({end.x, end.y})};
+        const glm::vec3 topLeft{unproject({begin.x, end.y})};
+        const glm::vec3 tileCenter{(bottomLeft + topRight) * 0.5f};
+
+        // Plane through the eye and two corners, facing the tile center
+        const auto plane{[&tileCenter](const glm::vec3 &a,
+                                       const glm::vec3 &b) {
+          const glm::vec3 normal{glm::normalize(glm::cross(a, b))};
+          return glm::dot(normal, tileCenter) < 0.0f ? -normal : normal;
+        }};
+
+        m_tilePlanes[x + y * m_tileCount.x] = {
+            plane(topLeft, bottomLeft),     // Left
+            plane(bottomRight, topRight),   // Right
+            plane(bottomLeft, bottomRight), // Bottom
+            plane(topRight, topLeft),       // Top
+        };
+      }
+    }
+  }
+
+  // Window space (min, max) depth of each tile, as read back from the depth
+  // pre-pass reduction
+  void setDepthBounds(const std::vector<glm::vec2> &depthBounds) {
+    for (size_t i{0}; i < m_depthRanges.size(); ++i) {
+      const glm::vec2 &bounds{depthBounds[i]};
+
+      if (bounds.x >= 1.0f) {
+        // Only the cleared far plane, no light can touch this tile
+        m_depthRanges[i] = glm::vec2{m_far, m_near};
+      } else {
+        m_depthRanges[i] = glm::vec2{linearizeDepth(bounds.x),
+                                     linearizeDepth(bounds.y)};
+      }
+    }
+  }
+
+  void assignLights(const std::vector<Lighting::Light> &lights,
+                    const glm::mat4 &viewMatrix) {
+    m_binner.bin(lights.size(), tileCount(),
+                 [&](const uint32_t light, std::vector<glm::uvec2> &pairs) {
+                   binLight(lights[light], light, viewMatrix, pairs);
+                 });
+  }
+
+  const glm::ivec2 &tileCountXY() const { return m_tileCount; }
+
+  const std::vector<glm::uvec2> &lightGrid() const {
+    return m_binner.lightGrid();
+  }
+
+  const std::vector<uint32_t> &lightIndices() const {
+    return m_binner.lightIndices();
+  }
+
+  // Wall time of the last assignLights call
+  double binningMilliseconds() const { return m_binner.binningMilliseconds(); }
+};
+
+} // namespace TiledShading
+
+class Camera {
+private:
+  // TODO: Add a way to keep multiple cameras. One which has ability to
+  // rotated freely, and another one with constrained pitch.
+  // TODO: Consider adding camera not capable of flying around.
+
+  glm::vec3 m_forward;
+  glm::vec3 m_right;
+  glm::vec3 m_up;
+
+  glm::vec3 m_eye;
+
+public:
+  Camera()
+      : m_forward{glm::vec3{0.0f, 0.0f, -1.0f}}, //
+        m_right{glm::vec3{1.0f, 0.0f, 0.0f}},    //
+        m_up{glm::vec3{0.0f, 1.0f, 0.0f}},       //
+        m_eye{glm::vec3(0.0f, 0.0f, 0.0f)}       //
+
+  {}
+
+  Camera(glm::vec3 eye)
+      : m_forward{glm::vec3{0.0f, 0.0f, -1.0f}}, //
+        m_right{glm::vec3{1.0f, 0.0f, 0.0f}},    //
+        m_up{glm::vec3{0.0f, 1.0f, 0.0f}},       //
+        m_eye{std::move(eye)}                    //
+  {}
+
+  Camera(glm::vec3 forward, glm::vec3 right, glm::vec3 up, glm::vec3 eye)
+      : m_forward{std::move(forward)}, //
+        m_right{std::move(right)},     //
+        m_up{std::move(up)},           //
+        m_eye{std::move(eye)}          //
+  {}
+
+  void update(const float pitch, const float yaw, const glm::vec3 &worldUp) {
+    // NOTE: The forward direction vector is derived by the following linear
+    // algebra multiplication, where +x is right, and -z is front:
+    // Ry(pitch)*Rx(yaw)*Vec(0,0,-1)
+    // The logic belows essentially implements exactly that for front
+    // vector.
+
+    // NOTE: The camera is always orinted relative to static world up, right
+    // and forward vectors. That way we use absolute yaw and pitch instead
+    // of delta values.
+
+    glm::vec3 forward{0.0f, 0.0f, -1.0f};
+    const glm::vec3 right{1.0f, 0.0f, 0.0f};
+
+    forward = glm::rotate(forward, pitch, right);
+    // TODO: Figure out if i should keep -yaw here, or should this method
+    // receive -yaw
+    forward = glm::rotate(forward, yaw, worldUp);
+
+    m_forward = glm::normalize(forward);
+    m_right = glm::normalize(glm::cross(m_forward, worldUp));
+    m_up = glm::cross(m_right, m_forward);
+  }
+
+  void up(const float speed) { m_eye += m_up * speed; }
+  void down(const float speed) { m_eye -= m_up * speed; }
+  // TODO: BUG - Sometimes camera moving sideways becomes slower than
+  // forward/backward movement
+  void right(const float speed) { m_eye += m_right * speed; }
+  void left(const float speed) { m_eye -= m_right * speed; }
+  void forward(const float speed) { m_eye += m_forward * speed; }
+  void backward(const float speed) { m_eye -= m_forward * speed; }
+
+  // Place the camera at eye, looking at target
+  void lookAt(const glm::vec3 &eye, const glm::vec3 &target,
+              const glm::vec3 &worldUp) {
+    m_eye = eye;
+    m_forward = glm::normalize(target - eye);
+    m_right = glm::normalize(glm::cross(m_forward, worldUp));
+    m_up = glm::cross(m_right, m_forward);
+  }
+
+  void moveTo(const glm::vec3 &eye) { m_eye = eye; }
+
+  const glm::vec3 &eye() const { return m_eye; }
+
+  glm::mat4 viewMatrix(const glm::vec3 &worldUp) const {
+    return glm::lookAt(
+        m_eye,
+        // Cancel out the eye vector to form a free look at matrix
+        m_eye + m_forward, worldUp);
+  }
+};
+
+// Camera state of one frame, as driven by the mouse and keyboard
+struct CameraSample {
+  // Seconds since the recording started
+  float time;
+  glm::vec3 eye;
+  // Degrees, as accumulated from mouse motion and passed to Camera::update
+  float pitch;
+  float yaw;
+};
+
+// Recorded camera movement, replayed at a fixed timestep so frame times can be
+// reproduced between runs.
+//
+// File layout: "CAMP", uint32 version, uint32 sample count, then the samples
+// as 6 floats each (time, eye xyz, pitch, yaw). Native byte order, little
+// endian on every platform we build for.
+class CameraPath {
+private:
+  static constexpr std::array<char, 4> MAGIC{'C', 'A', 'M', 'P'};
+  static constexpr uint32_t VERSION{1};
+
+  std::vector<CameraSample> m_samples;
+
+public:
+  void record(const CameraSample &sample) { m_samples.push_back(sample); }
+
+  bool empty() const { return m_samples.empty(); }
+
+  float duration() const { return empty() ? 0.0f : m_samples.back().time; }
+
+  // Linear interpolation between the two samples around time, clamped to the
+  // first and the last sample
+  CameraSample sample(const float time) const {
+    const auto next{std::upper_bound(
+        m_samples.begin(), m_samples.end(), time,
+        [](const float t, const CameraSample &s) { return t < s.time; })};
+
+    if (next == m_samples.begin()) {
+      return m_samples.front();
+    }
+    if (next == m_samples.end()) {
+      return m_samples.back();
+    }
+
+    const CameraSample &a{*(next - 1)};
+    const CameraSample &b{*next};
+    const float t{(time - a.time) / std::max(b.time - a.time, 1e-6f)};
+
+    return {
+        .time = time,
+        .eye = glm::mix(a.eye, b.eye, t),
+        .pitch = glm::mix(a.pitch, b.pitch, t),
+        .yaw = glm::mix(a.yaw, b.yaw, t),
+    };
+  }
+
+  void save(const std::string &filePath) const {
+    std::ofstream file{filePath, std::ios::binary};
+    if (!file.is_open()) {
+      throw std::runtime_error("Failed to open: " + filePath);
+    }
+
+    const uint32_t count{static_cast<uint32_t>(m_samples.size())};
+    file.write(MAGIC.data(), MAGIC.size());
+    file.write(reinterpret_cast<const char *>(&VERSION), sizeof(VERSION));
+    file.write(reinterpret_cast<const char *>(&count), sizeof(count));
+
+    for (const CameraSample &sample : m_samples) {
+      const std::array<float, 6> values{sample.time,  sample.eye.x,
+                                        sample.eye.y, sample.eye.z,
+                                        sample.pitch, sample.yaw};
+      file.write(reinterpret_cast<const char *>(values.data()),
+                 values.size() * sizeof(float));
+    }
+  }
+
+  static CameraPath load(const std::string &filePath) {
+    std::ifstream file{filePath, std::ios::binary};
+    if (!file.is_open()) {
+      throw std::runtime_error("Failed to open: " + filePath);
+    }
+
+    std::array<char, 4> magic{};
+    uint32_t version{0};
+    uint32_t count{0};
+    file.read(magic.data(), magic.size());
+    file.read(reinterpret_cast<char *>(&version), sizeof(version));
+    file.read(reinterpret_cast<char *>(&count), sizeof(count));
+
+    if (!file || magic != MAGIC || version != VERSION) {
+      throw std::runtime_error("Not a camera path: " + filePath);
+    }
+
+    // The count is only trusted when the rest of the file holds that many
+    // samples, so a corrupt header can't ask for a huge allocation
+    const std::streamoff header{file.tellg()};
+    file.seekg(0, std::ios::end);
+    const std::streamoff remaining{file.tellg() - header};
+    file.seekg(header);
+    if (!file || static_cast<uint64_t>(remaining) !=
+                     uint64_t{count} * 6 * sizeof(float)) {
+      throw std::runtime_error("Truncated camera path: " + filePath);
+    }
+
+    CameraPath path;
+    path.m_samples.reserve(count);
+
+    for (uint32_t i{0}; i < count; ++i) {
+      std::array<float, 6> values{};
+      file.read(reinterpret_cast<char *>(values.data()),
+                values.size() * sizeof(float));
+      if (!file) {
+        throw std::runtime_error("Truncated camera path: " + filePath);
+      }
+
+      path.m_samples.push_back({
+          .time = values[0],
+          .eye = glm::vec3{values[1], values[2], values[3]},
+          .pitch = values[4],
+          .yaw = values[5],
+      });
+    }
+
+    return path;
+  }
+};
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Nested CPU and GPU timing zones, e.g. a pass and the draw groups inside it.
+//
+// GL_TIME_ELAPSED queries can't nest, only one can be active at a time, so
+// every zone brackets its commands with a pair of GL_TIMESTAMP queries
+// instead. Each frame owns its queries, and a frame is read back only when its
+// slot in the ring comes around again. By then the GPU is long done with it,
+// so reading the results doesn't stall the pipeline.
+namespace Profiling {
+
+struct Zone {
+  const char *name;
+  int depth;
+  // Milliseconds since the profiler was created, on the CPU and GPU clocks
+  double cpuBegin;
+  double cpuEnd;
+  double gpuBegin;
+  double gpuEnd;
+};
+
+class Profiler {
+private:
+  static constexpr size_t FRAME_LATENCY{4};
+
+  struct Frame {
+    std::vector<Zone> zones;
+    // Begin and end timestamp query of each zone
+    std::vector<GLuint> queries;
+    bool pending{false};
+  };
+
+  struct ZoneTotals {
+    std::string_view name;
+    int depth;
+    size_t count;
+    double cpuMilliseconds;
+    double gpuMilliseconds;
+  };
+
+  std::array<Frame, FRAME_LATENCY> m_frames;
+  size_t m_frameIndex{0};
+  int m_depth{0};
+
+  Uint64 m_cpuOrigin{0};
+  GLint64 m_gpuOrigin{0};
+
+  // Accumulated since the last summary, in the order of the latest frame
+  std::vector<ZoneTotals> m_totals;
+  std::vector<Zone> m_latestZones;
+  size_t m_summaryFrames{0};
+
+  size_t m_traceFrameLimit{0};
+  std::deque<std::vector<Zone>> m_traceFrames;
+
+  Frame &currentFrame() { return m_frames[m_frameIndex % FRAME_LATENCY]; }
+
+  double cpuNow() const {
+    return (SDL_GetPerformanceCounter() - m_cpuOrigin) * 1000.0 /
+           SDL_GetPerformanceFrequency();
+  }
+
+  void resolve(Frame &frame) {
+    for (size_t i{0}; i < frame.zones.size(); ++i) {
+      Zone &zone{frame.zones[i]};
+
+      GLuint64 begin{0};
+      GLuint64 end{0};
+      glGetQueryObjectui64v(frame.queries[2 * i], GL_QUERY_RESULT, &begin);
+      glGetQueryObjectui64v(frame.queries[2 * i + 1], GL_QUERY_RESULT, &end);
+      zone.gpuBegin = (static_cast<GLint64>(begin) - m_gpuOrigin) / 1.0e6;
+      zone.gpuEnd = (static_cast<GLint64>(end) - m_gpuOrigin) / 1.0e6;
+
+      const auto it{std::find_if(
+          m_totals.begin(), m_totals.end(), [&](const ZoneTotals &totals) {
+            return totals.depth == zone.depth && totals.name == zone.name;
+          })};
+      ZoneTotals &totals{it != m_totals.end()
+                             ? *it
+                             : m_totals.emplace_back(ZoneTotals{
+                                   .name = zone.name,
+                                   .depth = zone.depth,
+                                   .count = 0,
+                                   .cpuMilliseconds = 0.0,
+                                   .gpuMilliseconds = 0.0})};
+      ++totals.count;
+      totals.cpuMilliseconds += zone.cpuEnd - zone.cpuBegin;
+      totals.gpuMilliseconds += zone.gpuEnd - zone.gpuBegin;
+    }
+
+    m_latestZones = frame.zones;
+    ++m_summaryFrames;
+
+    if (m_traceFrameLimit > 0) {
+      m_traceFrames.push_back(frame.zones);
+      if (m_traceFrames.size() > m_traceFrameLimit) {
+        m_traceFrames.pop_front();
+      }
+    }
+
+    frame.pending = false;
+  }
+
+public:
+  // Keeps the zones of the last traceFrameLimit frames for writeChromeTrace,
+  // zero disables tracing
+  explicit Profiler(const size_t traceFrameLimit = 0)
+      : m_traceFrameLimit{traceFrameLimit} {
+    // Both clocks start at zero here, so CPU and GPU zones line up in a trace
+    m_cpuOrigin = SDL_GetPerformanceCounter();
+    glGetInteger64v(GL_TIMESTAMP, &m_gpuOrigin);
+  }
+
+  Profiler(const Profiler &) = delete;
+  Profiler &operator=(const Profiler &) = delete;
+
+  ~Profiler() {
+    for (Frame &frame : m_frames) {
+      glDeleteQueries(frame.queries.size(), frame.queries.data());
+    }
+  }
+
+  // Opens the root "frame" zone. The ring slot is read back first if it still
+  // holds a frame from FRAME_LATENCY frames ago.
+  void beginFrame() {
+    Frame &frame{currentFrame()};
+    if (frame.pending) {
+      resolve(frame);
+    }
+    frame.zones.clear();
+
+    beginZone("frame");
+  }
+
+  void endFrame() {
+    endZone(0);
+
+    currentFrame().pending = true;
+    ++m_frameIndex;
+  }
+
+  size_t beginZone(const char *name) {
+    Frame &frame{currentFrame()};
+
+    const size_t index{frame.zones.size()};
+    frame.zones.push_back(Zone{.name = name,
+                               .depth = m_depth++,
+                               .cpuBegin = cpuNow(),
+                               .cpuEnd = 0.0,
+                               .gpuBegin = 0.0,
+                               .gpuEnd = 0.0});
+
+    if (frame.queries.size() < 2 * frame.zones.size()) {
+      const size_t first{frame.queries.size()};
+      frame.queries.resize(2 * frame.zones.size());
+      glGenQueries(frame.queries.size() - first, &frame.queries[first]);
+    }
+
+    glQueryCounter(frame.queries[2 * index], GL_TIMESTAMP);
+
+    return index;
+  }
+
+  void endZone(const size_t index) {
+    Frame &frame{currentFrame()};
+
+    --m_depth;
+    frame.zones[index].cpuEnd = cpuNow();
+
+    glQueryCounter(frame.queries[2 * index + 1], GL_TIMESTAMP);
+  }
+
+  // Read back every frame in flight, waits for the GPU
+  void flush() {
+    for (size_t i{0}; i < FRAME_LATENCY; ++i) {
+      Frame &frame{m_frames[(m_frameIndex + i) % FRAME_LATENCY]};
+      if (frame.pending) {
+        resolve(frame);
+      }
+    }
+  }
+
+  void resetSummary() {
+    m_totals.clear();
+    m_summaryFrames = 0;
+  }
+
+  // GPU milliseconds per frame of a zone over the frames read back since the
+  // last summary, 0 when it didn't run
+  double gpuAverage(const std::string_view name, const int depth) const {
+    const auto it{std::find_if(
+        m_totals.begin(), m_totals.end(), [&](const ZoneTotals &totals) {
+          return totals.depth == depth && totals.name == name;
+        })};
+    if (it == m_totals.end() || m_summaryFrames == 0) {
+      return 0.0;
+    }
+    return it->gpuMilliseconds / m_summaryFrames;
+  }
+
+  // Per zone averages over the frames read back since the last summary
+  void printSummary() {
+    if (m_summaryFrames == 0) {
+      return;
+    }
+
+    std::ostringstream summary;
+    summary.setf(std::ios::fixed);
+    summary.precision(3);
+
+    summary << "Profile over " << m_summaryFrames
+            << " frames, ms per frame (cpu / gpu):\n";
+    const auto sameZone{[](const Zone &zone, const auto &other) {
+      return other.depth == zone.depth && std::string_view{other.name} ==
+                                              zone.name;
+    }};
+
+    for (size_t i{0}; i < m_latestZones.size(); ++i) {
+      const Zone &zone{m_latestZones[i]};
+
+      // Repeated zones, e.g. "objects" in every pass, are listed once
+      const auto end{m_latestZones.begin() + i};
+      if (std::any_of(m_latestZones.begin(), end, [&](const Zone &other) {
+            return sameZone(zone, other);
+          })) {
+        continue;
+      }
+
+      const auto it{std::find_if(
+          m_totals.begin(), m_totals.end(),
+          [&](const ZoneTotals &totals) { return sameZone(zone, totals); })};
+      if (it == m_totals.end()) {
+        continue;
+      }
+
+      summary << std::string(2 + 2 * zone.depth, ' ') << zone.name << ": "
+              << it->cpuMilliseconds / m_summaryFrames << " / "
+              << it->gpuMilliseconds / m_summaryFrames << "\n";
+    }
+
+    std::cout << summary.str();
+
+    resetSummary();
+  }
+
+  // Trace Event Format, open with chrome://tracing or ui.perfetto.dev
+  void writeChromeTrace(const std::string &filePath) const {
+    std::ofstream file{filePath};
+    if (!file.is_open()) {
+      throw std::runtime_error("Failed to open: " + filePath);
+    }
+
+    file.setf(std::ios::fixed);
+    file.precision(3);
+
+    file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+         << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,"
+            "\"args\":{\"name\":\"CPU\"}},\n"
+         << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":1,"
+            "\"args\":{\"name\":\"GPU\"}}";
+
+    for (const std::vector<Zone> &zones : m_traceFrames) {
+      for (const Zone &zone : zones) {
+        // Microseconds
+        file << ",\n{\"name\":\"" << zone.name
+             << "\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":"
+             << zone.cpuBegin * 1000.0
+             << ",\"dur\":" << (zone.cpuEnd - zone.cpuBegin) * 1000.0 << "}";
+        file << ",\n{\"name\":\"" << zone.name
+             << "\",\"ph\":\"X\",\"pid\":0,\"tid\":1,\"ts\":"
+             << zone.gpuBegin * 1000.0
+             << ",\"dur\":" << (zone.gpuEnd - zone.gpuBegin) * 1000.0 << "}";
+      }
+    }
+
+    file << "\n]}\n";
+  }
+};
+
+// Times the enclosing block
+class Scope {
+private:
+  Profiler &m_profiler;
+  size_t m_zone;
+
+public:
+  Scope(Profiler &profiler, const char *name)
+      : m_profiler{profiler}, m_zone{profiler.beginZone(name)} {}
+
+  Scope(const Scope &) = delete;
+  Scope &operator=(const Scope &) = delete;
+
+  ~Scope() { m_profiler.endZone(m_zone); }
+};
+
+} // namespace Profiling
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Scene nodes stored as a structure of arrays, one contiguous array per
+// component, so a pass over 100k nodes touches only the data it needs.
+//
+// A node's parent must exist before the node, so parents always precede their
+// children in the arrays and one forward pass updates the whole hierarchy.
+namespace SceneGraph {
+
+using NodeId = uint32_t;
+
+constexpr NodeId NO_PARENT{std::numeric_limits<NodeId>::max()};
+constexpr NodeId NO_NODE{std::numeric_limits<NodeId>::max()};
+
+// How a node is drawn, a draw list selects the nodes which have all the
+// requested flags
+enum RenderFlags : uint32_t {
+  NONE = 0,
+  // The shared lit fragment shader
+  LIT = 1 << 0,
+  // The lit fragment shader with COMPUTE_CHECKER
+  CHECKER = 1 << 1,
+  // Unlit, e.g. the light source marker
+  EMISSIVE = 1 << 2,
+  SHADOW_CASTER = 1 << 3,
+  DEBUG_NORMALS = 1 << 4,
+  // Moves on its own, its shadow is drawn every frame instead of cached
+  DYNAMIC = 1 << 5,
+};
+
+struct NodeParam {
+  NodeId parent{NO_PARENT};
+  glm::vec3 position{0.0f};
+  glm::quat rotation{glm::identity<glm::quat>()};
+  glm::vec3 scale{1.0f};
+  // Tints the vertex colors of the mesh
+  glm::vec4 color{1.0f};
+  // Group nodes have no mesh, they only transform their children
+  const Mesh *mesh{nullptr};
+  uint32_t flags{NONE};
+};
+
+class Graph {
+private:
+  std::vector<NodeId> m_parents;
+  std::vector<glm::vec3> m_positions;
+  std::vector<glm::quat> m_rotations;
+  std::vector<glm::vec3> m_scales;
+  std::vector<glm::mat4> m_worldMatrices;
+  // Not std::vector<bool>, packed bits are slow to read and write one by one
+  std::vector<uint8_t> m_dirty;
+  bool m_anyDirty{false};
+
+  std::vector<glm::vec4> m_colors;
+  std::vector<const Mesh *> m_meshes;
+  std::vector<uint32_t> m_flags;
+  // Bumped when nodes are added or their mesh or flags change, a draw list
+  // built for the same version is still valid
+  uint64_t m_version{0};
+  // Bumped when world matrices or colors change, instance data packed for the
+  // same version is still valid
+  uint64_t m_instanceVersion{0};
+
+  void markDirty(const NodeId node) {
+    m_dirty[node] = 1;
+    m_anyDirty = true;
+  }
+
+public:
+  void reserve(const size_t count) {
+    m_parents.reserve(count);
+    m_positions.reserve(count);
+    m_rotations.reserve(count);
+    m_scales.reserve(count);
+    m_worldMatrices.reserve(count);
+    m_dirty.reserve(count);
+    m_colors.reserve(count);
+    m_meshes.reserve(count);
+    m_flags.reserve(count);
+  }
+
+  NodeId createNode(const NodeParam &param) {
+    if (param.parent != NO_PARENT && param.parent >= size()) {
+      throw std::runtime_error("Scene node parent does not exist: " +
+                               std::to_string(param.parent));
+    }
+
+    const NodeId node{static_cast<NodeId>(size())};
+
+    m_parents.push_back(param.parent);
+    m_positions.push_back(param.position);
+    m_rotations.push_back(param.rotation);
+    m_scales.push_back(param.scale);
+    m_worldMatrices.push_back(glm::identity<glm::mat4>());
+    m_dirty.push_back(0);
+    m_colors.push_back(param.color);
+    m_meshes.push_back(param.mesh);
+    m_flags.push_back(param.flags);
+
+    markDirty(node);
+    ++m_version;
+
+    return node;
+  }
+
+  size_t size() const { return m_parents.size(); }
+
+  uint64_t version() const { return m_version; }
+
+  uint64_t instanceVersion() const { return m_instanceVersion; }
+
+  void setPosition(const NodeId node, const glm::vec3 &position) {
+    m_positions[node] = position;
+    markDirty(node);
+  }
+
+  void setRotation(const NodeId node, const glm::quat &rotation) {
+    m_rotations[node] = rotation;
+    markDirty(node);
+  }
+
+  void setScale(const NodeId node, const glm::vec3 &scale) {
+    m_scales[node] = scale;
+    markDirty(node);
+  }
+
+  void setColor(const NodeId node, const glm::vec4 &color) {
+    m_colors[node] = color;
+    ++m_instanceVersion;
+  }
+
+  void setFlags(const NodeId node, const uint32_t flags) {
+    m_flags[node] = flags;
+    ++m_version;
+  }
+
+  const glm::vec3 &position(const NodeId node) const {
+    return m_positions[node];
+  }
+
+  const glm::quat &rotation(const NodeId node) const {
+    return m_rotations[node];
+  }
+
+  const glm::vec3 &scale(const NodeId node) const { return m_scales[node]; }
+
+  const glm::vec4 &color(const NodeId node) const { return m_colors[node]; }
+
+  const Mesh *mesh(const NodeId node) const { return m_meshes[node]; }
+
+  uint32_t flags(const NodeId node) const { return m_flags[node]; }
+
+  // Valid after updateWorldMatrices
+  const glm::mat4 &worldMatrix(const NodeId node) const {
+    return m_worldMatrices[node];
+  }
+
+  // Recomputes the world matrix of every changed node and of everything below
+  // it. A clean scene costs a single branch.
+  void updateWorldMatrices() {
+    if (!m_anyDirty) {
+      return;
+    }
+
+    for (size_t node{0}; node < size(); ++node) {
+      const NodeId parent{m_parents[node]};
+      // The parent was visited first, its flag already includes its ancestors
+      if (parent != NO_PARENT && m_dirty[parent]) {
+        m_dirty[node] = 1;
+      }
+      if (!m_dirty[node]) {
+        continue;
+      }
+
+      // TRS rule of thumb
+      // Position = M_Translate * M_Rotate * M_Scale * V_Position
+      const glm::mat4 local{
+          glm::scale(glm::translate(glm::identity<glm::mat4>(),
+                                    m_positions[node]) *
+                         glm::mat4_cast(m_rotations[node]),
+                     m_scales[node])};
+      m_worldMatrices[node] =
+          parent == NO_PARENT ? local : m_worldMatrices[parent] * local;
+    }
+
+    std::fill(m_dirty.begin(), m_dirty.end(), 0);
+    m_anyDirty = false;
+    ++m_instanceVersion;
+  }
+};
+
+struct DrawItem {
+  const Mesh *mesh;
+  NodeId node;
+};
+
+// The nodes a pass draws. Built and culled once per frame, then shared by
+// every pass that draws the same set from the same view, e.g. the lit objects
+// in the depth pre-pass and the shading pass.
+//
+// Nodes which share a mesh are one instanced draw. The model matrix and color
+// of every visible item are packed into an instance buffer, so a draw sets no
+// per-object uniforms. Programs which draw a list need the INSTANCED variant
+// of ShaderSource::vertexShader.
+class DrawList {
+private:
+  // A run of items with the same mesh
+  struct Batch {
+    const Mesh *mesh;
+    size_t firstInstance;
+    GLsizei instanceCount;
+  };
+
+  std::vector<DrawItem> m_items;
+  std::vector<Batch> m_batches;
+  uint32_t m_flags{NONE};
+  uint32_t m_excludedFlags{NONE};
+  uint64_t m_version{std::numeric_limits<uint64_t>::max()};
+
+  // Every item, in the order of m_items
+  std::vector<InstanceData> m_instanceData;
+  // World space bounds of every item, and the tree over them. The tree is
+  // rebuilt when the items change and refit when they only move.
+  std::vector<Geometry::AABB> m_bounds;
+  Geometry::Bvh m_bvh;
+  bool m_rebuildBvh{true};
+  uint64_t m_instanceVersion{std::numeric_limits<uint64_t>::max()};
+  bool m_instancesChanged{true};
+
+  // The visible items, what draw submits
+  std::vector<uint32_t> m_query;
+  std::vector<uint8_t> m_visible;
+  std::vector<uint8_t> m_nextVisible;
+  size_t m_visibleCount{0};
+  std::vector<InstanceData> m_visibleData;
+  std::vector<Batch> m_visibleBatches;
+  InstanceBuffer m_instances;
+  // 0 to drawCalls() - 1, what draw submits
+  std::vector<size_t> m_batchOrder;
+  // Scratch of drawBatches
+  mutable std::vector<MeshArena::DrawCommand> m_arenaCommands;
+  uint64_t m_drawVersion{0};
+  // What batchDepth measured, for m_depthView at m_depthVersion
+  mutable std::vector<float> m_batchDepths;
+  mutable glm::mat4 m_depthView{0.0f};
+  mutable uint64_t m_depthVersion{std::numeric_limits<uint64_t>::max()};
+
+  void collect(const Graph &graph, const uint32_t flags,
+               const uint32_t excludedFlags) {
+    m_items.clear();
+    for (NodeId node{0}; node < graph.size(); ++node) {
+      const Mesh *mesh{graph.mesh(node)};
+      if (mesh != nullptr && (graph.flags(node) & flags) == flags &&
+          (graph.flags(node) & excludedFlags) == 0) {
+        m_items.push_back(DrawItem{.mesh = mesh, .node = node});
+      }
+    }
+
+    std::stable_sort(m_items.begin(), m_items.end(),
+                     [](const DrawItem &a, const DrawItem &b) {
+                       return std::less<const Mesh *>{}(a.mesh, b.mesh);
+                     });
+
+    m_batches.clear();
+    for (size_t i{0}; i < m_items.size(); ++i) {
+      if (m_batches.empty() || m_batches.back().mesh != m_items[i].mesh) {
+        m_batches.push_back(Batch{
+            .mesh = m_items[i].mesh, .firstInstance = i, .instanceCount = 0});
+      }
+      ++m_batches.back().instanceCount;
+    }
+  }
+
+  // Returns whether any item moved or was recolored. The graph's instance
+  // version changes when any node does, most lists don't have that node.
+  bool pack(const Graph &graph) {
+    bool changed{m_rebuildBvh};
+    m_instanceData.resize(m_items.size());
+    m_bounds.resize(m_items.size());
+
+    for (size_t i{0}; i < m_items.size(); ++i) {
+      const glm::mat4 &world{graph.worldMatrix(m_items[i].node)};
+      const InstanceData instance{
+          .model = world,
+          .color = graph.color(m_items[i].node),
+      };
+      if (!m_rebuildBvh &&
+          std::memcmp(&instance, &m_instanceData[i], sizeof(instance)) == 0) {
+        continue;
+      }
+
+      m_instanceData[i] = instance;
+      m_bounds[i] = Geometry::transform(m_items[i].mesh->bounds().box, world);
+      changed = true;
+    }
+
+    if (m_rebuildBvh) {
+      m_bvh.build(m_bounds);
+      m_rebuildBvh = false;
+    } else if (changed) {
+      m_bvh.refit(m_bounds);
+    }
+
+    return changed;
+  }
+
+  // Makes the items in m_query the visible ones. The instances are only
+  // uploaded again when the visible set or the instance data changed.
+  void updateVisible() {
+    m_visibleCount = m_query.size();
+
+    m_nextVisible.assign(m_items.size(), 0);
+    for (const uint32_t item : m_query) {
+      m_nextVisible[item] = 1;
+    }
+    if (!m_instancesChanged && m_nextVisible == m_visible) {
+      return;
+    }
+    std::swap(m_visible, m_nextVisible);
+    m_instancesChanged = false;
+
+    m_visibleData.clear();
+    m_visibleBatches.clear();
+    for (const Batch &batch : m_batches) {
+      const size_t first{m_visibleData.size()};
+      for (size_t i{batch.firstInstance};
+           i < batch.firstInstance + batch.instanceCount; ++i) {
+        if (m_visible[i]) {
+          m_visibleData.push_back(m_instanceData[i]);
+        }
+      }
+
+      const size_t count{m_visibleData.size() - first};
+      if (count > 0) {
+        m_visibleBatches.push_back(
+            Batch{.mesh = batch.mesh,
+                  .firstInstance = first,
+                  .instanceCount = static_cast<GLsizei>(count)});
+      }
+    }
+
+    m_instances.upload(m_visibleData);
+    ++m_drawVersion;
+
+    m_batchOrder.resize(m_visibleBatches.size());
+    std::iota(m_batchOrder.begin(), m_batchOrder.end(), size_t{0});
+  }
+
+public:
+  // Every node with a mesh, all of the flags and none of the excluded ones,
+  // grouped by mesh. The nodes are only rescanned when the graph gained nodes
+  // or changed flags, and repacked when something moved or was recolored.
+  void build(const Graph &graph, const uint32_t flags,
+             const uint32_t excludedFlags = NONE) {
+    if (m_flags != flags || m_excludedFlags != excludedFlags ||
+        m_version != graph.version()) {
+      collect(graph, flags, excludedFlags);
+      m_flags = flags;
+      m_excludedFlags = excludedFlags;
+      m_version = graph.version();
+      m_instanceVersion = std::numeric_limits<uint64_t>::max();
+      m_rebuildBvh = true;
+    }
+
+    if (m_instanceVersion != graph.instanceVersion()) {
+      if (pack(graph)) {
+        m_instancesChanged = true;
+      }
+      m_instanceVersion = graph.instanceVersion();
+    }
+  }
+
+  // Keeps the items whose bounding box intersects the frustum, call after
+  // build and before draw
+  void cull(const Geometry::Frustum &frustum) {
+    m_query.clear();
+    m_bvh.query(frustum, m_query);
+    updateVisible();
+  }
+
+  // Keeps the items whose bounding box intersects the sphere, e.g. a local
+  // light's reach
+  void cull(const Geometry::Sphere &sphere) {
+    m_query.clear();
+    m_bvh.query(sphere, m_query);
+    updateVisible();
+  }
+
+  // The program must be a variant with INSTANCED
+  void draw() const { drawBatches(m_batchOrder); }
+
+  // Some of the drawCalls() batches, in the order of indices, e.g. sorted
+  // by a DrawQueue. A run of batches whose meshes share an arena is one
+  // MeshArena::draw, the others are drawn one by one.
+  void drawBatches(const std::span<const size_t> indices) const {
+    const MeshArena *arena{nullptr};
+    m_arenaCommands.clear();
+
+    for (const size_t index : indices) {
+      const Batch &batch{m_visibleBatches[index]};
+      const Mesh::ArenaRange &range{batch.mesh->arenaRange()};
+      if (arena != nullptr && range.arena != arena) {
+        arena->draw(m_instances, m_arenaCommands);
+        m_arenaCommands.clear();
+      }
+      arena = range.arena;
+
+      if (arena == nullptr) {
+        batch.mesh->attachInstances(m_instances, batch.firstInstance);
+        glDrawElementsInstanced(GL_TRIANGLES, batch.mesh->indicesCount(),
+                                batch.mesh->indexType(), 0,
+                                batch.instanceCount);
+        continue;
+      }
+
+      m_arenaCommands.push_back(MeshArena::DrawCommand{
+          .count = static_cast<GLuint>(batch.mesh->indicesCount()),
+          .instanceCount = static_cast<GLuint>(batch.instanceCount),
+          .firstIndex = range.firstIndex,
+          .baseVertex = range.baseVertex,
+          .baseInstance = static_cast<GLuint>(batch.firstInstance),
+      });
+    }
+
+    if (arena != nullptr) {
+      arena->draw(m_instances, m_arenaCommands);
+    }
+  }
+
+  const Mesh *batchMesh(const size_t index) const {
+    return m_visibleBatches[index].mesh;
+  }
+
+  // View space depth of the batch's nearest instance origin. The instances
+  // are only walked again when the view or the visible set changed, so the
+  // passes of a frame share one walk.
+  float batchDepth(const size_t index, const glm::mat4 &view) const {
+    if (m_depthVersion != m_drawVersion || m_depthView != view) {
+      m_batchDepths.clear();
+      for (const Batch &batch : m_visibleBatches) {
+        float depth{std::numeric_limits<float>::max()};
+        for (size_t i{batch.firstInstance};
+             i < batch.firstInstance + batch.instanceCount; ++i) {
+          depth = std::min(depth, -(view * m_visibleData[i].model[3]).z);
+        }
+        m_batchDepths.push_back(depth);
+      }
+      m_depthView = view;
+      m_depthVersion = m_drawVersion;
+    }
+    return m_batchDepths[index];
+  }
+
+  const std::vector<DrawItem> &items() const { return m_items; }
+
+  // Over the world bounds of the items, primitive i is items()[i]
+  const Geometry::Bvh &bvh() const { return m_bvh; }
+
+  size_t size() const { return m_items.size(); }
+
+  size_t visibleCount() const { return m_visibleCount; }
+
+  size_t culledCount() const { return m_items.size() - m_visibleCount; }
+
+  size_t drawCalls() const { return m_visibleBatches.size(); }
+
+  // Changes whenever draw submits other instances, or moved or recolored ones
+  uint64_t drawVersion() const { return m_drawVersion; }
+};
 
-  std::vector<unsigned int> indices{0, 1, 2, 2, 3, 0};
+} // namespace SceneGraph
 
-  VertexLayout layout;
+/////////////////////////////////////////////////////////////////////////////
 
-  // 3 floats for position, color, normal
-  layout.push<float>(3);
-  layout.push<float>(3);
-  layout.push<float>(3);
+// Light rendering techniques. The main loop owns the shadow and
+// post-processing passes, a technique shades the scene in between. Every
+// technique reads the same shadow map and writes the same color target, so
+// they can be switched at runtime and compared frame for frame.
+namespace Rendering {
 
-  Mesh mesh{vertices, indices, layout};
+// Draws of a pass, issued in the order of a 64 bit key instead of the order
+// they were submitted in. Each batch of a submitted draw list is a command.
+// Commands sort by program, then front to back, so a program is set up once
+// and hidden fragments fail the depth test early. The mesh only breaks ties,
+// switching meshes in an arena is free. Every command is opaque.
+//
+// From the top bit down, with the depth quantized to 24 bits:
+//   unused:12 | program:12 | depth:24 | mesh:16
+//
+// Instances of a batch are drawn in one call, in their own order.
+class DrawQueue {
+public:
+  // Sets the uniforms of a program once it's bound, before its first draw
+  using Setup = std::function<void(const ShaderProgram &)>;
 
-  return mesh;
-}
+private:
+  static constexpr int PROGRAM_BITS{12};
+  static constexpr int MESH_BITS{16};
+  static constexpr int DEPTH_BITS{24};
+
+  struct Command {
+    uint64_t key;
+    const SceneGraph::DrawList *list;
+    size_t batch;
+    uint32_t program;
+  };
 
-using UVMapCallback = std::function<void(const float, const float)>;
+  struct ProgramEntry {
+    const ShaderProgram *program;
+    Setup setup;
+  };
 
-void generateUVMap(const int uSteps, const int vSteps,
-                   const UVMapCallback &callback) {
-  for (int i{0}; i < uSteps; ++i) {
-    for (int j{0}; j < vSteps; ++j) {
-      const float u{static_cast<float>(i) / static_cast<float>(uSteps - 1)};
-      const float v{static_cast<float>(j) / static_cast<float>(vSteps - 1)};
+  std::vector<Command> m_commands;
+  std::vector<Command> m_sorted;
+  std::vector<ProgramEntry> m_programs;
+  std::vector<const Mesh *> m_meshes;
+  // The batches of the run flush is drawing
+  std::vector<size_t> m_batches;
+
+  // Least significant byte first, each pass is a stable counting sort. A
+  // byte which is the same in every key is skipped, e.g. the program bits
+  // of a queue with one program.
+  void sortCommands() {
+    m_sorted.resize(m_commands.size());
+    for (int shift{0}; shift < 64; shift += 8) {
+      std::array<size_t, 256> offsets{};
+      for (const Command &command : m_commands) {
+        ++offsets[(command.key >> shift) & 0xff];
+      }
+      if (std::find(offsets.begin(), offsets.end(), m_commands.size()) !=
+          offsets.end()) {
+        continue;
+      }
 
-      callback(u, v);
+      size_t offset{0};
+      for (size_t &count : offsets) {
+        offset += std::exchange(count, offset);
+      }
+      for (const Command &command : m_commands) {
+        m_sorted[offsets[(command.key >> shift) & 0xff]++] = command;
+      }
+      std::swap(m_commands, m_sorted);
     }
   }
-}
 
-struct UVIndexParam {
-  uint32_t topLeft;
-  uint32_t topRight;
-  uint32_t bottomLeft;
-  uint32_t bottomRight;
-};
+public:
+  // Every visible batch of the list, drawn with program. A program submitted
+  // again keeps its first setup.
+  void submit(const SceneGraph::DrawList &list, const ShaderProgram &program,
+              const Setup &setup = {}) {
+    auto entry{std::find_if(
+        m_programs.begin(), m_programs.end(),
+        [&](const ProgramEntry &other) { return other.program == &program; })};
+    if (entry == m_programs.end()) {
+      entry = m_programs.insert(
+          m_programs.end(), ProgramEntry{.program = &program, .setup = setup});
+    }
+    const uint32_t programIndex{
+        static_cast<uint32_t>(entry - m_programs.begin())};
+    assert(programIndex < (1u << PROGRAM_BITS) && "Too many programs.");
+
+    for (size_t batch{0}; batch < list.drawCalls(); ++batch) {
+      const Mesh *mesh{list.batchMesh(batch)};
+      auto meshEntry{std::find(m_meshes.begin(), m_meshes.end(), mesh)};
+      if (meshEntry == m_meshes.end()) {
+        meshEntry = m_meshes.insert(m_meshes.end(), mesh);
+      }
+      const uint64_t meshIndex{
+          static_cast<uint64_t>(meshEntry - m_meshes.begin())};
+      assert(meshIndex < (1u << MESH_BITS) && "Too many meshes.");
+
+      // The depth is filled in by flush
+      m_commands.push_back(Command{
+          .key = (uint64_t{programIndex} << (DEPTH_BITS + MESH_BITS)) |
+                 meshIndex,
+          .list = &list,
+          .batch = batch,
+          .program = programIndex,
+      });
+    }
+  }
 
-using UVMapIndexCallback = std::function<void(UVIndexParam)>;
+  // Sorts and draws the submitted commands, then empties the queue. Depth is
+  // measured from the view, up to far.
+  void flush(const glm::mat4 &view, const float far) {
+    constexpr uint64_t MAX_DEPTH{(uint64_t{1} << DEPTH_BITS) - 1};
+    for (Command &command : m_commands) {
+      const float depth{command.list->batchDepth(command.batch, view)};
+      const uint64_t quantized{static_cast<uint64_t>(
+          glm::clamp(depth / far, 0.0f, 1.0f) * MAX_DEPTH)};
+      command.key |= quantized << MESH_BITS;
+    }
 
-// NOTE: To wrap the grid, generate 1 more row or column (whichever expects
-// wrapping)
-void generateUVMapIndices(const int uSteps, const int vSteps,
-                          const UVMapIndexCallback &callback) {
-  for (int i{0}; i < uSteps - 1; ++i) {
-    for (int j{0}; j < vSteps - 1; ++j) {
-      const int nextI{(i + 1)};
-      const int nextJ{(j + 1)};
+    sortCommands();
 
-      const uint32_t topLeft{static_cast<uint32_t>(i * vSteps + j)};
-      const uint32_t topRight{static_cast<uint32_t>(i * vSteps + nextJ)};
-      const uint32_t bottomLeft{static_cast<uint32_t>(nextI * vSteps + j)};
-      const uint32_t bottomRight{static_cast<uint32_t>(nextI * vSteps + nextJ)};
+    uint32_t currentProgram{std::numeric_limits<uint32_t>::max()};
+    for (size_t i{0}; i < m_commands.size(); ++i) {
+      const Command &command{m_commands[i]};
+      if (command.program != currentProgram) {
+        const ProgramEntry &entry{m_programs[command.program]};
+        entry.program->use();
+        if (entry.setup) {
+          entry.setup(*entry.program);
+        }
+        currentProgram = command.program;
+      }
 
-      callback({
-          .topLeft = topLeft,
-          .topRight = topRight,
-          .bottomLeft = bottomLeft,
-          .bottomRight = bottomRight,
-      });
+      // A run of batches of one list and program is drawn together
+      m_batches.push_back(command.batch);
+      const Command *next{i + 1 < m_commands.size() ? &m_commands[i + 1]
+                                                    : nullptr};
+      if (next == nullptr || next->list != command.list ||
+          next->program != command.program) {
+        command.list->drawBatches(m_batches);
+        m_batches.clear();
+      }
     }
+
+    m_commands.clear();
+    m_programs.clear();
+    m_meshes.clear();
   }
-}
+};
 
-Vertex generateCylinderVertex(const float u, const float v) {
-  std::vector<Vertex> vertices;
-  const float angle{u * 2.0f * glm::pi<float>()};
-  const float z{v - 0.5f};
+// Per frame values shared by every technique
+struct FrameContext {
+  glm::mat4 view;
+  glm::mat4 projection;
+  float near;
+  float far;
+  glm::vec3 eye;
+  glm::ivec2 screenSize;
+  glm::vec3 lightDirection;
+  const ShadowMapping::Cascades &cascades;
+  // Picks the permutation of the lit programs
+  ShadowMapping::Filter shadowFilter;
+  const std::vector<Lighting::Light> &lights;
+  // Color and depth target of the light pass, read by post-processing
+  GLuint framebuffer;
+  Profiling::Profiler &profiler;
+  // Empty between passes, every pass flushes what it submitted
+  DrawQueue &drawQueue;
+};
 
-  glm::vec3 position{glm::cos(angle), glm::sin(angle), z};
-  const glm::vec3 center{0.0f, 0.0f, z};
-  glm::vec3 normal{glm::normalize(position - center)};
-  glm::vec3 color{1.0f, 1.0f, 1.0f};
+// Geometry owned by main which every technique draws. The lists are
+// instanced, so their programs must be permutations with INSTANCED.
+struct Scene {
+  // Lit objects
+  const SceneGraph::DrawList &objects;
+  // The floor uses its own program variant
+  const SceneGraph::DrawList &floor;
+  // With the bound program
+  std::function<void()> drawScreenQuad;
+};
 
-  return {
-      .pos = std::move(position),
-      .color = std::move(color),
-      .normal = std::move(normal),
-  };
+// Submits the lit objects and the floor with a pair of program variants and
+// draws them sorted
+void drawScene(const Scene &scene, const FrameContext &frame,
+               const ShaderProgram &program,
+               const ShaderProgram &floorProgram,
+               const DrawQueue::Setup &setup = {}) {
+  frame.drawQueue.submit(scene.objects, program, setup);
+  frame.drawQueue.submit(scene.floor, floorProgram, setup);
+
+  const Profiling::Scope scope{frame.profiler, "objects"};
+  frame.drawQueue.flush(frame.view, frame.far);
 }
 
-// TODO: Scaling cylinder length reduces curvature. Allow curvature to be
-// size-relative so stretching does not stretch out the curve.
-// TODO: Allow larger than unit length cylinders.
-Vertex generateWavyCylinderVertex(const float u, const float v) {
-  std::vector<Vertex> vertices;
-  const float angle{u * 2.0f * glm::pi<float>()};
-  const float z{v - 0.5f};
+// Texture buffers read by computeLocalLights
+struct LightBuffers {
+  TextureBuffer data{GL_RGBA32F};
+  TextureBuffer grid{GL_RG32UI};
+  TextureBuffer indices{GL_R32UI};
+  // Views and tiles of the lights in the shadow atlas
+  TextureBuffer shadows{GL_RGBA32F};
+
+  // Texture unit 0 is reserved for color/diffuse, 1 for the shadow map, 5 to
+  // 7 for the deferred G-buffer
+  static constexpr GLuint DATA_UNIT{2};
+  static constexpr GLuint GRID_UNIT{3};
+  static constexpr GLuint INDICES_UNIT{4};
+  static constexpr GLuint SHADOWS_UNIT{8};
+
+  void bind() const {
+    data.bind(DATA_UNIT);
+    grid.bind(GRID_UNIT);
+    indices.bind(INDICES_UNIT);
+    shadows.bind(SHADOWS_UNIT);
+  }
+};
 
-  glm::vec3 position{
-      glm::cos(angle),                                         //
-      glm::sin(z * 2.0f * glm::pi<float>()) + glm::sin(angle), //
-      z                                                        //
-  };
-  // Analytical Partial Derivative of the position parametric function
-  glm::vec3 d_angle{
-      -glm::sin(angle), //
-      glm::cos(angle),  //
-      0.0               //
-  };
-  glm::vec3 d_z{
-      0.0f,                                                            //
-      2.0f * glm::pi<float>() * glm::cos(z * 2.0f * glm::pi<float>()), //
-      1.0f                                                             //
+// Texture units of the shadow map and the local lights' shadow atlas, bound
+// by the main loop
+constexpr GLuint SHADOW_MAP_UNIT{1};
+constexpr GLuint SHADOW_ATLAS_UNIT{9};
+// The shadow map without comparison for PCSS, the moments for VSM and ESM
+constexpr GLuint SHADOW_DEPTH_UNIT{10};
+constexpr GLuint SHADOW_MOMENTS_UNIT{11};
+
+const glm::vec4 CLEAR_COLOR{0.1f, 0.1f, 0.15f, 1.0f};
+
+// The ViewBlock and ShadowBlock of ShaderSource, written once per frame
+// instead of being set on every program. Each frame writes its own third of
+// one uniform buffer, so the GPU can still read the previous two. GL 3.3 has
+// no persistent mapping, so the third is mapped unsynchronized, and a fence
+// of the frame which used it last keeps it from being overwritten early.
+class FrameUniforms {
+private:
+  // std140 layouts
+  struct ViewBlock {
+    glm::mat4 projection;
+    glm::mat4 view;
+    glm::vec3 eyePosition;
+    float padding;
   };
-  glm::vec3 normal{glm::normalize(glm::cross(d_angle, d_z))};
-  glm::vec3 color{1.0f, 1.0f, 1.0f};
 
-  return {
-      .pos = std::move(position),
-      .color = std::move(color),
-      .normal = std::move(normal),
+  struct ShadowBlock {
+    std::array<glm::mat4, ShadowMapping::MAX_CASCADES> cascadeMatrices;
+    glm::vec4 cascadeSplits;
+    glm::vec4 cascadeDepthBias;
+    glm::vec4 cascadeTexelSize;
+    glm::vec3 lightDirection;
+    int32_t cascadeCount;
   };
-}
 
-Vertex generateTorusVertex(const float u, const float v) {
-  const float theta{u * 2.0f * glm::pi<float>()};
-  const float phi{v * 2.0f * glm::pi<float>()};
-  const float z{v - 0.5f};
+  static_assert(sizeof(ViewBlock) == 144);
+  static_assert(sizeof(ShadowBlock) == 320);
 
-  // TODO: Configurable parameters, make radius configurable.
-  const float ringRadius{1.0f};
-  const float torusRadius{4.0f};
+  static constexpr size_t FRAMES{3};
 
-  glm::vec3 position{ringRadius * glm::cos(theta), ringRadius * glm::sin(theta),
-                     0.0f};
-  glm::mat4 model{glm::identity<glm::mat4>()};
-  model = glm::rotate(model, phi, glm::vec3{0.0f, 1.0f, 0.0f});
-  model = glm::translate(model, glm::vec3{torusRadius, 0.0f, 0.0f});
-  position = glm::vec3{model * glm::vec4{position, 1.0f}};
-  const glm::vec3 center{model * glm::vec4{0.0f, 0.0f, 0.0, 1.0f}};
-  glm::vec3 normal{glm::normalize(position - center)};
+  // Blocks of a frame: the camera's view, each cascade's, then the shadow
+  static constexpr size_t CAMERA_BLOCK{0};
+  static constexpr size_t SHADOW_BLOCK{1 + ShadowMapping::MAX_CASCADES};
 
-  glm::vec3 color{1.0f, 1.0f, 1.0f};
+  GLuint m_buffer{0};
+  // Offset of each block in a frame, GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT apart
+  GLsizeiptr m_stride{0};
+  GLsizeiptr m_frameSize{0};
+  std::array<GLsync, FRAMES> m_fences{};
+  size_t m_frame{0};
 
-  return {.pos = std::move(position),
-          .color = std::move(color),
-          .normal = std::move(normal)};
-}
+  GLintptr blockOffset(const size_t block) const {
+    return (m_frame % FRAMES) * m_frameSize + block * m_stride;
+  }
 
-// TODO: Add disc generator
+  template <typename Block>
+  static void write(uint8_t *frame, const GLsizeiptr offset,
+                    const Block &block) {
+    std::memcpy(frame + offset, &block, sizeof(Block));
+  }
 
-using GenerateMeshCallback = std::function<Vertex(const float, const float)>;
+  template <typename Block> void bind(const GLuint binding, size_t block) {
+    glBindBufferRange(GL_UNIFORM_BUFFER, binding, m_buffer, blockOffset(block),
+                      sizeof(Block));
+  }
 
-// TODO: Consider Finite Difference method in case of more geometry
-Mesh generateMesh(const GenerateMeshCallback &callback, const int uSteps = 32,
-                  const int vSteps = 32) {
-  std::vector<Vertex> vertices;
+public:
+  // Uniform block binding points, see ShaderProgram::bindUniformBlock
+  static constexpr GLuint VIEW_BINDING{0};
+  static constexpr GLuint SHADOW_BINDING{1};
+
+  FrameUniforms() {
+    GLint alignment{0};
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    alignment = std::max(alignment, 16);
+    const GLsizeiptr blockSize{
+        std::max(sizeof(ViewBlock), sizeof(ShadowBlock))};
+    m_stride = (blockSize + alignment - 1) / alignment * alignment;
+    m_frameSize = m_stride * (SHADOW_BLOCK + 1);
+
+    glGenBuffers(1, &m_buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
+    glBufferData(GL_UNIFORM_BUFFER, m_frameSize * FRAMES, nullptr,
+                 GL_STREAM_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  }
 
-  const int uCount{uSteps + 1};
+  FrameUniforms(const FrameUniforms &) = delete;
+  FrameUniforms &operator=(const FrameUniforms &) = delete;
 
-  generateUVMap(uCount, vSteps,
-                [&vertices, &callback](const float u, const float v) {
-                  vertices.push_back(callback(u, v));
-                });
+  ~FrameUniforms() {
+    for (const GLsync fence : m_fences) {
+      glDeleteSync(fence);
+    }
+    glDeleteBuffers(1, &m_buffer);
+  }
 
-  std::vector<uint32_t> indices;
+  // Writes the frame's blocks and binds the camera's view and the shadow
+  void upload(const FrameContext &frame) {
+    GLsync &fence{m_fences[m_frame % FRAMES]};
+    if (fence != nullptr) {
+      // Only waits when the GPU is more than two frames behind
+      glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                       std::numeric_limits<GLuint64>::max());
+      glDeleteSync(fence);
+      fence = nullptr;
+    }
 
-  generateUVMapIndices(uCount, vSteps, [&indices](const auto idxParam) {
-    indices.push_back(idxParam.topLeft);
-    indices.push_back(idxParam.topRight);
-    indices.push_back(idxParam.bottomLeft);
-    indices.push_back(idxParam.bottomLeft);
-    indices.push_back(idxParam.topRight);
-    indices.push_back(idxParam.bottomRight);
-  });
+    glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
+    uint8_t *mapped{static_cast<uint8_t *>(glMapBufferRange(
+        GL_UNIFORM_BUFFER, blockOffset(0), m_frameSize,
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT |
+            GL_MAP_UNSYNCHRONIZED_BIT))};
+
+    write(mapped, CAMERA_BLOCK * m_stride,
+          ViewBlock{.projection = frame.projection,
+                    .view = frame.view,
+                    .eyePosition = frame.eye,
+                    .padding = 0.0f});
+
+    const ShadowMapping::Cascades &cascades{frame.cascades};
+    ShadowBlock shadow{.cascadeMatrices = {},
+                       .cascadeSplits = glm::vec4{0.0f},
+                       .cascadeDepthBias = glm::vec4{0.0f},
+                       .cascadeTexelSize = glm::vec4{0.0f},
+                       .lightDirection = frame.lightDirection,
+                       .cascadeCount =
+                           static_cast<int32_t>(cascades.splits.size())};
+    for (size_t i{0}; i < cascades.matrices.size(); ++i) {
+      write(mapped, (CAMERA_BLOCK + 1 + i) * m_stride,
+            ViewBlock{.projection = cascades.matrices[i].projection,
+                      .view = cascades.matrices[i].view,
+                      .eyePosition = frame.eye,
+                      .padding = 0.0f});
+      shadow.cascadeMatrices[i] = cascades.viewProjections[i];
+      shadow.cascadeSplits[i] = cascades.splits[i];
+      shadow.cascadeDepthBias[i] = cascades.depthBiases[i];
+      shadow.cascadeTexelSize[i] = cascades.texelSizes[i];
+    }
+    write(mapped, SHADOW_BLOCK * m_stride, shadow);
 
-  VertexLayout layout;
+    glUnmapBuffer(GL_UNIFORM_BUFFER);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
 
-  layout.push<float>(3);
-  layout.push<float>(3);
-  layout.push<float>(3);
+    bindCameraView();
+    bind<ShadowBlock>(SHADOW_BINDING, SHADOW_BLOCK);
+  }
 
-  return {std::move(vertices), std::move(indices), std::move(layout)};
-}
+  void bindCameraView() { bind<ViewBlock>(VIEW_BINDING, CAMERA_BLOCK); }
 
-std::string loadShaderSource(const std::string &filePath) {
-  std::ifstream file(filePath);
-  if (!file.is_open()) {
-    throw std::runtime_error("Failed to open shader file: " + filePath);
+  // For drawing into the cascade's layer of the shadow map
+  void bindCascadeView(const size_t cascade) {
+    bind<ViewBlock>(VIEW_BINDING, CAMERA_BLOCK + 1 + cascade);
   }
-  std::stringstream buffer;
-  buffer << file.rdbuf();
-  return buffer.str();
-}
 
-enum class ShaderType : GLenum {
-  Vertex = GL_VERTEX_SHADER,
-  Fragment = GL_FRAGMENT_SHADER,
-  Geometry = GL_GEOMETRY_SHADER
+  // After the last command which reads this frame's blocks
+  void endFrame() {
+    m_fences[m_frame % FRAMES] =
+        glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    ++m_frame;
+  }
 };
 
-GLenum shaderTypeToGLenum(ShaderType shaderType) {
-  if (shaderType == ShaderType::Vertex) {
-    return GL_VERTEX_SHADER;
+class RenderTechnique {
+public:
+  virtual ~RenderTechnique() = default;
+
+  virtual const char *name() const = 0;
+
+  // Reallocate the screen sized targets
+  virtual void resize(const glm::ivec2 /*screenSize*/) {}
+
+  // CPU work which runs before the shadow pass, e.g. light binning
+  virtual void prepare(const FrameContext & /*frame*/) {}
+
+  // Shade the scene into frame.framebuffer and leave its depth usable for
+  // the forward drawn debug geometry
+  virtual void lightPass(const FrameContext &frame) = 0;
+
+  // Light binning cost and result size of the last frame
+  virtual float binningMilliseconds() const { return 0.0f; }
+  virtual size_t lightListEntries() const { return 0; }
+};
+
+// Every program permutation, compiled the first time it is requested and
+// kept, so variants which are never drawn cost nothing. The defines go into
+// copies of the ShaderSource stages, the shared sources are never modified.
+class ShaderPermutations {
+private:
+  using Program = ShaderSource::Program;
+
+  // Program in the high half, its features in the low half
+  std::unordered_map<uint64_t, std::unique_ptr<ShaderProgram>> m_programs;
+
+  template <ShaderType Type>
+  static Shader<Type> withDefines(const Shader<Type> &shader,
+                                  const std::vector<std::string> &defines) {
+    Shader<Type> variant{shader};
+    variant.insertDefines(defines);
+    return variant;
   }
-  if (shaderType == ShaderType::Fragment) {
-    return GL_FRAGMENT_SHADER;
+
+  static std::unique_ptr<ShaderProgram>
+  build(const ShaderSource::ProgramStages &stages, const uint32_t features) {
+    const std::vector<std::string> defines{
+        ShaderSource::featureDefines(features)};
+    const Shader<ShaderType::Vertex> vertex{
+        withDefines(*stages.vertex, defines)};
+
+    if (stages.geometry != nullptr && stages.fragment != nullptr) {
+      return std::make_unique<ShaderProgram>(
+          vertex, withDefines(*stages.geometry, defines),
+          withDefines(*stages.fragment, defines));
+    }
+    if (stages.geometry != nullptr) {
+      return std::make_unique<ShaderProgram>(
+          vertex, withDefines(*stages.geometry, defines));
+    }
+    if (stages.fragment != nullptr) {
+      return std::make_unique<ShaderProgram>(
+          vertex, withDefines(*stages.fragment, defines));
+    }
+    return std::make_unique<ShaderProgram>(vertex);
   }
-  if (shaderType == ShaderType::Geometry) {
-    return GL_GEOMETRY_SHADER;
+
+public:
+  ShaderPermutations() = default;
+
+  ShaderPermutations(const ShaderPermutations &) = delete;
+  ShaderPermutations &operator=(const ShaderPermutations &) = delete;
+
+  static uint64_t key(const Program program, const uint32_t features) {
+    const size_t index{static_cast<size_t>(program)};
+    const ShaderSource::ProgramStages &stages{ShaderSource::PROGRAMS[index]};
+    return static_cast<uint64_t>(index) << 32 | stages.required |
+           (features & stages.optional);
   }
 
-  throw std::runtime_error("Received unsupported shader type.");
-}
+  // Compiles the permutation on the first request. The reference stays
+  // valid for the lifetime of this.
+  const ShaderProgram &
+  get(const Program program,
+      const uint32_t features = ShaderSource::NO_FEATURES) {
+    const uint64_t permutation{key(program, features)};
+    if (const auto it{m_programs.find(permutation)}; it != m_programs.end()) {
+      return *it->second;
+    }
 
-class AbstractShader {
-public:
-  virtual ~AbstractShader() = default;
-  virtual AbstractShader &replace(const std::string &, const std::string &) = 0;
-  virtual std::string src() const = 0;
-  virtual ShaderType type() const = 0;
-  virtual AbstractShader &
-  insertDefines(const std::vector<std::string> &defines) = 0;
-  virtual AbstractShader &clearDefines() = 0;
+    const ShaderSource::ProgramStages &stages{
+        ShaderSource::PROGRAMS[static_cast<size_t>(program)]};
+    std::unique_ptr<ShaderProgram> built{
+        build(stages, static_cast<uint32_t>(permutation))};
+    built->bindUniformBlock("ViewBlock", FrameUniforms::VIEW_BINDING);
+    built->bindUniformBlock("ShadowBlock", FrameUniforms::SHADOW_BINDING);
+    return *m_programs.emplace(permutation, std::move(built)).first->second;
+  }
+
+  // Permutations compiled so far
+  size_t size() const { return m_programs.size(); }
 };
 
-template <ShaderType Type> //
-class Shader final : public AbstractShader {
-private:
-  std::string m_src;
+// Features of the lit programs for a frame, the floor adds COMPUTE_CHECKER
+uint32_t litFeatures(const uint32_t lightList, const FrameContext &frame) {
+  return lightList | ShadowMapping::namedFilter(frame.shadowFilter).feature;
+}
 
-  struct DefinesRange {
-    size_t begin{0};
-    size_t length{0};
-    bool valid{false};
-  };
+// Texture units of the shadows and the light data. The directional light
+// itself is in FrameUniforms' ShadowBlock.
+void setLightUniforms(const ShaderProgram &program,
+                      const FrameContext &frame) {
+  program.setUniform("u_lightData"_uniform,
+                     static_cast<int>(LightBuffers::DATA_UNIT));
+  program.setUniform("u_shadowData"_uniform,
+                     static_cast<int>(LightBuffers::SHADOWS_UNIT));
+  program.setUniform("u_shadowAtlas"_uniform,
+                     static_cast<int>(SHADOW_ATLAS_UNIT));
+
+  // VSM and ESM don't read the depth map
+  if (ShadowMapping::usesMoments(frame.shadowFilter)) {
+    program.setUniform("u_shadowMoments"_uniform,
+                       static_cast<int>(SHADOW_MOMENTS_UNIT));
+  } else {
+    program.setUniform("u_shadowMap"_uniform,
+                       static_cast<int>(SHADOW_MAP_UNIT));
+  }
+  if (frame.shadowFilter == ShadowMapping::Filter::PCSS) {
+    program.setUniform("u_shadowDepth"_uniform,
+                       static_cast<int>(SHADOW_DEPTH_UNIT));
+  }
+}
 
-  DefinesRange getDefinesRange() const {
-    const std::string definesBegin{"/*{{defines_begin}}*/"};
-    const std::string definesEnd{"/*{{defines_end}}*/"};
+// Uniforms of the (offset, count) grid and its light index list
+void setLightListUniforms(const ShaderProgram &program) {
+  program.setUniform("u_lightGrid"_uniform,
+                     static_cast<int>(LightBuffers::GRID_UNIT));
+  program.setUniform("u_lightIndices"_uniform,
+                     static_cast<int>(LightBuffers::INDICES_UNIT));
+}
 
-    size_t posBegin{m_src.find(definesBegin)};
-    size_t posEnd{m_src.find(definesEnd)};
+// Draw the lit objects and the floor with a pair of fragment shader variants
+void drawForward(const Scene &scene, const FrameContext &frame,
+                 const ShaderProgram &program,
+                 const ShaderProgram &floorProgram,
+                 const std::function<void(const ShaderProgram &)> &setUniforms) {
+  drawScene(scene, frame, program, floorProgram,
+            [&](const ShaderProgram &litProgram) {
+              setLightUniforms(litProgram, frame);
+              setUniforms(litProgram);
+            });
+}
+
+void clearTarget(const FrameContext &frame) {
+  GLState::bindFramebuffer(GL_FRAMEBUFFER, frame.framebuffer);
+
+  glViewport(0, 0, frame.screenSize.x, frame.screenSize.y);
+
+  glClearColor(CLEAR_COLOR.r, CLEAR_COLOR.g, CLEAR_COLOR.b, CLEAR_COLOR.a);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+}
 
-    if (posBegin != std::string::npos && posEnd != std::string::npos) {
-      size_t contentStart{posBegin + definesBegin.length()};
-      size_t contentLength{posEnd - contentStart};
-      const DefinesRange definesRange{
-          .begin = contentStart, .length = contentLength, .valid = true};
-      return definesRange;
-    }
+// ----
 
-    return DefinesRange{.valid = false};
-  }
+// Every fragment loops over every light, the baseline the culling
+// techniques are measured against
+class ForwardTechnique final : public RenderTechnique {
+private:
+  const Scene &m_scene;
+  ShaderPermutations &m_permutations;
 
 public:
-  Shader(std::string src,
-         const std::unordered_map<std::string, std::string> &replacements = {},
-         const std::vector<std::string> &defines = {})
-      : m_src{std::move(src)} {
-    for (const auto &[key, value] : replacements) {
-      this->replace(key, value);
-    }
-    insertDefines(defines);
+  ForwardTechnique(const Scene &scene, ShaderPermutations &permutations)
+      : m_scene{scene}, m_permutations{permutations} {}
+
+  const char *name() const override { return "forward"; }
+
+  void lightPass(const FrameContext &frame) override {
+    clearTarget(frame);
+
+    const uint32_t features{
+        litFeatures(ShaderSource::FORWARD_SHADING, frame)};
+    const int lightCount{static_cast<int>(frame.lights.size())};
+    drawForward(m_scene, frame,
+                m_permutations.get(ShaderSource::Program::LIT, features),
+                m_permutations.get(ShaderSource::Program::LIT,
+                                   features | ShaderSource::COMPUTE_CHECKER),
+                [&](const ShaderProgram &program) {
+                  program.setUniform("u_lightCount"_uniform, lightCount);
+                });
   }
+};
 
-  Shader &insertDefines(const std::vector<std::string> &defines = {}) override {
-    // TODO: Maybe prevent inserting multiple defines.
-    //
-    // Currently allows inserting multiple defines. It makes adding method to
-    // define a single define and remove it more difficult, as we have to
-    // currently treat every define we want to remove, as if there are multiple
-    // #defines of it.
+// ----
 
-    if (defines.empty()) {
-      return *this;
-    }
+void setClusterUniforms(const ShaderProgram &program,
+                        const FrameContext &frame,
+                        const ClusteredShading::ClusterGrid &clusterGrid) {
+  setLightListUniforms(program);
+  program.setUniform("u_screenSize"_uniform, glm::vec2{frame.screenSize});
+  program.setUniform("u_clusterGrid"_uniform, clusterGrid.dimensions());
+  program.setUniform("u_clusterDepthParams"_uniform, clusterGrid.depthParams());
+}
 
-    const DefinesRange range{getDefinesRange()};
-    if (!range.valid) {
-      return *this;
-    }
+void assignClusterLights(ClusteredShading::ClusterGrid &clusterGrid,
+                         LightBuffers &lightBuffers,
+                         const FrameContext &frame) {
+  clusterGrid.build(frame.projection, frame.near, frame.far);
+  clusterGrid.assignLights(frame.lights, frame.view);
 
-    std::string strDefines{"\n"};
+  lightBuffers.grid.upload(clusterGrid.lightGrid());
+  lightBuffers.indices.upload(clusterGrid.lightIndices());
+}
 
-    for (const auto &value : defines) {
-      strDefines += "#define " + value + "\n";
-    }
+// Forward shading with lights binned into view frustum clusters
+class ClusteredTechnique final : public RenderTechnique {
+private:
+  const Scene &m_scene;
+  LightBuffers &m_lightBuffers;
+  ShaderPermutations &m_permutations;
+  ClusteredShading::ClusterGrid m_clusterGrid;
 
-    m_src.insert(range.begin, strDefines);
+public:
+  ClusteredTechnique(const Scene &scene, LightBuffers &lightBuffers,
+                     ShaderPermutations &permutations, ThreadPool &threadPool)
+      : m_scene{scene}, m_lightBuffers{lightBuffers},
+        m_permutations{permutations}, m_clusterGrid{threadPool} {}
 
-    return *this;
-  }
+  const char *name() const override { return "clustered"; }
 
-  Shader &clearDefines() override {
-    const DefinesRange range{getDefinesRange()};
-    if (range.valid) {
-      m_src.replace(range.begin, range.length, "\n");
-    }
-    return *this;
+  void prepare(const FrameContext &frame) override {
+    assignClusterLights(m_clusterGrid, m_lightBuffers, frame);
   }
 
-  Shader &replace(const std::string &key, const std::string &value) override {
-    const std::string searchKey{"{{" + key + "}}"};
-    size_t pos{0};
-    while ((pos = m_src.find(searchKey, pos)) != std::string::npos) {
-      m_src.replace(pos, searchKey.length(), value);
-      pos += value.length();
-    }
-    return *this;
+  void lightPass(const FrameContext &frame) override {
+    clearTarget(frame);
+
+    const uint32_t features{
+        litFeatures(ShaderSource::CLUSTERED_SHADING, frame)};
+    drawForward(m_scene, frame,
+                m_permutations.get(ShaderSource::Program::LIT, features),
+                m_permutations.get(ShaderSource::Program::LIT,
+                                   features | ShaderSource::COMPUTE_CHECKER),
+                [&](const ShaderProgram &program) {
+                  setClusterUniforms(program, frame, m_clusterGrid);
+                });
   }
 
-  std::string src() const override { return m_src; }
+  float binningMilliseconds() const override {
+    return m_clusterGrid.binningMilliseconds();
+  }
 
-  ShaderType type() const override { return Type; }
+  size_t lightListEntries() const override {
+    return m_clusterGrid.lightIndices().size();
+  }
 };
 
-class ShaderProgram {
-private:
-  GLuint m_id{0};
-  mutable std::unordered_map<std::string, GLint> m_uniformCache;
+// ----
 
-  static GLuint compileShader(const AbstractShader &shader) {
-    GLuint shaderId{glCreateShader(shaderTypeToGLenum(shader.type()))};
+// Geometry pass into a G-buffer, then one full screen lighting pass which
+// reads the clustered light lists
+class DeferredTechnique final : public RenderTechnique {
+private:
+  const Scene &m_scene;
+  LightBuffers &m_lightBuffers;
+  ShaderPermutations &m_permutations;
+  ClusteredShading::ClusterGrid m_clusterGrid;
 
-    const std::string src{shader.src()};
-    const char *asd{src.c_str()};
+  GLuint m_framebufferId{0};
+  GLuint m_positionTextureId{0};
+  GLuint m_normalTextureId{0};
+  GLuint m_albedoTextureId{0};
+  GLuint m_renderbufferId{0};
 
-    glShaderSource(shaderId, 1, &asd, nullptr);
-    glCompileShader(shaderId);
+  static constexpr std::array<GLenum, 3> ATTACHMENTS{
+      GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2};
 
-    GLint success;
-    glGetShaderiv(shaderId, GL_COMPILE_STATUS, &success);
+  // Texture units 5, 6, 7 follow the light culling texture buffers
+  static constexpr GLuint POSITION_UNIT{5};
+  static constexpr GLuint NORMAL_UNIT{6};
+  static constexpr GLuint ALBEDO_UNIT{7};
 
-    if (!success) {
-      char infoLog[512];
-      glGetShaderInfoLog(shaderId, 512, nullptr, infoLog);
-      std::cerr << "Shader compile error:\n" << infoLog << std::endl;
+public:
+  DeferredTechnique(const Scene &scene, LightBuffers &lightBuffers,
+                    ShaderPermutations &permutations, ThreadPool &threadPool,
+                    const glm::ivec2 screenSize)
+      : m_scene{scene}, m_lightBuffers{lightBuffers},
+        m_permutations{permutations}, m_clusterGrid{threadPool} {
+    for (GLuint *textureId :
+         {&m_positionTextureId, &m_normalTextureId, &m_albedoTextureId}) {
+      glGenTextures(1, textureId);
+      GLState::bindTexture(GL_TEXTURE_2D, *textureId);
+      // Lighting pass samples exactly one texel per pixel
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     }
+    GLState::bindTexture(GL_TEXTURE_2D, 0);
 
-    return shaderId;
-  }
+    glGenRenderbuffers(1, &m_renderbufferId);
 
-  static void logLinkStatus(const GLuint shaderProgram,
-                            const std::string &prefix = "") {
-    GLint success;
+    resize(screenSize);
 
-    glGetProgramiv(shaderProgram, GL_LINK_STATUS, &success);
-    if (!success) {
-      char infoLog[512];
-      glGetProgramInfoLog(shaderProgram, 512, nullptr, infoLog);
-      std::cerr << prefix << "Program link error:\n" << infoLog << std::endl;
-    }
-    std::cout << prefix << "Program link success.\n";
-  }
+    glGenFramebuffers(1, &m_framebufferId);
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, m_framebufferId);
 
-  void finalizeProgram(
-      const std::initializer_list<std::reference_wrapper<const AbstractShader>>
-          shaders) {
-    m_id = glCreateProgram();
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                           m_positionTextureId, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D,
+                           m_normalTextureId, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D,
+                           m_albedoTextureId, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
+                              GL_RENDERBUFFER, m_renderbufferId);
 
-    std::vector<GLuint> compiledIds;
+    glDrawBuffers(ATTACHMENTS.size(), ATTACHMENTS.data());
 
-    for (const AbstractShader &shader : shaders) {
-      GLuint id{compileShader(shader)};
-      glAttachShader(m_id, id);
-      compiledIds.push_back(id);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE) {
+      std::cout << "G-Buffer Framebuffer IS COMPLETE.\n";
+    } else {
+      std::cerr << "G-Buffer Framebuffer is NOT complete!\n";
     }
 
-    glLinkProgram(m_id);
-    logLinkStatus(m_id);
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, 0);
+  }
 
-    for (const GLuint id : compiledIds) {
-      // https://gamedev.stackexchange.com/questions/47910/after-a-succesful-gllinkprogram-should-i-delete-detach-my-shaders
-      // https://registry.khronos.org/OpenGL-Refpages/gl4/html/glDetachShader.xhtml
-      glDetachShader(m_id, id);
-      glDeleteShader(id);
+  DeferredTechnique(const DeferredTechnique &) = delete;
+  DeferredTechnique &operator=(const DeferredTechnique &) = delete;
+
+  ~DeferredTechnique() override {
+    GLState::deleteFramebuffer(m_framebufferId);
+    glDeleteRenderbuffers(1, &m_renderbufferId);
+    for (const GLuint textureId :
+         {m_positionTextureId, m_normalTextureId, m_albedoTextureId}) {
+      GLState::deleteTexture(textureId);
     }
   }
 
-  GLint getUniformLocation(const std::string &name) const {
-    if (auto it{m_uniformCache.find(name)}; it != m_uniformCache.end()) {
-      return it->second;
-    }
+  const char *name() const override { return "deferred"; }
+
+  void resize(const glm::ivec2 screenSize) override {
+    // World space positions need full precision, shadows are looked up
+    // with them
+    GLState::bindTexture(GL_TEXTURE_2D, m_positionTextureId);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, screenSize.x, screenSize.y, 0,
+                 GL_RGB, GL_FLOAT, NULL);
+    GLState::bindTexture(GL_TEXTURE_2D, m_normalTextureId);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, screenSize.x, screenSize.y, 0,
+                 GL_RGB, GL_FLOAT, NULL);
+    GLState::bindTexture(GL_TEXTURE_2D, m_albedoTextureId);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, screenSize.x, screenSize.y, 0,
+                 GL_RGB, GL_UNSIGNED_BYTE, NULL);
+    GLState::bindTexture(GL_TEXTURE_2D, 0);
+
+    // Same format as the post-process renderbuffer, so depth can be blitted
+    glBindRenderbuffer(GL_RENDERBUFFER, m_renderbufferId);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, screenSize.x,
+                          screenSize.y);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+  }
 
-    GLint location{glGetUniformLocation(m_id, name.c_str())};
+  void prepare(const FrameContext &frame) override {
+    assignClusterLights(m_clusterGrid, m_lightBuffers, frame);
+  }
 
-    m_uniformCache[name] = location;
+  void lightPass(const FrameContext &frame) override {
+    /* GEOMETRY PASS */
 
-    if (location == -1) {
-      std::cerr << "Warning: Uniform '" << name
-                << "' does not exist or was optimized out." << std::endl;
+    const size_t geometryZone{frame.profiler.beginZone("geometry pass")};
+
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, m_framebufferId);
+
+    glViewport(0, 0, frame.screenSize.x, frame.screenSize.y);
+
+    // Zero normal marks the pixels without geometry
+    const glm::vec4 zero{0.0f};
+    for (GLint i{0}; i < static_cast<GLint>(ATTACHMENTS.size()); ++i) {
+      glClearBufferfv(GL_COLOR, i, glm::value_ptr(zero));
     }
+    glClear(GL_DEPTH_BUFFER_BIT);
 
-    return location;
-  }
+    drawScene(m_scene, frame,
+              m_permutations.get(ShaderSource::Program::G_BUFFER),
+              m_permutations.get(ShaderSource::Program::G_BUFFER,
+                                 ShaderSource::COMPUTE_CHECKER));
 
-public:
-  ShaderProgram(const Shader<ShaderType::Vertex> &vertexShader) {
-    finalizeProgram({vertexShader});
-  }
+    frame.profiler.endZone(geometryZone);
 
-  ShaderProgram(const Shader<ShaderType::Vertex> &vertexShader,
-                const Shader<ShaderType::Fragment> &fragmentShader) {
+    /* DEFERRED LIGHTING PASS */
 
-    finalizeProgram({vertexShader, fragmentShader});
-  }
+    const size_t lightingZone{frame.profiler.beginZone("lighting pass")};
 
-  ShaderProgram(const Shader<ShaderType::Vertex> &vertexShader,
-                const Shader<ShaderType::Geometry> &geometryShader,
-                const Shader<ShaderType::Fragment> &fragmentShader) {
-    finalizeProgram({vertexShader, geometryShader, fragmentShader});
-  }
+    clearTarget(frame);
 
-  ShaderProgram(const ShaderProgram &) = delete;
+    // Lighting runs once per pixel, regardless of the overdraw above
+    GLState::disable(GL_DEPTH_TEST);
 
-  ShaderProgram(ShaderProgram &&other) noexcept : m_id{other.m_id} {
-    other.m_id = 0;
-  }
+    GLState::bindTexture(POSITION_UNIT, GL_TEXTURE_2D, m_positionTextureId);
+    GLState::bindTexture(NORMAL_UNIT, GL_TEXTURE_2D, m_normalTextureId);
+    GLState::bindTexture(ALBEDO_UNIT, GL_TEXTURE_2D, m_albedoTextureId);
 
-  ~ShaderProgram() { glDeleteProgram(m_id); }
+    const ShaderProgram &lightingProgram{m_permutations.get(
+        ShaderSource::Program::DEFERRED_LIGHTING,
+        litFeatures(ShaderSource::CLUSTERED_SHADING, frame))};
+    lightingProgram.use();
 
-  ShaderProgram &operator=(const ShaderProgram &) = delete;
+    setLightUniforms(lightingProgram, frame);
+    setClusterUniforms(lightingProgram, frame, m_clusterGrid);
+    lightingProgram.setUniform("u_gPosition"_uniform,
+                               static_cast<int>(POSITION_UNIT));
+    lightingProgram.setUniform("u_gNormal"_uniform,
+                               static_cast<int>(NORMAL_UNIT));
+    lightingProgram.setUniform("u_gAlbedo"_uniform,
+                               static_cast<int>(ALBEDO_UNIT));
 
-  ShaderProgram &operator=(ShaderProgram &&other) noexcept {
-    if (this != &other) {
-      if (m_id != 0) {
-        glDeleteProgram(m_id);
-      }
-      m_id = other.m_id;
-      other.m_id = 0;
-      return *this;
-    }
-    return *this;
-  }
+    m_scene.drawScreenQuad();
 
-  void use() const { glUseProgram(m_id); }
+    GLState::enable(GL_DEPTH_TEST);
 
-  void unuse() const { glUseProgram(0); }
+    // The forward drawn debug geometry must be hidden by the scene
+    GLState::bindFramebuffer(GL_READ_FRAMEBUFFER, m_framebufferId);
+    GLState::bindFramebuffer(GL_DRAW_FRAMEBUFFER, frame.framebuffer);
+    glBlitFramebuffer(0, 0, frame.screenSize.x, frame.screenSize.y, 0, 0,
+                      frame.screenSize.x, frame.screenSize.y,
+                      GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, frame.framebuffer);
 
-  void setUniform(const std::string &name, int value) const {
-    glUniform1i(getUniformLocation(name), value);
+    frame.profiler.endZone(lightingZone);
   }
 
-  void setUniform(const std::string &name, const glm::vec3 &value) const {
-    glUniform3fv(getUniformLocation(name), 1, glm::value_ptr(value));
+  float binningMilliseconds() const override {
+    return m_clusterGrid.binningMilliseconds();
   }
 
-  void setUniform(const std::string &name, const glm::mat4 &value) const {
-    glUniformMatrix4fv(getUniformLocation(name), 1, GL_FALSE,
-                       glm::value_ptr(value));
+  size_t lightListEntries() const override {
+    return m_clusterGrid.lightIndices().size();
   }
 };
 
-namespace ShaderSource {
-
-// Source for `glsl` in c++ raw string literals: https://open.gl/geometry
-
-const std::string computeShadow{R"glsl(
-float computeShadow(vec4 fragPosLightSpace, vec3 normal, vec3 lightDir, sampler2DShadow shadowMap) {
-  vec3 projCoords = fragPosLightSpace.xyz / fragPosLightSpace.w;
-
-  // Normalize to [0, 1]
-  projCoords = projCoords * 0.5 + 0.5;
-
-  float currentDepth = projCoords.z;
+// ----
 
-  // https://learnopengl.com/Advanced-Lighting/Shadows/Shadow-Mapping
-  float bias = max(0.05 * (1.0 - dot(normal, lightDir)), 0.005);
+// Depth pre-pass, per tile depth bounds reduced on the GPU, lights binned
+// per 16x16 tile on the CPU, then forward shading over the tile's lights
+class ForwardPlusTechnique final : public RenderTechnique {
+private:
+  const Scene &m_scene;
+  LightBuffers &m_lightBuffers;
+  ShaderPermutations &m_permutations;
+  TiledShading::TileGrid m_tileGrid;
 
-  float shadow = 0.0;
+  // Depth pre-pass, a texture so the tile depth bounds can be reduced from it
+  GLuint m_depthFramebufferId{0};
+  GLuint m_depthTextureId{0};
 
-  vec2 texelSize = 1.0 / textureSize(shadowMap, 0);
+  // One (min, max) depth texel per tile
+  GLuint m_boundsFramebufferId{0};
+  GLuint m_boundsTextureId{0};
 
-  for(int x = -1; x <= 1; ++x) {
-    for(int y = -1; y <= 1; ++y) {
-      // The z-component is the reference depth to compare against
-      vec3 UVC = vec3(projCoords.xy + vec2(x, y) * texelSize, currentDepth - bias);
+  std::vector<glm::vec2> m_tileDepthBounds;
 
-      // This returns a smoothly interpolated value between 0.0 and 1.0 automatically
-      shadow += texture(shadowMap, UVC); 
-    }    
+  static glm::ivec2 tileCount(const glm::ivec2 screenSize) {
+    return (screenSize + TiledShading::TILE_SIZE - 1) / TiledShading::TILE_SIZE;
   }
 
-  // Average out the shadow for this pixel
-  shadow /= 9.0;
+public:
+  ForwardPlusTechnique(const Scene &scene, LightBuffers &lightBuffers,
+                       ShaderPermutations &permutations,
+                       ThreadPool &threadPool, const glm::ivec2 screenSize)
+      : m_scene{scene}, m_lightBuffers{lightBuffers},
+        m_permutations{permutations}, m_tileGrid{threadPool} {
+    for (GLuint *textureId : {&m_depthTextureId, &m_boundsTextureId}) {
+      glGenTextures(1, textureId);
+      GLState::bindTexture(GL_TEXTURE_2D, *textureId);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+    GLState::bindTexture(GL_TEXTURE_2D, 0);
 
-  return shadow;
-}
-)glsl"};
+    resize(screenSize);
 
-const std::string computeColor{R"glsl(
-// -----------------------
-// Phong & Lambert shading
+    glGenFramebuffers(1, &m_depthFramebufferId);
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, m_depthFramebufferId);
 
-vec3 computeAmbient(vec3 lightColor) {
-  float ambientStrength = 0.15;
-  vec3 ambient = ambientStrength * lightColor;
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
+                           GL_TEXTURE_2D, m_depthTextureId, 0);
 
-  return ambient;
-}
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
 
-vec3 computeDiffuse(vec3 lightColor, vec3 lightDirection, vec3 normal) {
-  float diffuseIntensity = max(dot(lightDirection, normal), 0.0);
-  vec3 diffuse = diffuseIntensity * lightColor;
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE) {
+      std::cout << "Depth Pre-Pass Framebuffer IS COMPLETE.\n";
+    } else {
+      std::cerr << "Depth Pre-Pass Framebuffer is NOT complete!\n";
+    }
 
-  return diffuse;
-}
+    glGenFramebuffers(1, &m_boundsFramebufferId);
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, m_boundsFramebufferId);
 
-vec3 computeSpecular(vec3 lightColor, vec3 eyeDirection, vec3 lightReflection) {
-  float specularStrength = 0.2;
-  float specularIntensity = pow(max(dot(eyeDirection, lightReflection), 0.0), 128);
-  vec3 specular = specularStrength * specularIntensity * lightColor;
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                           m_boundsTextureId, 0);
 
-  return specular;
-}
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE) {
+      std::cout << "Tile Depth Bounds Framebuffer IS COMPLETE.\n";
+    } else {
+      std::cerr << "Tile Depth Bounds Framebuffer is NOT complete!\n";
+    }
 
-struct LightingComponent {
-  vec3 ambient;
-  vec3 diffuse;
-  vec3 specular;
-};
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, 0);
+  }
 
-vec3 computeFragColor(LightingComponent light, vec3 baseColor, float shadow) {
-  return baseColor * (light.ambient + shadow * (light.diffuse + light.specular));
-}
-)glsl"};
+  ForwardPlusTechnique(const ForwardPlusTechnique &) = delete;
+  ForwardPlusTechnique &operator=(const ForwardPlusTechnique &) = delete;
 
-Shader<ShaderType::Vertex> vertexShader{
-    R"glsl(
-#version 330 core
+  ~ForwardPlusTechnique() override {
+    GLState::deleteFramebuffer(m_depthFramebufferId);
+    GLState::deleteFramebuffer(m_boundsFramebufferId);
+    GLState::deleteTexture(m_depthTextureId);
+    GLState::deleteTexture(m_boundsTextureId);
+  }
 
-/*{{defines_begin}}*/
-/*{{defines_end}}*/
+  const char *name() const override { return "forward+"; }
 
-layout (location = 0) in vec3 aPos;
-layout (location = 1) in vec3 aColor;
-layout (location = 2) in vec3 aNormal;
+  void resize(const glm::ivec2 screenSize) override {
+    // Same format as the post-process renderbuffer, so depth can be blitted
+    GLState::bindTexture(GL_TEXTURE_2D, m_depthTextureId);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, screenSize.x,
+                 screenSize.y, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, NULL);
 
-out vec3 vColor;
-out vec3 vNormal;
-out vec3 vFragPos;
-out vec4 vFragPosLightSpace;
+    const glm::ivec2 tiles{tileCount(screenSize)};
+    GLState::bindTexture(GL_TEXTURE_2D, m_boundsTextureId);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, tiles.x, tiles.y, 0, GL_RG,
+                 GL_FLOAT, NULL);
+    GLState::bindTexture(GL_TEXTURE_2D, 0);
+  }
 
-#ifdef HAS_GEOMETRY_SHADER
-// Does it matter if we output this and we don't have geometry shader in the next stage?
-// Do we have to match VS_OUT and vs_out to be exactly same with different casing?
-out VS_OUT {
-  vec3 worldPos;
-  vec3 vNormal;
-  vec3 vColor;
-} vs_out;
-#endif // HAS_GEOMETRY_SHADER
+  void lightPass(const FrameContext &frame) override {
+    /* DEPTH PRE-PASS */
 
-uniform mat4 u_view;
-uniform mat4 u_projection;
-uniform mat4 u_model;
-uniform mat4 u_lightProjection;
-uniform mat4 u_lightView;
+    const size_t depthZone{frame.profiler.beginZone("depth pre-pass")};
 
-// TODO: Normal, Tangent, Bitangent (Allow us to apply Finite Difference method on any position)
-// We can not do vertex displacement without Tangent, Bitangent, Normal data (to compute new normal)
-//
-// NOTE: We can use GLSL partial derivatives to guess/approximate UV coordinate
-// vec3 dPdx = dFdx(FragPos);
-// vec3 dPdy = dFdy(FragPos);
-// vec2 dUdx = dFdx(vec2(FragPos.x, FragPos.z)); // Guessing a UV
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, m_depthFramebufferId);
 
-void main() {
-  vec4 worldPosition = u_model * vec4(aPos, 1.0);
+    glViewport(0, 0, frame.screenSize.x, frame.screenSize.y);
 
-  gl_Position = u_projection * u_view * worldPosition;
+    glClear(GL_DEPTH_BUFFER_BIT);
 
-  // To make the lighting color math to work, the computation must happen in the same space. We must not mix spaces.
-  vFragPos = vec3(worldPosition);
+    const ShaderProgram &depthProgram{
+        m_permutations.get(ShaderSource::Program::DEPTH)};
+    drawScene(m_scene, frame, depthProgram, depthProgram);
 
-  vColor = aColor;
+    frame.profiler.endZone(depthZone);
+
+    /* TILE DEPTH BOUNDS */
 
-  // Rotate and move normal with the vertex, but prevent scaling from messing
-  // up the normals perpendicularity.
-  vNormal = mat3(transpose(inverse(u_model))) * aNormal;
-  vFragPosLightSpace = u_lightProjection * u_lightView * worldPosition;
+    const size_t boundsZone{frame.profiler.beginZone("tile depth bounds")};
 
-#ifdef HAS_GEOMETRY_SHADER
-  vs_out.worldPos = vec3(worldPosition);
-  // Keep the outputs to keep the compatibility with fragment shader.
-  // Is it fine to access vNormal like this? Since it's marked as 'out'?
-  vs_out.vNormal = vNormal;
-  vs_out.vColor = vColor;
-#endif // HAS_GEOMETRY_SHADER
-}
-)glsl"};
+    const glm::ivec2 tiles{tileCount(frame.screenSize)};
 
-const Shader<ShaderType::Geometry> geometryShader{
-    R"glsl(
-#version 330 core
-layout (triangles) in;
-layout (line_strip, max_vertices = 6) out;
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, m_boundsFramebufferId);
 
-in VS_OUT {
-  vec3 worldPos;
-  vec3 vNormal;
-  vec3 vColor;
-} gs_in[];
+    glViewport(0, 0, tiles.x, tiles.y);
+    GLState::disable(GL_DEPTH_TEST);
 
-out vec3 vColor;
+    GLState::bindTexture(0, GL_TEXTURE_2D, m_depthTextureId);
 
-// It is fine to declare uniforms with the same name, in different shaders.
-uniform mat4 u_view;
-uniform mat4 u_projection;
+    const ShaderProgram &boundsProgram{
+        m_permutations.get(ShaderSource::Program::TILE_DEPTH_BOUNDS)};
+    boundsProgram.use();
 
-// TODO: Make arrows instead of lines.
-void drawLine(int i) {
-  vColor = gs_in[i].vColor;
+    boundsProgram.setUniform("u_depthTexture"_uniform, 0);
+    boundsProgram.setUniform("u_tileSize"_uniform, TiledShading::TILE_SIZE);
 
-  gl_Position = u_projection * u_view * vec4(gs_in[i].worldPos, 1.0);
-  EmitVertex();
+    m_scene.drawScreenQuad();
 
-  vec3 tip = gs_in[i].worldPos + (gs_in[i].vNormal * 1.0);
-  gl_Position = u_projection * u_view * vec4(tip, 1.0);
-  EmitVertex();
+    GLState::bindTexture(GL_TEXTURE_2D, 0);
+    GLState::enable(GL_DEPTH_TEST);
 
-  EndPrimitive();
-}
+    // NOTE: Synchronous, the CPU waits for the pre-pass to finish. The
+    // readback is only tiles.x * tiles.y texels, the stall is the cost of
+    // binning the lights on the CPU.
+    m_tileDepthBounds.resize(static_cast<size_t>(tiles.x) * tiles.y);
+    glReadPixels(0, 0, tiles.x, tiles.y, GL_RG, GL_FLOAT,
+                 m_tileDepthBounds.data());
 
-void main() {
-  // We should already have a normal? among regular input from vertex shader?
-  drawLine(0);
-  drawLine(1);
-  drawLine(2);
-}
-)glsl"};
+    frame.profiler.endZone(boundsZone);
 
-const Shader<ShaderType::Fragment> basicFragmentShader{
-    R"glsl(
-#version 330 core
+    /* LIGHT CULLING */
 
-out vec4 FragColor;
+    const size_t cullingZone{frame.profiler.beginZone("tile light culling")};
 
-in vec3 vColor;
+    m_tileGrid.build(frame.projection, frame.near, frame.far,
+                     frame.screenSize);
+    m_tileGrid.setDepthBounds(m_tileDepthBounds);
+    m_tileGrid.assignLights(frame.lights, frame.view);
 
-void main() {
-  FragColor = vec4(vColor, 1.0);
-}
-)glsl"};
+    m_lightBuffers.grid.upload(m_tileGrid.lightGrid());
+    m_lightBuffers.indices.upload(m_tileGrid.lightIndices());
 
-Shader<ShaderType::Fragment> fragmentShader{
-    R"glsl(
-#version 330 core
+    frame.profiler.endZone(cullingZone);
 
-/*{{defines_begin}}*/
-/*{{defines_end}}*/
+    /* FORWARD+ SHADING */
 
-in vec3 vColor;
-in vec3 vNormal;
-in vec3 vFragPos;
-in vec4 vFragPosLightSpace;
+    const size_t shadingZone{frame.profiler.beginZone("shading")};
 
-out vec4 FragColor;
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, frame.framebuffer);
 
-uniform vec3 u_eyePosition;
-uniform vec3 u_lightDirection;
-uniform sampler2DShadow u_shadowMap;
+    glViewport(0, 0, frame.screenSize.x, frame.screenSize.y);
 
-{{computeShadow}}
+    glClearColor(CLEAR_COLOR.r, CLEAR_COLOR.g, CLEAR_COLOR.b, CLEAR_COLOR.a);
+    glClear(GL_COLOR_BUFFER_BIT);
 
-{{computeColor}}
+    // Reuse the pre-pass depth, hidden fragments are rejected before shading
+    GLState::bindFramebuffer(GL_READ_FRAMEBUFFER, m_depthFramebufferId);
+    GLState::bindFramebuffer(GL_DRAW_FRAMEBUFFER, frame.framebuffer);
+    glBlitFramebuffer(0, 0, frame.screenSize.x, frame.screenSize.y, 0, 0,
+                      frame.screenSize.x, frame.screenSize.y,
+                      GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, frame.framebuffer);
 
-#ifdef COMPUTE_CHECKER
-vec3 computeChecker(vec3 fragPos) {
-  // Make each checker sides 1 unit long
-  vec2 pos = fragPos.xz * 0.5;
+    GLState::depthFunc(GL_LEQUAL);
+    GLState::depthMask(GL_FALSE);
 
-  vec2 f = fract(pos);
+    const uint32_t features{litFeatures(ShaderSource::TILED_SHADING, frame)};
+    drawForward(m_scene, frame,
+                m_permutations.get(ShaderSource::Program::LIT, features),
+                m_permutations.get(ShaderSource::Program::LIT,
+                                   features | ShaderSource::COMPUTE_CHECKER),
+                [&](const ShaderProgram &program) {
+                  setLightListUniforms(program);
+                  program.setUniform("u_tileSize"_uniform,
+                                     TiledShading::TILE_SIZE);
+                  program.setUniform("u_tileCountX"_uniform,
+                                     m_tileGrid.tileCountXY().x);
+                });
 
-  // The step() is faster if (f.x < 0.5) on GPU
-  float sX = step(0.5, f.x);
-  float sY = step(0.5, f.y);
+    GLState::depthMask(GL_TRUE);
+    GLState::depthFunc(GL_LESS);
 
-  // XOR
-  float checker = abs(sX - sY);
+    frame.profiler.endZone(shadingZone);
+  }
 
-  return vec3(checker);
-}
+  float binningMilliseconds() const override {
+    return m_tileGrid.binningMilliseconds();
+  }
 
-vec3 getColor(vec3 fragPos, vec3 color) {
-  return computeChecker(fragPos);
-}
-#else
-vec3 getColor(vec3 fragPos, vec3 color) {
-  return color;
-}
-#endif // COMPUTE_CHECKER
+  size_t lightListEntries() const override {
+    return m_tileGrid.lightIndices().size();
+  }
+};
 
-void main() {
-  vec3 normal = normalize(vNormal);
+} // namespace Rendering
 
-  vec3 lightColor = vec3(1.0, 0.98, 0.9);
+/////////////////////////////////////////////////////////////////////////////
 
-  // From fragment to the directional light source
-  vec3 lightDirection = -u_lightDirection;
-  vec3 lightReflection = reflect(-lightDirection, normal);
-  vec3 eyeDirection = normalize(u_eyePosition - vFragPos);
+// Fixed workload frame timing, so the techniques can be compared on the same
+// content
+namespace Benchmark {
 
-  LightingComponent lightComponent;
-  lightComponent.ambient = computeAmbient(lightColor);
-  lightComponent.diffuse = computeDiffuse(lightColor, lightDirection, normal);
-  lightComponent.specular = computeSpecular(lightColor, eyeDirection, lightReflection);
+// Frames each technique renders before it is timed, lets the driver finish
+// its lazy allocations and the light grids reach their working size
+constexpr int WARMUP_FRAMES{30};
 
-  float shadow = computeShadow(vFragPosLightSpace, normal, lightDirection, u_shadowMap);
+// Lights animate with a fixed step instead of the wall clock, so every
+// technique shades the same light positions on the same frame
+constexpr float FRAME_SECONDS{1.0f / 60.0f};
 
-  vec3 baseColor = getColor(vFragPos, vColor);
+struct CameraPose {
+  glm::vec3 eye;
+  glm::vec3 target;
+};
 
-  vec3 fragmentColor = computeFragColor(lightComponent, baseColor, shadow);
+// One closed loop around the objects, t in [0, 1]. It passes through the
+// dense part of the light field and looks along the floor, so depth
+// complexity and light overlap both change over the path.
+CameraPose cameraPath(const float t) {
+  const float angle{t * 2.0f * glm::pi<float>()};
+  const glm::vec3 center{5.0f, 0.0f, -20.0f};
 
-  FragColor = vec4(fragmentColor, 1.0);
+  return {
+      .eye = center + glm::vec3{28.0f * std::cos(angle),
+                                6.0f + 3.0f * std::sin(2.0f * angle),
+                                24.0f * std::sin(angle)},
+      .target = center + glm::vec3{6.0f * std::sin(angle), 3.0f, 0.0f},
+  };
 }
-)glsl",
-    {{"computeColor", computeColor}, //
-     {"computeShadow", computeShadow}}};
 
-const Shader<ShaderType::Vertex> postProcessingVert{R"glsl(
-#version 330
+struct Percentiles {
+  double mean{0.0};
+  double p50{0.0};
+  double p95{0.0};
+  double p99{0.0};
+};
 
-layout(location = 0) in vec3 aPos;
+// Nearest rank percentiles
+Percentiles computePercentiles(std::vector<double> samples) {
+  if (samples.empty()) {
+    return {};
+  }
 
-out vec2 TexCoords;
+  std::sort(samples.begin(), samples.end());
 
-void main() {
-  gl_Position = vec4(aPos.x, aPos.z, 0.0, 1.0);
-  TexCoords = vec2(aPos.x, aPos.z) * 0.5 + 0.5;
-}
-)glsl"};
+  const auto rank{[&](const double percentile) {
+    const size_t index{static_cast<size_t>(
+        std::ceil(percentile / 100.0 * samples.size()))};
+    return samples[std::clamp<size_t>(index, 1, samples.size()) - 1];
+  }};
 
-const Shader<ShaderType::Fragment> postProcessingFrag{R"glsl(
-#version 330
+  double sum{0.0};
+  for (const double sample : samples) {
+    sum += sample;
+  }
 
-out vec4 FragColor;
+  return {
+      .mean = sum / samples.size(),
+      .p50 = rank(50.0),
+      .p95 = rank(95.0),
+      .p99 = rank(99.0),
+  };
+}
 
-in vec2 TexCoords;
+// GPU time of whole frames through GL_TIME_ELAPSED queries. Results arrive a
+// few frames late, a small ring of queries keeps the CPU from waiting on them.
+class GpuFrameTimer {
+private:
+  static constexpr size_t QUERY_COUNT{4};
 
-uniform sampler2D u_screenTexture;
+  std::array<GLuint, QUERY_COUNT> m_queries{};
+  // Frames issued and frames read back, both only grow
+  size_t m_issued{0};
+  size_t m_collected{0};
 
-void main() {
-  vec3 color = texture(u_screenTexture, TexCoords).rgb;
+  std::vector<double> m_milliseconds;
 
-  // Fade the pixels the further we are from the center of the screen
-  float dist = distance(TexCoords, vec2(0.5, 0.5));
-  float vignette = smoothstep(1.0, 0.2, dist);
+  void readOldest() {
+    GLuint64 nanoseconds{0};
+    glGetQueryObjectui64v(m_queries[m_collected % QUERY_COUNT],
+                          GL_QUERY_RESULT, &nanoseconds);
+    m_milliseconds.push_back(nanoseconds / 1.0e6);
+    ++m_collected;
+  }
 
-  color *= vignette;
+public:
+  GpuFrameTimer() { glGenQueries(m_queries.size(), m_queries.data()); }
 
-  FragColor = vec4(color, 1.0);
-}
-)glsl"};
+  GpuFrameTimer(const GpuFrameTimer &) = delete;
+  GpuFrameTimer &operator=(const GpuFrameTimer &) = delete;
 
-} // namespace ShaderSource
+  ~GpuFrameTimer() { glDeleteQueries(m_queries.size(), m_queries.data()); }
 
-// TODO: Render a plane and use calculus to make it more interesting. Procedural
-// terrain generation?
+  // Waits for the oldest query only when all of them are still in flight
+  void begin() {
+    if (m_issued - m_collected == QUERY_COUNT) {
+      readOldest();
+    }
+    glBeginQuery(GL_TIME_ELAPSED, m_queries[m_issued % QUERY_COUNT]);
+  }
 
-// TODO: Render a pipe in a sinus & cosinus shape. Remove the dead code which
-// used to render sinus wave.
+  void end() {
+    glEndQuery(GL_TIME_ELAPSED);
+    ++m_issued;
+  }
 
-namespace ShadowMapping {
+  // Read back the results which are ready without waiting
+  void collect() {
+    while (m_collected < m_issued) {
+      GLint available{0};
+      glGetQueryObjectiv(m_queries[m_collected % QUERY_COUNT],
+                         GL_QUERY_RESULT_AVAILABLE, &available);
+      if (!available) {
+        return;
+      }
+      readOldest();
+    }
+  }
 
-struct LightMatrix {
-  glm::mat4 view;
-  glm::mat4 projection;
+  // Wait for every query in flight, e.g. before the technique changes
+  void flush() {
+    while (m_collected < m_issued) {
+      readOldest();
+    }
+  }
+
+  // Frame times read back since the last call, in issue order
+  std::vector<double> takeMilliseconds() {
+    return std::exchange(m_milliseconds, {});
+  }
 };
 
-struct CreateLightMatrixParam {
-  glm::mat4 projectionMatrix;
-  glm::mat4 viewMatrix;
-  glm::vec3 worldUp;
-  glm::vec3 lightDirection;
+struct TechniqueResult {
+  std::string scene;
+  std::string name;
+  // ShadowMapping::FILTERS name
+  std::string shadowFilter;
+  std::vector<double> cpuMilliseconds;
+  std::vector<double> gpuMilliseconds;
+  // Mean GPU time of the shadow and light pass profiler zones
+  double shadowPassMilliseconds{0.0};
+  double lightPassMilliseconds{0.0};
+  // Wall clock time of the timed frames, swaps included
+  double seconds{0.0};
 };
 
-// TODO: Split into two functions lightViewMatrix & lightProjectionMatrix
-LightMatrix createLightMatrix(const CreateLightMatrixParam &param) {
-  const auto &projectionMatrix{param.projectionMatrix};
-  const auto &viewMatrix{param.viewMatrix};
-  const auto &worldUp{param.worldUp};
-  const auto &lightDirection{param.lightDirection};
+void printReport(const std::vector<TechniqueResult> &results) {
+  std::ostringstream report;
+  report.setf(std::ios::fixed);
+  report.precision(3);
+
+  report << "\nBenchmark, frame times in ms (mean / p50 / p95 / p99)\n";
+  for (const TechniqueResult &result : results) {
+    const Percentiles cpu{computePercentiles(result.cpuMilliseconds)};
+    const Percentiles gpu{computePercentiles(result.gpuMilliseconds)};
+
+    report << "  " << result.scene << " / " << result.name << " / "
+           << result.shadowFilter << ", " << result.cpuMilliseconds.size()
+           << " frames, "
+           << (result.seconds > 0.0
+                   ? result.cpuMilliseconds.size() / result.seconds
+                   : 0.0)
+           << " fps\n"
+           << "    cpu: " << cpu.mean << " / " << cpu.p50 << " / " << cpu.p95
+           << " / " << cpu.p99 << "\n"
+           << "    gpu: " << gpu.mean << " / " << gpu.p50 << " / " << gpu.p95
+           << " / " << gpu.p99 << "\n"
+           << "    gpu shadow pass: " << result.shadowPassMilliseconds
+           << ", light pass: " << result.lightPassMilliseconds << "\n";
+  }
 
-  if (glm::abs(glm::dot(lightDirection, worldUp)) >= 0.9999f) {
-    throw std::runtime_error(
-        "Light direction and world up must not be parallel.");
+  std::cout << report.str();
+}
+
+// Light layouts the suite runs every technique over. The default scene is the
+// interactive one.
+struct NamedScene {
+  const char *name;
+  Lighting::GenerateLightsParam lights;
+};
+
+const std::array<NamedScene, 3> SCENES{{
+    {.name = "default",
+     .lights = {.count = 1024,
+                .minBound = glm::vec3{-40.0f, 0.5f, -60.0f},
+                .maxBound = glm::vec3{40.0f, 6.0f, 10.0f},
+                .minRadius = 2.0f,
+                .maxRadius = 6.0f,
+                .spotLightStride = 8,
+                .seed = 1337}},
+    // Few large lights, long light lists per cell but little binning work
+    {.name = "sparse",
+     .lights = {.count = 128,
+                .minBound = glm::vec3{-40.0f, 0.5f, -60.0f},
+                .maxBound = glm::vec3{40.0f, 6.0f, 10.0f},
+                .minRadius = 6.0f,
+                .maxRadius = 12.0f,
+                .spotLightStride = 4,
+                .seed = 7}},
+    // Many small lights, binning dominates
+    {.name = "dense",
+     .lights = {.count = 4096,
+                .minBound = glm::vec3{-40.0f, 0.5f, -60.0f},
+                .maxBound = glm::vec3{40.0f, 6.0f, 10.0f},
+                .minRadius = 1.0f,
+                .maxRadius = 3.0f,
+                .spotLightStride = 8,
+                .seed = 4242}},
+}};
+
+void writeJson(const std::string &filePath,
+               const std::vector<TechniqueResult> &results) {
+  std::ofstream file{filePath};
+  if (!file.is_open()) {
+    throw std::runtime_error("Failed to open: " + filePath);
   }
 
-  auto cameraInverse{glm::inverse(projectionMatrix * viewMatrix)};
-  std::vector<glm::vec3> corners;
+  file.setf(std::ios::fixed);
+  file.precision(4);
+
+  const auto writePercentiles{[&](const Percentiles &percentiles) {
+    file << "{\"mean\": " << percentiles.mean << ", \"p50\": "
+         << percentiles.p50 << ", \"p95\": " << percentiles.p95
+         << ", \"p99\": " << percentiles.p99 << "}";
+  }};
 
-  // Collect corner points
-  for (float x = 0.0f; x < 2.0f; ++x) {
-    for (float y = 0.0f; y < 2.0f; ++y) {
-      for (float z = 0.0f; z < 2.0f; ++z) {
-        const float xPos{2 * x - 1};
-        const float yPos{2 * y - 1};
-        const float zPos{2 * z - 1};
+  file << "{\n  \"results\": [";
+  for (size_t i{0}; i < results.size(); ++i) {
+    const TechniqueResult &result{results[i]};
+
+    file << (i == 0 ? "\n" : ",\n") << "    {\"scene\": \"" << result.scene
+         << "\", \"technique\": \"" << result.name
+         << "\", \"shadowFilter\": \"" << result.shadowFilter
+         << "\", \"frames\": " << result.cpuMilliseconds.size()
+         << ", \"fps\": "
+         << (result.seconds > 0.0
+                 ? result.cpuMilliseconds.size() / result.seconds
+                 : 0.0)
+         << ",\n     \"cpu\": ";
+    writePercentiles(computePercentiles(result.cpuMilliseconds));
+    file << ",\n     \"gpu\": ";
+    writePercentiles(computePercentiles(result.gpuMilliseconds));
+    file << ",\n     \"shadowPassGpu\": " << result.shadowPassMilliseconds
+         << ", \"lightPassGpu\": " << result.lightPassMilliseconds << "}";
+  }
+  file << "\n  ]\n}\n";
+}
 
-        glm::vec4 pt{cameraInverse * glm::vec4{xPos, yPos, zPos, 1.0f}};
-        // Todo: Derive mathematically on paper
-        corners.push_back(glm::vec3(pt / pt.w));
+// Just enough JSON to read back what writeJson wrote
+struct JsonValue {
+  enum class Type { Null, Boolean, Number, String, Array, Object };
+
+  Type type{Type::Null};
+  double number{0.0};
+  std::string string;
+  std::vector<JsonValue> array;
+  std::vector<std::pair<std::string, JsonValue>> object;
+
+  // Member of an object, Null when missing
+  const JsonValue &operator[](const std::string_view key) const {
+    static const JsonValue null{};
+    for (const auto &[name, value] : object) {
+      if (name == key) {
+        return value;
       }
     }
+    return null;
   }
+};
 
-  // Find frustum center
-  glm::vec3 center{0.0f};
-  // Note: Centroid formula, a center of a mass
-  for (const auto &corner : corners) {
-    center += corner;
+class JsonParser {
+private:
+  const std::string &m_text;
+  size_t m_position{0};
+
+  [[noreturn]] void fail(const std::string &message) const {
+    throw std::runtime_error("JSON: " + message + " at offset " +
+                             std::to_string(m_position));
   }
-  center /= corners.size();
 
-  // TODO: (BUG) A far object outside this frustum, which blocks the light
-  // vector, will be excluded from shadow mapping computation, because it's not
-  // in the frustum. However we also can't make the frustum infinitely large
-  // because of the computation cost. There MUST be a better way.
-  //
-  // Find the largest enclosing radius as light position distance
-  //
-  // Note: This is required to precisely illuminate visible area in the frustum.
-  float radius{0.0f};
-  for (const auto &corner : corners) {
-    radius = glm::max(radius, glm::length(corner - center));
+  void skipWhitespace() {
+    while (m_position < m_text.size() &&
+           std::isspace(static_cast<unsigned char>(m_text[m_position]))) {
+      ++m_position;
+    }
   }
-  glm::vec3 position{center - radius * lightDirection};
 
-  // The light position and orientation matrix
-  glm::mat4 lightView{glm::lookAt(position, center, worldUp)};
-
-  // Move the frustum corners into light space before creating ortho
-  // projection
-  std::vector<glm::vec3> lightSpaceCorners(corners.size());
-  std::transform(corners.begin(), corners.end(), lightSpaceCorners.begin(),
-                 [&lightView](const glm::vec3 &corner) {
-                   return glm::vec3{lightView * glm::vec4(corner, 1.0f)};
-                 });
+  void expect(const char c) {
+    skipWhitespace();
+    if (m_position >= m_text.size() || m_text[m_position] != c) {
+      fail(std::string{"expected '"} + c + "'");
+    }
+    ++m_position;
+  }
 
-  // Get the ortho projection bounds
-  // Note: If shadows jitter due to subpixel changes in minBound & maxBound, try
-  // using spherical bounding box.
-  // Note: Intentionally does not include the bounding box adjustment for
-  // object right behind camera to cast the shadows.
-  // Collect minimum and maximum component-wise bounds.
-  glm::vec3 minBound{lightSpaceCorners.at(0)};
-  glm::vec3 maxBound{lightSpaceCorners.at(0)};
-  for (const auto &corner : lightSpaceCorners) {
-    minBound = glm::min(minBound, corner);
-    maxBound = glm::max(maxBound, corner);
+  bool consume(const char c) {
+    skipWhitespace();
+    if (m_position < m_text.size() && m_text[m_position] == c) {
+      ++m_position;
+      return true;
+    }
+    return false;
   }
-  // Looking down the -z axis, adjust to positive values.
-  const float near{-maxBound.z};
-  const float far{-minBound.z};
 
-  glm::mat4 lightProjection{
-      glm::ortho(minBound.x, maxBound.x, minBound.y, maxBound.y, near, far)};
+  std::string parseString() {
+    expect('"');
+    std::string result;
+    while (m_position < m_text.size() && m_text[m_position] != '"') {
+      // Escapes are kept as the escaped character, no \u support
+      if (m_text[m_position] == '\\') {
+        ++m_position;
+      }
+      result += m_text[m_position++];
+    }
+    expect('"');
+    return result;
+  }
 
-  return {.view = lightView, .projection = lightProjection};
-}
-} // namespace ShadowMapping
+public:
+  explicit JsonParser(const std::string &text) : m_text{text} {}
 
-class Camera {
-private:
-  // TODO: Add a way to keep multiple cameras. One which has ability to
-  // rotated freely, and another one with constrained pitch.
-  // TODO: Consider adding camera not capable of flying around.
+  JsonValue parse() {
+    skipWhitespace();
+    if (m_position >= m_text.size()) {
+      fail("unexpected end");
+    }
 
-  glm::vec3 m_forward;
-  glm::vec3 m_right;
-  glm::vec3 m_up;
+    JsonValue value;
+    const char c{m_text[m_position]};
+
+    if (c == '{') {
+      value.type = JsonValue::Type::Object;
+      expect('{');
+      if (!consume('}')) {
+        do {
+          std::string key{parseString()};
+          expect(':');
+          value.object.emplace_back(std::move(key), parse());
+        } while (consume(','));
+        expect('}');
+      }
+    } else if (c == '[') {
+      value.type = JsonValue::Type::Array;
+      expect('[');
+      if (!consume(']')) {
+        do {
+          value.array.push_back(parse());
+        } while (consume(','));
+        expect(']');
+      }
+    } else if (c == '"') {
+      value.type = JsonValue::Type::String;
+      value.string = parseString();
+    } else if (m_text.compare(m_position, 4, "true") == 0 ||
+               m_text.compare(m_position, 5, "false") == 0) {
+      value.type = JsonValue::Type::Boolean;
+      value.number = c == 't' ? 1.0 : 0.0;
+      m_position += c == 't' ? 4 : 5;
+    } else if (m_text.compare(m_position, 4, "null") == 0) {
+      m_position += 4;
+    } else {
+      const char *begin{m_text.c_str() + m_position};
+      char *end{nullptr};
+      value.type = JsonValue::Type::Number;
+      value.number = std::strtod(begin, &end);
+      if (end == begin) {
+        fail("unexpected character");
+      }
+      m_position += end - begin;
+    }
 
-  glm::vec3 m_eye;
+    return value;
+  }
+};
 
-public:
-  Camera()
-      : m_forward{glm::vec3{0.0f, 0.0f, -1.0f}}, //
-        m_right{glm::vec3{1.0f, 0.0f, 0.0f}},    //
-        m_up{glm::vec3{0.0f, 1.0f, 0.0f}},       //
-        m_eye{glm::vec3(0.0f, 0.0f, 0.0f)}       //
+// Flags every mean and p95, CPU and GPU, which got slower than the baseline by
+// more than thresholdPercent. Pairs missing from the baseline are reported and
+// skipped. Returns false on any regression.
+bool compareWithBaseline(const std::vector<TechniqueResult> &results,
+                         const std::string &baselinePath,
+                         const double thresholdPercent) {
+  std::ifstream file{baselinePath};
+  if (!file.is_open()) {
+    throw std::runtime_error("Failed to open: " + baselinePath);
+  }
+  std::stringstream text;
+  text << file.rdbuf();
+
+  const JsonValue baseline{JsonParser{text.str()}.parse()};
+
+  std::ostringstream report;
+  report.setf(std::ios::fixed);
+  report.precision(3);
+
+  report << "\nBaseline " << baselinePath << ", threshold +"
+         << thresholdPercent << "%\n";
+
+  bool passed{true};
+
+  for (const TechniqueResult &result : results) {
+    const auto &entries{baseline["results"].array};
+    const auto entry{
+        std::find_if(entries.begin(), entries.end(), [&](const JsonValue &e) {
+          // Baselines from before the filters were selectable used PCF
+          const std::string_view shadowFilter{
+              e["shadowFilter"].type == JsonValue::Type::Null
+                  ? "pcf"
+                  : e["shadowFilter"].string};
+          return e["scene"].string == result.scene &&
+                 e["technique"].string == result.name &&
+                 shadowFilter == result.shadowFilter;
+        })};
+
+    report << "  " << result.scene << " / " << result.name << " / "
+           << result.shadowFilter;
+    if (entry == entries.end()) {
+      report << ": not in baseline\n";
+      continue;
+    }
+    report << "\n";
+
+    const Percentiles cpu{computePercentiles(result.cpuMilliseconds)};
+    const Percentiles gpu{computePercentiles(result.gpuMilliseconds)};
+
+    const std::array<std::tuple<const char *, const char *, double>, 4>
+        metrics{{{"cpu", "mean", cpu.mean},
+                 {"cpu", "p95", cpu.p95},
+                 {"gpu", "mean", gpu.mean},
+                 {"gpu", "p95", gpu.p95}}};
+
+    for (const auto &[clock, statistic, current] : metrics) {
+      const double previous{(*entry)[clock][statistic].number};
+      const double change{previous > 0.0
+                              ? (current - previous) / previous * 100.0
+                              : 0.0};
+      const bool regressed{change > thresholdPercent};
+      passed = passed && !regressed;
+
+      report << "    " << clock << " " << statistic << ": " << previous
+             << " -> " << current << " ms (" << (change >= 0.0 ? "+" : "")
+             << change << "%)" << (regressed ? " REGRESSION" : "") << "\n";
+    }
+  }
 
-  {}
+  report << (passed ? "PASSED\n" : "FAILED\n");
+  std::cout << report.str();
 
-  Camera(glm::vec3 eye)
-      : m_forward{glm::vec3{0.0f, 0.0f, -1.0f}}, //
-        m_right{glm::vec3{1.0f, 0.0f, 0.0f}},    //
-        m_up{glm::vec3{0.0f, 1.0f, 0.0f}},       //
-        m_eye{std::move(eye)}                    //
-  {}
+  return passed;
+}
 
-  Camera(glm::vec3 forward, glm::vec3 right, glm::vec3 up, glm::vec3 eye)
-      : m_forward{std::move(forward)}, //
-        m_right{std::move(right)},     //
-        m_up{std::move(up)},           //
-        m_eye{std::move(eye)}          //
-  {}
+// Binary PPM of a bottom-up RGB framebuffer read, e.g. for golden image
+// comparisons
+void writePPM(const std::string &filePath, const int width, const int height,
+              const std::vector<unsigned char> &pixels) {
+  std::ofstream file{filePath, std::ios::binary};
+  if (!file.is_open()) {
+    throw std::runtime_error("Failed to open: " + filePath);
+  }
+
+  file << "P6\n" << width << " " << height << "\n255\n";
+
+  const size_t rowSize{static_cast<size_t>(width) * 3};
+  for (int y{height - 1}; y >= 0; --y) {
+    file.write(reinterpret_cast<const char *>(&pixels[y * rowSize]), rowSize);
+  }
+}
+
+// Queries per second of every batch kernel at every SIMD width the CPU runs,
+// over random primitives in a 200 unit cube. Returns false when a width
+// disagrees with the scalar kernel.
+bool runGeometryBenchmark(const size_t count = size_t{1} << 20) {
+  std::mt19937 generator{2024};
+  std::uniform_real_distribution<float> coordinate{-100.0f, 100.0f};
+  std::uniform_real_distribution<float> extent{0.5f, 4.0f};
+
+  Geometry::AABBBatch boxes;
+  boxes.resize(count);
+  for (size_t i{0}; i < count; ++i) {
+    const glm::vec3 center{coordinate(generator), coordinate(generator),
+                           coordinate(generator)};
+    const float size{extent(generator)};
+    boxes.set(i, Geometry::AABB{.min = center - size, .max = center + size});
+  }
+
+  const Geometry::Frustum frustum{Geometry::extractFrustum(
+      glm::perspective(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, 100.0f) *
+      glm::lookAt(glm::vec3{0.0f}, glm::vec3{0.0f, 0.0f, -1.0f},
+                  glm::vec3{0.0f, 1.0f, 0.0f}))};
+  const Geometry::Sphere sphere{.center = glm::vec3{0.0f}, .radius = 20.0f};
+  const Geometry::Ray ray{.origin = glm::vec3{-100.0f},
+                          .direction = glm::vec3{1.0f, 0.9f, 1.1f}};
+
+  std::vector<Geometry::SimdWidth> widths{Geometry::SimdWidth::SCALAR};
+  if (Geometry::bestSimdWidth() != Geometry::SimdWidth::SCALAR) {
+    widths.push_back(Geometry::SimdWidth::SSE);
+  }
+  if (Geometry::bestSimdWidth() == Geometry::SimdWidth::AVX) {
+    widths.push_back(Geometry::SimdWidth::AVX);
+  }
 
-  void update(const float pitch, const float yaw, const glm::vec3 &worldUp) {
-    // NOTE: The forward direction vector is derived by the following linear
-    // algebra multiplication, where +x is right, and -z is front:
-    // Ry(pitch)*Rx(yaw)*Vec(0,0,-1)
-    // The logic belows essentially implements exactly that for front
-    // vector.
+  std::ostringstream report;
+  report.setf(std::ios::fixed);
+  report.precision(1);
+  report << "Geometry queries, " << count
+         << " primitives, million tests per second\n";
+
+  bool agree{true};
+
+  // Repeats the kernel for at least a quarter second
+  const auto measure{[&](const char *name, auto &&kernel, auto &output) {
+    auto reference{output};
+    double scalarRate{0.0};
+
+    for (const Geometry::SimdWidth width : widths) {
+      size_t hitCount{kernel(width)};
+
+      size_t repeats{0};
+      const Uint64 begin{SDL_GetPerformanceCounter()};
+      double seconds{0.0};
+      do {
+        hitCount = kernel(width);
+        ++repeats;
+        seconds = static_cast<double>(SDL_GetPerformanceCounter() - begin) /
+                  SDL_GetPerformanceFrequency();
+      } while (seconds < 0.25);
+
+      const double rate{repeats * count / seconds / 1.0e6};
+      if (width == Geometry::SimdWidth::SCALAR) {
+        scalarRate = rate;
+        reference = output;
+      }
 
-    // NOTE: The camera is always orinted relative to static world up, right
-    // and forward vectors. That way we use absolute yaw and pitch instead
-    // of delta values.
+      const bool matches{output == reference};
+      agree = agree && matches;
 
-    glm::vec3 forward{0.0f, 0.0f, -1.0f};
-    const glm::vec3 right{1.0f, 0.0f, 0.0f};
+      report << "  " << name << ", " << static_cast<int>(width)
+             << " wide: " << rate << " (x" << rate / scalarRate << "), "
+             << hitCount << " hits" << (matches ? "" : ", MISMATCH") << "\n";
+    }
+  }};
 
-    forward = glm::rotate(forward, pitch, right);
-    // TODO: Figure out if i should keep -yaw here, or should this method
-    // receive -yaw
-    forward = glm::rotate(forward, yaw, worldUp);
+  std::vector<uint8_t> hits(count);
+  std::vector<float> distances(count);
+
+  measure(
+      "frustum / boxes",
+      [&](const Geometry::SimdWidth width) {
+        return Geometry::intersectBatch(frustum, boxes, 0, count, hits.data(),
+                                        width);
+      },
+      hits);
+  measure(
+      "sphere / boxes",
+      [&](const Geometry::SimdWidth width) {
+        return Geometry::intersectBatch(sphere, boxes, 0, count, hits.data(),
+                                        width);
+      },
+      hits);
+  measure(
+      "ray / boxes",
+      [&](const Geometry::SimdWidth width) {
+        return Geometry::intersectBatch(ray, boxes, 0, count,
+                                        distances.data(), width);
+      },
+      distances);
+
+  // The same queries through a tree over the boxes, against the flat kernels
+  // at the best width
+  const auto secondsPerCall{[](auto &&call) {
+    size_t repeats{0};
+    const Uint64 begin{SDL_GetPerformanceCounter()};
+    double seconds{0.0};
+    do {
+      call();
+      ++repeats;
+      seconds = static_cast<double>(SDL_GetPerformanceCounter() - begin) /
+                SDL_GetPerformanceFrequency();
+    } while (seconds < 0.25);
+    return seconds / repeats;
+  }};
 
-    m_forward = glm::normalize(forward);
-    m_right = glm::normalize(glm::cross(m_forward, worldUp));
-    m_up = glm::cross(m_right, m_forward);
+  std::vector<Geometry::AABB> boxList(count);
+  for (size_t i{0}; i < count; ++i) {
+    boxList[i] = boxes.get(i);
   }
 
-  void up(const float speed) { m_eye += m_up * speed; }
-  void down(const float speed) { m_eye -= m_up * speed; }
-  // TODO: BUG - Sometimes camera moving sideways becomes slower than
-  // forward/backward movement
-  void right(const float speed) { m_eye += m_right * speed; }
-  void left(const float speed) { m_eye -= m_right * speed; }
-  void forward(const float speed) { m_eye += m_forward * speed; }
-  void backward(const float speed) { m_eye -= m_forward * speed; }
+  Geometry::Bvh bvh;
+  const double buildSeconds{secondsPerCall([&]() { bvh.build(boxList); })};
+  const double refitSeconds{secondsPerCall([&]() { bvh.refit(boxList); })};
+
+  report.precision(3);
+  report << "BVH over " << count << " boxes, " << bvh.nodes().size()
+         << " nodes, build " << buildSeconds * 1000.0 << " ms, refit "
+         << refitSeconds * 1000.0 << " ms, ms per query (flat / tree):\n";
+
+  std::vector<uint32_t> result;
+  const auto compare{[&](const char *name, const size_t flatHits,
+                         const double flatSeconds, auto &&query) {
+    const double treeSeconds{secondsPerCall([&]() {
+      result.clear();
+      query();
+    })};
+
+    const bool matches{result.size() == flatHits};
+    agree = agree && matches;
+
+    report << "  " << name << ": " << flatSeconds * 1000.0 << " / "
+           << treeSeconds * 1000.0 << " (x" << flatSeconds / treeSeconds
+           << "), " << result.size() << " hits"
+           << (matches ? "" : ", MISMATCH") << "\n";
+  }};
 
-  const glm::vec3 &eye() const { return m_eye; }
+  size_t flatHits{0};
+  double flatSeconds{secondsPerCall([&]() {
+    flatHits = Geometry::intersectBatch(frustum, boxes, 0, count, hits.data());
+  })};
+  compare("frustum / boxes", flatHits, flatSeconds,
+          [&]() { bvh.query(frustum, result); });
 
-  glm::mat4 viewMatrix(const glm::vec3 &worldUp) const {
-    return glm::lookAt(
-        m_eye,
-        // Cancel out the eye vector to form a free look at matrix
-        m_eye + m_forward, worldUp);
+  flatSeconds = secondsPerCall([&]() {
+    flatHits = Geometry::intersectBatch(sphere, boxes, 0, count, hits.data());
+  });
+  compare("sphere / boxes", flatHits, flatSeconds,
+          [&]() { bvh.query(sphere, result); });
+
+  float nearest{std::numeric_limits<float>::infinity()};
+  flatSeconds = secondsPerCall([&]() {
+    Geometry::intersectBatch(ray, boxes, 0, count, distances.data());
+    nearest = *std::min_element(distances.begin(), distances.end());
+  });
+  Geometry::Bvh::RayHit rayHit{};
+  const double raySeconds{
+      secondsPerCall([&]() { rayHit = bvh.raycast(ray); })};
+  const bool rayMatches{rayHit.distance == nearest};
+  agree = agree && rayMatches;
+  report << "  nearest ray hit: " << flatSeconds * 1000.0 << " / "
+         << raySeconds * 1000.0 << " (x" << flatSeconds / raySeconds
+         << "), distance " << rayHit.distance
+         << (rayMatches ? "" : ", MISMATCH") << "\n";
+
+  std::cout << report.str();
+
+  return agree;
+}
+
+// Sets the texture units of a lit program the three ways: by std::string
+// through ShaderProgram's map, by UniformName through its slot array, and
+// with glUniform1i on known locations, the cost of the GL call alone
+void runUniformBenchmark(const ShaderProgram &program) {
+  program.use();
+
+  // Repeats the update for at least a quarter second
+  const auto nanosecondsPerCall{[](auto &&update) {
+    constexpr size_t CALLS{6};
+    update();
+
+    size_t repeats{0};
+    const Uint64 begin{SDL_GetPerformanceCounter()};
+    double seconds{0.0};
+    do {
+      for (size_t i{0}; i < 1000; ++i) {
+        update();
+      }
+      repeats += 1000;
+      seconds = static_cast<double>(SDL_GetPerformanceCounter() - begin) /
+                SDL_GetPerformanceFrequency();
+    } while (seconds < 0.25);
+
+    return seconds * 1.0e9 / (repeats * CALLS);
+  }};
+
+  const double mapNanoseconds{nanosecondsPerCall([&]() {
+    program.setUniform("u_lightData", 2);
+    program.setUniform("u_lightGrid", 3);
+    program.setUniform("u_lightIndices", 4);
+    program.setUniform("u_shadowData", 8);
+    program.setUniform("u_shadowAtlas", 9);
+    program.setUniform("u_shadowMap", 1);
+  })};
+
+  const double handleNanoseconds{nanosecondsPerCall([&]() {
+    program.setUniform("u_lightData"_uniform, 2);
+    program.setUniform("u_lightGrid"_uniform, 3);
+    program.setUniform("u_lightIndices"_uniform, 4);
+    program.setUniform("u_shadowData"_uniform, 8);
+    program.setUniform("u_shadowAtlas"_uniform, 9);
+    program.setUniform("u_shadowMap"_uniform, 1);
+  })};
+
+  std::array<GLint, 6> locations{};
+  const std::array<const char *, 6> names{"u_lightData",  "u_lightGrid",
+                                          "u_lightIndices", "u_shadowData",
+                                          "u_shadowAtlas", "u_shadowMap"};
+  for (size_t i{0}; i < names.size(); ++i) {
+    locations[i] = glGetUniformLocation(program.id(), names[i]);
   }
-};
+  const double glNanoseconds{nanosecondsPerCall([&]() {
+    glUniform1i(locations[0], 2);
+    glUniform1i(locations[1], 3);
+    glUniform1i(locations[2], 4);
+    glUniform1i(locations[3], 8);
+    glUniform1i(locations[4], 9);
+    glUniform1i(locations[5], 1);
+  })};
+
+  std::ostringstream report;
+  report.setf(std::ios::fixed);
+  report.precision(1);
+  report << "Uniform updates, ns per setUniform:\n"
+         << "  std::string map: " << mapNanoseconds << "\n"
+         << "  uniform slot: " << handleNanoseconds << " (x"
+         << mapNanoseconds / handleNanoseconds << ")\n"
+         << "  glUniform alone: " << glNanoseconds << "\n";
+  std::cout << report.str();
+
+  program.unuse();
+}
+
+} // namespace Benchmark
+
+/////////////////////////////////////////////////////////////////////////////
 
 // TODO: Generate distortion over a plane. This is where we can practically
 // apply calculus.
@@ -1295,18 +7847,253 @@ public:
 
 // TODO: Add one point light illumination.
 
-// TODO: Add point light shadow mapping.
-
 // TODO: Add deffered shading after one point light illumination.
 
 // TODO: Implement deffered shading, clustered shading, forward+ shading.
 // Implement all 3 of them. Compare them. Provide a way to
 // store/configure/choose/switch shading implementation. Forward+ and Clustered
 // shading can be implemented on CPU instead of compute shaders.
-int main() {
+//
+// NOTE: Implemented as Rendering::RenderTechnique, compared with --benchmark.
+
+const char *const USAGE{
+    "Usage: main [--technique <name>] [--benchmark] [--benchmark-frames <n>]\n"
+    "            [--trace <file>] [--headless] [--screenshot <file>]\n"
+    "            [--scene <name>] [--record <file>] [--camera-path <file>]\n"
+    "            [--json <file>] [--baseline <file>] [--threshold <percent>]\n"
+    "            [--objects <n>] [--geometry-benchmark] [--cascades <n>]\n"
+    "            [--stable-shadows] [--shadowed-lights <n>]\n"
+    "            [--shadow-filter <name>] [--shader-cache <dir>]\n"
+    "            [--no-shader-cache] [--uniform-benchmark]\n"
+    "            [--no-multi-draw]\n"
+    "  --technique         start with forward, clustered, deferred or forward+\n"
+    "  --benchmark         fly the benchmark camera path with every technique\n"
+    "                      (or only --technique) and print frame times\n"
+    "  --benchmark-frames  timed frames per technique, 600 by default\n"
+    "  --trace             write the last 300 frames of CPU and GPU zones as a\n"
+    "                      Chrome trace on exit\n"
+    "  --headless          no display, render offscreen and run --benchmark\n"
+    "  --screenshot        write the last frame as a binary PPM on exit\n"
+    "  --scene             default, sparse or dense light layout; the\n"
+    "                      benchmark runs every scene unless one is picked\n"
+    "  --record            record the camera while flying, saved on exit\n"
+    "  --camera-path       benchmark along a recorded camera path instead of\n"
+    "                      the built-in loop, sets the frame count\n"
+    "  --json              write the benchmark results as JSON\n"
+    "  --baseline          compare with a --json file, exit code 1 when a\n"
+    "                      mean or p95 frame time regressed\n"
+    "  --threshold         allowed regression in percent, 10 by default\n"
+    "  --objects           scatter n extra instanced cubes and spheres over\n"
+    "                      the floor\n"
+    "  --geometry-benchmark\n"
+    "                      measure the intersection kernels and exit\n"
+    "  --cascades          shadow map cascades, 1 to 4, 4 by default\n"
+    "  --stable-shadows    snap the cascades to shadow map texels, and reuse\n"
+    "                      the shadow map while nothing moved\n"
+    "  --shadowed-lights   local lights with shadows in the shadow atlas, the\n"
+    "                      largest on screen first, 16 by default\n"
+    "  --shadow-filter     pcf, hardware, poisson, pcss, vsm or esm, pcf by\n"
+    "                      default; all benchmarks every filter\n"
+    "  --shader-cache      directory of linked program binaries, reused on\n"
+    "                      the next launch, shader_cache by default\n"
+    "  --no-shader-cache   compile every shader program from source\n"
+    "  --uniform-benchmark\n"
+    "                      compare setUniform by name and by uniform slot,\n"
+    "                      and exit\n"
+    "  --no-multi-draw     draw the mesh arena with a loop of calls, as on\n"
+    "                      GL 3.3, even when glMultiDrawElementsIndirect is\n"
+    "                      available\n"};
+
+struct Options {
+  // RenderTechnique::name, empty keeps the first one
+  std::string technique;
+  bool benchmark{false};
+  int benchmarkFrames{600};
+  // Chrome trace output, empty disables tracing
+  std::string tracePath;
+  // Offscreen video driver, for CI and machines without a display or GPU
+  bool headless{false};
+  std::string screenshotPath;
+  // Benchmark::SCENES name, empty means the default scene, or every scene in
+  // a benchmark
+  std::string scene;
+  std::string recordPath;
+  std::string cameraPath;
+  std::string jsonPath;
+  std::string baselinePath;
+  double thresholdPercent{10.0};
+  // Extra scene nodes, for instancing and scene graph stress tests
+  int objects{0};
+  bool geometryBenchmark{false};
+  bool uniformBenchmark{false};
+  int cascades{ShadowMapping::MAX_CASCADES};
+  bool stableShadows{false};
+  // Point and spot lights which get a shadow atlas tile, 0 disables them
+  int shadowedLights{16};
+  ShadowMapping::Filter shadowFilter{ShadowMapping::Filter::PCF};
+  // Benchmark runs every filter, starting with shadowFilter
+  bool allShadowFilters{false};
+  // Program binaries, empty compiles every shader on every launch
+  std::string shaderCachePath{"shader_cache"};
+  // glMultiDrawElementsIndirect for the mesh arena when the driver has it
+  bool multiDraw{true};
+};
+
+Options parseOptions(const int argc, char *argv[]) {
+  Options options;
+
+  for (int i{1}; i < argc; ++i) {
+    const std::string arg{argv[i]};
+
+    const auto value{[&]() -> std::string {
+      if (i + 1 >= argc) {
+        throw std::runtime_error{arg + " expects a value"};
+      }
+      return argv[++i];
+    }};
+
+    if (arg == "--technique") {
+      options.technique = value();
+    } else if (arg == "--benchmark") {
+      options.benchmark = true;
+    } else if (arg == "--headless") {
+      // Nobody can drive the camera, so run the scripted benchmark
+      options.headless = true;
+      options.benchmark = true;
+    } else if (arg == "--screenshot") {
+      options.screenshotPath = value();
+    } else if (arg == "--scene") {
+      options.scene = value();
+    } else if (arg == "--record") {
+      options.recordPath = value();
+    } else if (arg == "--camera-path") {
+      options.cameraPath = value();
+    } else if (arg == "--json") {
+      options.jsonPath = value();
+    } else if (arg == "--baseline") {
+      options.baselinePath = value();
+    } else if (arg == "--threshold") {
+      const std::string threshold{value()};
+      options.thresholdPercent = std::atof(threshold.c_str());
+      if (options.thresholdPercent <= 0.0) {
+        throw std::runtime_error{"Invalid threshold: " + threshold};
+      }
+    } else if (arg == "--geometry-benchmark") {
+      options.geometryBenchmark = true;
+    } else if (arg == "--uniform-benchmark") {
+      options.uniformBenchmark = true;
+    } else if (arg == "--objects") {
+      const std::string objects{value()};
+      options.objects = std::atoi(objects.c_str());
+      if (options.objects < 0) {
+        throw std::runtime_error{"Invalid object count: " + objects};
+      }
+    } else if (arg == "--stable-shadows") {
+      options.stableShadows = true;
+    } else if (arg == "--shadow-filter") {
+      const std::string filter{value()};
+      const auto it{std::find_if(
+          ShadowMapping::FILTERS.begin(), ShadowMapping::FILTERS.end(),
+          [&](const ShadowMapping::NamedFilter &named) {
+            return filter == named.name;
+          })};
+      if (filter == "all") {
+        options.allShadowFilters = true;
+      } else if (it == ShadowMapping::FILTERS.end()) {
+        throw std::runtime_error{"Unknown shadow filter: " + filter};
+      } else {
+        options.shadowFilter = it->filter;
+      }
+    } else if (arg == "--shadowed-lights") {
+      const std::string lights{value()};
+      options.shadowedLights = std::atoi(lights.c_str());
+      if (options.shadowedLights < 0) {
+        throw std::runtime_error{"Invalid shadowed light count: " + lights};
+      }
+    } else if (arg == "--cascades") {
+      const std::string cascades{value()};
+      options.cascades = std::atoi(cascades.c_str());
+      if (options.cascades < 1 ||
+          options.cascades > ShadowMapping::MAX_CASCADES) {
+        throw std::runtime_error{"Invalid cascade count: " + cascades};
+      }
+    } else if (arg == "--shader-cache") {
+      options.shaderCachePath = value();
+      if (options.shaderCachePath.empty()) {
+        throw std::runtime_error{"Invalid shader cache directory"};
+      }
+    } else if (arg == "--no-shader-cache") {
+      options.shaderCachePath.clear();
+    } else if (arg == "--no-multi-draw") {
+      options.multiDraw = false;
+    } else if (arg == "--trace") {
+      options.tracePath = value();
+    } else if (arg == "--benchmark-frames") {
+      const std::string frames{value()};
+      options.benchmarkFrames = std::atoi(frames.c_str());
+      if (options.benchmarkFrames <= 0) {
+        throw std::runtime_error{"Invalid frame count: " + frames};
+      }
+    } else {
+      throw std::runtime_error{"Unknown option: " + arg};
+    }
+  }
+
+  return options;
+}
+
+int main(int argc, char *argv[]) {
+  Options options;
+  try {
+    options = parseOptions(argc, argv);
+  } catch (const std::runtime_error &error) {
+    std::cerr << error.what() << "\n" << USAGE;
+    return 1;
+  }
+
+  // CPU only, needs no window
+  if (options.geometryBenchmark) {
+    return Benchmark::runGeometryBenchmark() ? 0 : 1;
+  }
+
+  size_t sceneIndex{0};
+  if (!options.scene.empty()) {
+    const auto it{std::find_if(Benchmark::SCENES.begin(),
+                               Benchmark::SCENES.end(),
+                               [&](const Benchmark::NamedScene &scene) {
+                                 return options.scene == scene.name;
+                               })};
+    if (it == Benchmark::SCENES.end()) {
+      std::cerr << "Unknown scene: " << options.scene << "\n" << USAGE;
+      return 1;
+    }
+    sceneIndex = std::distance(Benchmark::SCENES.begin(), it);
+  }
+
+  // Replayed by the benchmark instead of Benchmark::cameraPath
+  CameraPath playbackPath;
+  if (!options.cameraPath.empty()) {
+    try {
+      playbackPath = CameraPath::load(options.cameraPath);
+    } catch (const std::runtime_error &error) {
+      std::cerr << error.what() << "\n";
+      return 1;
+    }
+    options.benchmarkFrames = static_cast<int>(playbackPath.duration() /
+                                               Benchmark::FRAME_SECONDS) +
+                              1;
+  }
+
   /////////////////////////////////////////////////////////////////////////////
 
   /* SDL setup */
+
+  // Renders through EGL, Mesa's llvmpipe when there is no GPU
+  if (options.headless && !SDL_SetHint(SDL_HINT_VIDEO_DRIVER, "offscreen")) {
+    std::cerr << "Offscreen video driver hint failed: " << SDL_GetError()
+              << "\n";
+  }
+
   if (!SDL_Init(SDL_INIT_VIDEO)) {
     std::cerr << "SDL_Init failed: " << SDL_GetError() << "\n";
     return 1;
@@ -1318,9 +8105,10 @@ int main() {
 
   float window_width = 800;
   float window_height = 600;
-  SDL_Window *window =
-      SDL_CreateWindow("SDL3 Window", window_width, window_height,
-                       SDL_WINDOW_RESIZABLE | SDL_WINDOW_OPENGL);
+  SDL_Window *window = SDL_CreateWindow(
+      "SDL3 Window", window_width, window_height,
+      SDL_WINDOW_RESIZABLE | SDL_WINDOW_OPENGL |
+          (options.headless ? SDL_WINDOW_HIDDEN : 0));
 
   if (!window) {
     std::cerr << "SDL_CreateWindow failed: " << SDL_GetError() << "\n";
@@ -1330,13 +8118,28 @@ int main() {
 
   SDL_GLContext context = SDL_GL_CreateContext(window);
 
+  // Declared before every GL object, so it is destroyed after all of them
+  // released their names through the still current context
+  struct SDLCleanup {
+    SDL_Window *window;
+    SDL_GLContext context;
+
+    ~SDLCleanup() {
+      SDL_GL_DestroyContext(context);
+      SDL_DestroyWindow(window);
+      SDL_Quit();
+    }
+  };
+
+  const SDLCleanup sdlCleanup{window, context};
+
   // Synchronize the loop with the monitor refresh rate
   // This one line reduces gpu usage from 85% to <=5%
   SDL_GL_SetSwapInterval(1);
 
   SDL_SetHint(SDL_HINT_MOUSE_RELATIVE_MODE_CENTER, "1");
 
-  if (!SDL_SetWindowRelativeMouseMode(window, true)) {
+  if (!options.headless && !SDL_SetWindowRelativeMouseMode(window, true)) {
     std::cerr << "Relative mouse mode failed: " << SDL_GetError() << "\n";
   }
 
@@ -1344,188 +8147,423 @@ int main() {
     std::cerr << "Failed to initialize GLAD\n";
   }
 
+  // Until the techniques are built, reported before the first frame
+  const Uint64 startupBegin{SDL_GetPerformanceCounter()};
+
+  // Declared before every program, it is only used while linking them
+  std::unique_ptr<ProgramBinaryCache> binaryCache;
+  if (!options.shaderCachePath.empty()) {
+    binaryCache =
+        std::make_unique<ProgramBinaryCache>(options.shaderCachePath);
+    if (binaryCache->supported()) {
+      ShaderProgram::setBinaryCache(binaryCache.get());
+    } else {
+      std::cerr << "The driver can't save program binaries, shaders are "
+                   "compiled on every launch\n";
+    }
+  }
+
   /////////////////////////////////////////////////////////////////////////////
 
   /* SHADER PROGRAM */
 
-  ShaderProgram shaderProgram{ShaderSource::vertexShader,
-                              ShaderSource::fragmentShader};
+  // Every scene program is instanced, see SceneGraph::DrawList. Programs are
+  // compiled on their first request, the techniques request theirs per frame.
+  Rendering::ShaderPermutations permutations;
+  // Bound to the uniform blocks of every program
+  Rendering::FrameUniforms frameUniforms;
 
-  // ----
+  using ShaderSource::Program;
 
-  ShaderSource::vertexShader.insertDefines({"HAS_GEOMETRY_SHADER"});
-  ShaderProgram debugShaderProgram{
-      ShaderSource::vertexShader,       //
-      ShaderSource::geometryShader,     //
-      ShaderSource::basicFragmentShader //
-  };
-  ShaderSource::vertexShader.clearDefines();
+  // Needs a context, but no scene
+  if (options.uniformBenchmark) {
+    Benchmark::runUniformBenchmark(
+        permutations.get(Program::LIT, ShaderSource::CLUSTERED_SHADING));
+    return 0;
+  }
 
-  // ----
+  const ShaderProgram &debugShaderProgram{
+      permutations.get(Program::DEBUG_NORMALS)};
+  const ShaderProgram &lightSourceProgram{permutations.get(Program::EMISSIVE)};
+  const ShaderProgram &depthProgram{permutations.get(Program::DEPTH)};
+  const ShaderProgram &shadowAtlasProgram{
+      permutations.get(Program::SHADOW_ATLAS)};
+  const ShaderProgram &postProcessingProgram{
+      permutations.get(Program::POST_PROCESSING)};
 
-  ShaderProgram lightSourceProgram{
-      ShaderSource::vertexShader,       //
-      ShaderSource::basicFragmentShader //
-  };
+  /////////////////////////////////////////////////////////////////////////////
 
-  // ----
+  /* PROFILER */
 
-  ShaderSource::fragmentShader.insertDefines({"COMPUTE_CHECKER"});
-  ShaderProgram floorProgram{
-      ShaderSource::vertexShader,  //
-      ShaderSource::fragmentShader //
-  };
-  ShaderSource::fragmentShader.clearDefines();
+  const size_t traceFrames{300};
+  Profiling::Profiler profiler{options.tracePath.empty() ? 0 : traceFrames};
 
-  // ----
+  /////////////////////////////////////////////////////////////////////////////
 
-  ShaderProgram depthProgram{ShaderSource::vertexShader};
+  /* MESH */
 
-  // ----
+  Mesh cube{generateCube(4.0f)};
+  Mesh sphere{generateSphere(30, 30, 8.0f)};
+  Mesh floor{generateQuad()};
+  Mesh lightSource{
+      generateSphere(20.0f, 20.0f, 1.0f, glm::vec3{1.0f, 1.0f, 0.0f})};
+  Mesh cylinder{generateMesh(generateCylinderVertex)};
+  Mesh wavyCylinder{generateMesh(generateWavyCylinderVertex)};
+  Mesh torus{generateMesh(generateTorusVertex)};
+  Mesh postProcessingQuad{generateQuad(1.0f)};
 
-  ShaderProgram postProcessingProgram{ShaderSource::postProcessingVert,
-                                      ShaderSource::postProcessingFrag};
+  // The scene's meshes share buffers, a pass draws a draw list in one call
+  const MeshArena meshArena{
+      {&cube, &sphere, &floor, &lightSource, &cylinder, &wavyCylinder, &torus},
+      options.multiDraw};
+  std::cout << "Mesh arena: " << meshArena.meshCount() << " meshes, "
+            << meshArena.vertexCount() << " vertices, "
+            << meshArena.indexCount() << " indices, drawn with "
+            << (meshArena.multiDrawIndirect()
+                    ? "glMultiDrawElementsIndirect"
+                    : "glDrawElementsInstancedBaseVertex")
+            << "\n";
 
   /////////////////////////////////////////////////////////////////////////////
 
-  /* MESH */
+  /* SCENE GRAPH */
 
-  Mesh cube{generateCube(4.0f)};
+  using SceneGraph::RenderFlags;
 
-  glm::mat4 cubemodelMatrix{1.0f};
-  // TRS rule of thumb
-  // Position = M_Translate * M_Rotate * M_Scale * V_Position
-  cubemodelMatrix =
-      glm::translate(cubemodelMatrix, glm::vec3(0.0f, 4.0f, -10.0f));
-  cubemodelMatrix = glm::rotate(cubemodelMatrix, glm::pi<float>() / 6,
-                                glm::vec3(1.0f, 0.0f, 0.0f));
+  SceneGraph::Graph sceneGraph;
 
-  // ----
+  constexpr uint32_t OBJECT_FLAGS{RenderFlags::LIT |
+                                  RenderFlags::SHADOW_CASTER};
 
-  Mesh sphere{generateSphere(30, 30, 8.0f)};
+  sceneGraph.createNode({
+      .position = glm::vec3{0.0f, 4.0f, -10.0f},
+      .rotation = glm::angleAxis(glm::pi<float>() / 6.0f,
+                                 glm::vec3{1.0f, 0.0f, 0.0f}),
+      .mesh = &cube,
+      .flags = OBJECT_FLAGS,
+  });
+
+  sceneGraph.createNode({
+      .position = glm::vec3{0.0f, 8.0f, -25.0f},
+      .mesh = &sphere,
+      .flags = OBJECT_FLAGS | RenderFlags::DEBUG_NORMALS,
+  });
 
-  glm::mat4 sphereModelMatrix{glm::translate(glm::identity<glm::mat4>(),
-                                             glm::vec3(0.0f, 8.0f, -25.0f))};
+  sceneGraph.createNode({
+      .position = glm::vec3{10.0f, 5.0f, -10.0f},
+      .scale = glm::vec3{1.0f, 1.0f, 4.0f},
+      .mesh = &cylinder,
+      .flags = OBJECT_FLAGS,
+  });
 
-  // ----
+  sceneGraph.createNode({
+      .position = glm::vec3{20.0f, 3.0f, -15.0f},
+      .rotation = glm::angleAxis(glm::pi<float>() / 2.0f,
+                                 glm::vec3{0.0f, 1.0f, 0.0f}),
+      .scale = glm::vec3{1.0f, 1.0f, 8.0f},
+      .mesh = &wavyCylinder,
+      .flags = OBJECT_FLAGS,
+  });
 
-  Mesh floor{generateQuad()};
+  sceneGraph.createNode({
+      .position = glm::vec3{20.0f, 8.0f, -25.0f},
+      .mesh = &torus,
+      .flags = OBJECT_FLAGS,
+  });
 
-  glm::mat4 floorModelMatrix{glm::identity<glm::mat4>()};
   // TODO: I wonder why is 100 units not enough to cover the whole frustum? The
   // far variable is 100 units, so... Update: The front of the floor is half of
   // the full length of the frustum.
-  floorModelMatrix =
-      glm::scale(floorModelMatrix, glm::vec3(200.0f, 1.0f, 200.0f));
-
-  // ----
-
-  Mesh lightSource{
-      generateSphere(20.0f, 20.0f, 1.0f, glm::vec3{1.0f, 1.0f, 0.0f})};
+  sceneGraph.createNode({
+      .scale = glm::vec3{200.0f, 1.0f, 200.0f},
+      .mesh = &floor,
+      .flags = RenderFlags::CHECKER,
+  });
 
   // TODO: Render point light & spotlight.
   // TODO: Make light source movable.
-  glm::mat4 lightSourceModelMatrix{glm::identity<glm::mat4>()};
-  lightSourceModelMatrix =
-      glm::translate(lightSourceModelMatrix, glm::vec3{-10.0f, 10.0f, -10.0f});
-
-  // ----
-
-  Mesh cylinder{generateMesh(generateCylinderVertex)};
-
-  glm::mat4 cylinderModelMatrix{glm::identity<glm::mat4>()};
-  cylinderModelMatrix =
-      glm::translate(cylinderModelMatrix, glm::vec3{10.0f, 5.0f, -10.0f});
-  cylinderModelMatrix =
-      glm::scale(cylinderModelMatrix, glm::vec3{1.0f, 1.0f, 4.0f});
-
-  // ----
-
-  Mesh wavyCylinder{generateMesh(generateWavyCylinderVertex)};
-
-  glm::mat4 wavyCylinderModelMatrix{glm::identity<glm::mat4>()};
-  wavyCylinderModelMatrix =
-      glm::translate(wavyCylinderModelMatrix, glm::vec3{20.0f, 3.0f, -15.0f});
-  wavyCylinderModelMatrix =
-      glm::rotate(wavyCylinderModelMatrix, glm::pi<float>() / 2.0f,
-                  glm::vec3{0.0f, 1.0f, 0.0f});
-  wavyCylinderModelMatrix =
-      glm::scale(wavyCylinderModelMatrix, glm::vec3{1.0f, 1.0f, 8.0f});
+  sceneGraph.createNode({
+      .position = glm::vec3{-10.0f, 10.0f, -10.0f},
+      .mesh = &lightSource,
+      .flags = RenderFlags::EMISSIVE,
+  });
 
-  // ----
+  // Nodes with RenderFlags::DYNAMIC and where they rest, animated every frame
+  struct DynamicNode {
+    SceneGraph::NodeId node;
+    glm::vec3 position;
+  };
+  std::vector<DynamicNode> dynamicNodes;
+
+  // Copies of the cube and the sphere under one group node, on a grid over the
+  // floor. A fixed seed keeps the layout the same on every run. Every 32nd one
+  // bobs up and down, the rest stay where they are.
+  if (options.objects > 0) {
+    sceneGraph.reserve(sceneGraph.size() + options.objects + 1);
+
+    const SceneGraph::NodeId group{sceneGraph.createNode({})};
+
+    const int columns{static_cast<int>(std::ceil(std::sqrt(options.objects)))};
+    const float extent{180.0f};
+    const float spacing{extent / columns};
+
+    std::mt19937 generator{99};
+    std::uniform_real_distribution<float> unit{0.0f, 1.0f};
+
+    for (int i{0}; i < options.objects; ++i) {
+      const glm::vec2 cell{
+          -extent / 2.0f + (i % columns + 0.5f) * spacing,
+          -extent / 2.0f + (i / columns + 0.5f) * spacing,
+      };
+      const glm::vec4 color{0.3f + 0.7f * unit(generator),
+                            0.3f + 0.7f * unit(generator),
+                            0.3f + 0.7f * unit(generator), 1.0f};
+      // Fits the cell, cube side 4, sphere radius 8
+      const float size{spacing * (0.2f + 0.2f * unit(generator))};
+      const glm::vec3 position{cell.x, size / 2.0f, cell.y};
+      const bool dynamic{i % 32 == 0};
+      const uint32_t flags{dynamic ? OBJECT_FLAGS | RenderFlags::DYNAMIC
+                                   : OBJECT_FLAGS};
+
+      SceneGraph::NodeId node{SceneGraph::NO_NODE};
+      if (i % 2 == 0) {
+        node = sceneGraph.createNode({
+            .parent = group,
+            .position = position,
+            .rotation = glm::angleAxis(glm::two_pi<float>() * unit(generator),
+                                       glm::vec3{0.0f, 1.0f, 0.0f}),
+            .scale = glm::vec3{size / 4.0f},
+            .color = color,
+            .mesh = &cube,
+            .flags = flags,
+        });
+      } else {
+        node = sceneGraph.createNode({
+            .parent = group,
+            .position = position,
+            .scale = glm::vec3{size / 16.0f},
+            .color = color,
+            .mesh = &sphere,
+            .flags = flags,
+        });
+      }
 
-  Mesh torus{generateMesh(generateTorusVertex)};
+      if (dynamic) {
+        dynamicNodes.push_back(DynamicNode{.node = node, .position = position});
+      }
+    }
+  }
 
-  glm::mat4 torusModelMatrix{glm::identity<glm::mat4>()};
-  torusModelMatrix =
-      glm::translate(torusModelMatrix, glm::vec3{20.0f, 8.0f, -25.0f});
+  // Rebuilt at the start of every frame, a list is only rescanned when nodes
+  // were added or their flags changed
+  SceneGraph::DrawList staticCasters;
+  SceneGraph::DrawList dynamicCasters;
+  // Culled per shadowed light, see the shadow pass
+  SceneGraph::DrawList localCasters;
+  SceneGraph::DrawList litObjects;
+  SceneGraph::DrawList checkerObjects;
+  SceneGraph::DrawList emissiveObjects;
+  SceneGraph::DrawList debugNormalObjects;
+
+  const auto buildScene{[&]() {
+    sceneGraph.updateWorldMatrices();
+
+    staticCasters.build(sceneGraph, RenderFlags::SHADOW_CASTER,
+                        RenderFlags::DYNAMIC);
+    dynamicCasters.build(sceneGraph,
+                         RenderFlags::SHADOW_CASTER | RenderFlags::DYNAMIC);
+    localCasters.build(sceneGraph, RenderFlags::SHADOW_CASTER);
+    litObjects.build(sceneGraph, RenderFlags::LIT);
+    checkerObjects.build(sceneGraph, RenderFlags::CHECKER);
+    emissiveObjects.build(sceneGraph, RenderFlags::EMISSIVE);
+    debugNormalObjects.build(sceneGraph, RenderFlags::DEBUG_NORMALS);
+  }};
 
-  // ----
+  // Shadow casters are culled by the box around every cascade and drawn into
+  // each of them, a cascade clips what it doesn't cover
+  const auto cullScene{[&](const Geometry::Frustum &cameraFrustum,
+                           const Geometry::Frustum &lightFrustum) {
+    staticCasters.cull(lightFrustum);
+    dynamicCasters.cull(lightFrustum);
+    for (SceneGraph::DrawList *list : {&litObjects, &checkerObjects,
+                                       &emissiveObjects, &debugNormalObjects}) {
+      list->cull(cameraFrustum);
+    }
+  }};
 
-  Mesh postProcessingQuad{generateQuad(1.0f)};
+  // The cascades and casters each shadow map was last rendered with
+  struct ShadowMapState {
+    std::vector<glm::mat4> viewProjections;
+    uint64_t staticVersion{0};
+    uint64_t dynamicVersion{0};
+  };
+  ShadowMapState staticShadowMapState;
+  ShadowMapState shadowMapState;
+  size_t staticShadowMapRenders{0};
+  size_t dynamicShadowMapRenders{0};
+  size_t shadowPassFrames{0};
+  Lighting::ShadowAtlas shadowAtlas;
+
+  const auto printCullingStats{[&]() {
+    std::cout << "Visible objects: " << litObjects.visibleCount() << " of "
+              << litObjects.size() << " in " << litObjects.drawCalls()
+              << " draw calls, static shadow casters: "
+              << staticCasters.visibleCount() << " of "
+              << staticCasters.size() << " in " << staticCasters.drawCalls()
+              << " draw calls, dynamic: " << dynamicCasters.visibleCount()
+              << " of " << dynamicCasters.size() << "\n";
+
+    std::cout << "Static shadow map drawn in " << staticShadowMapRenders
+              << " of " << shadowPassFrames << " frames, dynamic casters in "
+              << dynamicShadowMapRenders << "\n";
+    std::cout << "Shadow atlas: " << shadowAtlas.allocations().size()
+              << " lights, " << 100.0f * shadowAtlas.occupancy()
+              << "% in use\n";
+
+    const GLState::Counters stateChanges{GLState::takeCounters()};
+    if (shadowPassFrames > 0) {
+      std::cout << "GL state changes per frame: "
+                << stateChanges.issued / shadowPassFrames << " issued, "
+                << stateChanges.skipped / shadowPassFrames
+                << " skipped as redundant\n";
+    }
+    staticShadowMapRenders = 0;
+    dynamicShadowMapRenders = 0;
+    shadowPassFrames = 0;
+  }};
 
   /////////////////////////////////////////////////////////////////////////////
 
+  // One layer per shadow cascade
   struct DepthMap {
     GLuint framebuffer;
     GLuint texture;
     const unsigned int TEXTURE_WIDTH{2048};
     const unsigned int TEXTURE_HEIGHT{2048};
+    int layers;
     const std::array<float, 4> borderColor{1.0f, 1.0f, 1.0f, 1.0f};
 
     void setTextureSize(const float width, const float height) const noexcept {
-      glBindTexture(GL_TEXTURE_2D, texture);
+      GLState::bindTexture(GL_TEXTURE_2D_ARRAY, texture);
       // Store depth component in the texture, and tell graphics driver to give
       // us higher precision shadows
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, width, height, 0,
-                   GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-      glBindTexture(GL_TEXTURE_2D, 0);
+      glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT32F, width, height,
+                   layers, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+      GLState::bindTexture(GL_TEXTURE_2D_ARRAY, 0);
     }
   };
 
-  DepthMap depthMap;
-
-  // Texture
-  // https://wikis.khronos.org/opengl/Texture
-  glGenTextures(1, &depthMap.texture);
-  glBindTexture(GL_TEXTURE_2D, depthMap.texture);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE,
-                  GL_COMPARE_REF_TO_TEXTURE);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-  glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR,
-                   depthMap.borderColor.data());
-  glBindTexture(GL_TEXTURE_2D, 0);
-
-  depthMap.setTextureSize(depthMap.TEXTURE_WIDTH, depthMap.TEXTURE_HEIGHT);
-
-  // Framebuffer
-  glGenFramebuffers(1, &depthMap.framebuffer);
-  glBindFramebuffer(GL_FRAMEBUFFER, depthMap.framebuffer);
-
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D,
-                         depthMap.texture, 0);
-
-  glDrawBuffer(GL_NONE);
-  glReadBuffer(GL_NONE);
+  const auto initializeDepthMap{[](DepthMap &depthMap) {
+    // Texture
+    // https://wikis.khronos.org/opengl/Texture
+    glGenTextures(1, &depthMap.texture);
+    GLState::bindTexture(GL_TEXTURE_2D_ARRAY, depthMap.texture);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE,
+                    GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+    glTexParameterfv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BORDER_COLOR,
+                     depthMap.borderColor.data());
+    GLState::bindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    depthMap.setTextureSize(depthMap.TEXTURE_WIDTH, depthMap.TEXTURE_HEIGHT);
+
+    // Framebuffer, the shadow pass attaches one layer at a time
+    glGenFramebuffers(1, &depthMap.framebuffer);
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, depthMap.framebuffer);
+
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                              depthMap.texture, 0, 0);
+
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE) {
+      std::cout << "Depth Framebuffer IS complete." << std::endl;
+    } else {
+      std::cerr << "Depth Framebuffer is NOT complete!" << std::endl;
+    }
 
-  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE) {
-    std::cout << "Depth Framebuffer IS complete." << std::endl;
-  } else {
-    std::cerr << "Depth Framebuffer is NOT complete!" << std::endl;
-  }
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) ==
+        GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT) {
+      std::cerr << "Depth Framebuffer incomplete attachment\n";
+    } else {
+      std::cout << "Depth Framebuffer complete attachment\n";
+    }
 
-  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) ==
-      GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT) {
-    std::cerr << "Depth Framebuffer incomplete attachment\n";
-  } else {
-    std::cout << "Depth Framebuffer complete attachment\n";
-  }
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, 0);
+  }};
 
-  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  // Casters which didn't move since the cascades last changed are cached in
+  // staticDepthMap. Every frame it's copied into depthMap and the dynamic
+  // casters are drawn over it, the depth test keeps the closer of the two.
+  DepthMap staticDepthMap{
+      .framebuffer = 0, .texture = 0, .layers = options.cascades};
+  DepthMap depthMap{.framebuffer = 0, .texture = 0, .layers = options.cascades};
+  initializeDepthMap(staticDepthMap);
+  initializeDepthMap(depthMap);
+
+  // Local lights' tiles, see Lighting::ShadowAtlas
+  DepthMap shadowAtlasMap{.framebuffer = 0,
+                          .texture = 0,
+                          .TEXTURE_WIDTH = Lighting::ShadowAtlas::SIZE,
+                          .TEXTURE_HEIGHT = Lighting::ShadowAtlas::SIZE,
+                          .layers = 1};
+  initializeDepthMap(shadowAtlasMap);
+
+  // Reads the depth maps without comparison, for PCSS and the moments
+  GLuint rawDepthSampler{0};
+  glGenSamplers(1, &rawDepthSampler);
+  glSamplerParameteri(rawDepthSampler, GL_TEXTURE_COMPARE_MODE, GL_NONE);
+  glSamplerParameteri(rawDepthSampler, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glSamplerParameteri(rawDepthSampler, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glSamplerParameteri(rawDepthSampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glSamplerParameteri(rawDepthSampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+  // Blurred moments of every cascade for VSM and ESM, allocated when one of
+  // them is first used. The horizontal pass writes blurTexture, the vertical
+  // pass the cascade's layer.
+  struct MomentsMap {
+    GLuint framebuffer{0};
+    GLuint texture{0};
+    GLuint blurTexture{0};
+    // What the moments were last computed from
+    const DepthMap *source{nullptr};
+    ShadowMapState state;
+    ShadowMapping::Filter filter{ShadowMapping::Filter::PCF};
+  };
+  MomentsMap momentsMap;
+
+  const auto initializeMomentsMap{[&](MomentsMap &moments) {
+    const GLsizei width{static_cast<GLsizei>(depthMap.TEXTURE_WIDTH)};
+    const GLsizei height{static_cast<GLsizei>(depthMap.TEXTURE_HEIGHT)};
+
+    // Filtered like any color texture, VSM and ESM need no comparison
+    glGenTextures(1, &moments.texture);
+    GLState::bindTexture(GL_TEXTURE_2D_ARRAY, moments.texture);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RG32F, width, height,
+                 depthMap.layers, 0, GL_RG, GL_FLOAT, NULL);
+    GLState::bindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    glGenTextures(1, &moments.blurTexture);
+    GLState::bindTexture(GL_TEXTURE_2D, moments.blurTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, width, height, 0, GL_RG,
+                 GL_FLOAT, NULL);
+    GLState::bindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &moments.framebuffer);
+  }};
 
   /////////////////////////////////////////////////////////////////////////////
 
@@ -1535,10 +8573,10 @@ int main() {
     GLuint renderbufferId;
 
     void setTextureSize(const float width, const float height) const noexcept {
-      glBindTexture(GL_TEXTURE_2D, textureId);
+      GLState::bindTexture(GL_TEXTURE_2D, textureId);
       glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB,
                    GL_UNSIGNED_BYTE, NULL);
-      glBindTexture(GL_TEXTURE_2D, 0);
+      GLState::bindTexture(GL_TEXTURE_2D, 0);
     }
 
     void setRenderbufferSize(const float width,
@@ -1554,10 +8592,10 @@ int main() {
 
   // Texture
   glGenTextures(1, &postProcessBuffer.textureId);
-  glBindTexture(GL_TEXTURE_2D, postProcessBuffer.textureId);
+  GLState::bindTexture(GL_TEXTURE_2D, postProcessBuffer.textureId);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glBindTexture(GL_TEXTURE_2D, 0);
+  GLState::bindTexture(GL_TEXTURE_2D, 0);
 
   postProcessBuffer.setTextureSize(window_width, window_height);
 
@@ -1568,7 +8606,7 @@ int main() {
 
   // Framebuffer
   glGenFramebuffers(1, &postProcessBuffer.framebufferId);
-  glBindFramebuffer(GL_FRAMEBUFFER, postProcessBuffer.framebufferId);
+  GLState::bindFramebuffer(GL_FRAMEBUFFER, postProcessBuffer.framebufferId);
 
   glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
                          postProcessBuffer.textureId, 0);
@@ -1581,7 +8619,91 @@ int main() {
     std::cerr << "Post-Process Framebuffer is NOT complete!\n";
   }
 
-  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  GLState::bindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  /////////////////////////////////////////////////////////////////////////////
+
+  /* LIGHTS */
+
+  // Regenerated when the benchmark moves on to the next scene
+  std::vector<Lighting::Light> initialLights{
+      Lighting::generateLights(Benchmark::SCENES[sceneIndex].lights)};
+  std::vector<Lighting::Light> lights{initialLights};
+  std::vector<glm::vec4> lightTexels;
+
+  ThreadPool threadPool;
+  std::cout << "Light binning uses " << threadPool.threadCount()
+            << " threads.\n";
+
+  Rendering::LightBuffers lightBuffers;
+
+  /////////////////////////////////////////////////////////////////////////////
+
+  /* RENDER TECHNIQUES */
+
+  Rendering::DrawQueue drawQueue;
+
+  const Rendering::Scene scene{
+      .objects = litObjects,
+      .floor = checkerObjects,
+      .drawScreenQuad =
+          [&]() {
+            postProcessingQuad.bind();
+            glDrawElements(GL_TRIANGLES, postProcessingQuad.indicesCount(),
+                           postProcessingQuad.indexType(), 0);
+          },
+  };
+
+  const glm::ivec2 screenSize{window_width, window_height};
+
+  // Cycled with TAB, in this order
+  std::vector<std::unique_ptr<Rendering::RenderTechnique>> techniques;
+  techniques.push_back(std::make_unique<Rendering::ClusteredTechnique>(
+      scene, lightBuffers, permutations, threadPool));
+  techniques.push_back(std::make_unique<Rendering::DeferredTechnique>(
+      scene, lightBuffers, permutations, threadPool, screenSize));
+  techniques.push_back(std::make_unique<Rendering::ForwardPlusTechnique>(
+      scene, lightBuffers, permutations, threadPool, screenSize));
+  techniques.push_back(
+      std::make_unique<Rendering::ForwardTechnique>(scene, permutations));
+
+  // Picks the lit permutations, cycled with F
+  ShadowMapping::Filter shadowFilter{options.shadowFilter};
+
+  size_t techniqueIndex{0};
+  if (!options.technique.empty()) {
+    const auto it{std::find_if(techniques.begin(), techniques.end(),
+                               [&](const auto &technique) {
+                                 return options.technique == technique->name();
+                               })};
+    if (it == techniques.end()) {
+      std::cerr << "Unknown technique: " << options.technique << "\n"
+                << USAGE;
+      return 1;
+    }
+    techniqueIndex = std::distance(techniques.begin(), it);
+  }
+
+  {
+    std::ostringstream startup;
+    startup.setf(std::ios::fixed);
+    startup.precision(1);
+    startup << "Startup took "
+            << (SDL_GetPerformanceCounter() - startupBegin) * 1000.0 /
+                   SDL_GetPerformanceFrequency()
+            << " ms, " << ShaderProgram::buildMilliseconds()
+            << " ms of it building " << permutations.size()
+            << " shader programs, the rest are built on first use";
+    if (binaryCache != nullptr && binaryCache->supported()) {
+      startup << ", " << binaryCache->hits() << " of "
+              << binaryCache->hits() + binaryCache->misses()
+              << " loaded from the binary cache";
+      if (binaryCache->rejected() > 0) {
+        startup << " (" << binaryCache->rejected() << " rejected)";
+      }
+    }
+    std::cout << startup.str() << "\n";
+  }
 
   /////////////////////////////////////////////////////////////////////////////
 
@@ -1603,12 +8725,36 @@ int main() {
   Uint64 lastTime{SDL_GetTicks()};
   float deltaTime{0.0f};
 
+  Uint64 lastStatsTime{lastTime};
+  size_t framesSinceStats{0};
+
+  Benchmark::GpuFrameTimer gpuFrameTimer;
+
+  // Every technique renders the same camera path, one after another
+  std::vector<Benchmark::TechniqueResult> benchmarkResults;
+  int benchmarkFrame{0};
+  Uint64 benchmarkBegin{0};
+  int exitCode{0};
+
+  CameraPath recordedPath;
+  Uint64 recordBegin{0};
+  if (options.benchmark) {
+    // Measure the frame, not the display refresh rate
+    SDL_GL_SetSwapInterval(0);
+  }
+
   const float velocity{10.0f};
 
   glm::vec3 worldUp{0.0f, 1.0f, 0.0f};
 
   Camera camera{glm::vec3{0.0f, 5.0f, 0.0f}};
 
+  // Window coordinates of a click, picked at the start of the next frame
+  bool pickRequested{false};
+  glm::vec2 pickPosition{0.0f};
+  SceneGraph::NodeId pickedNode{SceneGraph::NO_NODE};
+  glm::vec4 pickedColor{1.0f};
+
   while (running) {
     while (SDL_PollEvent(&event)) {
       if (event.type == SDL_EVENT_QUIT) {
@@ -1622,6 +8768,24 @@ int main() {
 
         postProcessBuffer.setTextureSize(window_width, window_height);
         postProcessBuffer.setRenderbufferSize(window_width, window_height);
+
+        for (const auto &technique : techniques) {
+          technique->resize(glm::ivec2{window_width, window_height});
+        }
+      }
+      // The benchmark decides when the technique changes
+      if (event.type == SDL_EVENT_KEY_DOWN && !event.key.repeat &&
+          event.key.scancode == SDL_SCANCODE_TAB && !options.benchmark) {
+        techniqueIndex = (techniqueIndex + 1) % techniques.size();
+        std::cout << "Shading: " << techniques[techniqueIndex]->name() << "\n";
+      }
+      if (event.type == SDL_EVENT_KEY_DOWN && !event.key.repeat &&
+          event.key.scancode == SDL_SCANCODE_F && !options.benchmark) {
+        shadowFilter = ShadowMapping::FILTERS
+            [(static_cast<size_t>(shadowFilter) + 1) %
+             ShadowMapping::FILTERS.size()].filter;
+        std::cout << "Shadow filter: "
+                  << ShadowMapping::namedFilter(shadowFilter).name << "\n";
       }
       if (event.type == SDL_EVENT_MOUSE_MOTION) {
         // TODO: Mathematically check when do the two axes collapse and cause an
@@ -1648,12 +8812,24 @@ int main() {
 
         camera.update(glm::radians(pitch), -glm::radians(yaw), worldUp);
       }
+      if (event.type == SDL_EVENT_MOUSE_BUTTON_DOWN &&
+          event.button.button == SDL_BUTTON_LEFT) {
+        // The cursor is hidden in relative mode, pick what the view centers
+        pickRequested = true;
+        pickPosition = SDL_GetWindowRelativeMouseMode(window)
+                           ? glm::vec2{window_width, window_height} * 0.5f
+                           : glm::vec2{event.button.x, event.button.y};
+      }
     }
 
     const Uint64 currentTime{SDL_GetTicks()};
     deltaTime = (currentTime - lastTime) / 1000.0f;
     lastTime = currentTime;
 
+    const Uint64 frameBegin{SDL_GetPerformanceCounter()};
+
+    profiler.beginFrame();
+
     // TODO: Use quaternions (after fully understanding them)
     // Still prone to gimbal lock problem, hence should use quaternions
     // eventually
@@ -1682,6 +8858,42 @@ int main() {
       camera.down(speed);
     }
 
+    Rendering::RenderTechnique &technique{*techniques[techniqueIndex]};
+
+    // Lights animate with the wall clock, unless the frame is benchmarked
+    float animationTime{currentTime / 1000.0f};
+
+    if (options.benchmark) {
+      const int timedFrame{std::max(benchmarkFrame - Benchmark::WARMUP_FRAMES,
+                                    0)};
+      const float seconds{timedFrame * Benchmark::FRAME_SECONDS};
+
+      if (!playbackPath.empty()) {
+        const CameraSample sample{playbackPath.sample(seconds)};
+        camera.update(glm::radians(sample.pitch), -glm::radians(sample.yaw),
+                      worldUp);
+        camera.moveTo(sample.eye);
+      } else {
+        const Benchmark::CameraPose pose{Benchmark::cameraPath(
+            static_cast<float>(timedFrame) / options.benchmarkFrames)};
+        camera.lookAt(pose.eye, pose.target, worldUp);
+      }
+
+      animationTime = seconds;
+    } else if (!options.recordPath.empty()) {
+      if (recordedPath.empty()) {
+        recordBegin = frameBegin;
+      }
+      recordedPath.record({
+          .time = static_cast<float>(
+              static_cast<double>(frameBegin - recordBegin) /
+              SDL_GetPerformanceFrequency()),
+          .eye = camera.eye(),
+          .pitch = pitch,
+          .yaw = yaw,
+      });
+    }
+
     glm::mat4 viewMatrix{camera.viewMatrix(worldUp)};
 
     const float fov{glm::radians(60.0f)};
@@ -1694,168 +8906,547 @@ int main() {
         glm::rotate(glm::vec3{0.0f, -1.0f, 0.0f}, -glm::pi<float>() / 6.0f,
                     glm::vec3{1.0f, 0.0f, 0.0f}))};
 
-    const auto lightMatrix{
-        ShadowMapping::createLightMatrix({.projectionMatrix = projectionMatrix,
-                                          .viewMatrix = viewMatrix,
-                                          .worldUp = worldUp,
-                                          .lightDirection = lightDirection})};
+    /* PICKING */
+
+    // Against the lit objects' tree from the last update, the highlight shows
+    // up in this frame
+    if (pickRequested) {
+      pickRequested = false;
+
+      const glm::vec2 ndc{2.0f * pickPosition.x / window_width - 1.0f,
+                          1.0f - 2.0f * pickPosition.y / window_height};
+      const glm::mat4 inverseViewProjection{
+          glm::inverse(projectionMatrix * viewMatrix)};
+      const auto unproject{[&](const float depth) {
+        const glm::vec4 point{inverseViewProjection *
+                              glm::vec4{ndc, depth, 1.0f}};
+        return glm::vec3{point} / point.w;
+      }};
+      const glm::vec3 nearPoint{unproject(-1.0f)};
+      const Geometry::Ray ray{
+          .origin = nearPoint,
+          .direction = glm::normalize(unproject(1.0f) - nearPoint)};
+
+      if (pickedNode != SceneGraph::NO_NODE) {
+        sceneGraph.setColor(pickedNode, pickedColor);
+        pickedNode = SceneGraph::NO_NODE;
+      }
 
-    /* SHADOW PASS */
+      const Geometry::Bvh::RayHit hit{litObjects.bvh().raycast(ray)};
+      if (hit.primitive != Geometry::Bvh::NO_HIT) {
+        pickedNode = litObjects.items()[hit.primitive].node;
+        pickedColor = sceneGraph.color(pickedNode);
+        sceneGraph.setColor(pickedNode, glm::vec4{1.0f, 1.0f, 0.0f, 1.0f});
+        std::cout << "Picked node " << pickedNode << ", its bounds are "
+                  << hit.distance << " units away\n";
+      } else {
+        std::cout << "Picked nothing\n";
+      }
+    }
+
+    /* SCENE UPDATE */
 
-    glBindFramebuffer(GL_FRAMEBUFFER, depthMap.framebuffer);
+    const size_t sceneZone{profiler.beginZone("scene update")};
 
-    // TODO: Make shadows be affected by each light source. Currently only
-    // directional light affects shadows.
-    glViewport(0, 0, depthMap.TEXTURE_WIDTH, depthMap.TEXTURE_HEIGHT);
+    for (const DynamicNode &dynamic : dynamicNodes) {
+      const float phase{dynamic.position.x + dynamic.position.z};
+      sceneGraph.setPosition(
+          dynamic.node,
+          dynamic.position +
+              glm::vec3{0.0f, 2.0f * glm::sin(animationTime + phase), 0.0f});
+    }
 
-    glEnable(GL_DEPTH_TEST);
-    // Fix shadow acne
-    glCullFace(GL_FRONT);
+    buildScene();
 
-    glClear(GL_DEPTH_BUFFER_BIT);
+    // The roots of the casters' trees bound every caster
+    Geometry::AABB casterBounds{};
+    bool anyCasters{false};
+    for (const SceneGraph::DrawList *casters :
+         {&staticCasters, &dynamicCasters}) {
+      const std::vector<Geometry::Bvh::Node> &nodes{casters->bvh().nodes()};
+      if (nodes.empty()) {
+        continue;
+      }
+      casterBounds = anyCasters
+                         ? Geometry::merge(casterBounds, nodes.front().bounds)
+                         : nodes.front().bounds;
+      anyCasters = true;
+    }
+    const ShadowMapping::Cascades cascades{ShadowMapping::createCascades({
+        .projectionMatrix = projectionMatrix,
+        .viewMatrix = viewMatrix,
+        .near = near,
+        .far = far,
+        .worldUp = worldUp,
+        .lightDirection = lightDirection,
+        .cascadeCount = options.cascades,
+        // Mostly logarithmic, the near cascades get the most texels
+        .splitLambda = 0.75f,
+        .resolution = static_cast<int>(depthMap.TEXTURE_WIDTH),
+        .casterBounds = casterBounds,
+        .stable = options.stableShadows,
+    })};
+
+    cullScene(Geometry::extractFrustum(projectionMatrix * viewMatrix),
+              Geometry::extractFrustum(cascades.bounds.projection *
+                                       cascades.bounds.view));
+
+    profiler.endZone(sceneZone);
+
+    const Rendering::FrameContext frame{
+        .view = viewMatrix,
+        .projection = projectionMatrix,
+        .near = near,
+        .far = far,
+        .eye = camera.eye(),
+        .screenSize = glm::ivec2{window_width, window_height},
+        .lightDirection = lightDirection,
+        .cascades = cascades,
+        .shadowFilter = shadowFilter,
+        .lights = lights,
+        .framebuffer = postProcessBuffer.framebufferId,
+        .profiler = profiler,
+        .drawQueue = drawQueue,
+    };
+
+    // The camera and the directional light, for every program
+    frameUniforms.upload(frame);
+
+    /* LIGHT CULLING */
+
+    const size_t cullingZone{profiler.beginZone("light culling")};
+
+    Lighting::animateLights(lights, initialLights, animationTime);
+
+    shadowAtlas.allocate(lights, viewMatrix, projectionMatrix, near,
+                         options.shadowedLights);
+
+    Lighting::packLights(lights, lightTexels);
+    lightBuffers.data.upload(lightTexels);
+    lightBuffers.shadows.upload(shadowAtlas.texels());
+
+    technique.prepare(frame);
+
+    profiler.endZone(cullingZone);
+
+    // The warm up frames are not part of the result
+    if (options.benchmark && benchmarkFrame == Benchmark::WARMUP_FRAMES) {
+      gpuFrameTimer.flush();
+      gpuFrameTimer.takeMilliseconds();
+      profiler.flush();
+      profiler.resetSummary();
+    }
+
+    gpuFrameTimer.begin();
 
-    depthProgram.use();
+    /* SHADOW PASS */
+
+    const size_t shadowZone{profiler.beginZone("shadow pass")};
 
-    depthProgram.setUniform("u_projection", lightMatrix.projection);
-    depthProgram.setUniform("u_view", lightMatrix.view);
+    GLState::enable(GL_DEPTH_TEST);
 
-    depthProgram.setUniform("u_model", cubemodelMatrix);
-    cube.bind();
-    glDrawElements(GL_TRIANGLES, cube.indicesCount(), cube.indexType(), 0);
+    // Draws the casters into every cascade of the map. With a base map, its
+    // layers are copied in first and the casters are depth tested against
+    // them.
+    const auto drawShadowMap{[&](const DepthMap &map, const DepthMap *base,
+                                 const SceneGraph::DrawList &casters) {
+      GLState::bindFramebuffer(GL_FRAMEBUFFER, map.framebuffer);
 
-    depthProgram.setUniform("u_model", sphereModelMatrix);
-    sphere.bind();
-    glDrawElements(GL_TRIANGLES, sphere.indicesCount(), sphere.indexType(), 0);
+      glViewport(0, 0, map.TEXTURE_WIDTH, map.TEXTURE_HEIGHT);
 
-    depthProgram.setUniform("u_model", cylinderModelMatrix);
-    cylinder.bind();
-    glDrawElements(GL_TRIANGLES, cylinder.indicesCount(), cylinder.indexType(),
-                   0);
+      // Fix shadow acne
+      GLState::cullFace(GL_FRONT);
 
-    depthProgram.setUniform("u_model", wavyCylinderModelMatrix);
-    wavyCylinder.bind();
-    glDrawElements(GL_TRIANGLES, wavyCylinder.indicesCount(),
-                   wavyCylinder.indexType(), 0);
+      depthProgram.use();
 
-    depthProgram.setUniform("u_model", torusModelMatrix);
-    torus.bind();
-    glDrawElements(GL_TRIANGLES, torus.indicesCount(), torus.indexType(), 0);
+      for (size_t cascade{0}; cascade < cascades.matrices.size(); ++cascade) {
+        glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                                  map.texture, 0, cascade);
+        if (base != nullptr) {
+          GLState::bindFramebuffer(GL_READ_FRAMEBUFFER, base->framebuffer);
+          glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                                    base->texture, 0, cascade);
+          glBlitFramebuffer(0, 0, base->TEXTURE_WIDTH, base->TEXTURE_HEIGHT, 0,
+                            0, map.TEXTURE_WIDTH, map.TEXTURE_HEIGHT,
+                            GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        } else {
+          glClear(GL_DEPTH_BUFFER_BIT);
+        }
 
-    // Revert culling to normal one
-    glCullFace(GL_BACK);
+        frameUniforms.bindCascadeView(cascade);
 
-    /* LIGHT PASS */
+        const Profiling::Scope scope{profiler, "objects"};
+        casters.draw();
+      }
+
+      // Revert culling to normal one
+      GLState::cullFace(GL_BACK);
+    }};
+
+    // Cascades of a camera which didn't move have exactly the same matrices,
+    // stable ones also while it moves within a texel. The static map is only
+    // drawn again when they or the static casters changed.
+    const ShadowMapState currentState{
+        .viewProjections = cascades.viewProjections,
+        .staticVersion = staticCasters.drawVersion(),
+        .dynamicVersion = dynamicCasters.drawVersion(),
+    };
+
+    ++shadowPassFrames;
+    if (currentState.viewProjections !=
+            staticShadowMapState.viewProjections ||
+        currentState.staticVersion != staticShadowMapState.staticVersion) {
+      drawShadowMap(staticDepthMap, nullptr, staticCasters);
+      staticShadowMapState = currentState;
+      ++staticShadowMapRenders;
+    }
+
+    // Without dynamic casters the static map is the shadow map
+    const bool hasDynamicCasters{dynamicCasters.visibleCount() > 0};
+    if (hasDynamicCasters &&
+        (currentState.viewProjections != shadowMapState.viewProjections ||
+         currentState.staticVersion != shadowMapState.staticVersion ||
+         currentState.dynamicVersion != shadowMapState.dynamicVersion)) {
+      drawShadowMap(depthMap, &staticDepthMap, dynamicCasters);
+      shadowMapState = currentState;
+      ++dynamicShadowMapRenders;
+    }
+    const DepthMap &shadowMap{hasDynamicCasters ? depthMap : staticDepthMap};
+    const ShadowMapState &shadowMapContents{
+        hasDynamicCasters ? shadowMapState : staticShadowMapState};
+
+    // Only when the shadow map changed, like the map itself
+    if (ShadowMapping::usesMoments(shadowFilter) &&
+        (momentsMap.source != &shadowMap || momentsMap.filter != shadowFilter ||
+         momentsMap.state.viewProjections !=
+             shadowMapContents.viewProjections ||
+         momentsMap.state.staticVersion != shadowMapContents.staticVersion ||
+         momentsMap.state.dynamicVersion != shadowMapContents.dynamicVersion)) {
+      const Profiling::Scope scope{profiler, "moments"};
+
+      if (momentsMap.texture == 0) {
+        initializeMomentsMap(momentsMap);
+      }
 
-    glBindFramebuffer(GL_FRAMEBUFFER, postProcessBuffer.framebufferId);
+      GLState::bindFramebuffer(GL_FRAMEBUFFER, momentsMap.framebuffer);
+      glViewport(0, 0, depthMap.TEXTURE_WIDTH, depthMap.TEXTURE_HEIGHT);
+      GLState::disable(GL_DEPTH_TEST);
+
+      const glm::vec2 texelSize{1.0f / depthMap.TEXTURE_WIDTH,
+                                1.0f / depthMap.TEXTURE_HEIGHT};
+      // Depth to moments with a horizontal blur, then a vertical blur
+      const ShaderProgram &fromDepthProgram{permutations.get(
+          Program::SHADOW_MOMENTS,
+          ShaderSource::FROM_DEPTH |
+              ShadowMapping::namedFilter(shadowFilter).feature)};
+      const ShaderProgram &momentsBlurProgram{
+          permutations.get(Program::SHADOW_MOMENTS)};
+
+      GLState::bindTexture(Rendering::SHADOW_DEPTH_UNIT, GL_TEXTURE_2D_ARRAY,
+                           shadowMap.texture);
+      glBindSampler(Rendering::SHADOW_DEPTH_UNIT, rawDepthSampler);
+      GLState::bindTexture(0, GL_TEXTURE_2D, momentsMap.blurTexture);
+
+      for (size_t cascade{0}; cascade < cascades.matrices.size(); ++cascade) {
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                               GL_TEXTURE_2D, momentsMap.blurTexture, 0);
+        fromDepthProgram.use();
+        fromDepthProgram.setUniform(
+            "u_source"_uniform, static_cast<int>(Rendering::SHADOW_DEPTH_UNIT));
+        fromDepthProgram.setUniform("u_layer"_uniform,
+                                    static_cast<int>(cascade));
+        fromDepthProgram.setUniform("u_direction"_uniform,
+                                    glm::vec2{texelSize.x, 0.0f});
+        scene.drawScreenQuad();
+
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                  momentsMap.texture, 0, cascade);
+        momentsBlurProgram.use();
+        momentsBlurProgram.setUniform("u_source"_uniform, 0);
+        momentsBlurProgram.setUniform("u_direction"_uniform,
+                                      glm::vec2{0.0f, texelSize.y});
+        scene.drawScreenQuad();
+      }
 
-    glViewport(0, 0, window_width, window_height);
+      GLState::bindTexture(GL_TEXTURE_2D, 0);
+      glBindSampler(Rendering::SHADOW_DEPTH_UNIT, 0);
+      GLState::enable(GL_DEPTH_TEST);
 
-    glClearColor(0.1f, 0.1f, 0.15f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+      momentsMap.source = &shadowMap;
+      momentsMap.state = shadowMapContents;
+      momentsMap.filter = shadowFilter;
+    }
 
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, depthMap.texture);
+    // Every view of a local light in one draw, the casters are culled by the
+    // light's reach
+    if (!shadowAtlas.allocations().empty()) {
+      const Profiling::Scope scope{profiler, "local lights"};
 
-    shaderProgram.use();
+      GLState::bindFramebuffer(GL_FRAMEBUFFER, shadowAtlasMap.framebuffer);
+      glViewport(0, 0, shadowAtlasMap.TEXTURE_WIDTH,
+                 shadowAtlasMap.TEXTURE_HEIGHT);
+      glClear(GL_DEPTH_BUFFER_BIT);
 
-    shaderProgram.setUniform("u_projection", projectionMatrix);
-    shaderProgram.setUniform("u_view", viewMatrix);
-    shaderProgram.setUniform("u_eyePosition", camera.eye());
-    shaderProgram.setUniform("u_lightDirection", lightDirection);
-    shaderProgram.setUniform("u_lightProjection", lightMatrix.projection);
-    shaderProgram.setUniform("u_lightView", lightMatrix.view);
-    // Texture unit 0 is reserved for color/diffuse
-    shaderProgram.setUniform("u_shadowMap", 1);
+      for (GLenum plane{0}; plane < 4; ++plane) {
+        glEnable(GL_CLIP_DISTANCE0 + plane);
+      }
 
-    shaderProgram.setUniform("u_model", cubemodelMatrix);
+      shadowAtlasProgram.use();
+
+      std::vector<glm::mat4> faceMatrices;
+      std::vector<glm::vec4> faceTiles;
+      for (const Lighting::ShadowAtlas::Allocation &allocation :
+           shadowAtlas.allocations()) {
+        const Lighting::Light &light{lights[allocation.light]};
+        localCasters.cull(Geometry::Sphere{.center = light.position,
+                                           .radius = light.radius});
+        if (localCasters.visibleCount() == 0) {
+          continue;
+        }
 
-    cube.bind();
-    glDrawElements(GL_TRIANGLES, cube.indicesCount(), cube.indexType(), 0);
+        constexpr float ATLAS_SIZE{Lighting::ShadowAtlas::SIZE};
+        const float halfSize{allocation.tileSize / ATLAS_SIZE};
+        faceMatrices.clear();
+        faceTiles.clear();
+        for (int i{0}; i < allocation.faceCount; ++i) {
+          const Lighting::ShadowAtlas::Face &face{allocation.faces[i]};
+          const glm::vec2 center{
+              2.0f * glm::vec2{face.offset} / ATLAS_SIZE - 1.0f + halfSize};
+          faceMatrices.push_back(face.viewProjection);
+          faceTiles.push_back(glm::vec4{center, halfSize, halfSize});
+        }
 
-    shaderProgram.setUniform("u_model", sphereModelMatrix);
+        shadowAtlasProgram.setUniform("u_faceMatrices"_uniform, faceMatrices);
+        shadowAtlasProgram.setUniform("u_faceTiles"_uniform, faceTiles);
+        shadowAtlasProgram.setUniform("u_faceCount"_uniform,
+                                      allocation.faceCount);
 
-    sphere.bind();
-    glDrawElements(GL_TRIANGLES, sphere.indicesCount(), sphere.indexType(), 0);
+        localCasters.draw();
+      }
 
-    shaderProgram.setUniform("u_model", cylinderModelMatrix);
-    cylinder.bind();
-    glDrawElements(GL_TRIANGLES, cylinder.indicesCount(), cylinder.indexType(),
-                   0);
+      for (GLenum plane{0}; plane < 4; ++plane) {
+        glDisable(GL_CLIP_DISTANCE0 + plane);
+      }
+    }
 
-    shaderProgram.setUniform("u_model", wavyCylinderModelMatrix);
-    wavyCylinder.bind();
-    glDrawElements(GL_TRIANGLES, wavyCylinder.indicesCount(),
-                   wavyCylinder.indexType(), 0);
+    profiler.endZone(shadowZone);
 
-    shaderProgram.setUniform("u_model", torusModelMatrix);
-    torus.bind();
-    glDrawElements(GL_TRIANGLES, torus.indicesCount(), torus.indexType(), 0);
+    /* LIGHT PASS */
 
-    debugShaderProgram.use();
+    const size_t lightZone{profiler.beginZone("light pass")};
 
-    debugShaderProgram.setUniform("u_projection", projectionMatrix);
-    debugShaderProgram.setUniform("u_view", viewMatrix);
-    debugShaderProgram.setUniform("u_model", sphereModelMatrix);
-    // TODO: Figure out if we need to pass these uniforms to this shader
-    // program: u_lightProjection, u_lightView, u_shadowMap
+    // The shadow pass left the last cascade's view bound
+    frameUniforms.bindCameraView();
 
-    sphere.bind();
-    glDrawElements(GL_TRIANGLES, sphere.indicesCount(), sphere.indexType(), 0);
+    // Stay bound after the frame, so the next one with the same maps skips
+    // them. Nothing sampling these units draws into the maps.
+    GLState::bindTexture(Rendering::SHADOW_MAP_UNIT, GL_TEXTURE_2D_ARRAY,
+                         shadowMap.texture);
+    GLState::bindTexture(Rendering::SHADOW_ATLAS_UNIT, GL_TEXTURE_2D_ARRAY,
+                         shadowAtlasMap.texture);
+    GLState::bindTexture(Rendering::SHADOW_DEPTH_UNIT, GL_TEXTURE_2D_ARRAY,
+                         shadowMap.texture);
+    glBindSampler(Rendering::SHADOW_DEPTH_UNIT, rawDepthSampler);
+    GLState::bindTexture(Rendering::SHADOW_MOMENTS_UNIT, GL_TEXTURE_2D_ARRAY,
+                         momentsMap.texture);
 
-    floorProgram.use();
+    lightBuffers.bind();
 
-    floorProgram.setUniform("u_projection", projectionMatrix);
-    floorProgram.setUniform("u_view", viewMatrix);
-    floorProgram.setUniform("u_model", floorModelMatrix);
-    floorProgram.setUniform("u_eyePosition", camera.eye());
-    floorProgram.setUniform("u_lightDirection", lightDirection);
-    floorProgram.setUniform("u_lightProjection", lightMatrix.projection);
-    floorProgram.setUniform("u_lightView", lightMatrix.view);
-    // Texture unit 0 is reserved for color/diffuse
-    floorProgram.setUniform("u_shadowMap", 1);
+    technique.lightPass(frame);
 
-    floor.bind();
-    glDrawElements(GL_TRIANGLES, floor.indicesCount(), floor.indexType(), 0);
+    profiler.endZone(lightZone);
 
-    lightSourceProgram.use();
+    const size_t debugZone{profiler.beginZone("debug geometry")};
 
-    lightSourceProgram.setUniform("u_projection", projectionMatrix);
-    lightSourceProgram.setUniform("u_view", viewMatrix);
-    lightSourceProgram.setUniform("u_model", lightSourceModelMatrix);
-    // TODO: Figure out if we need to pass these uniforms to this shader
-    // program: u_lightProjection, u_lightView, u_shadowMap
+    drawQueue.submit(debugNormalObjects, debugShaderProgram);
+    drawQueue.submit(emissiveObjects, lightSourceProgram);
+    drawQueue.flush(viewMatrix, far);
 
-    lightSource.bind();
-    glDrawElements(GL_TRIANGLES, lightSource.indicesCount(),
-                   lightSource.indexType(), 0);
+    glBindSampler(Rendering::SHADOW_DEPTH_UNIT, 0);
 
-    // Unbind texture
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, 0);
+    profiler.endZone(debugZone);
 
     /* POST-PROCESSING PASS */
 
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    const size_t postProcessingZone{profiler.beginZone("post-processing")};
+
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, 0);
 
-    glClearBufferfv(GL_COLOR, 0,
-                    glm::value_ptr(glm::vec4{0.1f, 0.1f, 0.15f, 1.0f}));
-    glDisable(GL_DEPTH_TEST);
+    glClearBufferfv(GL_COLOR, 0, glm::value_ptr(Rendering::CLEAR_COLOR));
+    GLState::disable(GL_DEPTH_TEST);
 
     postProcessingProgram.use();
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, postProcessBuffer.textureId);
-    postProcessingProgram.setUniform("u_screenTexture", 0);
+    GLState::bindTexture(0, GL_TEXTURE_2D, postProcessBuffer.textureId);
+    postProcessingProgram.setUniform("u_screenTexture"_uniform, 0);
 
-    postProcessingQuad.bind();
-    glDrawElements(GL_TRIANGLES, postProcessingQuad.indicesCount(),
-                   postProcessingQuad.indexType(), 0);
+    scene.drawScreenQuad();
+
+    profiler.endZone(postProcessingZone);
+
+    gpuFrameTimer.end();
+
+    frameUniforms.endFrame();
+    profiler.endFrame();
+
+    // CPU time to record the frame, the swap below may wait for the GPU
+    const double cpuMilliseconds{
+        (SDL_GetPerformanceCounter() - frameBegin) * 1000.0 /
+        SDL_GetPerformanceFrequency()};
 
     /* ISSUE RENDER DIRECTIVE */
     SDL_GL_SwapWindow(window);
+
+    gpuFrameTimer.collect();
+
+    if (options.benchmark) {
+      if (benchmarkFrame == 0) {
+        benchmarkResults.push_back(
+            {.scene = Benchmark::SCENES[sceneIndex].name,
+             .name = technique.name(),
+             .shadowFilter = ShadowMapping::namedFilter(shadowFilter).name,
+             .cpuMilliseconds = {},
+             .gpuMilliseconds = {}});
+      }
+
+      Benchmark::TechniqueResult &result{benchmarkResults.back()};
+      if (benchmarkFrame == Benchmark::WARMUP_FRAMES) {
+        benchmarkBegin = frameBegin;
+      }
+      if (benchmarkFrame >= Benchmark::WARMUP_FRAMES) {
+        result.cpuMilliseconds.push_back(cpuMilliseconds);
+      }
+
+      if (++benchmarkFrame ==
+          Benchmark::WARMUP_FRAMES + options.benchmarkFrames) {
+        gpuFrameTimer.flush();
+        result.gpuMilliseconds = gpuFrameTimer.takeMilliseconds();
+        result.seconds =
+            static_cast<double>(SDL_GetPerformanceCounter() - benchmarkBegin) /
+            SDL_GetPerformanceFrequency();
+
+        std::cout << "Benchmarked " << technique.name() << " with "
+                  << result.shadowFilter << " shadows\n";
+        printCullingStats();
+        profiler.flush();
+        result.shadowPassMilliseconds = profiler.gpuAverage("shadow pass", 1);
+        result.lightPassMilliseconds = profiler.gpuAverage("light pass", 1);
+        profiler.printSummary();
+
+        benchmarkFrame = 0;
+
+        // A technique or a scene picked on the command line runs alone, the
+        // filters are only cycled with --shadow-filter all
+        const bool lastTechnique{!options.technique.empty() ||
+                                 techniqueIndex + 1 == techniques.size()};
+        const ShadowMapping::Filter nextFilter{
+            ShadowMapping::FILTERS[(static_cast<size_t>(shadowFilter) + 1) %
+                                   ShadowMapping::FILTERS.size()]
+                .filter};
+        const bool lastFilter{!options.allShadowFilters ||
+                              nextFilter == options.shadowFilter};
+        const bool lastScene{!options.scene.empty() ||
+                             sceneIndex + 1 == Benchmark::SCENES.size()};
+
+        if (!lastTechnique) {
+          ++techniqueIndex;
+        } else if (!lastFilter) {
+          shadowFilter = nextFilter;
+          if (options.technique.empty()) {
+            techniqueIndex = 0;
+          }
+          std::cout << "Shadow filter: "
+                    << ShadowMapping::namedFilter(shadowFilter).name << "\n";
+        } else if (!lastScene) {
+          ++sceneIndex;
+          if (options.technique.empty()) {
+            techniqueIndex = 0;
+          }
+          shadowFilter = options.shadowFilter;
+
+          initialLights =
+              Lighting::generateLights(Benchmark::SCENES[sceneIndex].lights);
+          lights = initialLights;
+          std::cout << "Scene: " << Benchmark::SCENES[sceneIndex].name << "\n";
+        } else {
+          Benchmark::printReport(benchmarkResults);
+
+          try {
+            if (!options.jsonPath.empty()) {
+              Benchmark::writeJson(options.jsonPath, benchmarkResults);
+              std::cout << "Wrote results: " << options.jsonPath << "\n";
+            }
+            if (!options.baselinePath.empty() &&
+                !Benchmark::compareWithBaseline(benchmarkResults,
+                                                options.baselinePath,
+                                                options.thresholdPercent)) {
+              exitCode = 1;
+            }
+          } catch (const std::runtime_error &error) {
+            std::cerr << error.what() << "\n";
+            exitCode = 1;
+          }
+
+          running = false;
+        }
+      }
+      continue;
+    }
+
+    ++framesSinceStats;
+    if (currentTime - lastStatsTime >= 5000) {
+      const Benchmark::Percentiles gpu{
+          Benchmark::computePercentiles(gpuFrameTimer.takeMilliseconds())};
+      std::cout << technique.name() << " frame: "
+                << static_cast<float>(currentTime - lastStatsTime) /
+                       framesSinceStats
+                << " ms, gpu: " << gpu.mean
+                << " ms, light binning: " << technique.binningMilliseconds()
+                << " ms, " << lights.size() << " lights, "
+                << technique.lightListEntries() << " light list entries\n";
+      printCullingStats();
+      profiler.printSummary();
+      lastStatsTime = currentTime;
+      framesSinceStats = 0;
+    }
   }
 
-  SDL_DestroyWindow(window);
-  SDL_Quit();
+  if (!options.screenshotPath.empty()) {
+    const int width{static_cast<int>(window_width)};
+    const int height{static_cast<int>(window_height)};
+    std::vector<unsigned char> pixels(static_cast<size_t>(width) * height * 3);
+
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, postProcessBuffer.framebufferId);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    try {
+      Benchmark::writePPM(options.screenshotPath, width, height, pixels);
+      std::cout << "Wrote screenshot: " << options.screenshotPath << "\n";
+    } catch (const std::runtime_error &error) {
+      std::cerr << error.what() << "\n";
+    }
+  }
+
+  if (!options.recordPath.empty()) {
+    try {
+      recordedPath.save(options.recordPath);
+      std::cout << "Wrote camera path: " << options.recordPath << ", "
+                << recordedPath.duration() << " s\n";
+    } catch (const std::runtime_error &error) {
+      std::cerr << error.what() << "\n";
+    }
+  }
+
+  if (!options.tracePath.empty()) {
+    profiler.flush();
+    try {
+      profiler.writeChromeTrace(options.tracePath);
+      std::cout << "Wrote trace: " << options.tracePath << "\n";
+    } catch (const std::runtime_error &error) {
+      std::cerr << error.what() << "\n";
+    }
+  }
 
-  return 0;
+  return exitCode;
 }